@@ -19,10 +19,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "v4l2_uvc.hpp"
 #include "globals.hpp"
 #include "ms_time.hpp"
+#include "hr_clock.hpp"
+#include "yuv_luma.hpp"
+#include "stream_record.hpp"
+#include "capture_bench.hpp"
+#include "frame_fanout.hpp"
+#include "frame_stats.hpp"
+#include "auto_exposure.hpp"
+#include "motion_detect.hpp"
+#include "control_profile.hpp"
+#include "hdr_bracket.hpp"
+#include "hdr_merge.hpp"
+#include "raw_record.hpp"
+#include "pretrigger_ring.hpp"
+#include "frame_shm.hpp"
+#include "shm_subscriber.hpp"
+#include "camera_broker.hpp"
+#include "mjpeg_http.hpp"
 #include <termios.h>
+#include <unistd.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -31,39 +50,375 @@ using namespace cv;
 
 struct GLOBAL *global = NULL;
 struct vdIn *videoIn = NULL;
+static int gray_preview = 0; // show luma only (toggled with 'g')
+static int print_stats = 0;  // print the statistics of the next preview frame ('a')
 
-void consume_frame(BYTE* frame, int width, int height) {
-	Mat yuv(height, width, CV_8UC2, frame);
+// every consumer gets a reference on the same driver buffer, no copies
+struct FrameFanout *fanout = NULL;
+struct FrameConsumer *preview = NULL;   // latest frame only (depth 1, drop oldest)
+struct FrameConsumer *recorder = NULL;  // passthrough recording (drop newest)
+struct FrameConsumer *raw_recorder = NULL; // raw O_DIRECT recording (drop newest)
+struct FrameConsumer *pretrigger = NULL;   // pre-trigger history (drop oldest)
+struct FrameConsumer *publisher = NULL;    // shared memory publishing (drop oldest)
+struct FrameConsumer *streamer = NULL;     // MJPEG over HTTP (latest frame only)
+struct FrameConsumer *hdr = NULL;          // bracket merge (drop newest)
+static ULLONG displayed = 0;            // frames rendered
+struct AutoExposure *ae = NULL;         // software exposure control (capture thread)
+struct MotionDetector *motion = NULL;   // marks unchanged frames (capture thread)
+struct ControlQueue *controls = NULL;   // key presses to the capture thread
+struct HdrBracket *bracket = NULL;      // exposure bracketing (capture thread)
+static struct ClockLink wallclock;      // buffer time stamps to wall time (updated by the capture thread)
+static int monotonic_stamps = 0;        // the driver stamps buffers with HRC_MONOTONIC (atomic)
+static BYTE *hdr_view = NULL;           // last merged bracket set, tone mapped for display (hdr_mutex)
+static int hdr_view_fresh = 0;          // the "hdr" window has not shown it yet (hdr_mutex)
+static __MUTEX_TYPE hdr_mutex;
+
+static void show_stats(const struct FrameStats *stats)
+{
+	if (!stats->valid)
+	{
+		printf("no statistics (-a <step>, uncompressed formats only)\n");
+		return;
+	}
+	printf("frame %u: mean %.1f p5 %i p50 %i p95 %i clipped %.2f%% (%u low, %u high) of %u samples\n",
+			stats->sequence, stats->mean, frame_stats_percentile(stats, 0.05f),
+			frame_stats_percentile(stats, 0.5f), frame_stats_percentile(stats, 0.95f),
+			100.0f * stats->clipped, stats->clipped_low, stats->clipped_high, stats->samples);
+	for (int zy = 0; zy < STATS_ZONES_Y; zy++)
+	{
+		printf("  ");
+		for (int zx = 0; zx < STATS_ZONES_X; zx++)
+			printf(" %6.1f", stats->zones[zy][zx]);
+		printf("\n");
+	}
+}
+
+static void show_frame(struct FrameRef *ref, BYTE* gray)
+{
+	struct FrameView roi;
+	struct LumaView luma;
 	Mat rgb;
-	cvtColor(yuv, rgb, CV_YUV2BGR_YUYV);
-	imshow("preview", rgb);
-	waitKey(10);
+
+	if (global->format == V4L2_PIX_FMT_MJPEG || global->format == V4L2_PIX_FMT_JPEG)
+	{
+		// compressed payload: decode for preview
+		Mat jpeg(1, ref->lease.bytesused, CV_8UC1, ref->lease.data);
+		rgb = imdecode(jpeg, IMREAD_COLOR);
+	}
+	else if (uvc_roi_view(videoIn, &ref->lease, &roi) != VDIN_OK)
+		return; // no preview for other compressed formats
+	else if (gray_preview &&
+			get_luma_view(roi.data, global->format, roi.width, roi.height, roi.stride, &luma) == 0)
+	{
+		// luma only: read Y straight from the driver buffer, no color conversion
+		extract_luma(&luma, gray, roi.width);
+		rgb = Mat(roi.height, roi.width, CV_8UC1, gray);
+	}
+	else
+	{
+		Mat yuv(roi.height, roi.width, CV_8UC2, roi.data, roi.stride);
+		cvtColor(yuv, rgb, CV_YUV2BGR_YUYV);
+	}
+	if (!rgb.empty())
+		imshow("preview", rgb);
 }
 
-void *camera_loop(void *arg)
+// render thread: shows the most recent frame once per display refresh
+void *render_loop(void *arg)
 {
-    bool signalquit = false;
-	BYTE* frame;
+    UINT64 period = G_NSEC_PER_SEC / DEFAULT_REFRESH_RATE;
+    UINT64 next_tick = ns_time_monotonic();
+    BYTE* gray = (BYTE*)malloc(videoIn->roi.width * videoIn->roi.height);
 
 	namedWindow("preview", CV_WINDOW_NORMAL);
 
-    while (!signalquit)
+    while (!videoIn->signalquit)
     {
-        signalquit = videoIn->signalquit;
+        // frames arriving between two ticks replace each other in the queue
+        next_tick += period;
+        UINT64 now = ns_time_monotonic();
+        if (next_tick > now)
+            sleep_until_ns(next_tick);
+        else
+            next_tick = now; // fell behind, resync
 
-        /*-------------------------- Grab Frame ----------------------------------*/
-        if (uvc_grab(videoIn, global, frame) < 0)
+        struct FrameRef *ref = frame_consumer_pop(preview, 100);
+        if (ref)
         {
-            printf("Error grabbing image \n");
+            if (!ref->unchanged)
+                show_frame(ref, gray); // otherwise the window still shows it
+            if (print_stats)
+            {
+                show_stats(&ref->stats);
+                printf("  exposure %i gain %i since frame %u (issued after frame %u)\n",
+                        ref->controls.exposure, ref->controls.gain,
+                        ref->controls.change_sequence, ref->controls.issued_sequence);
+                if (ref->lease.meta.sensor_ns)
+                    printf("  sensor time %+.3f ms from the buffer time stamp (pts %u, sof %u)\n",
+                            ((double) ref->lease.meta.sensor_ns - ref->lease.timestamp) / 1e6,
+                            ref->lease.meta.pts, ref->lease.meta.host_sof);
+                if (__atomic_load_n(&monotonic_stamps, __ATOMIC_RELAXED))
+                {
+                    UINT64 wall = hrc_link_map(&wallclock, ref->lease.timestamp);
+                    time_t sec = (time_t) (wall / G_NSEC_PER_SEC);
+                    char when[32];
+                    strftime(when, sizeof(when), "%H:%M:%S", localtime(&sec));
+                    printf("  captured at %s.%06u (wall clock %+.1f ppm from monotonic)\n", when,
+                            (unsigned) (wall % G_NSEC_PER_SEC / 1000), hrc_link_ppm(&wallclock));
+                }
+                if (ref->bracket.step >= 0)
+                    printf("  bracket set %u step %i of %i: exposure %i gain %i (x%.2f)\n",
+                            ref->bracket.set, ref->bracket.step + 1, ref->bracket.steps,
+                            ref->bracket.exposure, ref->bracket.gain, ref->bracket.scale);
+                print_stats = 0;
+            }
+            frame_ref_release(ref);
+            displayed++;
+        }
+
+        // the merged sets (-F) in a window of their own, on this thread like all HighGUI calls
+        if (hdr_view)
+        {
+            __LOCK_MUTEX(&hdr_mutex);
+            if (hdr_view_fresh)
+                imshow("hdr", Mat(videoIn->fmt.fmt.pix.height, videoIn->fmt.fmt.pix.width,
+                            CV_8UC1, hdr_view));
+            hdr_view_fresh = 0;
+            __UNLOCK_MUTEX(&hdr_mutex);
+        }
+
+        waitKey(1); // HighGUI event pump
+    }
+
+    destroyWindow("preview");
+    if (hdr_view)
+        destroyWindow("hdr");
+    free(gray);
+    return ((void *) 0);
+}
+
+// passthrough recording: write the dequeued payload as is, no decoding
+void *record_loop(void *arg)
+{
+    struct StreamRecord *rec = (struct StreamRecord *) arg;
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(recorder, 100);
+        if (!ref)
+            continue;
+        if (ref->unchanged)
+        {
+            frame_ref_release(ref);
+            continue;
+        }
+
+        struct FrameLease *lease = &ref->lease;
+        uint32_t size = lease->bytesused;
+        if (size == 0 || size > videoIn->buff_length[lease->index])
+            size = videoIn->buff_length[lease->index];
+        if (stream_record_write(rec, lease->data, size, lease->sequence, lease->timestamp, 0) < 0)
+            videoIn->signalquit = 1;
+
+        frame_ref_release(ref);
+    }
+
+    return ((void *) 0);
+}
+
+// raw recording: pre-allocated slots written from the driver buffer
+// (a software roi is copied out first, into a buffer written without copy)
+void *raw_record_loop(void *arg)
+{
+    struct RawRecord *raw = (struct RawRecord *) arg;
+    size_t page = sysconf(_SC_PAGESIZE);
+    BYTE *roi = NULL;
+
+    if (videoIn->roi_mode == VDIN_ROI_SW &&
+            posix_memalign((void **) &roi, RAW_RECORD_ALIGN, raw->slot_size))
+    {
+        printf("raw record: no memory for the roi\n");
+        videoIn->signalquit = 1;
+        return ((void *) 0);
+    }
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(raw_recorder, 100);
+        if (!ref)
+            continue;
+        if (ref->unchanged)
+        {
+            frame_ref_release(ref);
+            continue;
+        }
+
+        struct FrameLease *lease = &ref->lease;
+        int ret;
+        if (roi)
+        {
+            int size = uvc_copy_frame(videoIn, lease, roi);
+            ret = raw_record_write(raw, roi, size, raw->slot_size, lease->sequence, lease->timestamp);
+        }
+        else
+            // mmap'd buffers are whole pages
+            ret = raw_record_write(raw, lease->data, uvc_frame_size(videoIn, lease),
+                    (videoIn->buff_length[lease->index] + page - 1) / page * page,
+                    lease->sequence, lease->timestamp);
+        if (ret < 0)
+            videoIn->signalquit = 1; // full or write error
+
+        frame_ref_release(ref);
+    }
+    free(roi);
+
+    return ((void *) 0);
+}
+
+// pre-trigger history: every frame goes to the memory ring, 't' flushes it
+void *pretrigger_loop(void *arg)
+{
+    struct PretriggerRing *ring = (struct PretriggerRing *) arg;
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(pretrigger, 100);
+        if (!ref)
+            continue;
+
+        struct FrameLease *lease = &ref->lease;
+        uint32_t size = lease->bytesused;
+        if (size == 0 || size > videoIn->buff_length[lease->index])
+            size = videoIn->buff_length[lease->index];
+        pretrigger_push(ring, lease->data, size, lease->sequence, lease->timestamp);
+
+        frame_ref_release(ref);
+    }
+
+    return ((void *) 0);
+}
+
+// shared memory publishing: one copy into the ring, subscribers read it in place
+void *publish_loop(void *arg)
+{
+    struct ShmPublisher *pub = (struct ShmPublisher *) arg;
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(publisher, 100);
+        if (!ref)
             continue;
+
+        // straight into the slot, the software roi rows only
+        struct FrameLease *lease = &ref->lease;
+        if ((uint32_t) uvc_frame_size(videoIn, lease) <= pub->header->slot_size)
+        {
+            int size = uvc_copy_frame(videoIn, lease, shm_publish_slot(pub));
+            shm_publish_commit(pub, size, lease->sequence, lease->timestamp);
         }
         else
+            pub->too_large++;
+
+        frame_ref_release(ref);
+    }
+
+    return ((void *) 0);
+}
+
+// HTTP streaming: MJPEG payloads pass through, other formats are encoded
+// once per frame for all viewers, and not at all without viewers
+void *stream_loop(void *arg)
+{
+    struct MjpegServer *server = (struct MjpegServer *) arg;
+    std::vector<uchar> jpeg;
+    std::vector<int> params;
+    params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    params.push_back(80);
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(streamer, 100);
+        if (!ref)
+            continue;
+
+        struct FrameLease *lease = &ref->lease;
+        struct FrameView roi;
+        if (mjpeg_server_clients(server) == 0 || ref->unchanged)
+            ; // nobody watching or viewers have this picture
+        else if (global->format == V4L2_PIX_FMT_MJPEG || global->format == V4L2_PIX_FMT_JPEG)
+            mjpeg_server_push(server, lease->data, uvc_frame_size(videoIn, lease),
+                    lease->sequence, lease->timestamp);
+        else if (uvc_roi_view(videoIn, lease, &roi) == VDIN_OK)
         {
-			// if consume codes take too much time, consider putting following codes to another thread
-			consume_frame(frame, global->width, global->height);
-			free(frame);
+            Mat yuv(roi.height, roi.width, CV_8UC2, roi.data, roi.stride);
+            Mat rgb;
+            cvtColor(yuv, rgb, CV_YUV2BGR_YUYV);
+            if (imencode(".jpg", rgb, jpeg, params))
+                mjpeg_server_push(server, jpeg.data(), jpeg.size(),
+                        lease->sequence, lease->timestamp);
         }
 
+        frame_ref_release(ref);
+    }
+
+    return ((void *) 0);
+}
+
+// bracket merge: the frames of every complete set fused into one
+void *hdr_loop(void *arg)
+{
+    struct HdrMerge *merge = (struct HdrMerge *) arg;
+    struct v4l2_pix_format *pix = &videoIn->fmt.fmt.pix;
+
+    while (!videoIn->signalquit)
+    {
+        struct FrameRef *ref = frame_consumer_pop(hdr, 100);
+        if (!ref)
+            continue;
+
+        struct LumaView view;
+        int done = 0;
+        if (ref->bracket.step >= 0 && get_luma_view(ref->lease.data, pix->pixelformat,
+                    pix->width, pix->height, pix->bytesperline, &view) == 0)
+            done = hdr_merge_add(merge, &view, &ref->bracket);
+
+        frame_ref_release(ref);
+
+        // a complete set: the render thread shows it on its next tick
+        if (done == 1)
+        {
+            __LOCK_MUTEX(&hdr_mutex);
+            hdr_merge_tonemap(merge, hdr_view);
+            hdr_view_fresh = 1;
+            __UNLOCK_MUTEX(&hdr_mutex);
+        }
+    }
+
+    return ((void *) 0);
+}
+
+// capture thread: rendering and recording happen on their own threads,
+// capture never waits for them
+void *camera_loop(void *arg)
+{
+    bool signalquit = false;
+
+    while (!signalquit)
+    {
+        signalquit = videoIn->signalquit;
+
+        /*-------------------------- Grab Frame ----------------------------------*/
+        if (fanout_broadcast(fanout) < 0)
+            printf("Error grabbing image \n");
+        else
+        {
+            if (ae)
+                ae_update(ae, &fanout->stats); // between frames, like the broker
+            __atomic_store_n(&monotonic_stamps,
+                    (videoIn->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+                    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, __ATOMIC_RELAXED);
+            hrc_link_update(&wallclock); // resamples once a second
+        }
     }
 
     return ((void *) 0);
@@ -81,8 +436,241 @@ clean_struct ()
     printf("cleaned allocations - 100%%\n");
 }
 
+static void usage(const char *prog)
+{
+    printf("usage: %s [options] [devices...]\n"
+            "  -d <device>          video device (default /dev/video0) or virtual camera:\n"
+            "                       vcam:pattern or vcam:<file.dsr>, options appended as\n"
+            "                       ,fps=<n>,jitter=<%%>,drop=<%%>,delay=<frames>,move=<%%>\n"
+            "  -f <fourcc>          pixel format: yuyv, mjpg, h264, ... (default yuyv)\n"
+            "  -s <width>x<height>  frame size\n"
+            "  -c <l>,<t>,<w>,<h>   region of interest\n"
+            "  -r <file>            record payloads without decoding (.dsr)\n"
+            "  -H                   headless capture benchmark (json summary)\n"
+            "  -n <frames>          benchmark frame count\n"
+            "  -t <seconds>         benchmark duration (default %i s without -n)\n"
+            "  -V <cameras>         headless scaling benchmark, opens the device n times\n"
+            "  -k                   checksum frames instead of discarding them\n"
+            "  -o <file>            write the benchmark summary to file\n"
+            "  -w <file>            raw recording, pre-allocated for -n frames (default %i)\n"
+            "  -B <file>            raw recording write throughput benchmark (-s, -n)\n"
+            "  -P <MiB>             keep the most recent frames in memory, 't' saves them\n"
+            "  -z                   LZ4 compress the pre-trigger frames\n"
+            "  -S <socket>          publish frames to subscriber processes (shared memory)\n"
+            "  -R <readers>         shared memory benchmark with n reader processes (-s, -n)\n"
+            "  -b <socket>          camera broker: owns -d and any further devices, serves\n"
+            "                       frames and control requests until SIGINT/SIGTERM\n"
+            "  -C <socket>          broker client: counts frames, 'j' 'u' 'k' 'i' go to the broker\n"
+            "  -m <port>            MJPEG over HTTP server (http://<host>:<port>/stream)\n"
+            "  -M <clients>         HTTP loopback benchmark with n viewers, a quarter of them\n"
+            "                       slow (-m port, -n frames, -s: payload of w*h/8 bytes)\n"
+            "  -e <target>[,<n>]    software auto exposure/gain toward mean luma target,\n"
+            "                       control changes show n frames late (default %i)\n"
+            "  -x <diff>[,<step>]   skip conversion, encoding and recording of frames that\n"
+            "                       differ by at most diff luma levels on a grid of step\n"
+            "                       pixels (default %i) from the last changed frame\n"
+            "  -E [<us>][,<gain>]   manual exposure time in microseconds (control units if\n"
+            "                       the driver has none) and/or gain at start\n"
+            "  -p <file>            apply the control profile file at start if it exists,\n"
+            "                       'p' saves the current controls to it, 'l' applies it\n"
+            "  -u <node|auto>       UVC metadata node (auto: the one of the device): sensor\n"
+            "                       time of every frame from its payload headers ('a')\n"
+            "  -D <us>[:<gain>],<us>[:<gain>][,...][@<n>]\n"
+            "                       exposure bracketing: consecutive frames cycle through\n"
+            "                       2 to %i exposure/gain steps, written n frames ahead of\n"
+            "                       the frame showing them (default %i)\n"
+            "  -F                   fuse the luma of every bracket set into one frame,\n"
+            "                       shown tone mapped in an \"hdr\" window\n"
+            "  -a <step>            luma statistics of every frame on a grid of step pixels\n"
+            "                       ('a' prints them, -H: cost per frame)\n"
+            "  -h                   print this help\n", prog, DEFAULT_BENCH_SECONDS, DEFAULT_RAW_FRAMES,
+            AE_DEFAULT_DELAY, MOTION_DEFAULT_STEP, HDR_MAX_STEPS, HDR_DEFAULT_DELAY);
+}
+
+static void parse_options(int argc, char *argv[])
+{
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "d:f:s:c:r:Hn:t:V:ko:w:B:P:zS:R:b:C:m:M:a:e:x:E:p:u:D:Fh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                free(global->videodevice);
+                global->videodevice = strdup(optarg);
+                break;
+
+            case 'f':
+                global->format = get_PixFormat(optarg);
+                if (global->format < 0)
+                {
+                    printf("unknown format: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 's':
+                if (sscanf(optarg, "%ix%i", &global->width, &global->height) != 2)
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'c':
+                if (sscanf(optarg, "%i,%i,%i,%i", &global->roi_left, &global->roi_top,
+                            &global->roi_width, &global->roi_height) != 4)
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'r':
+                free(global->record_file);
+                global->record_file = strdup(optarg);
+                break;
+
+            case 'H':
+                global->headless = 1;
+                break;
+
+            case 'n':
+                global->bench_frames = atoi(optarg);
+                break;
+
+            case 't':
+                global->bench_seconds = atoi(optarg);
+                break;
+
+            case 'V':
+                global->bench_cameras = atoi(optarg);
+                global->headless = 1;
+                break;
+
+            case 'k':
+                global->bench_checksum = 1;
+                break;
+
+            case 'o':
+                free(global->bench_file);
+                global->bench_file = strdup(optarg);
+                break;
+
+            case 'w':
+                free(global->raw_file);
+                global->raw_file = strdup(optarg);
+                break;
+
+            case 'B':
+                free(global->write_bench);
+                global->write_bench = strdup(optarg);
+                break;
+
+            case 'P':
+                global->pretrigger_mb = atoi(optarg);
+                break;
+
+            case 'z':
+                global->pretrigger_lz4 = 1;
+                break;
+
+            case 'S':
+                free(global->shm_socket);
+                global->shm_socket = strdup(optarg);
+                break;
+
+            case 'R':
+                global->shm_readers = atoi(optarg);
+                break;
+
+            case 'b':
+                free(global->broker_socket);
+                global->broker_socket = strdup(optarg);
+                break;
+
+            case 'C':
+                free(global->client_socket);
+                global->client_socket = strdup(optarg);
+                break;
+
+            case 'm':
+                global->http_port = atoi(optarg);
+                break;
+
+            case 'M':
+                global->http_clients = atoi(optarg);
+                break;
+
+            case 'a':
+                global->stats_step = atoi(optarg);
+                break;
+
+            case 'e':
+                if (sscanf(optarg, "%f,%i", &global->ae_target, &global->ae_delay) < 1 ||
+                        global->ae_target <= 0)
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'x':
+                if (sscanf(optarg, "%f,%i", &global->motion_threshold, &global->motion_step) < 1 ||
+                        global->motion_threshold <= 0)
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'E':
+                // "<us>", "<us>,<gain>" or ",<gain>"
+                if ((optarg[0] != ',' && (sscanf(optarg, "%f", &global->exposure_us) != 1 ||
+                                global->exposure_us <= 0)) ||
+                        (strchr(optarg, ',') && (sscanf(strchr(optarg, ','), ",%i", &global->gain) != 1 ||
+                                global->gain < 0)))
+                {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'p':
+                free(global->profile);
+                global->profile = strdup(optarg);
+                break;
+
+            case 'u':
+                free(global->meta_device);
+                global->meta_device = strdup(optarg);
+                break;
+
+            case 'D':
+                free(global->bracket);
+                global->bracket = strdup(optarg);
+                break;
+
+            case 'F':
+                global->hdr_merge = 1;
+                break;
+
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (global->bracket && global->ae_target > 0)
+    {
+        printf("-D brackets the exposure, -e ignored\n");
+        global->ae_target = 0;
+    }
+    if (global->headless && !global->bench_frames && !global->bench_seconds)
+        global->bench_seconds = DEFAULT_BENCH_SECONDS;
+}
+
 void
-init_struct () 
+init_struct (int argc, char *argv[]) 
 {
     int ret = 0;
 
@@ -91,6 +679,13 @@ init_struct ()
 
 	// setting params here
     initGlobals(global);
+    parse_options(argc, argv);
+
+    // the write and shared memory benchmarks and the broker client run
+    // without a camera, the scaling benchmark and the broker open their own
+    if (global->write_bench || global->shm_readers > 0 || global->bench_cameras > 0 ||
+            global->http_clients > 0 || global->broker_socket || global->client_socket)
+        return;
 
     if ( ( ret=init_videoIn (videoIn, global) ) != 0)
     {
@@ -154,47 +749,465 @@ static void reset_keypress()
 	return;
 }
 
+// broker client: frames come from the broker's shared memory ring
+static int client_quit = 0;
+
+void *client_loop(void *arg)
+{
+    struct ShmSubscriber *sub = (struct ShmSubscriber *) arg;
+    struct ShmFrame frame;
+
+    while (!__atomic_load_n(&client_quit, __ATOMIC_ACQUIRE))
+    {
+        if (shm_next_frame(sub, &frame, 100) < 0)
+        {
+            printf("broker closed the stream\n");
+            break;
+        }
+    }
+
+    return ((void *) 0);
+}
+
+// exposure and gain keys become requests, applied by the broker between frames
+static int run_client(const char *socket_path)
+{
+    struct ShmSubscriber *sub = shm_subscribe(socket_path);
+    if (!sub)
+        return -1;
+    printf("subscribed to %s (%ux%u)\n", socket_path, sub->header->width, sub->header->height);
+
+    __THREAD_TYPE thread;
+    if (__THREAD_CREATE(&thread, client_loop, sub))
+    {
+        printf("Client thread creation failed\n");
+        shm_unsubscribe(sub);
+        return -1;
+    }
+
+	set_keypress();
+	int quit = 0;
+	while (!quit)
+	{
+		struct ShmReply reply;
+		const char *name = "exposure";
+		int ret;
+
+		switch (getchar())
+		{
+		case EOF:
+		case 'q':
+			quit = 1;
+			continue;
+		case 'j':
+			ret = shm_request(sub, SHM_OP_EXPOSURE, 0, IOCTL_DIRECT_DEC, &reply);
+			break;
+		case 'u':
+			ret = shm_request(sub, SHM_OP_EXPOSURE, 0, IOCTL_DIRECT_INC, &reply);
+			break;
+		case 'k':
+			name = "gain";
+			ret = shm_request(sub, SHM_OP_GAIN, 0, IOCTL_DIRECT_DEC, &reply);
+			break;
+		case 'i':
+			name = "gain";
+			ret = shm_request(sub, SHM_OP_GAIN, 0, IOCTL_DIRECT_INC, &reply);
+			break;
+		default:
+			continue;
+		}
+		if (ret)
+			printf("%s request failed: %s\n", name, strerror(-ret));
+		else
+			printf("%s %i (from frame %u on)\n", name, reply.value, reply.sequence + 1);
+	}
+	reset_keypress();
+
+    __atomic_store_n(&client_quit, 1, __ATOMIC_RELEASE);
+    __THREAD_JOIN(thread);
+    printf("frames received: %llu dropped: %llu\n",
+            (ULLONG) sub->reader->received, (ULLONG) sub->reader->dropped);
+    shm_unsubscribe(sub);
+
+    return 0;
+}
+
 
 int main(int argc, char *argv[])
 {
-    init_struct();
+    init_struct(argc, argv);
 
-	__THREAD_TYPE video_thread;
-    if( __THREAD_CREATE(&video_thread, camera_loop, NULL))
+    if (global->write_bench)
     {
-        printf("Video thread creation failed\n");
-		return -1;
+        // no capture involved, frame size from -s
+        int ret = raw_record_bench(global->write_bench, global->width * global->height * 2,
+                global->bench_frames > 0 ? global->bench_frames : DEFAULT_RAW_FRAMES);
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
     }
 
+    if (global->shm_readers > 0)
+    {
+        // synthetic frames of -s size, readers are forked processes
+        int ret = shm_bench(global->shm_socket ? global->shm_socket : SHM_BENCH_SOCKET,
+                global->width * global->height * 2,
+                global->bench_frames > 0 ? global->bench_frames : DEFAULT_RAW_FRAMES,
+                global->shm_readers);
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (global->http_clients > 0)
+    {
+        // synthetic JPEG sized payloads, viewers in this process
+        int fps = global->fps / MAX(global->fps_num, 1);
+        int ret = mjpeg_bench(global->http_port > 0 ? global->http_port : MJPEG_DEFAULT_PORT,
+                global->http_clients, global->http_clients / 4,
+                global->bench_frames > 0 ? global->bench_frames : fps * DEFAULT_BENCH_SECONDS,
+                global->width * global->height / 8, fps);
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (global->broker_socket)
+    {
+        // -d and the remaining arguments are the devices
+        char *devices[BROKER_MAX_CAMERAS];
+        int num_devices = 0;
+        devices[num_devices++] = global->videodevice;
+        for (int i = optind; i < argc && num_devices < BROKER_MAX_CAMERAS; i++)
+            devices[num_devices++] = argv[i];
+
+        int ret = -1;
+        struct CameraBroker *broker = broker_create(global, devices, num_devices,
+                global->broker_socket);
+        if (broker)
+        {
+            ret = broker_run(broker);
+            broker_destroy(broker);
+        }
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (global->client_socket)
+    {
+        int ret = run_client(global->client_socket);
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (global->bench_cameras > 0)
+    {
+        int ret = multi_capture_bench(global);
+        free(videoIn); // never initiated
+        videoIn = NULL;
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+    if (global->headless)
+    {
+        int ret = capture_bench(videoIn, global);
+        clean_struct();
+        return ret < 0 ? 1 : 0;
+    }
+
+	// everything below is released by cleanup, in reverse order
+	struct StreamRecord *rec = NULL;
+	struct RawRecord *raw = NULL;
+	struct PretriggerRing *ring = NULL;
+	struct ShmPublisher *pub = NULL;
+	struct MjpegServer *http = NULL;
+	struct HdrMerge *merge = NULL;
+	ULLONG triggers = 0;
+	int ret = -1;
+
+	// threads started so far (joined by cleanup)
+	__THREAD_TYPE video_thread;
+	__THREAD_TYPE render_thread;
+	__THREAD_TYPE record_thread;
+	__THREAD_TYPE raw_thread;
+	__THREAD_TYPE pretrigger_thread;
+	__THREAD_TYPE publish_thread;
+	__THREAD_TYPE stream_thread;
+	__THREAD_TYPE hdr_thread;
+	bool video_started = false;
+	bool render_started = false;
+	bool record_started = false;
+	bool raw_started = false;
+	bool pretrigger_started = false;
+	bool publish_started = false;
+	bool stream_started = false;
+	bool hdr_started = false;
+
+	if (global->record_file)
+	{
+		rec = stream_record_open(global->record_file, global->format,
+				global->width, global->height, global->fps, global->fps_num);
+		if (!rec)
+			goto cleanup;
+	}
+
+	if (global->raw_file)
+	{
+		raw = raw_record_open(global->raw_file, global->format, videoIn->roi.width, videoIn->roi.height,
+				uvc_max_frame_size(videoIn),
+				global->bench_frames > 0 ? global->bench_frames : DEFAULT_RAW_FRAMES);
+		if (!raw)
+			goto cleanup;
+	}
+
+	if (global->pretrigger_mb > 0)
+	{
+		ring = pretrigger_create((size_t) global->pretrigger_mb << 20, global->pretrigger_lz4,
+				global->format, global->width, global->height, global->fps, global->fps_num);
+		if (!ring)
+			goto cleanup;
+	}
+
+	if (global->shm_socket)
+	{
+		pub = shm_publisher_create(global->shm_socket, global->format, videoIn->roi.width,
+				videoIn->roi.height, uvc_max_frame_size(videoIn), SHM_DEFAULT_SLOTS);
+		if (!pub)
+			goto cleanup;
+		printf("publishing frames on %s\n", global->shm_socket);
+	}
+
+	if (global->http_port > 0)
+	{
+		http = mjpeg_server_create(global->http_port, 0);
+		if (!http)
+			goto cleanup;
+		printf("streaming on http://localhost:%i/stream\n", global->http_port);
+	}
+
+	if (global->profile && access(global->profile, R_OK) == 0)
+	{
+		// before capture starts: nobody else touches the controls yet
+		struct ControlProfile profile;
+		if (profile_load(&profile, global->profile) == 0 &&
+				profile_apply(videoIn, &profile) == 0)
+			printf("control profile %s applied (%u controls)\n", global->profile,
+					profile.header.count);
+	}
+
+	fanout = fanout_create(videoIn);
+	if (global->ae_target > 0)
+	{
+		ae = ae_create(videoIn, global->ae_target, global->ae_delay);
+		if (ae && global->stats_step <= 0)
+			global->stats_step = 4; // the mean of a 1/16 grid is plenty
+	}
+	fanout_set_stats(fanout, global->stats_step);
+	if (global->motion_threshold > 0)
+	{
+		motion = motion_create(videoIn->fmt.fmt.pix.width, videoIn->fmt.fmt.pix.height,
+				global->motion_step, global->motion_threshold);
+		fanout_set_motion(fanout, motion);
+	}
+	controls = cq_create(videoIn);
+	fanout_set_controls(fanout, controls);
+	if (global->exposure_us > 0)
+		cq_set_exposure(controls, global->exposure_us);
+	if (global->gain >= 0)
+		cq_set_gain(controls, global->gain);
+	if (global->bracket)
+	{
+		bracket = hdr_create(videoIn, global->bracket);
+		fanout_set_bracket(fanout, bracket);
+		if (bracket && global->hdr_merge)
+			merge = hdr_merge_create(videoIn->fmt.fmt.pix.width, videoIn->fmt.fmt.pix.height);
+		if (merge)
+		{
+			hdr_view = (BYTE *)calloc(merge->width * merge->height, 1);
+			__INIT_MUTEX(&hdr_mutex);
+		}
+	}
+	preview = fanout_add_consumer(fanout, "preview", 1, FANOUT_DROP_OLDEST);
+	if (rec)
+		recorder = fanout_add_consumer(fanout, "record", 2, FANOUT_DROP_NEWEST);
+	if (raw)
+		raw_recorder = fanout_add_consumer(fanout, "raw", 2, FANOUT_DROP_NEWEST);
+	if (ring)
+		pretrigger = fanout_add_consumer(fanout, "pretrigger", 2, FANOUT_DROP_OLDEST);
+	if (pub)
+		publisher = fanout_add_consumer(fanout, "shm", 2, FANOUT_DROP_OLDEST);
+	if (http)
+		streamer = fanout_add_consumer(fanout, "http", 1, FANOUT_DROP_OLDEST);
+	if (merge)
+		hdr = fanout_add_consumer(fanout, "hdr", HDR_MAX_STEPS, FANOUT_DROP_NEWEST);
+
+	hrc_link_init(&wallclock, HRC_MONOTONIC, HRC_REALTIME);
+	if (!(video_started = !__THREAD_CREATE(&video_thread, camera_loop, NULL)))
+	{
+		printf("Video thread creation failed\n");
+		goto cleanup;
+	}
+	if (!(render_started = !__THREAD_CREATE(&render_thread, render_loop, NULL)))
+	{
+		printf("Render thread creation failed\n");
+		goto cleanup;
+	}
+	if (rec && !(record_started = !__THREAD_CREATE(&record_thread, record_loop, rec)))
+	{
+		printf("Record thread creation failed\n");
+		goto cleanup;
+	}
+	if (raw && !(raw_started = !__THREAD_CREATE(&raw_thread, raw_record_loop, raw)))
+	{
+		printf("Raw record thread creation failed\n");
+		goto cleanup;
+	}
+	if (ring && !(pretrigger_started = !__THREAD_CREATE(&pretrigger_thread, pretrigger_loop, ring)))
+	{
+		printf("Pre-trigger thread creation failed\n");
+		goto cleanup;
+	}
+	if (pub && !(publish_started = !__THREAD_CREATE(&publish_thread, publish_loop, pub)))
+	{
+		printf("Publish thread creation failed\n");
+		goto cleanup;
+	}
+	if (http && !(stream_started = !__THREAD_CREATE(&stream_thread, stream_loop, http)))
+	{
+		printf("Stream thread creation failed\n");
+		goto cleanup;
+	}
+	if (merge && !(hdr_started = !__THREAD_CREATE(&hdr_thread, hdr_loop, merge)))
+	{
+		printf("HDR merge thread creation failed\n");
+		goto cleanup;
+	}
+
 	set_keypress();
-	while (1) {
+	while (ret < 0) {
 		char c = getchar();
 		switch(c) {
 		case 'q':
-			videoIn->signalquit = 1;			
-			__THREAD_JOIN(video_thread);
-			clean_struct();
-			reset_keypress();
-			return 0;
+			ret = 0;
+			break;
 
+		// applied by the capture thread between frames
 		case 'j':
-			exposure_control(videoIn, IOCTL_DIRECT_DEC);
+			cq_push(controls, videoIn->exposure_id, CQ_OP_STEP, IOCTL_DIRECT_DEC);
 			break;
 
 		case 'u':
-			exposure_control(videoIn, IOCTL_DIRECT_INC);
+			cq_push(controls, videoIn->exposure_id, CQ_OP_STEP, IOCTL_DIRECT_INC);
 			break;
 
 		case 'k':
-			gain_control(videoIn, IOCTL_DIRECT_DEC);
+			cq_push(controls, videoIn->gain_id, CQ_OP_STEP, IOCTL_DIRECT_DEC);
 			break;
 
 		case 'i':
-			gain_control(videoIn, IOCTL_DIRECT_INC);
+			cq_push(controls, videoIn->gain_id, CQ_OP_STEP, IOCTL_DIRECT_INC);
+			break;
+
+		case 'g':
+			gray_preview = !gray_preview;
+			break;
+
+		// saved and applied by the capture thread between frames
+		case 'p':
+			if (global->profile)
+				cq_save_profile(controls, global->profile);
+			break;
+
+		case 'l':
+			if (global->profile)
+				cq_restore_profile(controls, global->profile);
+			break;
+
+		case 'a':
+			print_stats = 1;
+			break;
+
+		case 't':
+			if (ring)
+			{
+				char name[64];
+				snprintf(name, sizeof(name), "pretrigger-%llu.dsr", ++triggers);
+				int n = pretrigger_trigger(ring, name);
+				if (n >= 0)
+					printf("saving %i frames to %s\n", n, name);
+			}
 			break;
 		}
 	}
+	reset_keypress();
 
-	return 0;
+cleanup:
+	// capture first, then every consumer drains and exits
+	videoIn->signalquit = 1;
+	if (video_started)
+		__THREAD_JOIN(video_thread);
+	if (render_started)
+		__THREAD_JOIN(render_thread);
+	if (record_started)
+	{
+		__THREAD_JOIN(record_thread);
+		printf("frames recorded: %llu dropped: %llu\n",
+				recorder->received, recorder->dropped);
+	}
+	if (raw_started)
+	{
+		__THREAD_JOIN(raw_thread);
+		printf("raw frames recorded: %llu dropped: %llu\n",
+				raw_recorder->received, raw_recorder->dropped);
+	}
+	if (pretrigger_started)
+		__THREAD_JOIN(pretrigger_thread);
+	if (publish_started)
+	{
+		__THREAD_JOIN(publish_thread);
+		printf("frames published: %llu dropped: %llu\n",
+				publisher->received, publisher->dropped);
+	}
+	if (stream_started)
+		__THREAD_JOIN(stream_thread);
+	if (hdr_started)
+		__THREAD_JOIN(hdr_thread);
+	if (video_started)
+	{
+		printf("frames captured: %llu displayed: %llu dropped: %llu\n",
+				fanout->broadcast, displayed, preview->dropped);
+		if (fanout->starved)
+			printf("frames dropped for lack of driver buffers: %llu\n", fanout->starved);
+	}
+
+	if (merge)
+	{
+		hdr_merge_destroy(merge);
+		__CLOSE_MUTEX(&hdr_mutex);
+		free(hdr_view);
+		hdr_view = NULL;
+	}
+	ae_destroy(ae);
+	motion_destroy(motion);
+	cq_destroy(controls);
+	hdr_destroy(bracket);
+	fanout_destroy(fanout);
+	mjpeg_server_destroy(http);
+	shm_publisher_destroy(pub);
+	pretrigger_destroy(ring); // waits for a running flush
+	if (raw)
+		raw_record_close(raw);
+	if (rec)
+		stream_record_close(rec);
+	clean_struct();
+	return ret;
 }
 
@@ -0,0 +1,159 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "auto_exposure.hpp"
+#include "ms_time.hpp"
+
+struct AutoExposure *ae_create(struct vdIn *vd, float target, int delay)
+{
+    Control *list = vd->s ? vd->s->control_list : NULL;
+    struct AutoExposure *ae = NULL;
+    Control *exposure = NULL;
+    Control *gain = NULL;
+
+    if (list && vd->exposure_id)
+        exposure = get_ctrl_by_id(list, vd->exposure_id);
+    if (list && vd->gain_id)
+        gain = get_ctrl_by_id(list, vd->gain_id);
+    if (exposure && exposure->control.type != V4L2_CTRL_TYPE_INTEGER)
+        exposure = NULL;
+    if (gain && gain->control.type != V4L2_CTRL_TYPE_INTEGER)
+        gain = NULL;
+    if (!exposure && !gain)
+    {
+        printf("ae: %s has no exposure or gain control\n", vd->videodevice);
+        return (NULL);
+    }
+
+    ae = (AutoExposure *)calloc(1, sizeof(struct AutoExposure));
+    ae->vd = vd;
+    ae->exposure = exposure;
+    ae->gain = gain;
+    ae->target = target > 0 ? target : AE_DEFAULT_TARGET;
+    ae->delay = delay >= 0 ? MIN(delay, AE_MAX_DELAY) : AE_DEFAULT_DELAY;
+
+    // the camera's own loop off before we take over
+    exposure_manual(vd);
+    if (exposure)
+        ae->exposure_max = exposure_frame_max(vd);
+
+    printf("ae: target %.0f, delay %i frames, exposure %s (max %i), gain %s\n", ae->target,
+            ae->delay, exposure ? (const char *) exposure->control.name : "-", ae->exposure_max,
+            gain ? (const char *) gain->control.name : "-");
+    return ae;
+}
+
+int ae_update(struct AutoExposure *ae, const struct FrameStats *stats)
+{
+    struct vdIn *vd = ae->vd;
+
+    if (!stats->valid)
+        return (0);
+    ae->frames++;
+
+    if (ae->settling)
+    {
+        if ((int32_t) (stats->sequence - ae->settle_sequence) < 0)
+            return (0); // the change cannot show yet
+        // the first frame that should show it barely moved: the camera is
+        // slower than the delay we assumed (clipped frames tell nothing)
+        float expected = ae->expected_mean - ae->last_mean;
+        float moved = stats->mean - ae->last_mean;
+        if (fabsf(expected) > 2 && moved / expected < 0.5f && stats->clipped < 0.02f &&
+                ae->delay < AE_MAX_DELAY)
+        {
+            ae->delay++;
+            ae->settle_sequence++;
+            printf("ae: frame %u did not show the change, delay %i frames\n",
+                    stats->sequence, ae->delay);
+            return (0);
+        }
+        ae->settling = 0;
+    }
+
+    ae->converged = fabsf(stats->mean - ae->target) <= AE_TOLERANCE * ae->target;
+    if (ae->converged)
+        return (0);
+
+    UINT64 now = ns_time_monotonic();
+    if (ae->last_write && now - ae->last_write < AE_MIN_INTERVAL_MS * 1000000ULL)
+        return (0);
+
+    // exposure x gain product for the target, exposure first
+    float ratio = (ae->target - AE_BLACK_LEVEL) / MAX(stats->mean - AE_BLACK_LEVEL, 1.0f);
+    ratio = MIN(MAX(ratio, 1.0f / AE_MAX_RATIO), AE_MAX_RATIO);
+
+    int exposure = ae->exposure ? ae->exposure->value : 1;
+    int base = ae->gain ? ctrl_gain_base(ae->gain) : 0;
+    int gain = ae->gain ? ae->gain->value : 1;
+    // exposure and gain factor at least 1: a 0 would stick (and divide by 0)
+    double product = (double) MAX(exposure, 1) * MAX(gain + base, 1) * ratio;
+    product = MIN(product, (double) INT32_MAX);
+
+    int new_exposure = exposure;
+    int new_gain = gain;
+    if (ae->exposure)
+    {
+        double min_gain = ae->gain ? ae->gain->control.minimum + base : 1;
+        new_exposure = ctrl_clamp(ae->exposure, MAX(llround(product / min_gain), 1));
+        new_exposure = MIN(new_exposure, ae->exposure_max);
+    }
+    if (ae->gain)
+        new_gain = ctrl_clamp(ae->gain, MAX(llround(product / MAX(new_exposure, 1)), 1) - base);
+    if (new_exposure == exposure && new_gain == gain)
+        return (0); // at the limits
+
+    // both in one transaction (one ioctl when they share a class), no read back
+    ControlTxn txn;
+    ctrl_txn_begin(&txn, vd->fd, vd->s->control_list);
+    if (new_exposure != exposure)
+        ctrl_txn_set(&txn, ae->exposure->control.id, new_exposure);
+    if (new_gain != gain)
+        ctrl_txn_set(&txn, ae->gain->control.id, new_gain);
+    ae->writes++;
+    int ret = ctrl_txn_commit(&txn, 0);
+    if (ae->exposure)
+        vd->currExposureTime = ae->exposure->value;
+    if (ae->gain)
+        vd->currGainValue = ae->gain->value;
+
+    double applied = (double) MAX(new_exposure, 1) * MAX(new_gain + base, 1) /
+        ((double) MAX(exposure, 1) * MAX(gain + base, 1));
+    ae->last_mean = stats->mean;
+    ae->expected_mean = MIN(AE_BLACK_LEVEL + (stats->mean - AE_BLACK_LEVEL) * applied, 255.0);
+    ae->settling = 1;
+    ae->settle_sequence = stats->sequence + 1 + ae->delay;
+    ae->last_write = now;
+    ae->adjustments++;
+
+    printf("ae: frame %u mean %.1f: exposure %i gain %i\n", stats->sequence, stats->mean,
+            new_exposure, new_gain);
+    return ret ? -1 : 1;
+}
+
+void ae_destroy(struct AutoExposure *ae)
+{
+    if (ae == NULL)
+        return;
+    printf("ae: %llu frames, %llu adjustments, %llu control transactions, %s (delay %i)\n",
+            ae->frames, ae->adjustments, ae->writes,
+            ae->converged ? "converged" : "not converged", ae->delay);
+    free(ae);
+}
@@ -0,0 +1,92 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUTO_EXPOSURE_H
+#define AUTO_EXPOSURE_H
+
+#include "defs.hpp"
+#include "v4l2_uvc.hpp"
+#include "v4l2_controls.hpp"
+#include "frame_stats.hpp"
+
+/*
+ * Software auto exposure / auto gain
+ *
+ * drives vd->exposure_id and vd->gain_id so the mean luma of the frame
+ * statistics (frame_stats.hpp) reaches a target. The image is taken as
+ * linear above black: the exposure x gain product is scaled by
+ * (target - black) / (mean - black) in one step. Exposure is raised first
+ * (up to one frame period) and gain only for the rest, gain is lowered
+ * first. Gamma encoded cameras respond stronger than linear, so the step
+ * falls short and the loop converges from one side in a few steps instead
+ * of overshooting.
+ *
+ * after a change the controller ignores frames until the change can show
+ * (delay frames after the next one); if the first of those frames did not
+ * move as expected, the change is taken as still pending and the delay is
+ * raised (up to AE_MAX_DELAY). Controls are written without read back, at
+ * most once per AE_MIN_INTERVAL_MS, and only while the mean is outside the
+ * tolerance band.
+ */
+#define AE_DEFAULT_TARGET     110     // mean luma
+#define AE_DEFAULT_DELAY      2       // frames before a control change shows
+#define AE_MAX_DELAY          8
+#define AE_TOLERANCE          0.06f   // no change within +-6% of the target
+#define AE_MAX_RATIO          8.0f    // largest change of the product per step
+#define AE_BLACK_LEVEL        16      // luma of black (limited range)
+#define AE_MIN_INTERVAL_MS    30      // between two control writes
+
+struct AutoExposure
+{
+    struct vdIn *vd;
+    Control *exposure;           // NULL - not adjusted
+    Control *gain;               // NULL - not adjusted
+    int exposure_max;            // exposure limit (frame period or control maximum)
+    float target;
+    int delay;                   // frames before a change shows (raised when too short)
+
+    int settling;                // waiting for the last change to show
+    uint32_t settle_sequence;    // first frame that can show it
+    float last_mean;             // mean before the change
+    float expected_mean;         // mean the change should give
+    UINT64 last_write;           // ns_time_monotonic of the last write
+
+    ULLONG frames;               // statistics seen
+    ULLONG adjustments;          // exposure/gain changes
+    ULLONG writes;               // control transactions submitted
+    int converged;               // mean within the tolerance band
+};
+
+/*
+ * sets up the controller on the exposure and gain controls of vd,
+ * switches camera auto exposure to manual
+ * args:
+ * target: mean luma (0 - AE_DEFAULT_TARGET)
+ * delay: frames before a control change shows in the image (< 0 - AE_DEFAULT_DELAY)
+ *
+ * returns: controller or NULL if the device has neither control
+ */
+struct AutoExposure *ae_create(struct vdIn *vd, float target, int delay);
+
+/*
+ * feeds the statistics of one frame (capture thread, between frames)
+ * returns: 1 if the controls were changed, 0 if not, -1 on ioctl error
+ */
+int ae_update(struct AutoExposure *ae, const struct FrameStats *stats);
+
+void ae_destroy(struct AutoExposure *ae);
+
+#endif
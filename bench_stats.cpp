@@ -0,0 +1,102 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bench_stats.hpp"
+
+#define LATENCY_MIN_CAPACITY 1024
+
+void latency_init(struct LatencyStats *stats, const char *name, int capacity)
+{
+    if (capacity < LATENCY_MIN_CAPACITY)
+        capacity = LATENCY_MIN_CAPACITY;
+
+    stats->name = name;
+    stats->samples = (UINT64 *)malloc(capacity * sizeof(UINT64));
+    stats->count = 0;
+    stats->size = capacity;
+    stats->sorted = 1;
+}
+
+void latency_add(struct LatencyStats *stats, UINT64 ns)
+{
+    if (stats->count >= stats->size)
+    {
+        stats->size *= 2;
+        stats->samples = (UINT64 *)realloc(stats->samples, stats->size * sizeof(UINT64));
+    }
+    stats->samples[stats->count++] = ns;
+    stats->sorted = 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    UINT64 x = *(const UINT64 *) a;
+    UINT64 y = *(const UINT64 *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * returns the p percentile (0 - 100) of the samples in ns
+ */
+UINT64 latency_percentile(struct LatencyStats *stats, double p)
+{
+    if (stats->count == 0)
+        return 0;
+
+    if (!stats->sorted)
+    {
+        qsort(stats->samples, stats->count, sizeof(UINT64), cmp_u64);
+        stats->sorted = 1;
+    }
+
+    int i = (int) (p / 100.0 * (stats->count - 1) + 0.5);
+    if (i < 0)
+        i = 0;
+    if (i >= stats->count)
+        i = stats->count - 1;
+    return stats->samples[i];
+}
+
+void latency_free(struct LatencyStats *stats)
+{
+    free(stats->samples);
+    stats->samples = NULL;
+    stats->count = 0;
+    stats->size = 0;
+}
+
+void latency_json(FILE *out, struct LatencyStats *stats, const char *indent)
+{
+    fprintf(out, "%s\"%s\": { \"count\": %i, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+            "\"p99_us\": %.1f, \"max_us\": %.1f }",
+            indent, stats->name, stats->count,
+            latency_percentile(stats, 50) / 1000.0,
+            latency_percentile(stats, 90) / 1000.0,
+            latency_percentile(stats, 99) / 1000.0,
+            latency_percentile(stats, 100) / 1000.0);
+}
+
+void cpu_usage(struct CpuUsage *usage)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    usage->user_ns = (UINT64) ru.ru_utime.tv_sec * 1000000000ULL + ru.ru_utime.tv_usec * 1000ULL;
+    usage->sys_ns = (UINT64) ru.ru_stime.tv_sec * 1000000000ULL + ru.ru_stime.tv_usec * 1000ULL;
+}
@@ -0,0 +1,59 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <stdio.h>
+#include "defs.hpp"
+
+/* latency samples of one pipeline stage (ns) */
+struct LatencyStats
+{
+    const char *name;     // stage name (json key)
+    UINT64 *samples;
+    int count;            // stored samples
+    int size;             // allocated samples
+    int sorted;           // samples are in ascending order
+};
+
+/* process cpu usage snapshot */
+struct CpuUsage
+{
+    UINT64 user_ns;
+    UINT64 sys_ns;
+};
+
+void latency_init(struct LatencyStats *stats, const char *name, int capacity);
+
+void latency_add(struct LatencyStats *stats, UINT64 ns);
+
+/*
+ * returns the p percentile (0 - 100) of the samples in ns
+ * (sorts the samples in place)
+ */
+UINT64 latency_percentile(struct LatencyStats *stats, double p);
+
+void latency_free(struct LatencyStats *stats);
+
+/*
+ * writes "name": { "count", "p50_us", "p90_us", "p99_us", "max_us" }
+ */
+void latency_json(FILE *out, struct LatencyStats *stats, const char *indent);
+
+void cpu_usage(struct CpuUsage *usage);
+
+#endif
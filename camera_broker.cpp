@@ -0,0 +1,353 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "camera_broker.hpp"
+#include "v4l2_uvc.hpp"
+#include "v4l2_controls.hpp"
+#include "ms_time.hpp"
+
+static volatile sig_atomic_t broker_quit = 0;
+
+static void broker_signal(int sig)
+{
+    (void) sig;
+    broker_quit = 1;
+}
+
+/* applies one control request on the capture thread */
+static void apply_request(struct BrokerCamera *cam, const struct ShmRequest *req,
+        struct ShmReply *reply)
+{
+    struct vdIn *vd = cam->vd;
+    Control *ctrl = NULL;
+    int ret = 0;
+
+    switch (req->op)
+    {
+        case SHM_OP_GET_CTRL:
+            ctrl = get_ctrl_by_id(vd->s->control_list, req->id);
+            // subscribed: the cached value follows the control events
+            if (ctrl && !ctrl->table->events)
+                ret = get_ctrl(vd->fd, vd->s->control_list, req->id);
+            break;
+
+        case SHM_OP_SET_CTRL:
+            ctrl = get_ctrl_by_id(vd->s->control_list, req->id);
+            if (ctrl)
+            {
+                ctrl->value = req->value;
+                ret = set_ctrl(vd->fd, vd->s->control_list, req->id); // read back if refused
+                if (req->id == (uint32_t) vd->exposure_id)
+                    vd->currExposureTime = ctrl->value;
+                else if (req->id == (uint32_t) vd->gain_id)
+                    vd->currGainValue = ctrl->value;
+            }
+            break;
+
+        case SHM_OP_EXPOSURE:
+            ctrl = get_ctrl_by_id(vd->s->control_list, vd->exposure_id);
+            if (ctrl)
+                ret = exposure_control(vd, req->value);
+            break;
+
+        case SHM_OP_GAIN:
+            ctrl = get_ctrl_by_id(vd->s->control_list, vd->gain_id);
+            if (ctrl)
+                ret = gain_control(vd, req->value);
+            break;
+
+        default:
+            reply->status = -EOPNOTSUPP;
+            return;
+    }
+
+    if (!ctrl)
+        reply->status = -EINVAL;
+    else
+    {
+        reply->status = ret ? -EIO : 0;
+        reply->value = ctrl->value;
+    }
+    reply->sequence = vd->last_sequence;
+    cam->requests++;
+    if (reply->status)
+        cam->request_errors++;
+}
+
+/* request handler of the publisher (accept thread): queues a copy of the
+ * request, the capture thread applies it and replies */
+static int queue_request(void *data, const struct ShmClient *client,
+        const struct ShmRequest *req, struct ShmReply *reply)
+{
+    struct BrokerCamera *cam = (struct BrokerCamera *) data;
+    struct BrokerRequest *request;
+
+    request = (struct BrokerRequest *) malloc(sizeof(struct BrokerRequest));
+    if (request == NULL)
+    {
+        reply->status = -ENOMEM;
+        return (0);
+    }
+    request->req = *req;
+    request->reply = *reply;
+    request->client = *client;
+    request->deadline_ns = ns_time_monotonic() + BROKER_APPLY_TIMEOUT_MS * 1000000ULL;
+    request->next = NULL;
+
+    __LOCK_MUTEX(&cam->mutex);
+    if (cam->stopped)
+    {
+        __UNLOCK_MUTEX(&cam->mutex);
+        free(request);
+        reply->status = -ESHUTDOWN;
+        return (0);
+    }
+    *cam->pending_tail = request;
+    cam->pending_tail = &request->next;
+    __UNLOCK_MUTEX(&cam->mutex);
+
+    return (SHM_REPLY_LATER);
+}
+
+/* takes the queued requests, in arrival order */
+static struct BrokerRequest *take_pending(struct BrokerCamera *cam)
+{
+    __LOCK_MUTEX(&cam->mutex);
+    struct BrokerRequest *list = cam->pending;
+    cam->pending = NULL;
+    cam->pending_tail = &cam->pending;
+    __UNLOCK_MUTEX(&cam->mutex);
+
+    return (list);
+}
+
+/* applies the queued requests and answers them */
+static void apply_pending(struct BrokerCamera *cam)
+{
+    // unlocked peek, a request missed here is applied after the next frame
+    if (__atomic_load_n(&cam->pending, __ATOMIC_ACQUIRE) == NULL)
+        return;
+
+    struct BrokerRequest *request = take_pending(cam);
+    while (request)
+    {
+        struct BrokerRequest *next = request->next;
+        // capture was stuck: the client gave up (or is about to), leave it
+        if (ns_time_monotonic() > request->deadline_ns)
+            request->reply.status = -ETIMEDOUT;
+        else
+            apply_request(cam, &request->req, &request->reply);
+        shm_reply(cam->pub, &request->client, &request->reply);
+        free(request);
+        request = next;
+    }
+}
+
+/* refuses further requests and answers the queued ones -ESHUTDOWN */
+static void stop_requests(struct BrokerCamera *cam)
+{
+    __LOCK_MUTEX(&cam->mutex);
+    cam->stopped = 1;
+    __UNLOCK_MUTEX(&cam->mutex);
+
+    struct BrokerRequest *request = take_pending(cam);
+    while (request)
+    {
+        struct BrokerRequest *next = request->next;
+        request->reply.status = -ESHUTDOWN;
+        shm_reply(cam->pub, &request->client, &request->reply);
+        free(request);
+        request = next;
+    }
+}
+
+/* capture thread: publishes every frame, applies controls between frames */
+static void *broker_loop(void *arg)
+{
+    struct BrokerCamera *cam = (struct BrokerCamera *) arg;
+    struct vdIn *vd = cam->vd;
+    struct FrameLease lease;
+
+    while (!vd->signalquit)
+    {
+        apply_pending(cam);
+
+        int ret = uvc_lease_frame(vd, &lease);
+        if (ret < 0)
+        {
+            cam->errors++;
+            if (ret == VDIN_STREAMON_ERR)
+                break;
+            continue;
+        }
+
+        // one copy into the shared ring (the software roi rows only), the
+        // driver buffer goes straight back
+        if ((uint32_t) uvc_frame_size(vd, &lease) <= cam->pub->header->slot_size)
+        {
+            int size = uvc_copy_frame(vd, &lease, shm_publish_slot(cam->pub));
+            shm_publish_commit(cam->pub, size, lease.sequence, lease.timestamp);
+        }
+        else
+            cam->pub->too_large++;
+        if (uvc_release_frame(vd, &lease) < 0)
+            cam->errors++;
+        cam->frames++;
+    }
+
+    // nobody applies requests any more, let waiting clients go
+    stop_requests(cam);
+
+    return ((void *) 0);
+}
+
+/*
+ * opens the devices and creates their publishers
+ */
+struct CameraBroker *broker_create(struct GLOBAL *global, char **devices, int num_devices,
+        const char *socket_path)
+{
+    struct CameraBroker *broker = (CameraBroker *)calloc(1, sizeof(struct CameraBroker));
+
+    if (num_devices > BROKER_MAX_CAMERAS)
+    {
+        printf("broker: at most %i cameras, ignoring the rest\n", BROKER_MAX_CAMERAS);
+        num_devices = BROKER_MAX_CAMERAS;
+    }
+
+    for (int i = 0; i < num_devices; i++)
+    {
+        struct BrokerCamera *cam = &broker->cameras[i];
+        char path[4096];
+        int ret;
+
+        cam->index = i;
+        cam->global = *global;
+        cam->global.videodevice = devices[i];
+        cam->vd = (vdIn *)calloc(1, sizeof(struct vdIn));
+        if ((ret = init_videoIn(cam->vd, &cam->global)) != VDIN_OK)
+        {
+            printf("broker: %s: init failed (%i)\n", devices[i], ret);
+            free(cam->vd); // released by init_videoIn
+            cam->vd = NULL;
+            broker_destroy(broker);
+            return (NULL);
+        }
+        broker->num_cameras++;
+
+        if (i == 0)
+            snprintf(path, sizeof(path), "%s", socket_path);
+        else
+            snprintf(path, sizeof(path), "%s.%i", socket_path, i);
+        cam->pub = shm_publisher_create(path, cam->global.format, cam->vd->roi.width,
+                cam->vd->roi.height, uvc_max_frame_size(cam->vd), SHM_DEFAULT_SLOTS);
+        if (!cam->pub)
+        {
+            broker_destroy(broker);
+            return (NULL);
+        }
+        cam->socket_path = strdup(path);
+
+        __INIT_MUTEX(&cam->mutex);
+        cam->pending = NULL;
+        cam->pending_tail = &cam->pending;
+        shm_publisher_set_handler(cam->pub, queue_request, cam);
+
+        printf("broker: %s (%ix%i) on %s\n", devices[i],
+                cam->vd->roi.width, cam->vd->roi.height, path);
+    }
+
+    return (broker);
+}
+
+/*
+ * starts the capture threads and serves clients until SIGINT or SIGTERM
+ */
+int broker_run(struct CameraBroker *broker)
+{
+    struct sigaction sa;
+    int ret = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = broker_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (int i = 0; i < broker->num_cameras; i++)
+    {
+        struct BrokerCamera *cam = &broker->cameras[i];
+        if (__THREAD_CREATE(&cam->thread, broker_loop, cam))
+        {
+            printf("broker: camera %i: thread creation failed\n", i);
+            broker_quit = 1;
+            ret = -1;
+            break;
+        }
+        cam->running = 1;
+    }
+
+    while (!broker_quit)
+    {
+        int streaming = 0;
+        for (int i = 0; i < broker->num_cameras; i++)
+            streaming += !broker->cameras[i].vd->signalquit;
+        if (!streaming)
+            break; // every device failed
+        sleep_ms(100);
+    }
+
+    for (int i = 0; i < broker->num_cameras; i++)
+        broker->cameras[i].vd->signalquit = 1;
+
+    return (ret);
+}
+
+/*
+ * stops capture, closes the publishers and the devices
+ */
+void broker_destroy(struct CameraBroker *broker)
+{
+    if (broker == NULL)
+        return;
+
+    for (int i = 0; i < broker->num_cameras; i++)
+    {
+        struct BrokerCamera *cam = &broker->cameras[i];
+
+        cam->vd->signalquit = 1;
+        if (cam->running)
+            __THREAD_JOIN(cam->thread);
+        if (cam->pub)
+        {
+            printf("broker: %s: %llu frames, %llu grab errors, %llu requests (%llu failed), "
+                    "%i clients\n", cam->socket_path, cam->frames, cam->errors,
+                    cam->requests, cam->request_errors, shm_publisher_readers(cam->pub));
+            stop_requests(cam); // capture never started
+            shm_publisher_destroy(cam->pub); // joins the accept thread
+            __CLOSE_MUTEX(&cam->mutex);
+        }
+        close_videoIn(cam->vd);
+        free(cam->socket_path);
+    }
+    free(broker);
+}
@@ -0,0 +1,103 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAMERA_BROKER_H
+#define CAMERA_BROKER_H
+
+#include <pthread.h>
+#include "defs.hpp"
+#include "globals.hpp"
+#include "frame_shm.hpp"
+
+/*
+ * Camera broker
+ *
+ * a long running process that owns the devices: one capture thread per
+ * camera publishes every frame through the shared memory ring
+ * (frame_shm.hpp) on its own socket
+ *     camera 0   <socket>
+ *     camera i   <socket>.<i>
+ * and client processes subscribe there (shm_subscriber.hpp). Control
+ * requests of all clients (set_ctrl, exposure_control, gain_control) are
+ * queued and applied by the capture thread between two frames, never
+ * while a frame is dequeued; the capture thread sends the reply, which
+ * carries the value read back and the last frame before the change (the
+ * accept thread only queues, so subscribers keep connecting meanwhile).
+ */
+#define BROKER_MAX_CAMERAS       8
+#define BROKER_APPLY_TIMEOUT_MS  2000   // a request not applied by then is answered -ETIMEDOUT
+
+struct BrokerRequest
+{
+    struct ShmRequest req;
+    struct ShmReply reply;           // magic and tag filled when queued
+    struct ShmClient client;         // gets the reply
+    UINT64 deadline_ns;              // monotonic, apply before
+    struct BrokerRequest *next;
+};
+
+struct BrokerCamera
+{
+    int index;
+    struct GLOBAL global;            // settings of this camera (strings not owned)
+    struct vdIn *vd;
+    struct ShmPublisher *pub;
+    char *socket_path;
+    __THREAD_TYPE thread;
+    int running;                     // capture thread started
+    int stopped;                     // capture thread done, requests are refused
+
+    __MUTEX_TYPE mutex;
+    struct BrokerRequest *pending;   // requests in arrival order (owned)
+    struct BrokerRequest **pending_tail;
+
+    ULLONG frames;                   // frames published
+    ULLONG errors;                   // grab errors
+    ULLONG requests;                 // control requests applied
+    ULLONG request_errors;
+};
+
+struct CameraBroker
+{
+    struct BrokerCamera cameras[BROKER_MAX_CAMERAS];
+    int num_cameras;
+};
+
+/*
+ * opens the devices and creates their publishers
+ * args:
+ * global: settings for all cameras (format, size, fps)
+ * devices: device names (as with -d, virtual cameras included)
+ * socket_path: socket of camera 0, camera i is at <socket_path>.<i>
+ *
+ * returns: broker or NULL on error
+ */
+struct CameraBroker *broker_create(struct GLOBAL *global, char **devices, int num_devices,
+        const char *socket_path);
+
+/*
+ * starts the capture threads and serves clients until SIGINT or SIGTERM
+ * returns: 0 on success, -1 on error
+ */
+int broker_run(struct CameraBroker *broker);
+
+/*
+ * stops capture, closes the publishers (clients see the end of the stream)
+ * and the devices
+ */
+void broker_destroy(struct CameraBroker *broker);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/videodev2.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "capture_bench.hpp"
+#include "bench_stats.hpp"
+#include "frame_stats.hpp"
+#include "yuv_luma.hpp"
+#include "ms_time.hpp"
+#include "hr_clock.hpp"
+
+/* 64 bit word sum, enough to keep the copy from being optimized out */
+static UINT64 frame_checksum(const BYTE *frame, int size)
+{
+    UINT64 sum = 0;
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        UINT64 w;
+        memcpy(&w, frame + i, 8);
+        sum += w;
+    }
+    for (; i < size; i++)
+        sum += frame[i];
+    return sum;
+}
+
+int capture_bench(struct vdIn *vd, struct GLOBAL *global)
+{
+    struct LatencyStats dequeue, copy, release, consume, latency, stats_time;
+    struct CpuUsage cpu_start, cpu_end;
+    struct FrameLease lease;
+    struct FrameStats stats;
+    struct LumaView luma;
+    ULLONG frames = 0;
+    ULLONG errors = 0;
+    ULLONG bytes_copied = 0;
+    UINT64 checksum = 0;
+    int last_error = 0;
+    int capacity = global->bench_frames > 0 ? global->bench_frames :
+        MAX(global->bench_seconds, 1) * MAX(global->fps / MAX(global->fps_num, 1), 1);
+
+    // stage time stamps are taken several times a frame: the CPU counter
+    // when it is invariant, in the time base of the buffer time stamps
+    hrc_tsc_init();
+    latency_init(&dequeue, "dequeue", capacity);
+    latency_init(&copy, "copy", capacity);
+    latency_init(&release, "release", capacity);
+    latency_init(&consume, "consume", capacity);
+    latency_init(&latency, "capture_to_dequeue", capacity);
+    latency_init(&stats_time, "stats", global->stats_step > 0 ? capacity : 1);
+    stats.valid = 0;
+
+    // the frame copy buffer is reused (not part of the measurement)
+    int buff_size = 0;
+    for (int i = 0; i < NB_BUFFER; i++)
+        buff_size = MAX(buff_size, (int) vd->buff_length[i]);
+    BYTE *frame = (BYTE *)malloc(buff_size);
+
+    UINT64 deadline = global->bench_seconds > 0 ?
+        hrc_now(HRC_TSC) + (UINT64) global->bench_seconds * G_NSEC_PER_SEC : 0;
+    ULLONG dropped_start = vd->dropped_frames;
+    cpu_usage(&cpu_start);
+    UINT64 start = hrc_now(HRC_TSC);
+    UINT64 first_frame = 0;
+
+    while (!vd->signalquit)
+    {
+        if (global->bench_frames > 0 && frames >= (ULLONG) global->bench_frames)
+            break;
+
+        UINT64 t0 = hrc_now(HRC_TSC);
+        if (deadline && t0 >= deadline)
+            break;
+
+        int ret = uvc_lease_frame(vd, &lease);
+        UINT64 t1 = hrc_now(HRC_TSC);
+        if (ret < 0)
+        {
+            errors++;
+            last_error = ret;
+            if (ret == VDIN_STREAMON_ERR)
+                break;
+            continue;
+        }
+        // driver time stamps share our clock only when they are monotonic
+        if (lease.timestamp && (vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) &&
+                (t1 > lease.timestamp))
+            latency_add(&latency, t1 - lease.timestamp);
+
+        // statistics on the driver buffer, as the fanout computes them
+        UINT64 t1s = t1;
+        if (global->stats_step > 0 &&
+                get_luma_view(lease.data, vd->fmt.fmt.pix.pixelformat, vd->fmt.fmt.pix.width,
+                    vd->fmt.fmt.pix.height, vd->fmt.fmt.pix.bytesperline, &luma) == 0)
+        {
+            frame_stats_compute(&luma, global->stats_step, &stats);
+            stats.sequence = lease.sequence;
+            t1s = hrc_now(HRC_TSC);
+            latency_add(&stats_time, t1s - t1);
+        }
+
+        int size = uvc_copy_frame(vd, &lease, frame);
+        UINT64 t2 = hrc_now(HRC_TSC);
+
+        ret = uvc_release_frame(vd, &lease);
+        UINT64 t3 = hrc_now(HRC_TSC);
+        if (ret < 0)
+        {
+            errors++;
+            last_error = ret;
+        }
+
+        if (global->bench_checksum)
+            checksum ^= frame_checksum(frame, size);
+        UINT64 t4 = hrc_now(HRC_TSC);
+
+        if (!frames)
+            first_frame = t1;
+        latency_add(&dequeue, t1 - t0);
+        latency_add(&copy, t2 - t1s);
+        latency_add(&release, t3 - t2);
+        latency_add(&consume, t4 - t3);
+        bytes_copied += size;
+        frames++;
+    }
+
+    UINT64 end = hrc_now(HRC_TSC);
+    cpu_usage(&cpu_end);
+    free(frame);
+
+    // fps over the streaming interval (the first dequeue includes stream on)
+    double elapsed = (end - start) / 1e9;
+    double stream_time = frames > 1 ? (end - first_frame) / 1e9 : elapsed;
+    double fps = (frames > 1 && stream_time > 0) ? (frames - 1) / stream_time : 0;
+    double cpu_user = cpu_end.user_ns / 1e9 - cpu_start.user_ns / 1e9;
+    double cpu_sys = cpu_end.sys_ns / 1e9 - cpu_start.sys_ns / 1e9;
+    char fourcc[5];
+    snprintf(fourcc, 5, "%c%c%c%c",
+            global->format & 0xFF, (global->format >> 8) & 0xFF,
+            (global->format >> 16) & 0xFF, (global->format >> 24) & 0xFF);
+
+    FILE *out = stdout;
+    if (global->bench_file && !(out = fopen(global->bench_file, "w")))
+    {
+        printf("Unable to create %s\n", global->bench_file);
+        out = stdout;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"device\": \"%s\",\n", vd->videodevice);
+    fprintf(out, "  \"format\": \"%s\",\n", fourcc);
+    fprintf(out, "  \"clock\": \"%s\",\n", hrc_name(HRC_TSC));
+    fprintf(out, "  \"width\": %i,\n  \"height\": %i,\n", global->width, global->height);
+    fprintf(out, "  \"requested_fps\": %.3f,\n", (double) global->fps / MAX(global->fps_num, 1));
+    fprintf(out, "  \"frames\": %llu,\n", frames);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"fps\": %.3f,\n", fps);
+    fprintf(out, "  \"dropped_frames\": %llu,\n", (ULLONG) (vd->dropped_frames - dropped_start));
+    fprintf(out, "  \"grab_errors\": %llu,\n", errors);
+    fprintf(out, "  \"bytes_copied\": %llu,\n", bytes_copied);
+    fprintf(out, "  \"cpu_user_s\": %.3f,\n", cpu_user);
+    fprintf(out, "  \"cpu_sys_s\": %.3f,\n", cpu_sys);
+    fprintf(out, "  \"cpu_percent\": %.1f,\n", elapsed > 0 ? 100.0 * (cpu_user + cpu_sys) / elapsed : 0);
+    if (global->bench_checksum)
+        fprintf(out, "  \"checksum\": \"%016llx\",\n", (ULLONG) checksum);
+    fprintf(out, "  \"latency\": {\n");
+    latency_json(out, &dequeue, "    ");
+    fprintf(out, ",\n");
+    latency_json(out, &copy, "    ");
+    fprintf(out, ",\n");
+    latency_json(out, &release, "    ");
+    fprintf(out, ",\n");
+    latency_json(out, &consume, "    ");
+    fprintf(out, ",\n");
+    latency_json(out, &latency, "    ");
+    if (global->stats_step > 0)
+    {
+        fprintf(out, ",\n");
+        latency_json(out, &stats_time, "    ");
+    }
+    fprintf(out, "\n  }");
+    if (stats.valid)
+        fprintf(out, ",\n  \"stats\": {\"step\": %i, \"samples\": %u, \"mean\": %.2f, "
+                "\"clipped\": %.4f}", stats.step, stats.samples, stats.mean, stats.clipped);
+    fprintf(out, "\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    latency_free(&dequeue);
+    latency_free(&copy);
+    latency_free(&release);
+    latency_free(&consume);
+    latency_free(&latency);
+    latency_free(&stats_time);
+
+    return (frames > 0 || !last_error) ? 0 : last_error;
+}
+
+/* one capture thread of multi_capture_bench */
+struct CameraBench
+{
+    struct vdIn *vd;
+    struct GLOBAL *global;
+    UINT64 deadline;
+    BYTE *frame;
+    ULLONG frames;
+    ULLONG errors;
+    ULLONG dropped;
+    UINT64 first_frame;
+    UINT64 last_frame;
+    UINT64 checksum;
+    struct LatencyStats latency;   // capture to dequeue
+};
+
+static void *camera_bench_loop(void *arg)
+{
+    struct CameraBench *cb = (struct CameraBench *) arg;
+    struct vdIn *vd = cb->vd;
+    struct FrameLease lease;
+    ULLONG dropped_start = vd->dropped_frames;
+
+    while (!vd->signalquit)
+    {
+        if (cb->global->bench_frames > 0 && cb->frames >= (ULLONG) cb->global->bench_frames)
+            break;
+        if (cb->deadline && hrc_now(HRC_TSC) >= cb->deadline)
+            break;
+
+        int ret = uvc_lease_frame(vd, &lease);
+        UINT64 now = hrc_now(HRC_TSC);
+        if (ret < 0)
+        {
+            cb->errors++;
+            if (ret == VDIN_STREAMON_ERR)
+                break;
+            continue;
+        }
+        if (lease.timestamp && (vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) &&
+                (now > lease.timestamp))
+            latency_add(&cb->latency, now - lease.timestamp);
+
+        int size = uvc_copy_frame(vd, &lease, cb->frame);
+        if (uvc_release_frame(vd, &lease) < 0)
+            cb->errors++;
+        if (cb->global->bench_checksum)
+            cb->checksum ^= frame_checksum(cb->frame, size);
+
+        if (!cb->frames)
+            cb->first_frame = now;
+        cb->last_frame = now;
+        cb->frames++;
+    }
+    cb->dropped = vd->dropped_frames - dropped_start;
+
+    return ((void *) 0);
+}
+
+int multi_capture_bench(struct GLOBAL *global)
+{
+    int cameras = global->bench_cameras;
+    struct CameraBench *cbs = (CameraBench *)calloc(cameras, sizeof(struct CameraBench));
+    __THREAD_TYPE *threads = (__THREAD_TYPE *)calloc(cameras, sizeof(__THREAD_TYPE));
+    struct CpuUsage cpu_start, cpu_end;
+    int opened = 0;
+    int ret = 0;
+    int capacity = global->bench_frames > 0 ? global->bench_frames :
+        MAX(global->bench_seconds, 1) * MAX(global->fps / MAX(global->fps_num, 1), 1);
+
+    hrc_tsc_init();
+    // all devices are set up before any of them streams
+    for (; opened < cameras; opened++)
+    {
+        struct CameraBench *cb = &cbs[opened];
+        cb->vd = (vdIn *)calloc(1, sizeof(struct vdIn));
+        cb->global = global;
+        if ((ret = init_videoIn(cb->vd, global)) != VDIN_OK)
+        {
+            printf("camera %i: init failed (%i)\n", opened, ret);
+            free(cb->vd);
+            break;
+        }
+        int buff_size = 0;
+        for (int i = 0; i < NB_BUFFER; i++)
+            buff_size = MAX(buff_size, (int) cb->vd->buff_length[i]);
+        cb->frame = (BYTE *)malloc(buff_size);
+        latency_init(&cb->latency, "capture_to_dequeue", capacity);
+    }
+
+    UINT64 start = hrc_now(HRC_TSC);
+    UINT64 deadline = global->bench_seconds > 0 ?
+        start + (UINT64) global->bench_seconds * G_NSEC_PER_SEC : 0;
+    cpu_usage(&cpu_start);
+    int started = 0;
+    for (; started < opened; started++)
+    {
+        cbs[started].deadline = deadline;
+        if (__THREAD_CREATE(&threads[started], camera_bench_loop, &cbs[started]))
+        {
+            printf("camera %i: thread creation failed\n", started);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        __THREAD_JOIN(threads[i]);
+    UINT64 end = hrc_now(HRC_TSC);
+    cpu_usage(&cpu_end);
+
+    double elapsed = (end - start) / 1e9;
+    double cpu_user = cpu_end.user_ns / 1e9 - cpu_start.user_ns / 1e9;
+    double cpu_sys = cpu_end.sys_ns / 1e9 - cpu_start.sys_ns / 1e9;
+    double total_fps = 0;
+    ULLONG total_frames = 0, total_dropped = 0, total_errors = 0;
+
+    FILE *out = stdout;
+    if (global->bench_file && !(out = fopen(global->bench_file, "w")))
+    {
+        printf("Unable to create %s\n", global->bench_file);
+        out = stdout;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"device\": \"%s\",\n", global->videodevice);
+    fprintf(out, "  \"cameras\": %i,\n", started);
+    fprintf(out, "  \"clock\": \"%s\",\n", hrc_name(HRC_TSC));
+    fprintf(out, "  \"width\": %i,\n  \"height\": %i,\n", global->width, global->height);
+    fprintf(out, "  \"requested_fps\": %.3f,\n", (double) global->fps / MAX(global->fps_num, 1));
+    fprintf(out, "  \"per_camera\": [\n");
+    for (int i = 0; i < started; i++)
+    {
+        struct CameraBench *cb = &cbs[i];
+        double stream_time = (cb->last_frame - cb->first_frame) / 1e9;
+        double fps = (cb->frames > 1 && stream_time > 0) ? (cb->frames - 1) / stream_time : 0;
+        total_fps += fps;
+        total_frames += cb->frames;
+        total_dropped += cb->dropped;
+        total_errors += cb->errors;
+        fprintf(out, "    { \"frames\": %llu, \"fps\": %.3f, \"dropped_frames\": %llu, "
+                "\"grab_errors\": %llu,", cb->frames, fps, cb->dropped, cb->errors);
+        if (global->bench_checksum)
+            fprintf(out, " \"checksum\": \"%016llx\",", (ULLONG) cb->checksum);
+        fprintf(out, "\n");
+        latency_json(out, &cb->latency, "      ");
+        fprintf(out, " }%s\n", i + 1 < started ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+    fprintf(out, "  \"frames\": %llu,\n", total_frames);
+    fprintf(out, "  \"total_fps\": %.3f,\n", total_fps);
+    fprintf(out, "  \"dropped_frames\": %llu,\n", total_dropped);
+    fprintf(out, "  \"grab_errors\": %llu,\n", total_errors);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"cpu_user_s\": %.3f,\n", cpu_user);
+    fprintf(out, "  \"cpu_sys_s\": %.3f,\n", cpu_sys);
+    fprintf(out, "  \"cpu_percent\": %.1f\n", elapsed > 0 ? 100.0 * (cpu_user + cpu_sys) / elapsed : 0);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    for (int i = 0; i < opened; i++)
+    {
+        latency_free(&cbs[i].latency);
+        free(cbs[i].frame);
+        close_videoIn(cbs[i].vd);
+    }
+    free(threads);
+    free(cbs);
+
+    return (opened == cameras) ? 0 : ret;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAPTURE_BENCH_H
+#define CAPTURE_BENCH_H
+
+#include "v4l2_uvc.hpp"
+#include "globals.hpp"
+
+/*
+ * headless capture benchmark (no window, no conversion)
+ * grabs global->bench_frames frames or for global->bench_seconds
+ * (whichever ends first, 0 - unlimited), copies every frame like
+ * uvc_grab does and discards or checksums it, then writes a json
+ * summary to global->bench_file (stdout if NULL)
+ *
+ * returns: 0 on success, error code of the last failed grab otherwise
+ */
+int capture_bench(struct vdIn *vd, struct GLOBAL *global);
+
+/*
+ * scaling benchmark: opens global->bench_cameras devices on
+ * global->videodevice (a virtual camera, see v4l2_vcam) with one capture
+ * thread each, runs like capture_bench and writes per camera and total
+ * throughput as json
+ *
+ * returns: 0 on success, error code of the first failed init otherwise
+ */
+int multi_capture_bench(struct GLOBAL *global);
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "control_profile.hpp"
+#include "v4l2_controls.hpp"
+
+/* manual controls without effect (rejected or overridden) while their auto mode is on */
+static const struct
+{
+    uint32_t auto_id;
+    uint32_t manual_id;
+} gated[] =
+{
+    { V4L2_CID_EXPOSURE_AUTO, V4L2_CID_EXPOSURE_ABSOLUTE },
+    { V4L2_CID_EXPOSURE_AUTO, V4L2_CID_EXPOSURE },
+    { V4L2_CID_AUTOGAIN, V4L2_CID_GAIN },
+    { V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_WHITE_BALANCE_TEMPERATURE },
+    { V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_RED_BALANCE },
+    { V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_BLUE_BALANCE },
+    { V4L2_CID_FOCUS_AUTO, V4L2_CID_FOCUS_ABSOLUTE },
+    { V4L2_CID_FOCUS_AUTO, V4L2_CID_FOCUS_RELATIVE },
+    { V4L2_CID_HUE_AUTO, V4L2_CID_HUE },
+};
+
+#define NUM_GATED (sizeof(gated) / sizeof(gated[0]))
+
+static const struct DspEntry *find_entry(const struct ControlProfile *profile, uint32_t id)
+{
+    for (uint32_t i = 0; i < profile->header.count; i++)
+        if (profile->entries[i].id == id)
+            return &profile->entries[i];
+    return NULL;
+}
+
+/* auto mode on with value (exposure: the modes that set the exposure time) */
+static int auto_on(uint32_t id, int32_t value)
+{
+    if (id == V4L2_CID_EXPOSURE_AUTO)
+        return value == V4L2_EXPOSURE_AUTO || value == V4L2_EXPOSURE_APERTURE_PRIORITY;
+    return value != 0;
+}
+
+/* 1 - auto mode control, 0 - manual value to apply, -1 - skipped (its auto mode stays on) */
+static int entry_phase(const struct ControlProfile *profile, uint32_t id)
+{
+    for (size_t i = 0; i < NUM_GATED; i++)
+    {
+        if (gated[i].auto_id == id)
+            return (1);
+        if (gated[i].manual_id == id)
+        {
+            const struct DspEntry *mode = find_entry(profile, gated[i].auto_id);
+            if (mode && auto_on(mode->id, mode->value))
+                return (-1);
+        }
+    }
+    return (0);
+}
+
+/* stages the changed values of one phase and submits them, returns the commit result */
+static int apply_phase(struct vdIn *vd, const struct ControlProfile *profile, int phase)
+{
+    Control *list = vd->s->control_list;
+    ControlTxn txn;
+    int ret = 0;
+
+    ctrl_txn_begin(&txn, vd->fd, list);
+    for (uint32_t i = 0; i < profile->header.count; i++)
+    {
+        const struct DspEntry *entry = &profile->entries[i];
+        Control *ctrl = get_ctrl_by_id(list, entry->id);
+        if (!ctrl || ctrl->value == entry->value || entry_phase(profile, entry->id) != phase)
+            continue;
+        if (txn.count == CTRL_TXN_MAX)
+            ret |= ctrl_txn_commit(&txn, 0); // more controls than a transaction holds
+        ctrl_txn_set(&txn, entry->id, entry->value);
+    }
+    return ret | ctrl_txn_commit(&txn, 0);
+}
+
+int profile_snapshot(struct vdIn *vd, struct ControlProfile *profile)
+{
+    Control *current = vd->s ? vd->s->control_list : NULL;
+
+    memset(profile, 0, sizeof(struct ControlProfile));
+    profile->header.magic = DSP_MAGIC;
+    profile->header.version = DSP_VERSION;
+    memcpy(profile->header.card, vd->cap.card, sizeof(profile->header.card));
+    memcpy(profile->header.bus_info, vd->cap.bus_info, sizeof(profile->header.bus_info));
+
+    for (; current != NULL && profile->header.count < DSP_MAX_CONTROLS; current = current->next)
+    {
+        if (current->control.flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_WRITE_ONLY))
+            continue;
+        switch (current->control.type)
+        {
+            case V4L2_CTRL_TYPE_INTEGER:
+            case V4L2_CTRL_TYPE_BOOLEAN:
+            case V4L2_CTRL_TYPE_MENU:
+            case V4L2_CTRL_TYPE_INTEGER_MENU:
+            case V4L2_CTRL_TYPE_BITMASK:
+                profile->entries[profile->header.count].id = current->control.id;
+                profile->entries[profile->header.count].value = current->value;
+                profile->header.count++;
+                break;
+            default:
+                break; // buttons, strings and 64 bit values are not state to restore
+        }
+    }
+    return profile->header.count;
+}
+
+int profile_apply(struct vdIn *vd, const struct ControlProfile *profile)
+{
+    if (!vd->s || !vd->s->control_list)
+        return (-1);
+    if (strncmp((const char *) profile->header.card, (const char *) vd->cap.card,
+                sizeof(profile->header.card)) != 0)
+    {
+        printf("profile of %.32s does not fit %.32s\n", profile->header.card, vd->cap.card);
+        return (-1);
+    }
+    if (strncmp((const char *) profile->header.bus_info, (const char *) vd->cap.bus_info,
+                sizeof(profile->header.bus_info)) != 0)
+        printf("profile saved from %.32s, applied to %.32s\n", profile->header.bus_info,
+                vd->cap.bus_info);
+
+    // auto modes off (or on) before the manual values they gate
+    int ret = apply_phase(vd, profile, 1);
+    ret |= apply_phase(vd, profile, 0);
+    return ret ? -1 : 0;
+}
+
+int profile_save(const struct ControlProfile *profile, const char *filename)
+{
+    size_t size = sizeof(struct DspHeader) + profile->header.count * sizeof(struct DspEntry);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Unable to create %s: %s\n", filename, strerror(errno));
+        return (-1);
+    }
+    // header and entries are contiguous in ControlProfile
+    ssize_t n = write(fd, profile, size);
+    close(fd);
+    if (n != (ssize_t) size)
+    {
+        printf("Unable to write %s\n", filename);
+        return (-1);
+    }
+    return (0);
+}
+
+int profile_load(struct ControlProfile *profile, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Unable to open %s: %s\n", filename, strerror(errno));
+        return (-1);
+    }
+    ssize_t n = read(fd, profile, sizeof(struct ControlProfile));
+    close(fd);
+    if (n < (ssize_t) sizeof(struct DspHeader) || profile->header.magic != DSP_MAGIC ||
+            profile->header.version != DSP_VERSION || profile->header.count > DSP_MAX_CONTROLS ||
+            (size_t) n != sizeof(struct DspHeader) + profile->header.count * sizeof(struct DspEntry))
+    {
+        printf("%s is not a control profile\n", filename);
+        return (-1);
+    }
+    return (0);
+}
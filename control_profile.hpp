@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONTROL_PROFILE_H
+#define CONTROL_PROFILE_H
+
+#include "defs.hpp"
+#include "v4l2_uvc.hpp"
+
+/*
+ * Control profiles (.dsp)
+ *
+ * header | entry | entry | ...
+ *
+ * the values of the writable controls of a camera, keyed by control id
+ * and stamped with the device identity (card name and bus), so a tuned
+ * state (day, night, ...) can be saved and applied again. A profile is
+ * applied in two control transactions: the auto modes first, then the
+ * manual values they gate (skipped where the profile has the auto mode
+ * on), one VIDIOC_S_EXT_CTRLS per control class each; unchanged values
+ * are not sent.
+ */
+#define DSP_MAGIC         0x31505344  // "DSP1"
+#define DSP_VERSION       1
+#define DSP_MAX_CONTROLS  128
+
+struct DspHeader
+{
+    uint32_t magic;          // DSP_MAGIC
+    uint32_t version;        // DSP_VERSION
+    uint8_t card[32];        // v4l2_capability.card of the device
+    uint8_t bus_info[32];    // v4l2_capability.bus_info
+    uint32_t count;          // entries following the header
+    uint32_t reserved;
+};
+
+struct DspEntry
+{
+    uint32_t id;             // v4l2 control id
+    int32_t value;
+};
+
+struct ControlProfile
+{
+    struct DspHeader header;
+    struct DspEntry entries[DSP_MAX_CONTROLS];
+};
+
+/*
+ * stores the current (cached) values of the integer, boolean and menu
+ * controls that can be read and written
+ * returns: number of controls stored
+ */
+int profile_snapshot(struct vdIn *vd, struct ControlProfile *profile);
+
+/*
+ * applies a profile of the same camera model (capture thread, or before
+ * capture starts); controls the device does not have are skipped
+ * returns: 0 on success, -1 on error (other camera, rejected values)
+ */
+int profile_apply(struct vdIn *vd, const struct ControlProfile *profile);
+
+/*
+ * returns: 0 on success, -1 on error
+ */
+int profile_save(const struct ControlProfile *profile, const char *filename);
+int profile_load(struct ControlProfile *profile, const char *filename);
+
+#endif
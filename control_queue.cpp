@@ -0,0 +1,278 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "control_queue.hpp"
+#include "control_profile.hpp"
+#include "v4l2_controls.hpp"
+
+static int32_t ctrl_value(uint32_t id, Control *list)
+{
+    Control *ctrl = get_ctrl_by_id(list, id);
+    return ctrl ? ctrl->value : 0;
+}
+
+struct ControlQueue *cq_create(struct vdIn *vd)
+{
+    struct ControlQueue *cq = (ControlQueue *)calloc(1, sizeof(struct ControlQueue));
+
+    cq->vd = vd;
+    for (uint32_t i = 0; i < CQ_SIZE; i++)
+        cq->cells[i].turn = i;
+    if (vd->s && vd->s->control_list)
+    {
+        cq->current.exposure = ctrl_value(vd->exposure_id, vd->s->control_list);
+        cq->current.gain = ctrl_value(vd->gain_id, vd->s->control_list);
+    }
+    return cq;
+}
+
+static int push(struct ControlQueue *cq, uint32_t id, int op, int32_t value, const char *profile)
+{
+    uint32_t pos = __atomic_load_n(&cq->head, __ATOMIC_RELAXED);
+    struct ControlCell *cell = NULL;
+
+    // claim a position: the cell is free when its turn is the position
+    for (;;)
+    {
+        cell = &cq->cells[pos & (CQ_SIZE - 1)];
+        int32_t diff = (int32_t) (__atomic_load_n(&cell->turn, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&cq->head, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // not applied yet a full ring ago
+            __atomic_add_fetch(&cq->dropped, 1, __ATOMIC_RELAXED);
+            return (-1);
+        }
+        else
+            pos = __atomic_load_n(&cq->head, __ATOMIC_RELAXED);
+    }
+
+    cell->cmd.id = id;
+    cell->cmd.op = op;
+    cell->cmd.value = value;
+    cell->cmd.profile = profile;
+    cell->cmd.issued_sequence = __atomic_load_n(&cq->sequence, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&cell->turn, pos + 1, __ATOMIC_RELEASE);
+    return (0);
+}
+
+int cq_push(struct ControlQueue *cq, uint32_t id, int op, int32_t value)
+{
+    return push(cq, id, op, value, NULL);
+}
+
+int cq_set_exposure(struct ControlQueue *cq, double us)
+{
+    double unit = exposure_unit_us(cq->vd);
+    double value = unit > 0 ? us / unit : us;
+
+    // an absolute exposure means manual mode (same transaction, no change
+    // reaches the device if it is manual already)
+    if (cq->vd->s && get_ctrl_by_id(cq->vd->s->control_list, V4L2_CID_EXPOSURE_AUTO))
+        cq_push(cq, V4L2_CID_EXPOSURE_AUTO, CQ_OP_SET, V4L2_EXPOSURE_MANUAL);
+
+    // the capture thread clamps to the range and step
+    value = MIN(MAX(value, (double) INT32_MIN), (double) INT32_MAX);
+    return cq_push(cq, cq->vd->exposure_id, CQ_OP_SET, (int32_t) lround(value));
+}
+
+int cq_set_gain(struct ControlQueue *cq, int32_t gain)
+{
+    return cq_push(cq, cq->vd->gain_id, CQ_OP_SET, gain);
+}
+
+double cq_exposure(struct ControlQueue *cq)
+{
+    double unit = exposure_unit_us(cq->vd);
+    int32_t value = __atomic_load_n(&cq->current.exposure, __ATOMIC_RELAXED);
+    return unit > 0 ? value * unit : value;
+}
+
+int cq_save_profile(struct ControlQueue *cq, const char *filename)
+{
+    return push(cq, 0, CQ_OP_SAVE, 0, filename);
+}
+
+int cq_restore_profile(struct ControlQueue *cq, const char *filename)
+{
+    return push(cq, 0, CQ_OP_RESTORE, 0, filename);
+}
+
+int32_t cq_gain(struct ControlQueue *cq)
+{
+    return __atomic_load_n(&cq->current.gain, __ATOMIC_RELAXED);
+}
+
+void cq_stamp(struct ControlQueue *cq, uint32_t sequence, struct FrameControls *controls)
+{
+    struct vdIn *vd = cq->vd;
+
+    // exposed before anything applied now (other writers, like auto
+    // exposure, change the cached values between frames too)
+    if (vd->s && vd->s->control_list)
+    {
+        int32_t exposure = ctrl_value(vd->exposure_id, vd->s->control_list);
+        int32_t gain = ctrl_value(vd->gain_id, vd->s->control_list);
+        if (exposure != cq->current.exposure || gain != cq->current.gain)
+        {
+            // read by cq_exposure/cq_gain from other threads
+            __atomic_store_n(&cq->current.exposure, exposure, __ATOMIC_RELAXED);
+            __atomic_store_n(&cq->current.gain, gain, __ATOMIC_RELAXED);
+            cq->current.change_sequence = sequence;
+        }
+    }
+    *controls = cq->current;
+    __atomic_store_n(&cq->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+/* the coalesced changes as one transaction, returns the number of controls changed */
+static int commit(struct ControlQueue *cq, Control **ctrls, int32_t *values, int n, uint32_t issued)
+{
+    struct vdIn *vd = cq->vd;
+    int staged[CTRL_TXN_MAX];
+
+    if (n == 0)
+        return (0);
+
+    ControlTxn txn;
+    ctrl_txn_begin(&txn, vd->fd, vd->s->control_list);
+    for (int i = 0; i < n; i++)
+    {
+        staged[i] = values[i] != ctrls[i]->value;
+        if (staged[i])
+            ctrl_txn_set(&txn, ctrls[i]->control.id, values[i]);
+    }
+    int changed = txn.count;
+    if (changed == 0)
+        return (0);
+    // all in one transaction: one ioctl per control class
+    ctrl_txn_commit(&txn, 0);
+    cq->transactions++;
+    cq->current.issued_sequence = issued;
+    printf("controls: issued after frame %u, applied after frame %u\n",
+            issued, cq->sequence);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!staged[i])
+            continue;
+        if (ctrls[i]->control.id == (uint32_t) vd->exposure_id)
+            vd->currExposureTime = ctrls[i]->value;
+        else if (ctrls[i]->control.id == (uint32_t) vd->gain_id)
+            vd->currGainValue = ctrls[i]->value;
+        printf("  %s: %i\n", ctrls[i]->control.name, ctrls[i]->value);
+    }
+    return (changed);
+}
+
+/* CQ_OP_SAVE and CQ_OP_RESTORE */
+static void profile_command(struct ControlQueue *cq, const struct ControlCommand *cmd)
+{
+    struct vdIn *vd = cq->vd;
+    struct ControlProfile profile;
+
+    if (cmd->op == CQ_OP_SAVE)
+    {
+        int n = profile_snapshot(vd, &profile);
+        if (profile_save(&profile, cmd->profile) == 0)
+            printf("%i controls saved to %s\n", n, cmd->profile);
+        return;
+    }
+
+    if (profile_load(&profile, cmd->profile) < 0 || profile_apply(vd, &profile) < 0)
+        return;
+    Control *list = vd->s->control_list;
+    vd->currExposureTime = ctrl_value(vd->exposure_id, list);
+    vd->currGainValue = ctrl_value(vd->gain_id, list);
+    cq->current.issued_sequence = cmd->issued_sequence;
+    printf("control profile %s applied after frame %u (%u controls)\n", cmd->profile,
+            cq->sequence, profile.header.count);
+}
+
+int cq_apply(struct ControlQueue *cq)
+{
+    struct vdIn *vd = cq->vd;
+    Control *list = vd->s ? vd->s->control_list : NULL;
+    Control *ctrls[CTRL_TXN_MAX];
+    int32_t values[CTRL_TXN_MAX];
+    uint32_t issued = 0;
+    int changed = 0;
+    int n = 0;
+
+    for (;;)
+    {
+        struct ControlCell *cell = &cq->cells[cq->tail & (CQ_SIZE - 1)];
+        if (__atomic_load_n(&cell->turn, __ATOMIC_ACQUIRE) != cq->tail + 1)
+            break; // empty (or the producer is still writing it)
+        struct ControlCommand cmd = cell->cmd;
+        __atomic_store_n(&cell->turn, cq->tail + CQ_SIZE, __ATOMIC_RELEASE);
+        cq->tail++;
+        cq->commands++;
+
+        if (cmd.op == CQ_OP_SAVE || cmd.op == CQ_OP_RESTORE)
+        {
+            // after the changes queued before it
+            if (!list || !cmd.profile)
+                continue;
+            changed += commit(cq, ctrls, values, n, issued);
+            n = 0;
+            profile_command(cq, &cmd);
+            continue;
+        }
+
+        Control *ctrl = list ? get_ctrl_by_id(list, cmd.id) : NULL;
+        if (!ctrl)
+            continue;
+        issued = cmd.issued_sequence;
+
+        // coalesce: one value per control, steps add up
+        int i = 0;
+        while (i < n && ctrls[i] != ctrl)
+            i++;
+        if (i == n)
+        {
+            if (n == CTRL_TXN_MAX)
+                continue;
+            ctrls[n] = ctrl;
+            values[n++] = ctrl->value;
+        }
+        if (cmd.op == CQ_OP_STEP)
+            values[i] = ctrl_clamp(ctrl, (int64_t) values[i] + (int64_t) cmd.value * MAX(ctrl->control.step, 1));
+        else
+            values[i] = ctrl_clamp(ctrl, cmd.value);
+    }
+
+    return changed + commit(cq, ctrls, values, n, issued);
+}
+
+void cq_destroy(struct ControlQueue *cq)
+{
+    if (cq == NULL)
+        return;
+    if (cq->commands)
+        printf("controls: %llu commands in %llu transactions, %llu dropped\n",
+                cq->commands, cq->transactions, cq->dropped);
+    free(cq);
+}
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONTROL_QUEUE_H
+#define CONTROL_QUEUE_H
+
+#include "defs.hpp"
+#include "v4l2_uvc.hpp"
+
+/*
+ * Control command queue
+ *
+ * control changes from other threads (keys, clients) are queued here
+ * instead of touching the device, the capture thread applies them between
+ * frames: all queued changes as one control transaction, repeated changes
+ * of a control coalesced into one value. The queue is a bounded lock free
+ * ring (any number of producers, the capture thread consumes).
+ *
+ * every change is stamped with the last frame sequence when it was issued,
+ * and frames carry the exposure and gain in effect, so the first frame
+ * that can show a change is known.
+ */
+#define CQ_SIZE         64      // queued commands (power of 2)
+
+// command ops (the result is clamped to the control range and step)
+#define CQ_OP_SET       0       // value is the new value
+#define CQ_OP_STEP      1       // value control steps are added to the current value
+#define CQ_OP_SAVE      2       // the cached values are saved to the profile file (no id)
+#define CQ_OP_RESTORE   3       // the profile file is applied (no id)
+
+struct ControlCommand
+{
+    uint32_t id;                // control id
+    int op;                     // CQ_OP_*
+    int32_t value;
+    const char *profile;        // control profile file of CQ_OP_SAVE and CQ_OP_RESTORE
+    uint32_t issued_sequence;   // last frame sequence when issued
+};
+
+struct ControlCell
+{
+    uint32_t turn;              // ring position the cell is ready for (atomic)
+    struct ControlCommand cmd;
+};
+
+/* controls in effect for a frame */
+struct FrameControls
+{
+    int32_t exposure;           // exposure and gain values (0 - no such control)
+    int32_t gain;
+    uint32_t change_sequence;   // first frame dequeued after the last change was applied
+    uint32_t issued_sequence;   // frame sequence when the last change was issued
+};
+
+struct ControlQueue
+{
+    struct vdIn *vd;
+    struct ControlCell cells[CQ_SIZE];
+    uint32_t head;              // next position to fill (producers, atomic)
+    uint32_t tail;              // next position to apply (capture thread)
+    uint32_t sequence;          // last dequeued frame sequence (atomic)
+    struct FrameControls current;   // stamped on the frames (capture thread)
+
+    ULLONG commands;            // commands applied
+    ULLONG transactions;        // control transactions submitted
+    ULLONG dropped;             // commands lost to a full queue (atomic)
+};
+
+struct ControlQueue *cq_create(struct vdIn *vd);
+
+/*
+ * queues a control change (any thread, does not block)
+ * args:
+ * id: control id
+ * op: CQ_OP_SET or CQ_OP_STEP
+ *
+ * returns: 0 - queued, -1 - queue full (the command is dropped)
+ */
+int cq_push(struct ControlQueue *cq, uint32_t id, int op, int32_t value);
+
+/*
+ * absolute exposure and gain, queued like any command (a burst of sets
+ * reaches the device as the last value only)
+ * args:
+ * us: exposure time in microseconds, control units if the driver gives
+ *     the control no unit (exposure_unit_us)
+ * gain: control units (V4L2 defines no unit for gain)
+ *
+ * returns: 0 - queued, -1 - queue full
+ */
+int cq_set_exposure(struct ControlQueue *cq, double us);
+int cq_set_gain(struct ControlQueue *cq, int32_t gain);
+
+/*
+ * control profiles (control_profile.hpp), saved or applied by the capture
+ * thread once the changes queued before have been applied, so the file
+ * holds the values in effect and a restore is not undone by them
+ * args:
+ * filename: profile file (kept by the caller until applied)
+ *
+ * returns: 0 - queued, -1 - queue full
+ */
+int cq_save_profile(struct ControlQueue *cq, const char *filename);
+int cq_restore_profile(struct ControlQueue *cq, const char *filename);
+
+/*
+ * returns: exposure (microseconds or control units, as above) and gain
+ *          of the last dequeued frame
+ */
+double cq_exposure(struct ControlQueue *cq);
+int32_t cq_gain(struct ControlQueue *cq);
+
+/*
+ * capture thread, for every dequeued frame before it is handed out:
+ * stamps the controls in effect on the frame
+ */
+void cq_stamp(struct ControlQueue *cq, uint32_t sequence, struct FrameControls *controls);
+
+/*
+ * capture thread, between frames: applies the queued commands (they can
+ * only show in frames dequeued later)
+ * returns: number of controls changed
+ */
+int cq_apply(struct ControlQueue *cq);
+
+/*
+ * prints the totals and frees the queue (capture must be stopped)
+ */
+void cq_destroy(struct ControlQueue *cq);
+
+#endif
@@ -64,6 +64,9 @@ typedef uint64_t   UINT64;
 #define DEFAULT_HEIGHT 621
 #define DEFAULT_FPS	30
 #define DEFAULT_FPS_NUM 1
+#define DEFAULT_REFRESH_RATE 60
+#define DEFAULT_BENCH_SECONDS 10
+#define DEFAULT_RAW_FRAMES (60 * DEFAULT_FPS)
 
 /*clip value between 0 and 255*/
 #define CLIP(value) (BYTE)(((value)>0xFF)?0xff:(((value)<0)?0:(value)))
@@ -73,5 +76,10 @@ typedef uint64_t   UINT64;
 #define MAX(a,b) (((a) < (b)) ? (b) : (a))
 #endif
 
+/*MIN macro - gets the smaller value*/
+#ifndef MIN
+#define MIN(a,b) (((a) > (b)) ? (b) : (a))
+#endif
+
 #endif
 
@@ -0,0 +1,337 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "frame_fanout.hpp"
+#include "ms_time.hpp"
+
+struct FrameFanout *fanout_create(struct vdIn *vd)
+{
+    struct FrameFanout *fanout = (FrameFanout *)calloc(1, sizeof(struct FrameFanout));
+
+    fanout->vd = vd;
+    for (int i = 0; i < NB_BUFFER; i++)
+        fanout->refs[i].fanout = fanout;
+    __INIT_MUTEX(&fanout->mutex);
+
+    return fanout;
+}
+
+void fanout_destroy(struct FrameFanout *fanout)
+{
+    if (fanout == NULL)
+        return;
+
+    for (int i = 0; i < fanout->num_consumers; i++)
+    {
+        struct FrameConsumer *consumer = fanout->consumers[i];
+        fanout_close_consumer(fanout, consumer);
+        __CLOSE_COND(&consumer->cond);
+        __CLOSE_MUTEX(&consumer->mutex);
+        free(consumer);
+    }
+    __CLOSE_MUTEX(&fanout->mutex);
+    free(fanout);
+}
+
+struct FrameConsumer *fanout_add_consumer(struct FrameFanout *fanout, const char *name,
+        int depth, int policy)
+{
+    struct FrameConsumer *consumer = NULL;
+    int held = 0;
+
+    if (depth < 1)
+        depth = 1;
+    if (depth > FANOUT_MAX_DEPTH)
+        depth = FANOUT_MAX_DEPTH;
+
+    __LOCK_MUTEX(&fanout->mutex);
+    if (fanout->num_consumers >= FANOUT_MAX_CONSUMERS)
+    {
+        __UNLOCK_MUTEX(&fanout->mutex);
+        printf("fanout: too many consumers (max %i)\n", FANOUT_MAX_CONSUMERS);
+        return NULL;
+    }
+
+    consumer = (FrameConsumer *)calloc(1, sizeof(struct FrameConsumer));
+    consumer->name = name;
+    consumer->depth = depth;
+    consumer->policy = policy;
+    __INIT_MUTEX(&consumer->mutex);
+    __INIT_COND(&consumer->cond);
+    fanout->consumers[fanout->num_consumers++] = consumer;
+
+    // each consumer may hold its queue plus the frame it is working on
+    for (int i = 0; i < fanout->num_consumers; i++)
+        held += fanout->consumers[i]->depth + 1;
+    __UNLOCK_MUTEX(&fanout->mutex);
+
+    if (held > FANOUT_MAX_HELD)
+        printf("fanout: consumers may hold %i of %i buffers, frames are dropped past %i\n",
+                held, NB_BUFFER, FANOUT_MAX_HELD);
+
+    return consumer;
+}
+
+void fanout_close_consumer(struct FrameFanout *fanout, struct FrameConsumer *consumer)
+{
+    struct FrameRef *queued[FANOUT_MAX_DEPTH];
+    int n = 0;
+
+    (void) fanout; // the consumer's frames release themselves
+
+    __LOCK_MUTEX(&consumer->mutex);
+    consumer->closed = 1;
+    while (consumer->count > 0)
+    {
+        queued[n++] = consumer->queue[consumer->head];
+        consumer->head = (consumer->head + 1) % consumer->depth;
+        consumer->count--;
+    }
+    __COND_BCAST(&consumer->cond);
+    __UNLOCK_MUTEX(&consumer->mutex);
+
+    // outside the lock, the last release queues the buffer
+    for (int i = 0; i < n; i++)
+        frame_ref_release(queued[i]);
+}
+
+void frame_ref_acquire(struct FrameRef *ref)
+{
+    __atomic_add_fetch(&ref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void frame_ref_release(struct FrameRef *ref)
+{
+    if (__atomic_sub_fetch(&ref->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        uvc_release_frame(ref->fanout->vd, &ref->lease);
+        __atomic_sub_fetch(&ref->fanout->held, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * drops queued frames of the live (drop oldest) consumers, the oldest
+ * first and one at a time, until no more buffers are held than the cap
+ * (a frame another consumer still holds frees nothing yet)
+ */
+static void reclaim_oldest(struct FrameFanout *fanout)
+{
+    while (__atomic_load_n(&fanout->held, __ATOMIC_ACQUIRE) > FANOUT_MAX_HELD)
+    {
+        struct FrameConsumer *oldest = NULL;
+        uint32_t sequence = 0;
+
+        for (int i = 0; i < fanout->num_consumers; i++)
+        {
+            struct FrameConsumer *consumer = fanout->consumers[i];
+            if (consumer->policy != FANOUT_DROP_OLDEST)
+                continue;
+            __LOCK_MUTEX(&consumer->mutex);
+            if (consumer->count > 0)
+            {
+                uint32_t head = consumer->queue[consumer->head]->lease.sequence;
+                if (!oldest || (int32_t) (head - sequence) < 0)
+                {
+                    oldest = consumer;
+                    sequence = head;
+                }
+            }
+            __UNLOCK_MUTEX(&consumer->mutex);
+        }
+        if (!oldest)
+            return; // nothing left to take back
+
+        struct FrameRef *stale = NULL;
+        __LOCK_MUTEX(&oldest->mutex);
+        if (oldest->count > 0)
+        {
+            stale = oldest->queue[oldest->head];
+            oldest->head = (oldest->head + 1) % oldest->depth;
+            oldest->count--;
+            oldest->dropped++;
+        }
+        __UNLOCK_MUTEX(&oldest->mutex);
+        if (stale)
+            frame_ref_release(stale);
+    }
+}
+
+/* queue ref to consumer following its full policy */
+static void consumer_push(struct FrameConsumer *consumer, struct FrameRef *ref)
+{
+    struct FrameRef *stale = NULL;
+
+    __LOCK_MUTEX(&consumer->mutex);
+    if (consumer->closed)
+    {
+        __UNLOCK_MUTEX(&consumer->mutex);
+        return;
+    }
+    if (consumer->count == consumer->depth)
+    {
+        consumer->dropped++;
+        if (consumer->policy == FANOUT_DROP_NEWEST)
+        {
+            __UNLOCK_MUTEX(&consumer->mutex);
+            return;
+        }
+        stale = consumer->queue[consumer->head];
+        consumer->head = (consumer->head + 1) % consumer->depth;
+        consumer->count--;
+    }
+    frame_ref_acquire(ref);
+    consumer->queue[(consumer->head + consumer->count) % consumer->depth] = ref;
+    consumer->count++;
+    consumer->received++;
+    __COND_BCAST(&consumer->cond);
+    __UNLOCK_MUTEX(&consumer->mutex);
+
+    if (stale)
+        frame_ref_release(stale);
+}
+
+void fanout_set_stats(struct FrameFanout *fanout, int step)
+{
+    fanout->stats_step = step > 0 ? step : 0;
+}
+
+void fanout_set_motion(struct FrameFanout *fanout, struct MotionDetector *md)
+{
+    fanout->motion = md;
+}
+
+void fanout_set_controls(struct FrameFanout *fanout, struct ControlQueue *cq)
+{
+    fanout->controls = cq;
+}
+
+void fanout_set_bracket(struct FrameFanout *fanout, struct HdrBracket *br)
+{
+    fanout->bracket = br;
+}
+
+int fanout_broadcast(struct FrameFanout *fanout)
+{
+    struct FrameLease lease;
+
+    int ret = uvc_lease_frame(fanout->vd, &lease);
+    if (ret < 0)
+        return ret;
+
+    // the capture side holds one reference while handing out the others
+    struct FrameRef *ref = &fanout->refs[lease.index];
+    ref->lease = lease;
+    ref->stats.valid = 0;
+    ref->unchanged = 0;
+    memset(&ref->controls, 0, sizeof(ref->controls));
+    if (fanout->controls)
+        cq_stamp(fanout->controls, lease.sequence, &ref->controls);
+    if (fanout->bracket)
+        hdr_tag(fanout->bracket, lease.sequence, &ref->bracket);
+    else
+    {
+        memset(&ref->bracket, 0, sizeof(ref->bracket));
+        ref->bracket.step = -1;
+    }
+    if (fanout->stats_step > 0 || fanout->motion)
+    {
+        // once per frame here, consumers and exposure control read the result
+        struct v4l2_pix_format *pix = &fanout->vd->fmt.fmt.pix;
+        struct LumaView view;
+        if (get_luma_view(lease.data, pix->pixelformat, pix->width, pix->height,
+                    pix->bytesperline, &view) == 0)
+        {
+            if (fanout->stats_step > 0 &&
+                    frame_stats_compute(&view, fanout->stats_step, &ref->stats) == 0)
+                ref->stats.sequence = lease.sequence;
+            if (fanout->motion)
+                ref->unchanged = !motion_update(fanout->motion, &view);
+        }
+        fanout->stats = ref->stats;
+    }
+    __atomic_store_n(&ref->refcount, 1, __ATOMIC_RELEASE);
+
+    __LOCK_MUTEX(&fanout->mutex);
+    // the driver keeps NB_BUFFER - FANOUT_MAX_HELD buffers whatever the consumers hold
+    int held = __atomic_add_fetch(&fanout->held, 1, __ATOMIC_ACQUIRE);
+    if (held > FANOUT_MAX_HELD)
+    {
+        reclaim_oldest(fanout);
+        held = __atomic_load_n(&fanout->held, __ATOMIC_ACQUIRE);
+    }
+    if (held <= FANOUT_MAX_HELD)
+    {
+        for (int i = 0; i < fanout->num_consumers; i++)
+            consumer_push(fanout->consumers[i], ref);
+        fanout->broadcast++;
+    }
+    else
+    {
+        // back to the driver at once (the capture reference is the last)
+        for (int i = 0; i < fanout->num_consumers; i++)
+        {
+            __LOCK_MUTEX(&fanout->consumers[i]->mutex);
+            fanout->consumers[i]->dropped++;
+            __UNLOCK_MUTEX(&fanout->consumers[i]->mutex);
+        }
+        fanout->starved++;
+    }
+    __UNLOCK_MUTEX(&fanout->mutex);
+
+    // between dequeue and queue of this buffer: changes show from a later frame
+    if (fanout->controls)
+        cq_apply(fanout->controls);
+    // after the queued commands: the bracket owns exposure and gain
+    if (fanout->bracket)
+        hdr_schedule(fanout->bracket);
+
+    frame_ref_release(ref);
+
+    return VDIN_OK;
+}
+
+struct FrameRef *frame_consumer_pop(struct FrameConsumer *consumer, int timeout_ms)
+{
+    struct FrameRef *ref = NULL;
+
+    __LOCK_MUTEX(&consumer->mutex);
+    if (consumer->count == 0 && !consumer->closed && timeout_ms > 0)
+    {
+        struct timespec timeout;
+        ULLONG deadline = ns_time() + (ULLONG) timeout_ms * 1000000LL;
+        timeout.tv_sec = deadline / G_NSEC_PER_SEC;
+        timeout.tv_nsec = deadline % G_NSEC_PER_SEC;
+        while (consumer->count == 0 && !consumer->closed)
+        {
+            if (__COND_TIMED_WAIT(&consumer->cond, &consumer->mutex, &timeout) != 0)
+                break;
+        }
+    }
+    if (consumer->count > 0)
+    {
+        ref = consumer->queue[consumer->head];
+        consumer->head = (consumer->head + 1) % consumer->depth;
+        consumer->count--;
+    }
+    __UNLOCK_MUTEX(&consumer->mutex);
+
+    return ref;
+}
@@ -0,0 +1,155 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_FANOUT_H
+#define FRAME_FANOUT_H
+
+#include <pthread.h>
+#include "defs.hpp"
+#include "v4l2_uvc.hpp"
+#include "frame_stats.hpp"
+#include "motion_detect.hpp"
+#include "control_queue.hpp"
+#include "hdr_bracket.hpp"
+
+#define FANOUT_MAX_CONSUMERS 8
+#define FANOUT_MAX_DEPTH     8
+#define FANOUT_MAX_HELD      (NB_BUFFER - 2)  // buffers out of the driver at once, the rest stay queued
+
+// consumer queue full policy
+#define FANOUT_DROP_OLDEST   0  // release the oldest queued frame (live consumers)
+#define FANOUT_DROP_NEWEST   1  // skip the incoming frame (keeps queued frames in order)
+
+struct FrameFanout;
+
+/*
+ * read only handle on a dequeued driver buffer
+ * the buffer is queued back to the driver when the last reference drops
+ */
+struct FrameRef
+{
+    struct FrameLease lease;        // driver buffer (consumers must not write to it)
+    struct FrameStats stats;        // luma statistics (stats.valid 0 - not computed)
+    int unchanged;                  // same picture as the last changed frame (may be skipped)
+    struct FrameControls controls;  // exposure and gain in effect (zero without a control queue)
+    struct BracketTag bracket;      // exposure bracket step (bracket.step -1 - not bracketed)
+    int refcount;                   // held references (atomic)
+    struct FrameFanout *fanout;     // owner
+};
+
+struct FrameConsumer
+{
+    const char *name;
+    int depth;                                  // max queued frames
+    int policy;                                 // FANOUT_DROP_OLDEST or FANOUT_DROP_NEWEST
+    struct FrameRef *queue[FANOUT_MAX_DEPTH];   // ring of queued references
+    int head;                                   // oldest queued frame
+    int count;                                  // queued frames
+    int closed;                                 // no more frames (fanout_close_consumer)
+    __MUTEX_TYPE mutex;
+    __COND_TYPE cond;
+    ULLONG received;                            // frames queued
+    ULLONG dropped;                             // frames dropped by the queue policy
+};
+
+struct FrameFanout
+{
+    struct vdIn *vd;
+    struct FrameRef refs[NB_BUFFER];            // one handle per driver buffer
+    struct FrameConsumer *consumers[FANOUT_MAX_CONSUMERS];
+    int num_consumers;
+    __MUTEX_TYPE mutex;                         // protects the consumer list
+    int stats_step;                             // statistics grid step (0 - off)
+    struct FrameStats stats;                    // statistics of the last frame (capture thread)
+    struct MotionDetector *motion;              // change detection (NULL - off, not owned)
+    struct ControlQueue *controls;              // control changes applied between frames (not owned)
+    struct HdrBracket *bracket;                 // exposure bracketing (NULL - off, not owned)
+    int held;                                   // buffers out of the driver (atomic)
+    ULLONG broadcast;                           // frames handed out
+    ULLONG starved;                             // frames not handed out, consumers held FANOUT_MAX_HELD buffers
+};
+
+struct FrameFanout *fanout_create(struct vdIn *vd);
+
+/*
+ * frees the fanout and its consumers
+ * (consumers must be done with their frames)
+ */
+void fanout_destroy(struct FrameFanout *fanout);
+
+/*
+ * registers a consumer with its own queue depth and full policy
+ * (all consumers together hold at most FANOUT_MAX_HELD buffers: past
+ * that, live consumers lose their oldest frame, then new frames are
+ * dropped for all of them)
+ * returns: consumer or NULL if too many consumers
+ */
+struct FrameConsumer *fanout_add_consumer(struct FrameFanout *fanout, const char *name,
+        int depth, int policy);
+
+/*
+ * computes the luma statistics of every frame on the capture thread,
+ * before the frame is handed out (frame_stats.hpp)
+ * args:
+ * step: sampling grid step (0 - off)
+ */
+void fanout_set_stats(struct FrameFanout *fanout, int step);
+
+/*
+ * marks unchanged frames (FrameRef.unchanged) with detector md,
+ * run on the capture thread before the frame is handed out
+ */
+void fanout_set_motion(struct FrameFanout *fanout, struct MotionDetector *md);
+
+/*
+ * stamps the frames with the controls in effect and applies the commands
+ * queued in cq while the capture side still holds the frame
+ */
+void fanout_set_controls(struct FrameFanout *fanout, struct ControlQueue *cq);
+
+/*
+ * tags the frames with their bracket step and writes the exposure of the
+ * frame due 1 + delay later while the capture side holds the frame
+ */
+void fanout_set_bracket(struct FrameFanout *fanout, struct HdrBracket *br);
+
+/*
+ * stops queueing frames to consumer, releases the queued ones
+ * and wakes a blocked frame_consumer_pop
+ */
+void fanout_close_consumer(struct FrameFanout *fanout, struct FrameConsumer *consumer);
+
+/*
+ * capture side: dequeues one frame and hands a reference to every consumer
+ * returns: error code ( 0 - VDIN_OK)
+ */
+int fanout_broadcast(struct FrameFanout *fanout);
+
+/*
+ * consumer side: waits up to timeout_ms for the next frame
+ * returns: frame reference (release it with frame_ref_release)
+ * or NULL on timeout or closed consumer
+ */
+struct FrameRef *frame_consumer_pop(struct FrameConsumer *consumer, int timeout_ms);
+
+void frame_ref_acquire(struct FrameRef *ref);
+
+/*
+ * drops a reference, the last one queues the buffer back to the driver
+ */
+void frame_ref_release(struct FrameRef *ref);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+#include <linux/videodev2.h>
+
+#include "frame_shm.hpp"
+#include "shm_subscriber.hpp"
+#include "bench_stats.hpp"
+#include "ms_time.hpp"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+static void wake_readers(struct ShmHeader *header)
+{
+    __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* hands a free reader entry and the memfd to a new subscriber */
+static void add_reader(struct ShmPublisher *pub)
+{
+    int fd = accept4(pub->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    int i;
+    for (i = 0; i < SHM_MAX_READERS; i++)
+        if (pub->clients[i] < 0)
+            break;
+    if (i == SHM_MAX_READERS)
+    {
+        printf("shm: %i subscribers connected, refusing another one\n", SHM_MAX_READERS);
+        close(fd);
+        return;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        cred.pid = 0;
+
+    // a new reader starts with the next frame
+    struct ShmReader *reader = &pub->header->readers[i];
+    reader->pid = cred.pid;
+    reader->cursor = __atomic_load_n(&pub->header->published, __ATOMIC_ACQUIRE);
+    reader->received = 0;
+    reader->dropped = 0;
+
+    struct ShmHello hello;
+    hello.magic = SHM_MAGIC;
+    hello.reader = i;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pub->memfd, sizeof(int));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(hello))
+    {
+        close(fd);
+        return;
+    }
+
+    __atomic_store_n(&reader->active, 1, __ATOMIC_RELEASE);
+    __LOCK_MUTEX(&pub->mutex);
+    pub->serial[i]++;
+    __atomic_store_n(&pub->clients[i], fd, __ATOMIC_RELEASE);
+    __UNLOCK_MUTEX(&pub->mutex);
+    if (DEBUG)
+        printf("shm: subscriber %i connected (pid %i)\n", i, (int) cred.pid);
+}
+
+static void drop_reader(struct ShmPublisher *pub, int i)
+{
+    struct ShmReader *reader = &pub->header->readers[i];
+
+    if (DEBUG)
+        printf("shm: subscriber %i (pid %i) gone: %llu frames read, %llu dropped\n",
+                i, reader->pid, (ULLONG) reader->received, (ULLONG) reader->dropped);
+    __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+    // not while a late reply is sent on it
+    __LOCK_MUTEX(&pub->mutex);
+    close(pub->clients[i]);
+    __atomic_store_n(&pub->clients[i], -1, __ATOMIC_RELEASE);
+    __UNLOCK_MUTEX(&pub->mutex);
+}
+
+/* answers one subscriber request */
+static void handle_request(struct ShmPublisher *pub, int i, const struct ShmRequest *req)
+{
+    struct ShmReply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = SHM_MAGIC;
+    reply.tag = req->tag;
+    reply.status = -EOPNOTSUPP;
+
+    ShmRequestHandler handler = __atomic_load_n(&pub->handler, __ATOMIC_ACQUIRE);
+    if (handler)
+    {
+        struct ShmClient client;
+        client.reader = i;
+        client.serial = pub->serial[i]; // only the accept thread changes it
+        if (handler(pub->handler_data, &client, req, &reply) == SHM_REPLY_LATER)
+            return;
+    }
+
+    if (send(pub->clients[i], &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+        drop_reader(pub, i);
+}
+
+/* accept thread: subscribers connect, get the memfd and stay connected
+ * until they unsubscribe (or die), which frees their reader entry;
+ * requests they send in between are answered here */
+static void *accept_loop(void *arg)
+{
+    struct ShmPublisher *pub = (struct ShmPublisher *) arg;
+    struct pollfd fds[SHM_MAX_READERS + 1];
+    int reader_of[SHM_MAX_READERS + 1];
+
+    while (!__atomic_load_n(&pub->quit, __ATOMIC_ACQUIRE))
+    {
+        int n = 0;
+        fds[n].fd = pub->listen_fd;
+        fds[n].events = POLLIN;
+        n++;
+        for (int i = 0; i < SHM_MAX_READERS; i++)
+        {
+            if (pub->clients[i] < 0)
+                continue;
+            fds[n].fd = pub->clients[i];
+            fds[n].events = POLLIN;
+            reader_of[n] = i;
+            n++;
+        }
+
+        if (poll(fds, n, 100) <= 0)
+            continue;
+
+        for (int k = 1; k < n; k++)
+        {
+            if (!fds[k].revents)
+                continue;
+            struct ShmRequest req;
+            ssize_t ret = recv(fds[k].fd, &req, sizeof(req), MSG_DONTWAIT);
+            if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+                drop_reader(pub, reader_of[k]);
+            else if (ret == (ssize_t) sizeof(req) && req.magic == SHM_MAGIC)
+                handle_request(pub, reader_of[k], &req);
+        }
+        if (fds[0].revents & POLLIN)
+            add_reader(pub);
+    }
+
+    return ((void *) 0);
+}
+
+/*
+ * creates the frame ring and listens for subscribers on socket_path
+ */
+struct ShmPublisher *shm_publisher_create(const char *socket_path, int format,
+        int width, int height, uint32_t frame_size, int num_slots)
+{
+    struct ShmPublisher *pub = (ShmPublisher *)calloc(1, sizeof(struct ShmPublisher));
+    struct sockaddr_un addr;
+    struct stat st;
+
+    pub->memfd = -1;
+    pub->listen_fd = -1;
+    for (int i = 0; i < SHM_MAX_READERS; i++)
+        pub->clients[i] = -1;
+    __INIT_MUTEX(&pub->mutex);
+    if (num_slots <= 0)
+        num_slots = SHM_DEFAULT_SLOTS;
+
+    uint32_t control_size = ALIGN_UP(sizeof(struct ShmHeader) + num_slots * sizeof(struct ShmSlot),
+            SHM_PAGE_SIZE);
+    uint32_t slot_size = ALIGN_UP(frame_size, SHM_PAGE_SIZE);
+    pub->size = control_size + (size_t) num_slots * slot_size;
+
+    pub->memfd = memfd_create("dscam-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pub->memfd < 0 || ftruncate(pub->memfd, pub->size) < 0)
+    {
+        printf("shm: unable to create a %zu byte frame ring: %s\n", pub->size, strerror(errno));
+        goto fail;
+    }
+    // subscribers map the size they see at connect time, it must not change
+    fcntl(pub->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    pub->header = (ShmHeader *) mmap(NULL, pub->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, pub->memfd, 0);
+    if (pub->header == MAP_FAILED)
+    {
+        pub->header = NULL;
+        printf("shm: unable to map the frame ring: %s\n", strerror(errno));
+        goto fail;
+    }
+    // fault the pages in now rather than at the first frames
+    memset(pub->header, 0, pub->size);
+    pub->slots = (ShmSlot *) (pub->header + 1);
+    pub->data = (BYTE *) pub->header + control_size;
+
+    pub->header->magic = SHM_MAGIC;
+    pub->header->version = SHM_VERSION;
+    pub->header->format = format;
+    pub->header->width = width;
+    pub->header->height = height;
+    pub->header->num_slots = num_slots;
+    pub->header->slot_size = slot_size;
+    pub->header->control_size = control_size;
+    pub->header->total_size = pub->size;
+
+    // a socket left behind by a previous run is replaced, anything else is not
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        printf("shm: socket path too long: %s\n", socket_path);
+        goto fail;
+    }
+    strcpy(addr.sun_path, socket_path);
+    pub->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (pub->listen_fd < 0 ||
+            bind(pub->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(pub->listen_fd, SHM_MAX_READERS) < 0)
+    {
+        printf("shm: unable to listen on %s: %s\n", socket_path, strerror(errno));
+        goto fail;
+    }
+    pub->socket_path = strdup(socket_path);
+
+    if (__THREAD_CREATE(&pub->thread, accept_loop, pub))
+    {
+        printf("shm: accept thread creation failed\n");
+        goto fail;
+    }
+
+    return (pub);
+
+fail:
+    if (pub->listen_fd >= 0)
+        close(pub->listen_fd);
+    if (pub->socket_path)
+        unlink(pub->socket_path);
+    if (pub->header)
+        munmap(pub->header, pub->size);
+    if (pub->memfd >= 0)
+        close(pub->memfd);
+    free(pub->socket_path);
+    __CLOSE_MUTEX(&pub->mutex);
+    free(pub);
+    return (NULL);
+}
+
+/*
+ * copies one frame into the next slot and wakes waiting readers
+ */
+BYTE *shm_publish_slot(struct ShmPublisher *pub)
+{
+    struct ShmHeader *header = pub->header;
+    uint64_t n = header->published;
+    struct ShmSlot *slot = &pub->slots[n % header->num_slots];
+
+    // odd lock: readers that still hold frame n - num_slots see it change
+    __atomic_store_n(&slot->lock, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    return pub->data + (size_t)(n % header->num_slots) * header->slot_size;
+}
+
+void shm_publish_commit(struct ShmPublisher *pub, uint32_t size, uint32_t sequence, UINT64 timestamp)
+{
+    struct ShmHeader *header = pub->header;
+    uint64_t n = header->published;
+    struct ShmSlot *slot = &pub->slots[n % header->num_slots];
+
+    slot->size = MIN(size, header->slot_size);
+    slot->sequence = sequence;
+    slot->timestamp = timestamp;
+    slot->publish_ns = ns_time_monotonic();
+
+    __atomic_store_n(&slot->lock, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->published, n + 1, __ATOMIC_RELEASE);
+    wake_readers(header);
+}
+
+int shm_publish(struct ShmPublisher *pub, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp)
+{
+    if (size > pub->header->slot_size)
+    {
+        pub->too_large++;
+        return (-1);
+    }
+
+    memcpy(shm_publish_slot(pub), data, size);
+    shm_publish_commit(pub, size, sequence, timestamp);
+
+    return (0);
+}
+
+void shm_publisher_set_handler(struct ShmPublisher *pub, ShmRequestHandler handler, void *data)
+{
+    pub->handler_data = data;
+    __atomic_store_n(&pub->handler, handler, __ATOMIC_RELEASE);
+}
+
+int shm_reply(struct ShmPublisher *pub, const struct ShmClient *client, const struct ShmReply *reply)
+{
+    int ret = -1;
+
+    if (client->reader < 0 || client->reader >= SHM_MAX_READERS)
+        return (-1);
+
+    // the accept thread notices a broken connection and drops it there
+    __LOCK_MUTEX(&pub->mutex);
+    if (pub->clients[client->reader] >= 0 && pub->serial[client->reader] == client->serial &&
+            send(pub->clients[client->reader], reply, sizeof(*reply),
+                MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) sizeof(*reply))
+        ret = 0;
+    __UNLOCK_MUTEX(&pub->mutex);
+
+    return (ret);
+}
+
+int shm_publisher_readers(struct ShmPublisher *pub)
+{
+    int n = 0;
+
+    for (int i = 0; i < SHM_MAX_READERS; i++)
+        n += __atomic_load_n(&pub->header->readers[i].active, __ATOMIC_ACQUIRE) ? 1 : 0;
+    return (n);
+}
+
+void shm_publisher_destroy(struct ShmPublisher *pub)
+{
+    if (pub == NULL)
+        return;
+
+    // subscribers drain what is left and see the end of the stream
+    __atomic_store_n(&pub->header->closed, 1, __ATOMIC_RELEASE);
+    wake_readers(pub->header);
+
+    __atomic_store_n(&pub->quit, 1, __ATOMIC_RELEASE);
+    __THREAD_JOIN(pub->thread);
+    for (int i = 0; i < SHM_MAX_READERS; i++)
+        if (pub->clients[i] >= 0)
+            close(pub->clients[i]);
+
+    if (pub->too_large)
+        printf("shm: %llu frames larger than a slot were not published\n", pub->too_large);
+
+    close(pub->listen_fd);
+    unlink(pub->socket_path);
+    munmap(pub->header, pub->size); // subscribers keep their own mapping
+    close(pub->memfd);
+    free(pub->socket_path);
+    __CLOSE_MUTEX(&pub->mutex);
+    free(pub);
+}
+
+// what a benchmark reader process reports back
+struct ShmBenchResult
+{
+    int ok;
+    ULLONG received;
+    ULLONG dropped;
+    ULLONG torn;             // frames overwritten while they were read
+    int count;
+    UINT64 p50, p90, p99, max;
+};
+
+/* benchmark reader process: reads every frame it can in place */
+static void bench_reader(const char *socket_path, int out, uint32_t frames)
+{
+    struct ShmBenchResult res;
+    struct LatencyStats latency;
+    struct ShmFrame frame;
+    volatile BYTE sum = 0;
+    int ret;
+
+    memset(&res, 0, sizeof(res));
+    struct ShmSubscriber *sub = shm_subscribe(socket_path);
+    if (sub)
+    {
+        latency_init(&latency, "latency", frames);
+        while ((ret = shm_next_frame(sub, &frame, 1000)) >= 0)
+        {
+            if (ret)
+                continue;
+            latency_add(&latency, ns_time_monotonic() - frame.publish_ns);
+
+            // touch every cache line, as a consumer of the image would
+            for (uint32_t i = 0; i < frame.size; i += 64)
+                sum += frame.data[i];
+            if (!shm_frame_valid(sub, &frame))
+                res.torn++;
+        }
+
+        res.ok = 1;
+        res.received = sub->reader->received;
+        res.dropped = sub->reader->dropped;
+        res.count = latency.count;
+        res.p50 = latency_percentile(&latency, 50);
+        res.p90 = latency_percentile(&latency, 90);
+        res.p99 = latency_percentile(&latency, 99);
+        res.max = latency_percentile(&latency, 100);
+        latency_free(&latency);
+        shm_unsubscribe(sub);
+    }
+
+    if (write(out, &res, sizeof(res)) != (ssize_t) sizeof(res))
+        _exit(1);
+    _exit(res.ok ? 0 : 1);
+}
+
+/*
+ * throughput and latency benchmark with reader processes
+ */
+int shm_bench(const char *socket_path, uint32_t frame_size, uint32_t frames, int readers)
+{
+    struct LatencyStats publish;
+    int pipes[SHM_MAX_READERS];
+    pid_t pids[SHM_MAX_READERS];
+    int started = 0;
+    int ret = 0;
+
+    readers = MAX(1, MIN(readers, SHM_MAX_READERS));
+
+    struct ShmPublisher *pub = shm_publisher_create(socket_path, V4L2_PIX_FMT_YUYV, 0, 0,
+            frame_size, SHM_DEFAULT_SLOTS);
+    if (!pub)
+        return (-1);
+
+    BYTE *frame = (BYTE *) malloc(frame_size);
+    for (uint32_t i = 0; i < frame_size; i++)
+        frame[i] = (BYTE) i;
+
+    fflush(stdout);
+    for (; started < readers; started++)
+    {
+        int fds[2];
+        if (pipe(fds) < 0)
+            break;
+        pids[started] = fork();
+        if (pids[started] == 0)
+        {
+            close(fds[0]);
+            bench_reader(socket_path, fds[1], frames);
+        }
+        close(fds[1]);
+        if (pids[started] < 0)
+        {
+            close(fds[0]);
+            break;
+        }
+        pipes[started] = fds[0];
+    }
+
+    // publish once every reader is connected
+    UINT64 wait_end = ns_time_monotonic() + 5 * G_NSEC_PER_SEC;
+    while (shm_publisher_readers(pub) < started && ns_time_monotonic() < wait_end)
+        sleep_ms(1);
+    int connected = shm_publisher_readers(pub);
+
+    latency_init(&publish, "publish", frames);
+    UINT64 start = ns_time_monotonic();
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        UINT64 t0 = ns_time_monotonic();
+        frame[0] = (BYTE) i;
+        shm_publish(pub, frame, frame_size, i, t0);
+        latency_add(&publish, ns_time_monotonic() - t0);
+    }
+    UINT64 end = ns_time_monotonic();
+    shm_publisher_destroy(pub);
+
+    struct ShmBenchResult res[SHM_MAX_READERS];
+    for (int r = 0; r < started; r++)
+    {
+        memset(&res[r], 0, sizeof(res[r]));
+        if (read(pipes[r], &res[r], sizeof(res[r])) != (ssize_t) sizeof(res[r]) || !res[r].ok)
+            ret = -1;
+        close(pipes[r]);
+        waitpid(pids[r], NULL, 0);
+    }
+
+    double elapsed = (end - start) / 1e9;
+    printf("{\n");
+    printf("  \"socket\": \"%s\",\n", socket_path);
+    printf("  \"frame_size\": %u,\n", frame_size);
+    printf("  \"slots\": %i,\n", SHM_DEFAULT_SLOTS);
+    printf("  \"readers\": %i,\n", connected);
+    printf("  \"frames\": %u,\n", frames);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"frames_per_s\": %.1f,\n", elapsed > 0 ? frames / elapsed : 0);
+    printf("  \"throughput_mb_s\": %.1f,\n", elapsed > 0 ? (double) frames * frame_size / elapsed / 1e6 : 0);
+    printf("  \"per_reader\": [\n");
+    for (int r = 0; r < started; r++)
+    {
+        printf("    { \"received\": %llu, \"dropped\": %llu, \"torn\": %llu,\n",
+                res[r].received, res[r].dropped, res[r].torn);
+        printf("      \"latency\": { \"count\": %i, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                "\"p99_us\": %.1f, \"max_us\": %.1f } }%s\n",
+                res[r].count, res[r].p50 / 1000.0, res[r].p90 / 1000.0,
+                res[r].p99 / 1000.0, res[r].max / 1000.0, r + 1 < started ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"latency\": {\n");
+    latency_json(stdout, &publish, "    ");
+    printf("\n  }\n}\n");
+
+    latency_free(&publish);
+    free(frame);
+
+    return (started == readers && connected == readers ? ret : -1);
+}
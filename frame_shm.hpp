@@ -0,0 +1,221 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_SHM_H
+#define FRAME_SHM_H
+
+#include <pthread.h>
+#include "defs.hpp"
+
+/*
+ * Shared memory frame publishing
+ *
+ * frames are copied once into a ring of slots in a memfd, subscriber
+ * processes connect to a UNIX socket, receive the memfd (SCM_RIGHTS) and
+ * map it: the control area read/write, the frame slots read only. Readers
+ * use the frames in place, no further copies.
+ *
+ * memfd layout:
+ *   ShmHeader, num_slots ShmSlot      control area (control_size, page aligned)
+ *   num_slots * slot_size             frame data, slot i at control_size + i * slot_size
+ *
+ * the publisher never waits for readers: frame n goes to slot n % num_slots,
+ * the slot lock is a seqlock (2n+1 while frame n is written, 2n+2 when it is
+ * complete), a reader that falls behind finds its frames overwritten and
+ * skips them. Each reader keeps its cursor (next frame number) in its
+ * ShmReader entry; waiting readers sleep on the header futex word, which the
+ * publisher bumps (and wakes, if anyone waits) after every frame.
+ *
+ * the socket (SOCK_SEQPACKET) stays open while a subscriber is attached;
+ * subscribers may send ShmRequest messages on it, which the publisher hands
+ * to its request handler and answers with a ShmReply.
+ */
+#define SHM_MAGIC          0x4d485344  // "DSHM"
+#define SHM_VERSION        1
+#define SHM_MAX_READERS    16
+#define SHM_DEFAULT_SLOTS  8
+#define SHM_PAGE_SIZE      4096
+#define SHM_BENCH_SOCKET   "/tmp/dscam-shm-bench.sock"
+
+struct ShmSlot
+{
+    uint64_t lock;           // seqlock, see above
+    uint32_t size;           // frame bytes
+    uint32_t sequence;       // driver frame sequence
+    uint64_t timestamp;      // buffer time stamp (ns)
+    uint64_t publish_ns;     // CLOCK_MONOTONIC when the frame was complete
+};
+
+struct ShmReader
+{
+    uint32_t active;         // entry owned by a connected subscriber
+    int32_t pid;
+    uint64_t cursor;         // next frame number to read
+    uint64_t received;       // frames read
+    uint64_t dropped;        // frames overwritten before they were read
+};
+
+struct ShmHeader
+{
+    uint32_t magic;          // SHM_MAGIC
+    uint32_t version;        // SHM_VERSION
+    uint32_t format;         // v4l2 pixel format
+    uint32_t width;
+    uint32_t height;
+    uint32_t num_slots;
+    uint32_t slot_size;      // bytes per frame slot (page aligned)
+    uint32_t control_size;   // offset of the first frame slot
+    uint64_t total_size;     // memfd size
+    uint64_t published;      // frames completed (write cursor)
+    uint32_t futex;          // bumped after every frame
+    uint32_t waiters;        // readers sleeping on futex
+    uint32_t closed;         // publisher gone, no more frames
+    uint32_t reserved;
+    struct ShmReader readers[SHM_MAX_READERS];
+};
+
+// sent with the memfd when a subscriber connects
+struct ShmHello
+{
+    uint32_t magic;          // SHM_MAGIC
+    int32_t reader;          // ShmReader entry of the subscriber
+};
+
+// requests (ShmRequest.op)
+#define SHM_OP_GET_CTRL    1   // reads control id
+#define SHM_OP_SET_CTRL    2   // sets control id to value
+#define SHM_OP_EXPOSURE    3   // steps exposure, value: IOCTL_DIRECT_INC or IOCTL_DIRECT_DEC
+#define SHM_OP_GAIN        4   // steps gain, value: IOCTL_DIRECT_INC or IOCTL_DIRECT_DEC
+
+struct ShmRequest
+{
+    uint32_t magic;          // SHM_MAGIC
+    uint32_t op;             // SHM_OP_*
+    uint32_t id;             // v4l2 control id
+    int32_t value;
+    uint32_t tag;            // echoed in the reply
+};
+
+struct ShmReply
+{
+    uint32_t magic;          // SHM_MAGIC
+    uint32_t tag;            // from the request
+    int32_t status;          // 0 or -errno
+    int32_t value;           // control value after the request
+    uint32_t sequence;       // last frame before the request took effect
+};
+
+// subscriber a reply goes to: its reader entry and which connection on it
+struct ShmClient
+{
+    int reader;
+    uint32_t serial;
+};
+
+#define SHM_REPLY_LATER    1   // handler result: answered later with shm_reply
+
+/*
+ * request handler, called on the accept thread (requests of all
+ * subscribers are handled one at a time, it must not block): fills
+ * reply->status, value and sequence and returns 0, or keeps client and
+ * *reply and returns SHM_REPLY_LATER to answer from another thread
+ */
+typedef int (*ShmRequestHandler)(void *data, const struct ShmClient *client,
+        const struct ShmRequest *req, struct ShmReply *reply);
+
+struct ShmPublisher
+{
+    int memfd;
+    int listen_fd;                   // UNIX socket subscribers connect to
+    char *socket_path;
+    struct ShmHeader *header;        // mapped memfd
+    struct ShmSlot *slots;
+    BYTE *data;
+    size_t size;                     // mapped bytes
+    int clients[SHM_MAX_READERS];    // connection of each reader entry (-1 free)
+    uint32_t serial[SHM_MAX_READERS]; // connections made on each entry
+    __MUTEX_TYPE mutex;              // clients and serial against late replies
+    __THREAD_TYPE thread;            // accepts and drops subscribers
+    int quit;                        // stop the accept thread (atomic)
+    ShmRequestHandler handler;       // subscriber requests (NULL - refused)
+    void *handler_data;
+    ULLONG too_large;                // frames not published (larger than a slot)
+};
+
+/*
+ * creates the frame ring and listens for subscribers on socket_path
+ * args:
+ * frame_size: largest frame published (slot size before alignment)
+ * num_slots: frames kept in the ring (0 - SHM_DEFAULT_SLOTS)
+ *
+ * returns: publisher or NULL on error
+ */
+struct ShmPublisher *shm_publisher_create(const char *socket_path, int format,
+        int width, int height, uint32_t frame_size, int num_slots);
+
+/*
+ * copies one frame into the next slot and wakes waiting readers
+ * (single producer)
+ *
+ * returns: 0 on success, -1 if the frame is larger than a slot
+ */
+int shm_publish(struct ShmPublisher *pub, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp);
+
+/*
+ * publishes a frame written in place, e.g. by uvc_copy_frame (single
+ * producer): shm_publish_slot opens the next slot (header->slot_size bytes,
+ * readers of its old frame see it change), shm_publish_commit completes it
+ * with the bytes written and wakes waiting readers
+ */
+BYTE *shm_publish_slot(struct ShmPublisher *pub);
+
+void shm_publish_commit(struct ShmPublisher *pub, uint32_t size, uint32_t sequence, UINT64 timestamp);
+
+/*
+ * installs the handler for subscriber requests (before frames are published)
+ */
+void shm_publisher_set_handler(struct ShmPublisher *pub, ShmRequestHandler handler, void *data);
+
+/*
+ * answers a request the handler returned SHM_REPLY_LATER for (any thread);
+ * a subscriber gone in between gets nothing
+ *
+ * returns: 0 on success, -1 if the reply was not sent
+ */
+int shm_reply(struct ShmPublisher *pub, const struct ShmClient *client, const struct ShmReply *reply);
+
+/*
+ * returns: number of connected subscribers
+ */
+int shm_publisher_readers(struct ShmPublisher *pub);
+
+/*
+ * marks the ring closed (subscribers see the end of the stream), stops
+ * accepting and frees the publisher
+ */
+void shm_publisher_destroy(struct ShmPublisher *pub);
+
+/*
+ * throughput and latency benchmark: forks the given number of subscriber
+ * processes, publishes synthetic frames of frame_size bytes to them as fast
+ * as possible and writes a json summary to stdout
+ *
+ * returns: 0 on success, -1 on error
+ */
+int shm_bench(const char *socket_path, uint32_t frame_size, uint32_t frames, int readers);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "frame_stats.hpp"
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/*
+ * SIMD part of scan_segment: whole 16 byte blocks of samples k.. (16 / stride
+ * samples each), never reading past the last sample of the row (a UYVY view
+ * ends one byte before the row does)
+ * inlined with a constant stride, so the binning loop is unrolled
+ * returns: first sample not scanned
+ */
+static inline int scan_blocks(const BYTE *row, int row_bytes, int k, int k1, const int stride,
+        uint32_t hist[4][STATS_HIST_BINS], UINT64 *sum)
+{
+    const int per_block = 16 / stride;
+    BYTE m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = (i % stride) ? 0 : 0xFF;
+#if defined(__SSE2__)
+    const __m128i mask = _mm_loadu_si128((const __m128i *) m);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+#else
+    const uint8x16_t mask = vld1q_u8(m);
+    uint32x4_t acc = vdupq_n_u32(0);
+#endif
+
+    for (; k + per_block <= k1 && k * stride + 16 <= row_bytes; k += per_block)
+    {
+        const BYTE *p = row + k * stride;
+#if defined(__SSE2__)
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) p), mask);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+#else
+        uint8x16_t v = vandq_u8(vld1q_u8(p), mask);
+        acc = vpadalq_u16(acc, vpaddlq_u8(v));
+#endif
+        // the block is in L1 now, bin its samples from there
+        for (int j = 0; j < per_block; j++)
+            hist[j & 3][p[j * stride]]++;
+    }
+
+#if defined(__SSE2__)
+    UINT64 lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    *sum += lanes[0] + lanes[1];
+#else
+    *sum += (UINT64) vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+        vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+    return k;
+}
+#endif
+
+/*
+ * sums the samples k0..k1-1 of one row (byte distance between samples
+ * stride) and counts them into the histograms
+ * hist: 4 histograms used in turn, so consecutive increments of the same
+ * bin do not wait for each other
+ */
+static UINT64 scan_segment(const BYTE *row, int row_bytes, int k0, int k1, int stride,
+        uint32_t hist[4][STATS_HIST_BINS])
+{
+    UINT64 sum = 0;
+    int k = k0;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    switch (stride)
+    {
+        case 1:
+            k = scan_blocks(row, row_bytes, k, k1, 1, hist, &sum);
+            break;
+
+        case 2:
+            k = scan_blocks(row, row_bytes, k, k1, 2, hist, &sum);
+            break;
+
+        case 4:
+            k = scan_blocks(row, row_bytes, k, k1, 4, hist, &sum);
+            break;
+
+        case 8:
+            k = scan_blocks(row, row_bytes, k, k1, 8, hist, &sum);
+            break;
+    }
+#endif
+
+    for (; k < k1; k++)
+    {
+        BYTE s = row[k * stride];
+        sum += s;
+        hist[k & 3][s]++;
+    }
+
+    return sum;
+}
+
+/*
+ * computes the statistics of view on a grid of step
+ */
+int frame_stats_compute(const struct LumaView *view, int step, struct FrameStats *stats)
+{
+    uint32_t hist[4][STATS_HIST_BINS];
+    UINT64 zone_sum[STATS_ZONES_Y][STATS_ZONES_X];
+    uint32_t zone_samples[STATS_ZONES_Y][STATS_ZONES_X];
+    UINT64 total = 0;
+
+    if (step <= 0)
+        step = 1;
+    stats->valid = 0;
+    if (view->width <= 0 || view->height <= 0)
+        return (-1);
+
+    memset(hist, 0, sizeof(hist));
+    memset(zone_sum, 0, sizeof(zone_sum));
+    memset(zone_samples, 0, sizeof(zone_samples));
+
+    // grid positions per row and rows, split evenly into zones
+    const int nx = (view->width + step - 1) / step;
+    const int ny = (view->height + step - 1) / step;
+    const int stride = view->step * step;
+    const int row_bytes = (view->width - 1) * view->step + 1;
+    int bounds[STATS_ZONES_X + 1];
+    for (int z = 0; z <= STATS_ZONES_X; z++)
+        bounds[z] = z * nx / STATS_ZONES_X;
+
+    for (int r = 0; r < ny; r++)
+    {
+        const BYTE *row = view->data + (size_t) r * step * view->stride;
+        int zy = r * STATS_ZONES_Y / ny;
+        for (int zx = 0; zx < STATS_ZONES_X; zx++)
+        {
+            zone_sum[zy][zx] += scan_segment(row, row_bytes, bounds[zx], bounds[zx + 1],
+                    stride, hist);
+            zone_samples[zy][zx] += bounds[zx + 1] - bounds[zx];
+        }
+    }
+
+    stats->step = step;
+    stats->samples = (uint32_t) nx * ny;
+    for (int i = 0; i < STATS_HIST_BINS; i++)
+        stats->hist[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+    for (int zy = 0; zy < STATS_ZONES_Y; zy++)
+        for (int zx = 0; zx < STATS_ZONES_X; zx++)
+        {
+            total += zone_sum[zy][zx];
+            stats->zones[zy][zx] = zone_samples[zy][zx] ?
+                (float) zone_sum[zy][zx] / zone_samples[zy][zx] : 0;
+        }
+    stats->mean = (float) total / stats->samples;
+
+    stats->clipped_low = 0;
+    for (int i = 0; i <= STATS_CLIP_LOW; i++)
+        stats->clipped_low += stats->hist[i];
+    stats->clipped_high = 0;
+    for (int i = STATS_CLIP_HIGH; i < STATS_HIST_BINS; i++)
+        stats->clipped_high += stats->hist[i];
+    stats->clipped = (float) (stats->clipped_low + stats->clipped_high) / stats->samples;
+    stats->valid = 1;
+
+    return (0);
+}
+
+/*
+ * returns: luma level below which fraction of the samples lie
+ */
+int frame_stats_percentile(const struct FrameStats *stats, float fraction)
+{
+    UINT64 target = (UINT64) (fraction * stats->samples);
+    UINT64 count = 0;
+
+    for (int i = 0; i < STATS_HIST_BINS; i++)
+    {
+        count += stats->hist[i];
+        if (count > target)
+            return i;
+    }
+    return STATS_HIST_BINS - 1;
+}
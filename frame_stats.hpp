@@ -0,0 +1,66 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include "defs.hpp"
+#include "yuv_luma.hpp"
+
+/*
+ * Per-frame luma statistics
+ *
+ * one pass over the luma samples of a frame (read in place from the driver
+ * buffer, see yuv_luma.hpp) fills the histogram and the zone sums; mean and
+ * clipped ratio are derived from them. With step > 1 only every step-th
+ * sample of every step-th row is read (step 4 reads 1/16 of the frame).
+ */
+#define STATS_HIST_BINS    256
+#define STATS_ZONES_X      4
+#define STATS_ZONES_Y      4
+#define STATS_CLIP_LOW     4     // samples at or below are clipped black
+#define STATS_CLIP_HIGH    251   // samples at or above are clipped white
+
+struct FrameStats
+{
+    int valid;                       // computed for this frame
+    uint32_t sequence;               // driver sequence of the frame
+    int step;                        // sampling grid step
+    uint32_t samples;                // luma samples read
+    float mean;                      // 0..255
+    uint32_t hist[STATS_HIST_BINS];
+    uint32_t clipped_low;            // samples <= STATS_CLIP_LOW
+    uint32_t clipped_high;           // samples >= STATS_CLIP_HIGH
+    float clipped;                   // (clipped_low + clipped_high) / samples
+    float zones[STATS_ZONES_Y][STATS_ZONES_X];   // mean per zone, row major
+};
+
+/*
+ * computes the statistics of view on a grid of step
+ * the zone sums use SSE2/NEON when available
+ * args:
+ * step: grid step in samples and rows (<= 0 - 1)
+ *
+ * returns: 0 on success, -1 if the view is empty
+ */
+int frame_stats_compute(const struct LumaView *view, int step, struct FrameStats *stats);
+
+/*
+ * returns: luma level below which fraction (0..1) of the samples lie
+ */
+int frame_stats_percentile(const struct FrameStats *stats, float fraction);
+
+#endif
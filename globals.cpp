@@ -34,6 +34,38 @@ int initGlobals (struct GLOBAL *global)
     global->height = DEFAULT_HEIGHT;
     global->format = V4L2_PIX_FMT_YUYV; // only handle yuyv now
     global->lctl_method = LIST_CTL_METHOD_NEXT_FLAG;
+    global->roi_left = 0;
+    global->roi_top = 0;
+    global->roi_width = 0; // full frame
+    global->roi_height = 0;
+    global->record_file = NULL;
+    global->headless = 0;
+    global->bench_frames = 0;
+    global->bench_seconds = 0;
+    global->bench_checksum = 0;
+    global->bench_file = NULL;
+    global->bench_cameras = 0;
+    global->raw_file = NULL;
+    global->write_bench = NULL;
+    global->pretrigger_mb = 0;
+    global->pretrigger_lz4 = 0;
+    global->shm_socket = NULL;
+    global->shm_readers = 0;
+    global->broker_socket = NULL;
+    global->client_socket = NULL;
+    global->http_port = 0;
+    global->http_clients = 0;
+    global->stats_step = 0;
+    global->ae_target = 0;
+    global->ae_delay = -1;
+    global->motion_threshold = 0;
+    global->motion_step = 0;
+    global->exposure_us = 0;
+    global->gain = -1;
+    global->profile = NULL;
+    global->meta_device = NULL;
+    global->bracket = NULL;
+    global->hdr_merge = 0;
 
     return (0);
 }
@@ -41,6 +73,16 @@ int initGlobals (struct GLOBAL *global)
 int closeGlobals(struct GLOBAL *global)
 {
     free(global->videodevice);
+    free(global->record_file);
+    free(global->bench_file);
+    free(global->raw_file);
+    free(global->write_bench);
+    free(global->shm_socket);
+    free(global->broker_socket);
+    free(global->client_socket);
+    free(global->profile);
+    free(global->meta_device);
+    free(global->bracket);
     free(global);
     global=NULL;
 
@@ -30,6 +30,38 @@ struct GLOBAL
     int fps;               //fps denominator
     int fps_num;           //fps numerator (usually 1)
     int lctl_method;       // 0 for control id loop, 1 for next_ctrl flag method
+    int roi_left;          // region of interest (roi_width 0 - full frame)
+    int roi_top;
+    int roi_width;
+    int roi_height;
+    char *record_file;     // passthrough recording file (NULL - off)
+    int headless;          // run the capture benchmark instead of the preview
+    int bench_frames;      // benchmark frame count (0 - unlimited)
+    int bench_seconds;     // benchmark duration (0 - unlimited)
+    int bench_checksum;    // checksum frames instead of discarding them
+    char *bench_file;      // benchmark json summary file (NULL - stdout)
+    int bench_cameras;     // cameras opened by the scaling benchmark (0 - off)
+    char *raw_file;        // raw (O_DIRECT) recording file (NULL - off)
+    char *write_bench;     // raw recording write benchmark file (NULL - off)
+    int pretrigger_mb;     // pre-trigger ring memory budget in MiB (0 - off)
+    int pretrigger_lz4;    // LZ4 compress pre-trigger frames
+    char *shm_socket;      // publish frames to subscriber processes on this socket (NULL - off)
+    int shm_readers;       // reader processes of the shared memory benchmark (0 - off)
+    char *broker_socket;   // run as camera broker serving on this socket (NULL - off)
+    char *client_socket;   // run as client of the broker on this socket (NULL - off)
+    int http_port;         // MJPEG over HTTP server port (0 - off)
+    int http_clients;      // viewers of the HTTP loopback benchmark (0 - off)
+    int stats_step;        // per-frame luma statistics grid step (0 - off)
+    float ae_target;       // software auto exposure target mean luma (0 - off)
+    int ae_delay;          // frames before a control change shows (-1 - default)
+    float motion_threshold; // skip unchanged frames, zone luma difference (0 - off)
+    int motion_step;       // change detection grid step (0 - default)
+    float exposure_us;     // manual exposure time at start, microseconds (0 - keep)
+    int gain;              // manual gain at start (-1 - keep)
+    char *profile;         // control profile applied at start, saved with 'p' (NULL - off)
+    char *meta_device;     // UVC metadata node or "auto" (NULL - off)
+    char *bracket;         // exposure bracket steps (NULL - off)
+    int hdr_merge;         // fuse every bracket set into one frame
 };
 
 
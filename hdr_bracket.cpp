@@ -0,0 +1,170 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr_bracket.hpp"
+
+/* steps "<us>[:<gain>],..." and "@<delay>", in control units */
+static int parse_steps(struct HdrBracket *br, const char *spec)
+{
+    char *copy = strdup(spec);
+    char *at = strchr(copy, '@');
+    char *save = NULL;
+    int ret = 0;
+    double unit = exposure_unit_us(br->vd);
+
+    br->delay = HDR_DEFAULT_DELAY;
+    if (at)
+    {
+        *at = '\0';
+        br->delay = atoi(at + 1);
+        if (br->delay < 0 || br->delay > HDR_MAX_DELAY)
+            ret = -1;
+    }
+
+    for (char *tok = strtok_r(copy, ",", &save); tok && ret == 0; tok = strtok_r(NULL, ",", &save))
+    {
+        double us = 0;
+        int gain = -1;
+        if (br->num_steps == HDR_MAX_STEPS || sscanf(tok, "%lf:%i", &us, &gain) < 1 || us <= 0)
+        {
+            ret = -1;
+            break;
+        }
+        struct BracketStep *step = &br->steps[br->num_steps++];
+        step->exposure = ctrl_clamp(br->exposure, llround(unit > 0 ? us / unit : us));
+        if (br->gain)
+            step->gain = gain >= 0 ? ctrl_clamp(br->gain, gain) : br->gain->value;
+    }
+
+    free(copy);
+    return ret == 0 && br->num_steps >= 2 ? 0 : -1;
+}
+
+struct HdrBracket *hdr_create(struct vdIn *vd, const char *spec)
+{
+    Control *list = vd->s ? vd->s->control_list : NULL;
+    Control *exposure = list && vd->exposure_id ? get_ctrl_by_id(list, vd->exposure_id) : NULL;
+
+    if (!exposure || exposure->control.type != V4L2_CTRL_TYPE_INTEGER)
+    {
+        printf("hdr: %s has no exposure control\n", vd->videodevice);
+        return (NULL);
+    }
+
+    struct HdrBracket *br = (HdrBracket *)calloc(1, sizeof(struct HdrBracket));
+    br->vd = vd;
+    br->exposure = exposure;
+    br->gain = vd->gain_id ? get_ctrl_by_id(list, vd->gain_id) : NULL;
+    if (br->gain && br->gain->control.type != V4L2_CTRL_TYPE_INTEGER)
+        br->gain = NULL;
+    if (parse_steps(br, spec) < 0)
+    {
+        printf("hdr: bad bracket '%s' (2 to %i steps, delay up to %i frames)\n", spec,
+                HDR_MAX_STEPS, HDR_MAX_DELAY);
+        free(br);
+        return (NULL);
+    }
+
+    // a step longer than the frame period would slow every frame down
+    int period = exposure_frame_max(vd);
+    for (int i = 0; i < br->num_steps; i++)
+        br->steps[i].exposure = MIN(br->steps[i].exposure, period);
+
+    int base = br->gain ? ctrl_gain_base(br->gain) : 0;
+    double shortest = 0;
+    for (int i = 0; i < br->num_steps; i++)
+    {
+        double product = (double) br->steps[i].exposure * (br->gain ? br->steps[i].gain + base : 1);
+        br->steps[i].scale = (float) product;
+        if (shortest == 0 || product < shortest)
+            shortest = product;
+    }
+    float longest = 1;
+    for (int i = 0; i < br->num_steps; i++)
+    {
+        br->steps[i].scale /= shortest;
+        longest = MAX(longest, br->steps[i].scale);
+    }
+
+    exposure_manual(vd);
+
+    printf("hdr: %i steps, %.1f stops, control latency %i frames:", br->num_steps,
+            log2f(longest), br->delay);
+    for (int i = 0; i < br->num_steps; i++)
+        printf(" %i/%i", br->steps[i].exposure, br->gain ? br->steps[i].gain : 0);
+    printf(" (exposure/gain)\n");
+    return br;
+}
+
+void hdr_tag(struct HdrBracket *br, uint32_t sequence, struct BracketTag *tag)
+{
+    struct BracketPlan *plan = &br->planned[sequence % HDR_PIPE];
+
+    br->sequence = sequence;
+    br->frames++;
+    memset(tag, 0, sizeof(*tag));
+    tag->step = -1;
+    if (!plan->valid || plan->sequence != sequence)
+        return; // before the first write or after a gap
+
+    struct BracketStep *step = &br->steps[sequence % br->num_steps];
+    tag->step = sequence % br->num_steps;
+    tag->steps = br->num_steps;
+    tag->set = sequence / br->num_steps;
+    tag->exposure = step->exposure;
+    tag->gain = step->gain;
+    tag->scale = step->scale;
+    br->tagged++;
+}
+
+int hdr_schedule(struct HdrBracket *br)
+{
+    uint32_t target = br->sequence + 1 + br->delay;
+    struct BracketStep *step = &br->steps[target % br->num_steps];
+    struct BracketPlan *plan = &br->planned[target % HDR_PIPE];
+    int ret = 0;
+
+    // only what differs from the frame before (its write is cached)
+    ControlTxn txn;
+    ctrl_txn_begin(&txn, br->vd->fd, br->vd->s->control_list);
+    if (br->exposure->value != step->exposure)
+        ctrl_txn_set(&txn, br->exposure->control.id, step->exposure);
+    if (br->gain && br->gain->value != step->gain)
+        ctrl_txn_set(&txn, br->gain->control.id, step->gain);
+    if (txn.count)
+    {
+        ret = ctrl_txn_commit(&txn, 0);
+        br->writes++;
+    }
+
+    plan->sequence = target;
+    plan->valid = ret == 0;
+    return ret ? -1 : 0;
+}
+
+void hdr_destroy(struct HdrBracket *br)
+{
+    if (br == NULL)
+        return;
+    printf("hdr: %llu frames, %llu tagged, %llu control transactions\n",
+            br->frames, br->tagged, br->writes);
+    free(br);
+}
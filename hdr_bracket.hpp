@@ -0,0 +1,109 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDR_BRACKET_H
+#define HDR_BRACKET_H
+
+#include "defs.hpp"
+#include "v4l2_uvc.hpp"
+
+/*
+ * Exposure bracketing
+ *
+ * consecutive frames cycle through a list of exposure/gain steps: frame
+ * sequence s is step s % steps of set s / steps. A control write reaches
+ * the image delay frames after the next frame, so on the capture thread,
+ * after frame s, the step of frame s + 1 + delay is written (one control
+ * transaction per frame): the writes are pipelined ahead and every frame
+ * shows its own step. This takes a camera that latches exposure and gain
+ * per frame with a fixed latency, as sensors with per-frame controls do.
+ *
+ * frames are tagged with their step when the write for them was made;
+ * frames after a gap (a lost frame means a missed write) are left
+ * untagged.
+ */
+#define HDR_MAX_STEPS      4
+#define HDR_DEFAULT_DELAY  2
+#define HDR_MAX_DELAY      8
+#define HDR_PIPE           16      // planned frames kept (more than 1 + HDR_MAX_DELAY)
+
+/* bracket position of a frame */
+struct BracketTag
+{
+    int step;                   // step of the frame (-1 - not bracketed)
+    int steps;                  // steps per set
+    uint32_t set;               // set number (its frames are consecutive)
+    int32_t exposure;           // exposure and gain written for the frame
+    int32_t gain;
+    float scale;                // exposure x gain relative to the shortest step (>= 1)
+};
+
+struct BracketStep
+{
+    int32_t exposure;           // control units
+    int32_t gain;
+    float scale;
+};
+
+struct BracketPlan
+{
+    uint32_t sequence;          // frame the write was made for
+    int valid;
+};
+
+struct HdrBracket
+{
+    struct vdIn *vd;
+    Control *exposure;
+    Control *gain;              // NULL - no gain control
+    struct BracketStep steps[HDR_MAX_STEPS];
+    int num_steps;
+    int delay;                  // frames between a write and the frame showing it, after the next
+    struct BracketPlan planned[HDR_PIPE];   // by frame sequence
+    uint32_t sequence;          // last tagged frame
+
+    ULLONG frames;
+    ULLONG tagged;
+    ULLONG writes;              // control transactions
+};
+
+/*
+ * args:
+ * vd: device with an integer exposure control (manual modes are set)
+ * spec: steps and latency "<us>[:<gain>],<us>[:<gain>][,...][@<delay>]",
+ *       exposure in microseconds (control units if the driver gives the
+ *       control no unit), gain in control units (default: current gain),
+ *       delay in frames (default HDR_DEFAULT_DELAY)
+ *
+ * returns: scheduler or NULL on error
+ */
+struct HdrBracket *hdr_create(struct vdIn *vd, const char *spec);
+
+/*
+ * capture thread, for every dequeued frame before it is handed out
+ */
+void hdr_tag(struct HdrBracket *br, uint32_t sequence, struct BracketTag *tag);
+
+/*
+ * capture thread, between frames: writes the step of the frame
+ * 1 + delay after the last tagged one
+ * returns: 0 or -1 if the write failed (the frame stays untagged)
+ */
+int hdr_schedule(struct HdrBracket *br);
+
+void hdr_destroy(struct HdrBracket *br);
+
+#endif
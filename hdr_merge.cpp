@@ -0,0 +1,224 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "hdr_merge.hpp"
+#include "ms_time.hpp"
+
+/*
+ * sum += w * v * mul, weight += w with w = min(v, 255 - v) + 1
+ * (mul <= 256: v * mul fits 16 bits, HDR_MAX_STEPS sums fit 32 bits)
+ */
+static void accumulate(const BYTE *v, uint32_t *sum, uint16_t *weight, uint16_t mul, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    const __m128i m = _mm_set1_epi16((short) mul);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) (v + i));
+        __m128i w8 = _mm_min_epu8(x, _mm_xor_si128(x, ff));
+        __m128i w[2] = { _mm_add_epi16(_mm_unpacklo_epi8(w8, zero), one),
+            _mm_add_epi16(_mm_unpackhi_epi8(w8, zero), one) };
+        __m128i r[2] = { _mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), m),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), m) };
+        for (int h = 0; h < 2; h++)
+        {
+            // 16 x 16 -> 32 bit products from the low and high halves
+            __m128i lo = _mm_mullo_epi16(w[h], r[h]);
+            __m128i hi = _mm_mulhi_epu16(w[h], r[h]);
+            __m128i *s = (__m128i *) (sum + i + 8 * h);
+            _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(lo, hi)));
+            _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, hi)));
+            __m128i *wp = (__m128i *) (weight + i + 8 * h);
+            _mm_storeu_si128(wp, _mm_add_epi16(_mm_loadu_si128(wp), w[h]));
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t one = vdupq_n_u16(1);
+    const uint16x8_t m = vdupq_n_u16(mul);
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t x = vld1q_u8(v + i);
+        uint8x16_t w8 = vminq_u8(x, vmvnq_u8(x));
+        uint16x8_t w[2] = { vaddw_u8(one, vget_low_u8(w8)), vaddw_u8(one, vget_high_u8(w8)) };
+        uint16x8_t r[2] = { vmulq_u16(vmovl_u8(vget_low_u8(x)), m),
+            vmulq_u16(vmovl_u8(vget_high_u8(x)), m) };
+        for (int h = 0; h < 2; h++)
+        {
+            uint32_t *s = sum + i + 8 * h;
+            vst1q_u32(s, vmlal_u16(vld1q_u32(s), vget_low_u16(w[h]), vget_low_u16(r[h])));
+            vst1q_u32(s + 4, vmlal_u16(vld1q_u32(s + 4), vget_high_u16(w[h]), vget_high_u16(r[h])));
+            vst1q_u16(weight + i + 8 * h, vaddq_u16(vld1q_u16(weight + i + 8 * h), w[h]));
+        }
+    }
+#endif
+    for (; i < n; i++)
+    {
+        uint32_t w = MIN(v[i], 255 - v[i]) + 1;
+        sum[i] += w * v[i] * mul;
+        weight[i] += w;
+    }
+}
+
+/* out = sum / weight, rounded */
+static void resolve(const uint32_t *sum, const uint16_t *weight, uint16_t *out, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short) 0x8000);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i w = _mm_loadu_si128((const __m128i *) (weight + i));
+        __m128 q0 = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (sum + i))),
+                _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)));
+        __m128 q1 = _mm_div_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (sum + i + 4))),
+                _mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)));
+        // no unsigned 32 -> 16 pack in SSE2: pack signed around 32768
+        __m128i p = _mm_packs_epi32(_mm_sub_epi32(_mm_cvtps_epi32(q0), bias),
+                _mm_sub_epi32(_mm_cvtps_epi32(q1), bias));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(p, flip));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t w = vld1q_u16(weight + i);
+        float32x4_t q[2];
+        for (int h = 0; h < 2; h++)
+        {
+            float32x4_t s = vcvtq_f32_u32(vld1q_u32(sum + i + 4 * h));
+            float32x4_t d = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(w) : vget_low_u16(w)));
+#if defined(__aarch64__)
+            q[h] = vdivq_f32(s, d);
+#else
+            // reciprocal estimate with two Newton steps
+            float32x4_t r = vrecpeq_f32(d);
+            r = vmulq_f32(r, vrecpsq_f32(d, r));
+            r = vmulq_f32(r, vrecpsq_f32(d, r));
+            q[h] = vmulq_f32(s, r);
+#endif
+            q[h] = vaddq_f32(q[h], vdupq_n_f32(0.5f));
+        }
+        vst1q_u16(out + i, vcombine_u16(vqmovn_u32(vcvtq_u32_f32(q[0])), vqmovn_u32(vcvtq_u32_f32(q[1]))));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = (uint16_t) ((sum[i] + weight[i] / 2) / weight[i]);
+}
+
+struct HdrMerge *hdr_merge_create(int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return (NULL);
+
+    struct HdrMerge *merge = (HdrMerge *)calloc(1, sizeof(struct HdrMerge));
+    merge->width = width;
+    merge->height = height;
+    // padded: the vector loops run to the end, padding accumulates zeros
+    merge->samples = ((size_t) width * height + 15) & ~(size_t) 15;
+    merge->luma = (BYTE *)calloc(merge->samples, 1);
+    merge->sum = (uint32_t *)calloc(merge->samples, sizeof(uint32_t));
+    merge->weight = (uint16_t *)calloc(merge->samples, sizeof(uint16_t));
+    merge->out = (uint16_t *)calloc(merge->samples, sizeof(uint16_t));
+    if (!merge->luma || !merge->sum || !merge->weight || !merge->out)
+    {
+        hdr_merge_destroy(merge);
+        return (NULL);
+    }
+    return merge;
+}
+
+int hdr_merge_add(struct HdrMerge *merge, const struct LumaView *view, const struct BracketTag *tag)
+{
+    if (tag->step < 0 || view->width != merge->width || view->height != merge->height)
+        return (-1);
+
+    UINT64 start = ns_time_monotonic();
+    if (merge->seen == 0 || tag->set != merge->set)
+    {
+        if (merge->seen)
+            merge->incomplete++; // a frame of the last set was lost
+        merge->set = tag->set;
+        merge->seen = 0;
+        memset(merge->sum, 0, merge->samples * sizeof(uint32_t));
+        memset(merge->weight, 0, merge->samples * sizeof(uint16_t));
+    }
+
+    extract_luma(view, merge->luma, merge->width);
+    int mul = (int) lroundf(256.0f / MAX(tag->scale, 1.0f));
+    accumulate(merge->luma, merge->sum, merge->weight, (uint16_t) MAX(mul, 1), merge->samples);
+    merge->seen |= 1u << tag->step;
+
+    int done = merge->seen == (1u << tag->steps) - 1;
+    if (done)
+    {
+        resolve(merge->sum, merge->weight, merge->out, merge->samples);
+        merge->out_set = merge->set;
+        merge->seen = 0;
+        merge->merged++;
+    }
+    merge->merge_ns += ns_time_monotonic() - start;
+    return done;
+}
+
+void hdr_merge_tonemap(const struct HdrMerge *merge, BYTE *dst)
+{
+    size_t n = (size_t) merge->width * merge->height;
+    BYTE lut[4096];
+    uint16_t top = 1;
+
+    for (size_t i = 0; i < n; i++)
+        top = MAX(top, merge->out[i]);
+
+    // indexed by the top 12 bits
+    float scale = 255.0f / logf(1.0f + top);
+    for (int i = 0; i < 4096; i++)
+        lut[i] = (BYTE) MIN(lroundf(logf(1.0f + (i << 4)) * scale), 255);
+    for (size_t i = 0; i < n; i++)
+        dst[i] = lut[merge->out[i] >> 4];
+}
+
+void hdr_merge_destroy(struct HdrMerge *merge)
+{
+    if (merge == NULL)
+        return;
+    if (merge->merged || merge->incomplete)
+        printf("hdr merge: %llu sets merged, %llu incomplete, %.2f ms per set\n",
+                merge->merged, merge->incomplete,
+                merge->merged ? merge->merge_ns / 1e6 / merge->merged : 0.0);
+    free(merge->luma);
+    free(merge->sum);
+    free(merge->weight);
+    free(merge->out);
+    free(merge);
+}
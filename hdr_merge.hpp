@@ -0,0 +1,81 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDR_MERGE_H
+#define HDR_MERGE_H
+
+#include "defs.hpp"
+#include "hdr_bracket.hpp"
+#include "yuv_luma.hpp"
+
+/*
+ * Bracket merge
+ *
+ * fuses the luma of the frames of a bracket set (hdr_bracket.hpp) into
+ * one 16 bit frame: every sample is divided by the relative exposure of
+ * its step and weighted by how well exposed it is (a hat over 0..255, so
+ * highlights come from the short steps and shadows from the long ones).
+ * The result is in units of the shortest step, 8.8 fixed point: 256 is
+ * level 1 of the shortest exposure, shadows keep the fraction bits the
+ * longer steps resolve.
+ *
+ * accumulation and the final division run 16 samples at a time with
+ * SSE2/NEON. A set that misses a frame is dropped.
+ */
+struct HdrMerge
+{
+    int width;
+    int height;
+    size_t samples;             // width * height, rounded up to 16
+    uint32_t set;               // set being merged
+    uint32_t seen;              // its steps accumulated (bit mask)
+    BYTE *luma;                 // luma of the current frame
+    uint32_t *sum;              // weighted sum of the exposure scaled samples
+    uint16_t *weight;           // sum of the weights
+    uint16_t *out;              // last merged set (width x height, 8.8 fixed point)
+    uint32_t out_set;
+
+    ULLONG merged;              // sets merged
+    ULLONG incomplete;          // sets dropped for a missing frame
+    UINT64 merge_ns;            // time spent merging
+};
+
+/*
+ * args:
+ * width, height: luma size of the frames
+ *
+ * returns: merge state or NULL on error
+ */
+struct HdrMerge *hdr_merge_create(int width, int height);
+
+/*
+ * adds a bracketed frame to its set
+ * returns: 1 - the set is complete (merge->out holds it), 0 - not yet,
+ *          -1 - the frame is not bracketed or of another size
+ */
+int hdr_merge_add(struct HdrMerge *merge, const struct LumaView *view, const struct BracketTag *tag);
+
+/*
+ * 8 bit view of the last merged set for display: log of the range the set
+ * covers, so shadows and highlights both stay visible
+ * args:
+ * dst: width x height bytes
+ */
+void hdr_merge_tonemap(const struct HdrMerge *merge, BYTE *dst);
+
+void hdr_merge_destroy(struct HdrMerge *merge);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hr_clock.hpp"
+#include "ms_time.hpp"
+
+static const clockid_t clock_ids[] = { CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW, CLOCK_REALTIME };
+static const char *clock_names[] = { "monotonic", "raw", "realtime", "tsc" };
+
+static struct ClockLink tsc_link;
+static int tsc_state = 0;      // 1 - the counter is used, -1 - not available (atomic)
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+
+static inline UINT64 read_counter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    UINT64 ticks;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (ticks) :: "memory");
+    return ticks;
+#else
+    return 0;
+#endif
+}
+
+/* the counter runs at a constant rate, in step on all cores */
+static int counter_invariant(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // the kernel keeps the TSC as clocksource only when it is stable and synchronized
+    char name[32] = "";
+    FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (!f)
+        return 0;
+    int ok = fgets(name, sizeof(name), f) && strncmp(name, "tsc", 3) == 0;
+    fclose(f);
+    return ok;
+#elif defined(__aarch64__)
+    return 1; // the generic timer
+#else
+    return 0;
+#endif
+}
+
+/* ns for the posix clocks, ticks for the counter */
+static inline UINT64 read_raw(int clock)
+{
+    struct timespec ts;
+
+    if (clock == HRC_TSC)
+        return read_counter();
+    clock_gettime(clock_ids[clock], &ts);
+    return (UINT64) ts.tv_sec * G_NSEC_PER_SEC + (UINT64) ts.tv_nsec;
+}
+
+/* a (from, to) pair, to read around from: the tightest of 3 tries */
+static void sample(int from, int to, UINT64 *f, UINT64 *t)
+{
+    UINT64 best = ~0ULL;
+
+    for (int i = 0; i < 3; i++)
+    {
+        UINT64 a = read_raw(to);
+        UINT64 b = read_raw(from);
+        UINT64 c = read_raw(to);
+        if (c - a < best)
+        {
+            best = c - a;
+            *f = b;
+            *t = a + (c - a) / 2;
+        }
+    }
+}
+
+/* writer side of the seqlock (one writer, see busy) */
+static void publish(struct ClockLink *link, UINT64 from_base, UINT64 to_base, double rate)
+{
+    uint32_t seq = link->seq;
+
+    __atomic_store_n(&link->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&link->from_base, from_base, __ATOMIC_RELAXED);
+    __atomic_store_n(&link->to_base, to_base, __ATOMIC_RELAXED);
+    __atomic_store(&link->rate, &rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&link->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (rate > 0)
+        __atomic_store_n(&link->next_update,
+                from_base + (UINT64) (HRC_UPDATE_MS * 1e6 / rate), __ATOMIC_RELAXED);
+}
+
+/* reader side: a consistent mapping */
+static void load(const struct ClockLink *link, UINT64 *from_base, UINT64 *to_base, double *rate)
+{
+    uint32_t seq;
+
+    do
+    {
+        seq = __atomic_load_n(&link->seq, __ATOMIC_ACQUIRE);
+        *from_base = __atomic_load_n(&link->from_base, __ATOMIC_RELAXED);
+        *to_base = __atomic_load_n(&link->to_base, __ATOMIC_RELAXED);
+        __atomic_load(&link->rate, rate, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    while ((seq & 1) || seq != __atomic_load_n(&link->seq, __ATOMIC_RELAXED));
+}
+
+static void tsc_setup(void)
+{
+    if (!counter_invariant())
+    {
+        __atomic_store_n(&tsc_state, -1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    hrc_link_init(&tsc_link, HRC_TSC, HRC_MONOTONIC);
+    usleep(HRC_CALIBRATE_MS * 1000);
+    hrc_link_update(&tsc_link); // first rate
+    if (tsc_link.rate <= 0)
+    {
+        __atomic_store_n(&tsc_state, -1, __ATOMIC_RELEASE);
+        return;
+    }
+    printf("clock: cpu counter at %.3f MHz\n", 1e3 / tsc_link.rate);
+    __atomic_store_n(&tsc_state, 1, __ATOMIC_RELEASE);
+}
+
+UINT64 hrc_now(int clock)
+{
+    if (clock == HRC_TSC)
+    {
+        if (__atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) > 0)
+        {
+            UINT64 ticks = read_counter();
+            // the reader that finds the link due resamples it
+            if ((INT64) (ticks - __atomic_load_n(&tsc_link.next_update, __ATOMIC_RELAXED)) >= 0)
+                hrc_link_update(&tsc_link);
+            return hrc_link_map(&tsc_link, ticks);
+        }
+        clock = HRC_MONOTONIC;
+    }
+    if (clock < HRC_MONOTONIC || clock > HRC_REALTIME)
+        clock = HRC_MONOTONIC;
+    return read_raw(clock);
+}
+
+int hrc_tsc_init(void)
+{
+    pthread_once(&tsc_once, tsc_setup);
+    return __atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) > 0 ? 0 : -1;
+}
+
+const struct ClockLink *hrc_tsc_link(void)
+{
+    return __atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) > 0 ? &tsc_link : NULL;
+}
+
+const char *hrc_name(int clock)
+{
+    if (clock == HRC_TSC && __atomic_load_n(&tsc_state, __ATOMIC_ACQUIRE) <= 0)
+        clock = HRC_MONOTONIC;
+    return clock >= HRC_MONOTONIC && clock <= HRC_TSC ? clock_names[clock] : "?";
+}
+
+void hrc_link_init(struct ClockLink *link, int from, int to)
+{
+    UINT64 f = 0;
+    UINT64 t = 0;
+
+    memset(link, 0, sizeof(*link));
+    link->from = from;
+    link->to = to >= HRC_MONOTONIC && to <= HRC_REALTIME ? to : HRC_MONOTONIC;
+    sample(link->from, link->to, &f, &t);
+    link->window.anchor = f;
+    link->window.anchor_ns = t;
+    link->samples = 1;
+    // a counter has no nominal rate: the first update measures it
+    link->measured = from == HRC_TSC ? 0 : 1.0;
+    publish(link, f, t, link->measured);
+}
+
+int hrc_link_update(struct ClockLink *link)
+{
+    UINT64 f = 0;
+    UINT64 t = 0;
+    double rate;
+
+    __atomic_load(&link->rate, &rate, __ATOMIC_RELAXED);
+    if (rate > 0 &&
+            (INT64) (read_raw(link->from) - __atomic_load_n(&link->next_update, __ATOMIC_RELAXED)) < 0)
+        return (0);
+    if (__atomic_exchange_n(&link->busy, 1, __ATOMIC_ACQUIRE))
+        return (0); // another thread is at it
+
+    sample(link->from, link->to, &f, &t);
+    if (f == link->window.anchor)
+    {
+        __atomic_store_n(&link->busy, 0, __ATOMIC_RELEASE);
+        return (0);
+    }
+    link->samples++;
+
+    UINT64 mapped = link->rate > 0 ? hrc_link_map(link, f) : t;
+    link->last_error = (INT64) (t - mapped);
+    if (link->rate > 0 && llabs(link->last_error) > HRC_STEP_NS)
+    {
+        // the target clock was set: start over from this sample
+        link->steps++;
+        link->window.anchor = f;
+        link->window.anchor_ns = t;
+        publish(link, f, t, link->measured);
+    }
+    else
+    {
+        // a counter takes its first rate from any span
+        double rate = hrc_window_fit(&link->window, f, t,
+                link->measured == 0 ? 0 : HRC_RATE_MS * 1000000ULL, HRC_WINDOW_MS * 1000000ULL);
+        if (rate > 0)
+            link->measured = rate;
+        // continuous from the current mapping, the error is steered out by the next update
+        double interval = HRC_UPDATE_MS * 1e6 / link->measured;
+        publish(link, f, mapped, link->measured + (double) link->last_error / interval);
+    }
+
+    __atomic_store_n(&link->busy, 0, __ATOMIC_RELEASE);
+    return (1);
+}
+
+UINT64 hrc_link_map(const struct ClockLink *link, UINT64 value)
+{
+    UINT64 from_base, to_base;
+    double rate;
+
+    load(link, &from_base, &to_base, &rate);
+    return to_base + (INT64) ((double) (INT64) (value - from_base) * rate);
+}
+
+UINT64 hrc_link_unmap(const struct ClockLink *link, UINT64 value)
+{
+    UINT64 from_base, to_base;
+    double rate;
+
+    load(link, &from_base, &to_base, &rate);
+    if (rate <= 0)
+        return from_base;
+    return from_base + (INT64) ((double) (INT64) (value - to_base) / rate);
+}
+
+double hrc_window_fit(struct RateWindow *win, UINT64 value, UINT64 ns, UINT64 min_ns,
+        UINT64 window_ns)
+{
+    UINT64 span = ns - win->anchor_ns;
+    double rate = 0;
+
+    if (span >= min_ns && value != win->anchor)
+        rate = (double) span / (double) (value - win->anchor);
+    if (span > window_ns)
+    {
+        win->anchor += (value - win->anchor) / 2;
+        win->anchor_ns += span / 2;
+    }
+    return rate;
+}
+
+double hrc_link_ppm(const struct ClockLink *link)
+{
+    if (link->from == HRC_TSC || link->measured <= 0)
+        return 0;
+    return (1.0 / link->measured - 1.0) * 1e6;
+}
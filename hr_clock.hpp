@@ -0,0 +1,141 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HR_CLOCK_H
+#define HR_CLOCK_H
+
+#include "defs.hpp"
+
+/*
+ * High resolution clocks
+ *
+ * every call reads the clock into a local (no allocation, no shared
+ * state), all of them are safe from any thread:
+ *   HRC_MONOTONIC  CLOCK_MONOTONIC, the clock of V4L2 buffer time stamps
+ *                  (V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC), rate corrected by NTP
+ *   HRC_RAW        CLOCK_MONOTONIC_RAW, the hardware rate
+ *   HRC_REALTIME   CLOCK_REALTIME, wall time (steps when the clock is set)
+ *   HRC_TSC        the CPU counter (x86 TSC, ARM generic timer) mapped to
+ *                  HRC_MONOTONIC: a few ns per read, same time base as the
+ *                  buffer time stamps. Available after hrc_tsc_init found
+ *                  an invariant counter, HRC_MONOTONIC otherwise.
+ *
+ * a ClockLink maps one clock to another (offset and rate from paired
+ * samples, read with a seqlock: one updater, any number of readers). The
+ * rate is measured over a sliding window so the drift between the clocks
+ * is followed; an error above HRC_STEP_NS means the target was set and
+ * the mapping starts over. hrc_now(HRC_TSC) keeps its own link updated.
+ */
+#define HRC_MONOTONIC  0
+#define HRC_RAW        1
+#define HRC_REALTIME   2
+#define HRC_TSC        3
+
+#define HRC_UPDATE_MS       1000     // links are resampled this often
+#define HRC_RATE_MS         200      // span before a measured rate replaces the nominal one
+#define HRC_WINDOW_MS       60000    // the rate is measured over at most this span
+#define HRC_STEP_NS         1000000  // larger errors are clock steps
+#define HRC_CALIBRATE_MS    20       // first TSC rate measurement
+
+/* paired samples of a clock and ns the rate is fitted over (hrc_window_fit) */
+struct RateWindow
+{
+    UINT64 anchor;              // window start: clock value
+    UINT64 anchor_ns;           // and ns
+};
+
+struct ClockLink
+{
+    int from;                   // HRC_* clocks
+    int to;
+    uint32_t seq;               // odd while the mapping is rewritten (atomic)
+    UINT64 from_base;           // mapping: to = to_base + (from - from_base) * rate
+    UINT64 to_base;
+    double rate;                // to ns per from unit (0 - not measured yet)
+    double measured;            // rate over the window (rate also steers out the last error)
+
+    int busy;                   // an update is running (atomic)
+    UINT64 next_update;         // in from units (atomic)
+    struct RateWindow window;   // from clock against to ns
+    ULLONG samples;
+    ULLONG steps;               // target clock steps seen
+    INT64 last_error;           // sample minus mapping at the last update (ns)
+};
+
+/*
+ * returns: clock in nanoseconds (HRC_TSC: in the HRC_MONOTONIC time base)
+ */
+UINT64 hrc_now(int clock);
+
+/*
+ * calibrates the CPU counter against HRC_MONOTONIC (blocks
+ * HRC_CALIBRATE_MS the first time, any thread, once)
+ * returns: 0 - HRC_TSC reads the counter, -1 - no invariant counter
+ *          (HRC_TSC reads HRC_MONOTONIC)
+ */
+int hrc_tsc_init(void);
+
+/*
+ * returns: the link that maps the counter (NULL before hrc_tsc_init)
+ */
+const struct ClockLink *hrc_tsc_link(void);
+
+const char *hrc_name(int clock);
+
+/*
+ * starts a link with a first sample pair (rate 1 between ns clocks)
+ * args:
+ * from: any HRC_* clock
+ * to: HRC_MONOTONIC, HRC_RAW or HRC_REALTIME
+ */
+void hrc_link_init(struct ClockLink *link, int from, int to);
+
+/*
+ * resamples the link if HRC_UPDATE_MS passed (cheap otherwise, and
+ * skipped while another thread updates it)
+ * returns: 1 - updated, 0 - not due
+ */
+int hrc_link_update(struct ClockLink *link);
+
+/*
+ * returns: value of the from clock in the to clock (ns)
+ */
+UINT64 hrc_link_map(const struct ClockLink *link, UINT64 value);
+
+/*
+ * returns: value of the to clock (ns) in the from clock
+ */
+UINT64 hrc_link_unmap(const struct ClockLink *link, UINT64 value);
+
+/*
+ * rate between a clock and ns from the window start to a new sample; past
+ * window_ns the window keeps half its span, so the rate follows drift
+ * args:
+ * value, ns: the sample (ns after the window start)
+ * min_ns: span before a rate is given
+ *
+ * returns: ns per clock unit, 0 - span below min_ns
+ */
+double hrc_window_fit(struct RateWindow *win, UINT64 value, UINT64 ns, UINT64 min_ns,
+        UINT64 window_ns);
+
+/*
+ * returns: drift of the from clock against the to clock, ppm
+ *          (0 for a counter, whose nominal rate is unknown)
+ */
+double hrc_link_ppm(const struct ClockLink *link);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include "mem_arena.hpp"
+
+// chunk header size, keeps the data aligned
+#define CHUNK_HEADER ((sizeof(struct ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+static struct ArenaChunk *new_chunk(struct MemArena *arena, size_t size)
+{
+    struct ArenaChunk *chunk = (ArenaChunk *)calloc(1, CHUNK_HEADER + size);
+    if (!chunk)
+        return NULL;
+    chunk->size = size;
+    arena->chunks++;
+    return chunk;
+}
+
+struct MemArena *arena_create(size_t chunk_size)
+{
+    struct MemArena *arena = (MemArena *)calloc(1, sizeof(struct MemArena));
+    if (!arena)
+        return NULL;
+
+    arena->chunk_size = chunk_size > 0 ? chunk_size : ARENA_DEFAULT_CHUNK;
+    arena->chunk = new_chunk(arena, arena->chunk_size);
+    if (!arena->chunk)
+    {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void *arena_alloc(struct MemArena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    struct ArenaChunk *chunk = arena->chunk;
+    if (chunk->size - chunk->used < size)
+    {
+        if (size > arena->chunk_size / 4)
+        {
+            // big block: a chunk of its own behind the current one, so
+            // the space left in the current chunk is not wasted
+            struct ArenaChunk *big = new_chunk(arena, size);
+            if (!big)
+                return NULL;
+            big->used = size;
+            big->prev = chunk->prev;
+            chunk->prev = big;
+            arena->allocated += size;
+            return (BYTE *) big + CHUNK_HEADER;
+        }
+        chunk = new_chunk(arena, arena->chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->prev = arena->chunk;
+        arena->chunk = chunk;
+    }
+
+    void *ptr = (BYTE *) chunk + CHUNK_HEADER + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    return ptr;
+}
+
+void arena_destroy(struct MemArena *arena)
+{
+    if (arena == NULL)
+        return;
+
+    struct ArenaChunk *chunk = arena->chunk;
+    while (chunk)
+    {
+        struct ArenaChunk *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    free(arena);
+}
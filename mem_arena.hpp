@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEM_ARENA_H
+#define MEM_ARENA_H
+
+#include <stddef.h>
+#include "defs.hpp"
+
+/*
+ * bump allocator: allocations are carved from large zeroed chunks and
+ * only freed all at once with arena_destroy
+ */
+#define ARENA_DEFAULT_CHUNK  16384
+#define ARENA_ALIGN          16
+
+struct ArenaChunk
+{
+    struct ArenaChunk *prev;
+    size_t size;             // usable bytes after the header
+    size_t used;
+};
+
+struct MemArena
+{
+    struct ArenaChunk *chunk;    // current chunk (chunks are chained back)
+    size_t chunk_size;           // size of new chunks
+    size_t allocated;            // bytes handed out
+    int chunks;
+};
+
+/*
+ * args:
+ * chunk_size: bytes per chunk (0 - ARENA_DEFAULT_CHUNK), larger
+ *             allocations get a chunk of their own
+ *
+ * returns: arena or NULL if out of memory
+ */
+struct MemArena *arena_create(size_t chunk_size);
+
+/*
+ * returns: size zeroed bytes aligned to ARENA_ALIGN, NULL if out of memory
+ */
+void *arena_alloc(struct MemArena *arena, size_t size);
+
+/*
+ * frees the arena and everything allocated from it
+ */
+void arena_destroy(struct MemArena *arena);
+
+#endif
@@ -0,0 +1,774 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "mjpeg_http.hpp"
+#include "bench_stats.hpp"
+#include "ms_time.hpp"
+
+#define MJPEG_SLOW_READ     16384   // bytes a slow benchmark viewer reads per round
+#define MJPEG_SLOW_PERIOD   50      // ms between the rounds
+
+static const char stream_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+    "Cache-Control: no-cache, no-store\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n\r\n";
+
+static const char not_found_response[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n\r\n"
+    "not found\r\n";
+
+static void frame_release(struct MjpegFrame *frame)
+{
+    if (frame && --frame->refs == 0)
+        free(frame);
+}
+
+static void client_want_write(struct MjpegServer *server, struct MjpegClient *client, int on)
+{
+    struct epoll_event ev;
+
+    if (client->want_write == on)
+        return;
+    ev.events = EPOLLIN | (on ? (uint32_t) EPOLLOUT : 0u);
+    ev.data.ptr = client;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->want_write = on;
+}
+
+/* the next part: header in head, frame (and trailer) from the shared buffer */
+static void client_start(struct MjpegClient *client, struct MjpegFrame *frame)
+{
+    client->head_len = snprintf(client->head, sizeof(client->head),
+            "--" MJPEG_BOUNDARY "\r\n"
+            "Content-Type: image/jpeg\r\n"
+            "Content-Length: %u\r\n"
+            "X-Timestamp: %llu\r\n\r\n",
+            frame->size, (ULLONG) frame->timestamp);
+    client->sending = frame;
+    client->sent = 0;
+}
+
+/*
+ * writes as much of the pending data as the socket takes
+ * returns: 0 - done or waiting for EPOLLOUT, -1 - close the client
+ */
+static int client_flush(struct MjpegServer *server, struct MjpegClient *client)
+{
+    for (;;)
+    {
+        struct MjpegFrame *frame = client->sending;
+        size_t total = client->head_len + (frame ? frame->size + 2 : 0);
+
+        if (client->sent >= total)
+        {
+            if (frame)
+            {
+                client->frames++;
+                server->sent++;
+                frame_release(frame);
+                client->sending = NULL;
+            }
+            client->head_len = 0;
+            client->sent = 0;
+            if (!client->streaming)
+                return (-1); // error page sent
+            if (client->next)
+            {
+                // the pending reference moves to the part in flight
+                client_start(client, client->next);
+                client->next = NULL;
+                continue;
+            }
+            client_want_write(server, client, 0);
+            return (0);
+        }
+
+        // head, frame, trailer from where the last write stopped
+        struct iovec iov[3];
+        int n = 0;
+        size_t skip = client->sent;
+        if (skip < (size_t) client->head_len)
+        {
+            iov[n].iov_base = client->head + skip;
+            iov[n].iov_len = client->head_len - skip;
+            n++;
+            skip = 0;
+        }
+        else
+            skip -= client->head_len;
+        if (frame)
+        {
+            if (skip < frame->size)
+            {
+                iov[n].iov_base = frame->data + skip;
+                iov[n].iov_len = frame->size - skip;
+                n++;
+                skip = 0;
+            }
+            else
+                skip -= frame->size;
+            iov[n].iov_base = (void *) ("\r\n" + skip);
+            iov[n].iov_len = 2 - skip;
+            n++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                client_want_write(server, client, 1);
+                return (0);
+            }
+            return (-1);
+        }
+        client->sent += ret;
+        server->bytes_sent += ret;
+    }
+}
+
+/* a new frame for the client: sent now, or kept as the only pending one */
+static int client_offer(struct MjpegServer *server, struct MjpegClient *client,
+        struct MjpegFrame *frame)
+{
+    if (!client->streaming)
+        return (0);
+
+    frame->refs++;
+    if (client->sending || client->head_len)
+    {
+        // still busy with an older frame: the viewer skips the one in between
+        if (client->next)
+        {
+            frame_release(client->next);
+            client->dropped++;
+            server->dropped++;
+        }
+        client->next = frame;
+        return (0);
+    }
+
+    client_start(client, frame);
+    return (client_flush(server, client));
+}
+
+/* reads the request, answers it once the header is complete */
+static int client_read(struct MjpegServer *server, struct MjpegClient *client)
+{
+    char discard[256];
+
+    if (client->streaming)
+    {
+        // nothing more is expected from a viewer, only the hang up
+        ssize_t ret = recv(client->fd, discard, sizeof(discard), MSG_DONTWAIT);
+        return (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) ? -1 : 0;
+    }
+
+    ssize_t ret = recv(client->fd, client->request + client->request_len,
+            MJPEG_REQUEST_MAX - 1 - client->request_len, MSG_DONTWAIT);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (ret == 0)
+        return (-1);
+    client->request_len += ret;
+    client->request[client->request_len] = '\0';
+
+    if (!strstr(client->request, "\r\n\r\n") && !strstr(client->request, "\n\n"))
+        return (client->request_len < MJPEG_REQUEST_MAX - 1) ? 0 : -1;
+
+    const char *response = not_found_response;
+    if (!strncmp(client->request, "GET / ", 6) || !strncmp(client->request, "GET /stream", 11) ||
+            !strncmp(client->request, "GET /?", 6))
+    {
+        response = stream_response;
+        client->streaming = 1;
+    }
+    client->head_len = snprintf(client->head, sizeof(client->head), "%s", response);
+    client->sent = 0;
+    return (client_flush(server, client));
+}
+
+static void accept_clients(struct MjpegServer *server)
+{
+    for (;;)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        // a small send buffer: a slow viewer shows up as a busy client
+        // (and skips frames) instead of collecting seconds of frames in the kernel
+        int one = 1;
+        int sndbuf = MJPEG_SEND_BUFFER;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+        struct MjpegClient *client = (MjpegClient *)calloc(1, sizeof(struct MjpegClient));
+        client->fd = fd;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        client->next_client = server->clients;
+        if (server->clients)
+            server->clients->prev_client = client;
+        server->clients = client;
+        __atomic_add_fetch(&server->num_clients, 1, __ATOMIC_RELEASE);
+        server->connections++;
+    }
+}
+
+static void close_client(struct MjpegServer *server, struct MjpegClient *client)
+{
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    frame_release(client->sending);
+    frame_release(client->next);
+
+    if (client->prev_client)
+        client->prev_client->next_client = client->next_client;
+    else
+        server->clients = client->next_client;
+    if (client->next_client)
+        client->next_client->prev_client = client->prev_client;
+    __atomic_sub_fetch(&server->num_clients, 1, __ATOMIC_RELEASE);
+    free(client);
+}
+
+/* clients are closed after the event batch, later events may still name them */
+static void client_fail(struct MjpegServer *server, struct MjpegClient *client)
+{
+    if (client->failed)
+        return;
+    client->failed = 1;
+    server->num_failed++;
+}
+
+/* server thread: the only one touching clients and frame references */
+static void *server_loop(void *arg)
+{
+    struct MjpegServer *server = (struct MjpegServer *) arg;
+    struct epoll_event events[MJPEG_MAX_EVENTS];
+
+    while (!__atomic_load_n(&server->quit, __ATOMIC_ACQUIRE))
+    {
+        int n = epoll_wait(server->epoll_fd, events, MJPEG_MAX_EVENTS, 100);
+
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &server->listen_fd)
+                accept_clients(server);
+            else if (ptr == &server->event_fd)
+            {
+                uint64_t count;
+                if (read(server->event_fd, &count, sizeof(count)) < 0)
+                    continue;
+
+                __LOCK_MUTEX(&server->mutex);
+                struct MjpegFrame *frame = server->latest;
+                server->latest = NULL;
+                __UNLOCK_MUTEX(&server->mutex);
+                if (!frame)
+                    continue;
+
+                for (struct MjpegClient *c = server->clients; c; c = c->next_client)
+                    if (!c->failed && client_offer(server, c, frame) < 0)
+                        client_fail(server, c);
+                frame_release(frame);
+            }
+            else
+            {
+                struct MjpegClient *client = (struct MjpegClient *) ptr;
+                int ret = 0;
+
+                if (client->failed)
+                    continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    ret = -1;
+                if (ret == 0 && (events[i].events & EPOLLIN))
+                    ret = client_read(server, client);
+                if (ret == 0 && (events[i].events & EPOLLOUT))
+                    ret = client_flush(server, client);
+                if (ret < 0)
+                    client_fail(server, client);
+            }
+        }
+
+        for (struct MjpegClient *c = server->clients; server->num_failed && c; )
+        {
+            struct MjpegClient *next = c->next_client;
+            if (c->failed)
+            {
+                close_client(server, c);
+                server->num_failed--;
+            }
+            c = next;
+        }
+    }
+
+    return ((void *) 0);
+}
+
+/*
+ * listens on port and starts the server thread
+ */
+struct MjpegServer *mjpeg_server_create(int port, int loopback)
+{
+    struct MjpegServer *server = (MjpegServer *)calloc(1, sizeof(struct MjpegServer));
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int one = 1;
+
+    server->port = port;
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->epoll_fd < 0 || server->event_fd < 0 || server->listen_fd < 0)
+    {
+        printf("mjpeg: unable to create the server: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
+    if (bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(server->listen_fd, SOMAXCONN) < 0)
+    {
+        printf("mjpeg: unable to listen on port %i: %s\n", port, strerror(errno));
+        goto fail;
+    }
+
+    // listen and event fds are told apart from clients by their address
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server->listen_fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev);
+    ev.data.ptr = &server->event_fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->event_fd, &ev);
+
+    __INIT_MUTEX(&server->mutex);
+    if (__THREAD_CREATE(&server->thread, server_loop, server))
+    {
+        printf("mjpeg: server thread creation failed\n");
+        __CLOSE_MUTEX(&server->mutex);
+        goto fail;
+    }
+
+    return (server);
+
+fail:
+    if (server->listen_fd >= 0)
+        close(server->listen_fd);
+    if (server->event_fd >= 0)
+        close(server->event_fd);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    free(server);
+    return (NULL);
+}
+
+/*
+ * hands a JPEG to the server thread
+ */
+int mjpeg_server_push(struct MjpegServer *server, const BYTE *jpeg, uint32_t size,
+        uint32_t sequence, UINT64 timestamp)
+{
+    struct MjpegFrame *frame = (MjpegFrame *)malloc(sizeof(struct MjpegFrame) + size);
+    if (!frame)
+        return (-1);
+
+    frame->refs = 1;
+    frame->size = size;
+    frame->sequence = sequence;
+    frame->timestamp = timestamp;
+    frame->data = (BYTE *) (frame + 1);
+    memcpy(frame->data, jpeg, size);
+
+    __LOCK_MUTEX(&server->mutex);
+    struct MjpegFrame *old = server->latest;
+    server->latest = frame;
+    server->pushed++;
+    if (old)
+        server->replaced++;
+    __UNLOCK_MUTEX(&server->mutex);
+    free(old); // never seen by the server thread, no other references
+
+    uint64_t one = 1;
+    if (write(server->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        return (-1);
+    return (0);
+}
+
+int mjpeg_server_clients(struct MjpegServer *server)
+{
+    return __atomic_load_n(&server->num_clients, __ATOMIC_ACQUIRE);
+}
+
+static void server_stop(struct MjpegServer *server)
+{
+    if (__atomic_exchange_n(&server->quit, 1, __ATOMIC_ACQ_REL))
+        return;
+    __THREAD_JOIN(server->thread);
+}
+
+void mjpeg_server_destroy(struct MjpegServer *server)
+{
+    if (server == NULL)
+        return;
+
+    server_stop(server);
+    printf("mjpeg: %llu frames pushed, %llu sent, %llu dropped for slow viewers, %llu connections\n",
+            server->pushed, server->sent, server->dropped, server->connections);
+    while (server->clients)
+        close_client(server, server->clients);
+    free(server->latest);
+
+    __CLOSE_MUTEX(&server->mutex);
+    close(server->listen_fd);
+    close(server->event_fd);
+    close(server->epoll_fd);
+    free(server);
+}
+
+/* benchmark viewer: parses the multipart stream */
+struct BenchViewer
+{
+    int fd;
+    int state;               // 0 - response header, 1 - part header, 2 - jpeg, 3 - trailer
+    char head[512];
+    int head_len;
+    uint32_t remaining;
+    UINT64 timestamp;
+    ULLONG frames;
+    ULLONG bytes;
+};
+
+struct ViewerGroup
+{
+    struct BenchViewer *viewers;
+    int count;
+    int slow;                // read at most MJPEG_SLOW_READ per MJPEG_SLOW_PERIOD
+    int quit;                // atomic
+    ULLONG errors;
+    struct LatencyStats latency;   // push to complete frame
+};
+
+static int viewer_feed(struct BenchViewer *v, const char *data, size_t n, struct LatencyStats *latency)
+{
+    v->bytes += n;
+    while (n > 0)
+    {
+        if (v->state >= 2)
+        {
+            size_t take = MIN(n, (size_t) v->remaining);
+            v->remaining -= take;
+            data += take;
+            n -= take;
+            if (v->remaining)
+                continue;
+            if (v->state == 2)
+            {
+                v->frames++;
+                latency_add(latency, ns_time_monotonic() - v->timestamp);
+                v->state = 3;
+                v->remaining = 2;
+            }
+            else
+                v->state = 1;
+            continue;
+        }
+
+        // header lines, byte by byte up to the blank line
+        if (v->head_len >= (int) sizeof(v->head) - 1)
+            return (-1);
+        v->head[v->head_len++] = *data++;
+        n--;
+        if (v->head_len < 4 || memcmp(v->head + v->head_len - 4, "\r\n\r\n", 4))
+            continue;
+        v->head[v->head_len] = '\0';
+        v->head_len = 0;
+
+        if (v->state == 0)
+        {
+            if (strncmp(v->head, "HTTP/1.0 200", 12))
+                return (-1);
+            v->state = 1;
+            continue;
+        }
+        const char *len = strstr(v->head, "Content-Length: ");
+        const char *ts = strstr(v->head, "X-Timestamp: ");
+        if (!len || !ts)
+            return (-1);
+        v->remaining = strtoul(len + 16, NULL, 10);
+        v->timestamp = strtoull(ts + 13, NULL, 10);
+        v->state = 2;
+    }
+    return (0);
+}
+
+static void *viewer_loop(void *arg)
+{
+    struct ViewerGroup *group = (struct ViewerGroup *) arg;
+    static const int buf_size = 65536;
+    char *buf = (char *) malloc(buf_size);
+    struct epoll_event events[MJPEG_MAX_EVENTS];
+    int epoll_fd = -1;
+
+    if (!group->slow)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (int i = 0; i < group->count; i++)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &group->viewers[i];
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, group->viewers[i].fd, &ev);
+        }
+    }
+
+    while (!__atomic_load_n(&group->quit, __ATOMIC_ACQUIRE))
+    {
+        if (group->slow)
+        {
+            for (int i = 0; i < group->count; i++)
+            {
+                struct BenchViewer *v = &group->viewers[i];
+                ssize_t n = recv(v->fd, buf, MJPEG_SLOW_READ, MSG_DONTWAIT);
+                if (n > 0 && viewer_feed(v, buf, n, &group->latency) < 0)
+                    group->errors++;
+            }
+            sleep_ms(MJPEG_SLOW_PERIOD);
+            continue;
+        }
+
+        int n = epoll_wait(epoll_fd, events, MJPEG_MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++)
+        {
+            struct BenchViewer *v = (struct BenchViewer *) events[i].data.ptr;
+            ssize_t r;
+            while ((r = recv(v->fd, buf, buf_size, MSG_DONTWAIT)) > 0)
+                if (viewer_feed(v, buf, r, &group->latency) < 0)
+                    group->errors++;
+        }
+    }
+
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    free(buf);
+    return ((void *) 0);
+}
+
+static int viewer_connect(struct BenchViewer *v, int port, int slow)
+{
+    struct sockaddr_in addr;
+    static const char request[] = "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    memset(v, 0, sizeof(struct BenchViewer));
+    v->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (v->fd < 0)
+        return (-1);
+    if (slow)
+    {
+        // a small receive buffer so the server feels the slow reader early
+        int size = 2 * MJPEG_SLOW_READ;
+        setsockopt(v->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(v->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            send(v->fd, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0)
+    {
+        close(v->fd);
+        v->fd = -1;
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * loopback benchmark with fast and slow viewers
+ */
+int mjpeg_bench(int port, int clients, int slow_clients, uint32_t frames,
+        uint32_t frame_size, int fps)
+{
+    struct ViewerGroup groups[2];   // fast, slow
+    __THREAD_TYPE threads[2];
+    struct CpuUsage cpu_start, cpu_end;
+    int ret = 0;
+
+    slow_clients = MAX(0, MIN(slow_clients, clients));
+    frame_size = MAX(frame_size, 4);
+
+    struct MjpegServer *server = mjpeg_server_create(port, 1);
+    if (!server)
+        return (-1);
+
+    memset(groups, 0, sizeof(groups));
+    groups[0].count = clients - slow_clients;
+    groups[1].count = slow_clients;
+    groups[1].slow = 1;
+    int connected = 0;
+    for (int g = 0; g < 2; g++)
+    {
+        groups[g].viewers = (BenchViewer *)calloc(MAX(groups[g].count, 1), sizeof(struct BenchViewer));
+        latency_init(&groups[g].latency, g ? "slow_viewers" : "viewers", frames);
+        for (int i = 0; i < groups[g].count; i++)
+            if (viewer_connect(&groups[g].viewers[i], port, groups[g].slow) == 0)
+                connected++;
+            else
+            {
+                printf("mjpeg bench: viewer %i: connect failed: %s\n", connected, strerror(errno));
+                groups[g].count = i;
+                ret = -1;
+                break;
+            }
+    }
+
+    // every viewer has its stream header before the first frame
+    UINT64 wait_end = ns_time_monotonic() + 5 * G_NSEC_PER_SEC;
+    while (mjpeg_server_clients(server) < connected && ns_time_monotonic() < wait_end)
+        sleep_ms(1);
+    sleep_ms(100);
+
+    int started = 0;
+    for (; started < 2; started++)
+        if (__THREAD_CREATE(&threads[started], viewer_loop, &groups[started]))
+        {
+            ret = -1;
+            break;
+        }
+
+    // a synthetic JPEG: SOI ... EOI
+    BYTE *frame = (BYTE *) malloc(frame_size);
+    for (uint32_t i = 0; i < frame_size; i++)
+        frame[i] = (BYTE) (i * 131);
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    frame[frame_size - 2] = 0xFF;
+    frame[frame_size - 1] = 0xD9;
+
+    UINT64 period = fps > 0 ? G_NSEC_PER_SEC / fps : 0;
+    cpu_usage(&cpu_start);
+    UINT64 start = ns_time_monotonic();
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        if (period)
+            sleep_until_ns(start + i * period);
+        mjpeg_server_push(server, frame, frame_size, i, ns_time_monotonic());
+    }
+    UINT64 end = ns_time_monotonic();
+    sleep_ms(500); // let the fast viewers get the last frames
+
+    for (int g = 0; g < started; g++)
+    {
+        __atomic_store_n(&groups[g].quit, 1, __ATOMIC_RELEASE);
+        __THREAD_JOIN(threads[g]);
+    }
+    cpu_usage(&cpu_end);
+    server_stop(server);
+
+    double elapsed = (end - start) / 1e9;
+    double cpu_user = cpu_end.user_ns / 1e9 - cpu_start.user_ns / 1e9;
+    double cpu_sys = cpu_end.sys_ns / 1e9 - cpu_start.sys_ns / 1e9;
+    ULLONG group_frames[2] = {0, 0};
+    ULLONG group_min[2] = {0, 0};
+    for (int g = 0; g < 2; g++)
+        for (int i = 0; i < groups[g].count; i++)
+        {
+            ULLONG f = groups[g].viewers[i].frames;
+            group_frames[g] += f;
+            group_min[g] = i ? MIN(group_min[g], f) : f;
+        }
+
+    printf("{\n");
+    printf("  \"port\": %i,\n", port);
+    printf("  \"clients\": %i,\n  \"slow_clients\": %i,\n", connected, groups[1].count);
+    printf("  \"frame_size\": %u,\n", frame_size);
+    printf("  \"requested_fps\": %i,\n", fps);
+    printf("  \"frames\": %llu,\n", server->pushed);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"push_fps\": %.1f,\n", elapsed > 0 ? server->pushed / elapsed : 0);
+    printf("  \"frames_sent\": %llu,\n", server->sent);
+    printf("  \"frames_dropped\": %llu,\n", server->dropped);
+    printf("  \"frames_replaced\": %llu,\n", server->replaced);
+    printf("  \"bytes_sent\": %llu,\n", server->bytes_sent);
+    printf("  \"throughput_mb_s\": %.1f,\n", elapsed > 0 ? server->bytes_sent / elapsed / 1e6 : 0);
+    printf("  \"viewer_frames_avg\": %.1f,\n",
+            groups[0].count ? (double) group_frames[0] / groups[0].count : 0);
+    printf("  \"viewer_frames_min\": %llu,\n", group_min[0]);
+    printf("  \"slow_viewer_frames_avg\": %.1f,\n",
+            groups[1].count ? (double) group_frames[1] / groups[1].count : 0);
+    printf("  \"parse_errors\": %llu,\n", groups[0].errors + groups[1].errors);
+    printf("  \"cpu_user_s\": %.3f,\n", cpu_user);
+    printf("  \"cpu_sys_s\": %.3f,\n", cpu_sys);
+    printf("  \"cpu_percent\": %.1f,\n", elapsed > 0 ? 100.0 * (cpu_user + cpu_sys) / elapsed : 0);
+    printf("  \"latency\": {\n");
+    latency_json(stdout, &groups[0].latency, "    ");
+    printf(",\n");
+    latency_json(stdout, &groups[1].latency, "    ");
+    printf("\n  }\n}\n");
+
+    if (groups[0].errors + groups[1].errors)
+        ret = -1;
+    for (int g = 0; g < 2; g++)
+    {
+        for (int i = 0; i < groups[g].count; i++)
+            close(groups[g].viewers[i].fd);
+        free(groups[g].viewers);
+        latency_free(&groups[g].latency);
+    }
+    mjpeg_server_destroy(server);
+    free(frame);
+
+    return (ret);
+}
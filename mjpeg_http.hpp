@@ -0,0 +1,136 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MJPEG_HTTP_H
+#define MJPEG_HTTP_H
+
+#include <pthread.h>
+#include "defs.hpp"
+
+/*
+ * MJPEG over HTTP
+ *
+ * an epoll loop on its own thread serves
+ *   GET / or GET /stream    multipart/x-mixed-replace JPEG stream
+ * every pushed JPEG (camera payload passed through or encoded once by the
+ * caller) is stored once and sent from there to all clients with writev,
+ * no per client copies. A client that is still sending a frame when the
+ * next one arrives keeps only the newest one pending: slow viewers skip
+ * frames (counted as dropped), nothing queues up.
+ *
+ * each part carries Content-Length and X-Timestamp (the frame time stamp
+ * in ns as passed to mjpeg_server_push).
+ */
+#define MJPEG_BOUNDARY        "dscamframe"
+#define MJPEG_DEFAULT_PORT    8080
+#define MJPEG_MAX_EVENTS      64
+#define MJPEG_REQUEST_MAX     2048   // longest request header accepted
+#define MJPEG_SEND_BUFFER     65536  // socket send buffer: frames wait in the server, not the kernel
+
+// a frame shared by all clients (server thread only, no locking)
+struct MjpegFrame
+{
+    int refs;                // clients sending it or holding it pending, + the server
+    uint32_t size;
+    uint32_t sequence;
+    UINT64 timestamp;
+    BYTE *data;              // follows the struct
+};
+
+struct MjpegClient
+{
+    int fd;
+    int streaming;           // request answered, frames are sent
+    int want_write;          // EPOLLOUT armed
+    int failed;              // closed at the end of the event batch
+    char request[MJPEG_REQUEST_MAX];
+    int request_len;
+
+    char head[512];          // response and/or part header of the frame in flight
+    int head_len;
+    struct MjpegFrame *sending;   // frame in flight (NULL - only head)
+    size_t sent;             // bytes of head + frame + trailer written
+    struct MjpegFrame *next;      // newest frame waiting behind the one in flight
+
+    ULLONG frames;           // frames sent completely
+    ULLONG dropped;          // frames replaced before they were sent
+    struct MjpegClient *prev_client, *next_client;
+};
+
+struct MjpegServer
+{
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;            // push wakes the server thread
+    int port;
+    __THREAD_TYPE thread;
+    int quit;                // atomic
+
+    __MUTEX_TYPE mutex;      // latest
+    struct MjpegFrame *latest;   // pushed, not yet taken by the server thread
+
+    struct MjpegClient *clients; // connected clients
+    int num_clients;         // atomic (read by mjpeg_server_clients)
+    int num_failed;          // clients to close
+
+    ULLONG pushed;           // frames pushed
+    ULLONG replaced;         // pushed frames the server thread never saw
+    ULLONG sent;             // frames sent completely (all clients)
+    ULLONG dropped;          // frames skipped for slow clients
+    ULLONG bytes_sent;
+    ULLONG connections;
+};
+
+/*
+ * listens on port and starts the server thread
+ * args:
+ * loopback: listen on 127.0.0.1 only (otherwise all interfaces)
+ *
+ * returns: server or NULL on error
+ */
+struct MjpegServer *mjpeg_server_create(int port, int loopback);
+
+/*
+ * hands a JPEG to the server thread (copied once, thread safe)
+ * a frame the server has not picked up yet is replaced
+ *
+ * returns: 0 on success, -1 on error
+ */
+int mjpeg_server_push(struct MjpegServer *server, const BYTE *jpeg, uint32_t size,
+        uint32_t sequence, UINT64 timestamp);
+
+/*
+ * returns: number of connected clients (encoders can skip work without viewers)
+ */
+int mjpeg_server_clients(struct MjpegServer *server);
+
+/*
+ * disconnects the clients, stops the thread and frees the server
+ */
+void mjpeg_server_destroy(struct MjpegServer *server);
+
+/*
+ * loopback benchmark: clients viewers connect to a server on port, of which
+ * slow_clients read at a limited rate; frames synthetic payloads of
+ * frame_size bytes are pushed at fps (0 - as fast as possible) and a json
+ * summary is written to stdout
+ *
+ * returns: 0 on success, -1 on error
+ */
+int mjpeg_bench(int port, int clients, int slow_clients, uint32_t frames,
+        uint32_t frame_size, int fps);
+
+#endif
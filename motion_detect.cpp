@@ -0,0 +1,209 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "motion_detect.hpp"
+
+/* sum of absolute differences of chunks 16 byte blocks */
+static UINT64 block_sad(const BYTE *a, const BYTE *b, int chunks)
+{
+    UINT64 sum = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int j = 0; j < chunks; j++)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (a + 16 * j)),
+                    _mm_loadu_si128((const __m128i *) (b + 16 * j))));
+    UINT64 lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sum = lanes[0] + lanes[1];
+#elif defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (int j = 0; j < chunks; j++)
+        acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + 16 * j), vld1q_u8(b + 16 * j))));
+    sum = (UINT64) vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+        vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#else
+    for (int i = 0; i < 16 * chunks; i++)
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+#endif
+
+    return sum;
+}
+
+/*
+ * one grid row: each sample is the mean of step luma samples of the row,
+ * so an edge moving by less than step still changes the grid
+ */
+static void gather_row(const BYTE *src, BYTE *dst, int width, int step, int sample_bytes)
+{
+    int k = 0;
+    int x = 0;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    // step samples in 16 bytes (YUYV step 8, planar step 16): sum the masked
+    // luma bytes (sad against zero / pairwise adds)
+    if (step * sample_bytes == 16)
+    {
+        BYTE m[16];
+        for (int i = 0; i < 16; i++)
+            m[i] = (i % sample_bytes) ? 0 : 0xFF;
+#if defined(__SSE2__)
+        const __m128i mask = _mm_loadu_si128((const __m128i *) m);
+        const __m128i zero = _mm_setzero_si128();
+#else
+        const uint8x16_t mask = vld1q_u8(m);
+#endif
+        // a UYVY view ends one byte before the row, the last block is done below
+        for (; x + step < width; x += step, k++)
+        {
+            const BYTE *p = src + x * sample_bytes;
+#if defined(__SSE2__)
+            __m128i s = _mm_sad_epu8(_mm_and_si128(_mm_loadu_si128((const __m128i *) p), mask), zero);
+            int sum = _mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4);
+#else
+            uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vandq_u8(vld1q_u8(p), mask))));
+            int sum = (int) (vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+#endif
+            dst[k] = (BYTE) (sum / step);
+        }
+    }
+#endif
+    for (; x < width; x += step, k++)
+    {
+        int n = MIN(step, width - x);
+        int sum = 0;
+        for (int i = 0; i < n; i++)
+            sum += src[(x + i) * sample_bytes];
+        dst[k] = (BYTE) (sum / n);
+    }
+}
+
+struct MotionDetector *motion_create(int width, int height, int step, float threshold)
+{
+    if (width <= 0 || height <= 0)
+        return (NULL);
+
+    struct MotionDetector *md = (MotionDetector *)calloc(1, sizeof(struct MotionDetector));
+    md->step = step > 0 ? step : MOTION_DEFAULT_STEP;
+    md->threshold = threshold > 0 ? threshold : MOTION_DEFAULT_THRESHOLD;
+    md->grid_width = ((width + md->step - 1) / md->step + 15) & ~15;
+    md->grid_height = (height + md->step - 1) / md->step;
+    // zeroed padding stays equal in both grids
+    md->grid = (BYTE *)calloc(md->grid_width, md->grid_height);
+    md->reference = (BYTE *)calloc(md->grid_width, md->grid_height);
+    if (!md->grid || !md->reference)
+    {
+        motion_destroy(md);
+        return (NULL);
+    }
+    return md;
+}
+
+int motion_update(struct MotionDetector *md, const struct LumaView *view)
+{
+    UINT64 zone_sad[MOTION_ZONES][MOTION_ZONES];
+    UINT64 zone_samples[MOTION_ZONES][MOTION_ZONES];
+    const int chunks = md->grid_width / 16;
+    const int nx = (view->width + md->step - 1) / md->step;
+    int bounds[MOTION_ZONES + 1];
+
+    if (nx > md->grid_width || (view->height + md->step - 1) / md->step != md->grid_height)
+        return (1); // not the size the detector was made for
+
+    md->frames++;
+
+    // every step-th row, averaged in runs of step samples
+    for (int r = 0; r < md->grid_height; r++)
+        gather_row(view->data + (size_t) r * md->step * view->stride,
+                md->grid + r * md->grid_width, view->width, md->step, view->step);
+
+    if (!md->has_reference)
+    {
+        BYTE *swap = md->reference;
+        md->reference = md->grid;
+        md->grid = swap;
+        md->has_reference = 1;
+        return (1);
+    }
+
+    memset(zone_sad, 0, sizeof(zone_sad));
+    memset(zone_samples, 0, sizeof(zone_samples));
+    for (int z = 0; z <= MOTION_ZONES; z++)
+        bounds[z] = z * chunks / MOTION_ZONES;
+
+    for (int r = 0; r < md->grid_height; r++)
+    {
+        int zy = r * MOTION_ZONES / md->grid_height;
+        const BYTE *a = md->grid + r * md->grid_width;
+        const BYTE *b = md->reference + r * md->grid_width;
+        for (int zx = 0; zx < MOTION_ZONES; zx++)
+        {
+            int n = bounds[zx + 1] - bounds[zx];
+            if (n == 0)
+                continue; // narrower than MOTION_ZONES blocks
+            zone_sad[zy][zx] += block_sad(a + 16 * bounds[zx], b + 16 * bounds[zx], n);
+            zone_samples[zy][zx] += 16 * n;
+        }
+    }
+
+    float diff = 0;
+    for (int zy = 0; zy < MOTION_ZONES; zy++)
+        for (int zx = 0; zx < MOTION_ZONES; zx++)
+            if (zone_samples[zy][zx])
+                diff = MAX(diff, (float) zone_sad[zy][zx] / zone_samples[zy][zx]);
+    md->last_diff = diff;
+
+    if (diff <= md->threshold && md->since_change < MOTION_REFRESH_FRAMES)
+    {
+        md->since_change++;
+        md->unchanged++;
+        return (0);
+    }
+
+    // changed (or refresh): this frame is the new reference
+    BYTE *swap = md->reference;
+    md->reference = md->grid;
+    md->grid = swap;
+    md->since_change = 0;
+    return (1);
+}
+
+float motion_skipped(const struct MotionDetector *md)
+{
+    return md->frames ? (float) md->unchanged / md->frames : 0;
+}
+
+void motion_destroy(struct MotionDetector *md)
+{
+    if (md == NULL)
+        return;
+    if (md->frames)
+        printf("motion: %llu of %llu frames unchanged, %.1f%% of conversion, encoding "
+                "and recording skipped\n", md->unchanged, md->frames, 100 * motion_skipped(md));
+    free(md->grid);
+    free(md->reference);
+    free(md);
+}
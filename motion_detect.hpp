@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOTION_DETECT_H
+#define MOTION_DETECT_H
+
+#include "defs.hpp"
+#include "yuv_luma.hpp"
+
+/*
+ * Change detection
+ *
+ * every step-th luma row is averaged in runs of step samples into a small
+ * grid (an edge moving by less than step still shows), which is compared
+ * with the grid of the last changed frame (not the previous one, so slow
+ * drifts add up) by sum of absolute differences (SSE2 sad / NEON vabd). The grid is split into zones; a frame is changed
+ * when the mean difference of any zone exceeds the threshold, so a small
+ * moving object is not averaged away by a static background.
+ *
+ * unchanged frames can be skipped by conversion, encoding and recording;
+ * after MOTION_REFRESH_FRAMES unchanged frames one is reported changed
+ * anyway (new viewers and recordings get a picture of a static scene).
+ */
+#define MOTION_DEFAULT_STEP       8
+#define MOTION_DEFAULT_THRESHOLD  3.0f   // mean absolute luma difference per zone
+#define MOTION_ZONES              8      // zones per row and column
+#define MOTION_REFRESH_FRAMES     30
+
+struct MotionDetector
+{
+    int step;                    // grid step in samples and rows
+    float threshold;
+    int grid_width;              // samples per grid row (multiple of 16, zero padded)
+    int grid_height;
+    BYTE *grid;                  // current frame
+    BYTE *reference;             // last changed frame
+    int has_reference;
+    int since_change;            // unchanged frames in a row
+    float last_diff;             // largest zone difference of the last frame
+
+    ULLONG frames;
+    ULLONG unchanged;            // frames reported unchanged
+};
+
+/*
+ * args:
+ * width, height: luma size of the frames
+ * step: grid step (<= 0 - MOTION_DEFAULT_STEP)
+ * threshold: mean absolute difference of a zone that counts as change
+ *            (<= 0 - MOTION_DEFAULT_THRESHOLD)
+ *
+ * returns: detector or NULL on error
+ */
+struct MotionDetector *motion_create(int width, int height, int step, float threshold);
+
+/*
+ * compares a frame with the last changed one
+ * returns: 1 if the frame changed (it becomes the reference), 0 if not
+ */
+int motion_update(struct MotionDetector *md, const struct LumaView *view);
+
+/*
+ * returns: fraction of the frames reported unchanged (work avoided downstream)
+ */
+float motion_skipped(const struct MotionDetector *md);
+
+void motion_destroy(struct MotionDetector *md);
+
+#endif
@@ -15,51 +15,40 @@
  */
 
 #include <time.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "ms_time.hpp"
+#include "hr_clock.hpp"
 
 /*------------------------------ get time ------------------------------------*/
+/* all read into locals through hr_clock (nothing allocated or shared) */
+
 /*in miliseconds*/
-DWORD ms_time (void)
+ULLONG ms_time (void)
 {
-    struct timeval *tod;
-    tod = (struct timeval *)malloc( 1 * sizeof(struct timeval));
-    gettimeofday(tod, NULL);
-    DWORD mst = (DWORD) tod->tv_sec * 1000 + (DWORD) tod->tv_usec / 1000;
-    free(tod);
-    return (mst);
+    return (hrc_now(HRC_REALTIME) / 1000000);
 }
 /*in microseconds*/
 ULLONG us_time(void)
 {
-    struct timeval *tod;
-    tod = (struct timeval *)malloc( 1 * sizeof(struct timeval));
-    gettimeofday(tod, NULL);
-    ULLONG ust = (DWORD) tod->tv_sec * 1000000 + (DWORD) tod->tv_usec;
-    free(tod);
-    return (ust);
+    return (hrc_now(HRC_REALTIME) / 1000);
 }
 
 /*REAL TIME CLOCK*/
 /*in nanoseconds*/
 ULLONG ns_time (void)
 {
-    static struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return ((ULLONG) ts.tv_sec * G_NSEC_PER_SEC + (ULLONG) ts.tv_nsec);
+    return (hrc_now(HRC_REALTIME));
 }
 
 /*MONOTONIC CLOCK*/
 /*in nanosec*/
 UINT64 ns_time_monotonic()
 {
-    static struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ((UINT64) ts.tv_sec * G_NSEC_PER_SEC + (ULLONG) ts.tv_nsec);
+    return (hrc_now(HRC_MONOTONIC));
 }
 
 //sleep for given time in ms
@@ -69,6 +58,15 @@ void sleep_ms(int ms_time)
     usleep( sleep_us );/*sleep for sleep_ms ms*/
 }
 
+//sleep until the monotonic clock reaches ns (absolute, no drift)
+void sleep_until_ns(UINT64 ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / G_NSEC_PER_SEC;
+    ts.tv_nsec = ns % G_NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
 /*wait on cond by sleeping for n_loops of sleep_ms ms (test var==val every loop)*/
 /*return remaining number of loops (if 0 then a stall occurred)              */
 int wait_ms(bool* var, bool val, __MUTEX_TYPE *mutex, int ms_time, int n_loops)
@@ -23,8 +23,8 @@
 #define G_NSEC_PER_SEC 1000000000LL
 #endif
 
-/*time in miliseconds*/
-DWORD ms_time (void);
+/*time in miliseconds (real time, see hr_clock.hpp for the other clocks)*/
+ULLONG ms_time (void);
 /*time in microseconds*/
 ULLONG us_time(void);
 /*time in nanoseconds (real time for benchmark)*/
@@ -35,6 +35,9 @@ UINT64 ns_time_monotonic();
 /*sleep for given time in ms*/
 void sleep_ms(int ms_time);
 
+/*sleep until MONOTONIC CLOCK reaches ns*/
+void sleep_until_ns(UINT64 ns);
+
 /*wait on cond by sleeping for n_loops of sleep_ms ms */
 /*(test (var == val) every loop)                      */
 int wait_ms(bool* var, bool val, __MUTEX_TYPE *mutex, int ms_time, int n_loops);
@@ -0,0 +1,256 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "pretrigger_ring.hpp"
+#include "stream_record.hpp"
+
+/*
+ * allocates the frame store
+ */
+struct PretriggerRing *pretrigger_create(size_t budget, int compress, int format,
+        int width, int height, int fps, int fps_num)
+{
+    struct PretriggerRing *ring = (PretriggerRing *)calloc(1, sizeof(struct PretriggerRing));
+
+#ifndef HAVE_LZ4
+    if (compress)
+    {
+        printf("pretrigger: built without LZ4, frames are stored uncompressed\n");
+        compress = 0;
+    }
+#endif
+
+    ring->mem = (BYTE *)malloc(budget);
+    ring->max_frames = budget / PRETRIGGER_MIN_FRAME + 1;
+    ring->frames = (PretriggerFrame *)calloc(ring->max_frames, sizeof(struct PretriggerFrame));
+    if (!ring->mem || !ring->frames)
+    {
+        printf("pretrigger: unable to allocate %zu bytes\n", budget);
+        free(ring->mem);
+        free(ring->frames);
+        free(ring);
+        return NULL;
+    }
+    // fault the pages in now rather than at the first frames
+    memset(ring->mem, 0, budget);
+
+    ring->budget = budget;
+    ring->compress = compress;
+    ring->format = format;
+    ring->width = width;
+    ring->height = height;
+    ring->fps = fps;
+    ring->fps_num = fps_num;
+    __INIT_MUTEX(&ring->mutex);
+
+    return ring;
+}
+
+void pretrigger_destroy(struct PretriggerRing *ring)
+{
+    if (ring == NULL)
+        return;
+
+    if (ring->flushing)
+        __THREAD_JOIN(ring->flush_thread);
+
+    printf("pretrigger: %llu frames stored, %llu evicted, %llu dropped, %llu flushed",
+            ring->pushed, ring->evicted, ring->dropped, ring->flushed);
+    if (ring->compress && ring->stored_bytes)
+        printf(" (compression %.2f:1)", (double) ring->raw_bytes / ring->stored_bytes);
+    printf("\n");
+
+    __CLOSE_MUTEX(&ring->mutex);
+    free(ring->flush_file);
+    free(ring->frames);
+    free(ring->mem);
+    free(ring);
+}
+
+/*
+ * stores one frame
+ */
+int pretrigger_push(struct PretriggerRing *ring, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp)
+{
+    size_t need = size;
+
+#ifdef HAVE_LZ4
+    if (ring->compress)
+        need = LZ4_compressBound(size);
+#endif
+
+    __LOCK_MUTEX(&ring->mutex);
+    if (need > ring->budget)
+    {
+        ring->dropped++;
+        __UNLOCK_MUTEX(&ring->mutex);
+        return (-1);
+    }
+
+    // frames are laid out in arrival order, wrap to the start when the
+    // end of the block is reached; evict oldest first until the frame fits
+    size_t pos = ring->head;
+    int wrap = (pos + need > ring->budget);
+    if (wrap)
+        pos = 0;
+    while (ring->count > 0)
+    {
+        struct PretriggerFrame *oldest = &ring->frames[ring->first];
+        int in_way;
+
+        if (ring->count == ring->max_frames)
+            in_way = 1;
+        else if (wrap) // frames from head to the end are older than those at the start
+            in_way = (oldest->offset >= ring->head) || (oldest->offset < need);
+        else
+            in_way = (oldest->offset >= pos) && (oldest->offset < pos + need);
+        if (!in_way)
+            break;
+
+        if (ring->first_id >= ring->pin_next && ring->first_id < ring->pin_end)
+        {
+            // pinned for a flush: the live frame gives way
+            ring->dropped++;
+            __UNLOCK_MUTEX(&ring->mutex);
+            return (-1);
+        }
+        ring->first = (ring->first + 1) % ring->max_frames;
+        ring->count--;
+        ring->first_id++;
+        ring->evicted++;
+    }
+    __UNLOCK_MUTEX(&ring->mutex);
+
+    // [pos, pos + need) is ours now, the flush thread only reads pinned frames
+    struct PretriggerFrame frame;
+    frame.offset = pos;
+    frame.size = size;
+    frame.sequence = sequence;
+    frame.flags = 0;
+    frame.timestamp = timestamp;
+#ifdef HAVE_LZ4
+    if (ring->compress)
+    {
+        int n = LZ4_compress_default((const char *) data, (char *) ring->mem + pos, size, need);
+        if (n > 0)
+        {
+            frame.size = n;
+            frame.flags = DSR_FLAG_LZ4;
+        }
+    }
+    if (frame.flags == 0)
+#endif
+        memcpy(ring->mem + pos, data, size);
+
+    __LOCK_MUTEX(&ring->mutex);
+    ring->frames[(ring->first + ring->count) % ring->max_frames] = frame;
+    ring->count++;
+    ring->head = pos + frame.size;
+    ring->pushed++;
+    ring->raw_bytes += size;
+    ring->stored_bytes += frame.size;
+    __UNLOCK_MUTEX(&ring->mutex);
+
+    return (0);
+}
+
+/* flush thread: writes the pinned frames straight from the ring */
+static void *flush_loop(void *arg)
+{
+    struct PretriggerRing *ring = (struct PretriggerRing *) arg;
+
+    struct StreamRecord *rec = stream_record_open(ring->flush_file, ring->format,
+            ring->width, ring->height, ring->fps, ring->fps_num);
+
+    __LOCK_MUTEX(&ring->mutex);
+    while (rec && ring->pin_next < ring->pin_end)
+    {
+        // pinned frames do not move, write them without the lock
+        struct PretriggerFrame frame =
+            ring->frames[(ring->first + (ring->pin_next - ring->first_id)) % ring->max_frames];
+        __UNLOCK_MUTEX(&ring->mutex);
+
+        int ret = stream_record_write(rec, ring->mem + frame.offset, frame.size,
+                frame.sequence, frame.timestamp, frame.flags);
+
+        __LOCK_MUTEX(&ring->mutex);
+        if (ret < 0)
+            break;
+        ring->pin_next++; // written, may be evicted from now on
+        ring->flushed++;
+    }
+    ring->pin_next = ring->pin_end;
+    __UNLOCK_MUTEX(&ring->mutex);
+
+    if (rec)
+        stream_record_close(rec);
+
+    __atomic_store_n(&ring->writing, 0, __ATOMIC_RELEASE);
+    return ((void *) 0);
+}
+
+/*
+ * pins the stored frames and writes them on a flush thread
+ */
+int pretrigger_trigger(struct PretriggerRing *ring, const char *filename)
+{
+    if (pretrigger_busy(ring))
+    {
+        printf("pretrigger: flush in progress, trigger ignored\n");
+        return (-1);
+    }
+    if (ring->flushing)
+    {
+        __THREAD_JOIN(ring->flush_thread);
+        ring->flushing = 0;
+    }
+
+    free(ring->flush_file);
+    ring->flush_file = strdup(filename);
+
+    __LOCK_MUTEX(&ring->mutex);
+    int n = ring->count;
+    ring->pin_next = ring->first_id;
+    ring->pin_end = ring->first_id + n;
+    ring->writing = 1;
+    __UNLOCK_MUTEX(&ring->mutex);
+
+    if (__THREAD_CREATE(&ring->flush_thread, flush_loop, ring))
+    {
+        printf("pretrigger: flush thread creation failed\n");
+        __LOCK_MUTEX(&ring->mutex);
+        ring->pin_next = ring->pin_end;
+        ring->writing = 0;
+        __UNLOCK_MUTEX(&ring->mutex);
+        return (-1);
+    }
+    ring->flushing = 1;
+
+    return (n);
+}
+
+int pretrigger_busy(struct PretriggerRing *ring)
+{
+    return __atomic_load_n(&ring->writing, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PRETRIGGER_RING_H
+#define PRETRIGGER_RING_H
+
+#include <pthread.h>
+#include "defs.hpp"
+
+/*
+ * Pre-trigger recording
+ *
+ * the most recent frames are kept in one fixed memory block (the budget),
+ * each frame is copied (or LZ4 compressed) once from the driver buffer and
+ * stays in place until it is evicted by newer frames. A trigger pins the
+ * frames in memory and a flush thread writes them from there to a .dsr
+ * file while capture goes on; pinned frames are never overwritten, live
+ * frames that do not fit next to them are dropped (and counted) instead.
+ */
+#define PRETRIGGER_MIN_FRAME 4096   // smallest frame accounted for when sizing the frame table
+
+struct PretriggerFrame
+{
+    size_t offset;           // frame position in the memory block
+    uint32_t size;           // stored bytes
+    uint32_t sequence;       // driver frame sequence
+    uint32_t flags;          // DSR_FLAG_* of the stored payload
+    UINT64 timestamp;        // buffer time stamp (ns)
+};
+
+struct PretriggerRing
+{
+    BYTE *mem;               // frame storage (budget bytes)
+    size_t budget;
+    size_t head;             // where the next frame goes
+    struct PretriggerFrame *frames;  // ring of stored frames, oldest first
+    int max_frames;
+    int first;               // oldest frame in frames[]
+    int count;               // stored frames
+    ULLONG first_id;         // number of the oldest frame (frames ever stored before it)
+    int compress;            // LZ4 compress frames
+    int format, width, height, fps, fps_num;  // .dsr header
+    __MUTEX_TYPE mutex;
+
+    // flush job: frames [pin_next, pin_end) are pinned
+    __THREAD_TYPE flush_thread;
+    int flushing;            // flush thread started (not joined)
+    int writing;             // flush thread still writing (atomic)
+    ULLONG pin_next;         // next frame to write
+    ULLONG pin_end;
+    char *flush_file;
+
+    ULLONG pushed;           // frames stored
+    ULLONG dropped;          // live frames dropped (no room next to pinned frames)
+    ULLONG evicted;          // frames overwritten by newer ones
+    ULLONG flushed;          // frames written to disk
+    ULLONG raw_bytes;        // frame bytes before compression
+    ULLONG stored_bytes;     // frame bytes stored
+};
+
+/*
+ * allocates the frame store
+ * args:
+ * budget: memory for frames in bytes
+ * compress: LZ4 compress frames (ignored without HAVE_LZ4)
+ * format, width, height, fps, fps_num: written to the .dsr header on flush
+ *
+ * returns: ring or NULL on error
+ */
+struct PretriggerRing *pretrigger_create(size_t budget, int compress, int format,
+        int width, int height, int fps, int fps_num);
+
+/*
+ * waits for a running flush and frees the ring
+ */
+void pretrigger_destroy(struct PretriggerRing *ring);
+
+/*
+ * stores one frame (single producer: the capture or a consumer thread)
+ * evicts the oldest frames to make room
+ *
+ * returns: 0 on success, -1 if the frame was dropped
+ */
+int pretrigger_push(struct PretriggerRing *ring, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp);
+
+/*
+ * pins the stored frames and writes them to filename on a flush thread,
+ * returns immediately
+ *
+ * returns: number of frames to flush, -1 on error or if a flush is running
+ */
+int pretrigger_trigger(struct PretriggerRing *ring, const char *filename);
+
+/*
+ * returns: 1 while a flush is writing, 0 otherwise
+ */
+int pretrigger_busy(struct PretriggerRing *ring);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include "raw_record.hpp"
+#include "bench_stats.hpp"
+#include "ms_time.hpp"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * creates the data file (pre-allocated for max_frames) and its index
+ */
+struct RawRecord *raw_record_open(const char *filename, int format, int width, int height,
+        uint32_t frame_size, uint32_t max_frames)
+{
+    struct RawRecord *rec = (RawRecord *)calloc(1, sizeof(struct RawRecord));
+    char index_name[4096];
+    struct stat st;
+    uint32_t block;
+
+    rec->fd = -1;
+    rec->index_fd = -1;
+
+    // O_DIRECT bypasses the page cache; not every file system has it
+    rec->direct = 1;
+    rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (rec->fd < 0 && errno == EINVAL)
+    {
+        printf("raw record: no O_DIRECT on %s, using buffered writes\n", filename);
+        rec->direct = 0;
+        rec->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (rec->fd < 0)
+    {
+        printf("Unable to create %s: %s\n", filename, strerror(errno));
+        goto fail;
+    }
+
+    // whole file system blocks per slot keep every O_DIRECT write aligned
+    block = RAW_RECORD_ALIGN;
+    if (fstat(rec->fd, &st) == 0 && st.st_blksize > block && (st.st_blksize & (st.st_blksize - 1)) == 0)
+        block = st.st_blksize;
+    rec->slot_size = ALIGN_UP(frame_size, block);
+
+    // reserve all blocks up front, no allocation while recording
+    if (fallocate(rec->fd, 0, 0, (off_t) rec->slot_size * max_frames) < 0)
+        printf("raw record: fallocate failed (%s), file grows while recording\n", strerror(errno));
+
+    if (posix_memalign((void **) &rec->staging, RAW_RECORD_ALIGN, rec->slot_size))
+    {
+        rec->staging = NULL;
+        goto fail;
+    }
+
+    snprintf(index_name, sizeof(index_name), "%s.idx", filename);
+    rec->index_fd = open(index_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (rec->index_fd < 0)
+    {
+        printf("Unable to create %s: %s\n", index_name, strerror(errno));
+        goto fail;
+    }
+    rec->index_size = sizeof(struct RawIndexHeader) + (size_t) max_frames * sizeof(struct RawIndexEntry);
+    if (ftruncate(rec->index_fd, rec->index_size) < 0)
+    {
+        printf("Unable to size %s: %s\n", index_name, strerror(errno));
+        goto fail;
+    }
+    rec->index = (RawIndexHeader *) mmap(NULL, rec->index_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, rec->index_fd, 0);
+    if (rec->index == MAP_FAILED)
+    {
+        rec->index = NULL;
+        printf("Unable to map %s: %s\n", index_name, strerror(errno));
+        goto fail;
+    }
+    rec->entries = (RawIndexEntry *) (rec->index + 1);
+
+    rec->index->magic = RAW_INDEX_MAGIC;
+    rec->index->version = RAW_INDEX_VERSION;
+    rec->index->format = format;
+    rec->index->width = width;
+    rec->index->height = height;
+    rec->index->slot_size = rec->slot_size;
+    rec->index->max_frames = max_frames;
+    rec->index->frame_count = 0;
+
+    return rec;
+
+fail:
+    if (rec->index)
+        munmap(rec->index, rec->index_size);
+    if (rec->index_fd >= 0)
+        close(rec->index_fd);
+    if (rec->fd >= 0)
+        close(rec->fd);
+    free(rec->staging);
+    free(rec);
+    return NULL;
+}
+
+/* write a whole slot at offset
+ * returns: 0 on success, 1 - O_DIRECT refused the buffer (alignment), -1 on error
+ */
+static int write_slot(struct RawRecord *rec, const BYTE *buf, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < rec->slot_size)
+    {
+        ssize_t n = pwrite(rec->fd, buf + done, rec->slot_size - done, offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (rec->direct && (errno == EINVAL || errno == EOPNOTSUPP))
+                return (1);
+            printf("raw record: write failed: %s\n", strerror(errno));
+            return (-1);
+        }
+        done += n;
+    }
+    return (0);
+}
+
+/*
+ * writes one frame into the next slot
+ */
+int raw_record_write(struct RawRecord *rec, const BYTE *data, uint32_t size, uint32_t capacity,
+        uint32_t sequence, UINT64 timestamp)
+{
+    uint32_t n = rec->index->frame_count;
+    off_t offset = (off_t) n * rec->slot_size;
+
+    if (n >= rec->index->max_frames)
+        return (-1);
+    if (size > rec->slot_size)
+        size = rec->slot_size;
+
+    // mmap'd driver buffers are page aligned and whole pages: no copy
+    int ret = 1;
+    if (!rec->copy_only && (((uintptr_t) data % RAW_RECORD_ALIGN) == 0) && (capacity >= rec->slot_size))
+    {
+        ret = write_slot(rec, data, offset);
+        if (ret == 0)
+            rec->direct_writes++;
+        else if (ret > 0)
+            rec->copy_only = 1; // the source buffer does not suit the device
+    }
+    if (ret > 0)
+    {
+        memcpy(rec->staging, data, size);
+        memset(rec->staging + size, 0, rec->slot_size - size);
+        ret = write_slot(rec, rec->staging, offset);
+        if (ret > 0)
+        {
+            // not even an aligned buffer: the file system has no usable O_DIRECT
+            printf("raw record: O_DIRECT write refused, using buffered writes\n");
+            fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+            rec->direct = 0;
+            ret = write_slot(rec, rec->staging, offset);
+        }
+        if (ret == 0)
+            rec->staged_writes++;
+    }
+    if (ret < 0)
+        return (-1);
+
+    struct RawIndexEntry *entry = &rec->entries[n];
+    entry->offset = offset;
+    entry->timestamp = timestamp;
+    entry->sequence = sequence;
+    entry->size = size;
+    // publish the entry before the count
+    __atomic_store_n(&rec->index->frame_count, n + 1, __ATOMIC_RELEASE);
+
+    rec->bytes_written += rec->slot_size;
+
+    return (0);
+}
+
+/*
+ * trims unused slots, syncs and closes data and index files
+ */
+int raw_record_close(struct RawRecord *rec)
+{
+    int ret = 0;
+
+    if (rec == NULL)
+        return (-1);
+
+    if (ftruncate(rec->fd, (off_t) rec->index->frame_count * rec->slot_size) < 0)
+        ret = -1;
+    if (fdatasync(rec->fd) < 0)
+        ret = -1;
+    if (msync(rec->index, rec->index_size, MS_SYNC) < 0)
+        ret = -1;
+
+    printf("raw record: %u frames, %llu bytes (%llu direct, %llu staged)\n",
+            rec->index->frame_count, rec->bytes_written, rec->direct_writes, rec->staged_writes);
+
+    munmap(rec->index, rec->index_size);
+    close(rec->index_fd);
+    close(rec->fd);
+    free(rec->staging);
+    free(rec);
+
+    return (ret);
+}
+
+/*
+ * sustained write throughput benchmark
+ */
+int raw_record_bench(const char *filename, uint32_t frame_size, uint32_t frames)
+{
+    struct LatencyStats write_lat;
+    BYTE *frame = NULL;
+
+    struct RawRecord *rec = raw_record_open(filename, V4L2_PIX_FMT_YUYV, 0, 0, frame_size, frames);
+    if (!rec)
+        return (-1);
+    uint32_t slot_size = rec->slot_size;
+
+    // page aligned like a driver buffer, so the zero copy path is measured
+    if (posix_memalign((void **) &frame, RAW_RECORD_ALIGN, slot_size))
+    {
+        raw_record_close(rec);
+        return (-1);
+    }
+    for (uint32_t i = 0; i < slot_size; i++)
+        frame[i] = (BYTE) i;
+
+    latency_init(&write_lat, "write", frames);
+
+    int ret = 0;
+    UINT64 start = ns_time_monotonic();
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        UINT64 t0 = ns_time_monotonic();
+        frame[0] = (BYTE) i;
+        if (raw_record_write(rec, frame, frame_size, slot_size, i, t0) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        latency_add(&write_lat, ns_time_monotonic() - t0);
+    }
+    UINT64 written = ns_time_monotonic();
+    int direct = rec->direct;
+    ULLONG bytes = rec->bytes_written;
+    uint32_t recorded = rec->index->frame_count;
+    if (raw_record_close(rec) < 0)
+        ret = -1;
+    UINT64 end = ns_time_monotonic();
+
+    double elapsed = (end - start) / 1e9;
+    printf("{\n");
+    printf("  \"file\": \"%s\",\n", filename);
+    printf("  \"frame_size\": %u,\n  \"slot_size\": %u,\n", frame_size, slot_size);
+    printf("  \"o_direct\": %s,\n", direct ? "true" : "false");
+    printf("  \"frames\": %u,\n", recorded);
+    printf("  \"bytes\": %llu,\n", bytes);
+    printf("  \"write_s\": %.3f,\n", (written - start) / 1e9);
+    printf("  \"elapsed_s\": %.3f,\n", elapsed);
+    printf("  \"throughput_mb_s\": %.1f,\n", elapsed > 0 ? bytes / elapsed / 1e6 : 0);
+    printf("  \"frames_per_s\": %.1f,\n", elapsed > 0 ? recorded / elapsed : 0);
+    printf("  \"latency\": {\n");
+    latency_json(stdout, &write_lat, "    ");
+    printf("\n  }\n}\n");
+
+    latency_free(&write_lat);
+    free(frame);
+
+    return (ret);
+}
@@ -0,0 +1,109 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RAW_RECORD_H
+#define RAW_RECORD_H
+
+#include "defs.hpp"
+
+/*
+ * Raw frame recording for sustained uncompressed capture
+ *
+ * <file>      pre-allocated data file, frame i at i * slot_size
+ *             (slot_size: frame size rounded up to the file system block
+ *             size, at least RAW_RECORD_ALIGN)
+ *             written with O_DIRECT when the file system allows it
+ * <file>.idx  mmap'd index: RawIndexHeader followed by one RawIndexEntry
+ *             per frame, frame_count is updated after each entry so the
+ *             index can be followed while recording
+ */
+#define RAW_RECORD_ALIGN   4096
+#define RAW_INDEX_MAGIC    0x58494452  // "RDIX"
+#define RAW_INDEX_VERSION  1
+
+struct RawIndexHeader
+{
+    uint32_t magic;          // RAW_INDEX_MAGIC
+    uint32_t version;        // RAW_INDEX_VERSION
+    uint32_t format;         // v4l2 pixel format
+    uint32_t width;
+    uint32_t height;
+    uint32_t slot_size;      // bytes per frame slot in the data file
+    uint32_t max_frames;     // pre-allocated slots
+    uint32_t frame_count;    // recorded frames
+};
+
+struct RawIndexEntry
+{
+    uint64_t offset;         // data file offset of the frame
+    uint64_t timestamp;      // buffer time stamp (ns)
+    uint32_t sequence;       // driver frame sequence
+    uint32_t size;           // frame bytes (without slot padding)
+};
+
+struct RawRecord
+{
+    int fd;                        // data file
+    int direct;                    // O_DIRECT in use
+    int index_fd;                  // index file
+    struct RawIndexHeader *index;  // mmap'd index file
+    struct RawIndexEntry *entries;
+    size_t index_size;             // mapped index bytes
+    uint32_t slot_size;
+    int copy_only;                 // O_DIRECT refused a source buffer, always stage
+    BYTE *staging;                 // aligned bounce buffer (unaligned or short sources)
+    ULLONG bytes_written;
+    ULLONG direct_writes;          // frames written straight from the source buffer
+    ULLONG staged_writes;          // frames copied to the bounce buffer first
+};
+
+/*
+ * creates the data file (pre-allocated for max_frames) and its index
+ * returns: recording handle or NULL on error
+ */
+struct RawRecord *raw_record_open(const char *filename, int format, int width, int height,
+        uint32_t frame_size, uint32_t max_frames);
+
+/*
+ * writes one frame into the next slot
+ * args:
+ * data, size: frame
+ * capacity: readable bytes at data (e.g. driver buffer length rounded up
+ *           to the page, mmap'd buffers are whole pages), frames in page
+ *           aligned buffers with a whole slot readable are written without
+ *           copy
+ *
+ * returns: 0 on success, -1 on error or when all slots are used
+ */
+int raw_record_write(struct RawRecord *rec, const BYTE *data, uint32_t size, uint32_t capacity,
+        uint32_t sequence, UINT64 timestamp);
+
+/*
+ * trims unused slots, syncs and closes data and index files
+ * returns: 0 on success, -1 on error
+ */
+int raw_record_close(struct RawRecord *rec);
+
+/*
+ * sustained write throughput benchmark (e.g. on a tmpfs or loop device):
+ * records the given number of synthetic frames of frame_size bytes as fast
+ * as possible and writes a json summary to stdout
+ *
+ * returns: 0 on success, -1 on error
+ */
+int raw_record_bench(const char *filename, uint32_t frame_size, uint32_t frames);
+
+#endif
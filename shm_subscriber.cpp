@@ -0,0 +1,339 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "shm_subscriber.hpp"
+
+static UINT64 monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* receives the hello message and the memfd */
+static int recv_hello(int sock, struct ShmHello *hello)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = hello;
+    iov.iov_len = sizeof(struct ShmHello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) sizeof(struct ShmHello))
+        return (-1);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return (-1);
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return (fd);
+}
+
+/*
+ * connects to a publisher and maps its ring
+ */
+struct ShmSubscriber *shm_subscribe(const char *socket_path)
+{
+    struct ShmSubscriber *sub = (ShmSubscriber *)calloc(1, sizeof(struct ShmSubscriber));
+    struct sockaddr_un addr;
+    struct ShmHello hello;
+    struct stat st;
+
+    sub->memfd = -1;
+    sub->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sub->sock < 0)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    if (connect(sub->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        printf("shm: unable to connect to %s: %s\n", socket_path, strerror(errno));
+        goto fail;
+    }
+
+    sub->memfd = recv_hello(sub->sock, &hello);
+    if (sub->memfd < 0 || hello.magic != SHM_MAGIC ||
+            hello.reader < 0 || hello.reader >= SHM_MAX_READERS)
+    {
+        printf("shm: %s refused the subscription (no free reader entry)\n", socket_path);
+        goto fail;
+    }
+
+    // the header tells the layout; the memfd is sealed, its size is final
+    if (fstat(sub->memfd, &st) < 0 || (size_t) st.st_size < sizeof(struct ShmHeader))
+        goto fail;
+    sub->header = (ShmHeader *) mmap(NULL, sizeof(struct ShmHeader), PROT_READ,
+            MAP_SHARED, sub->memfd, 0);
+    if (sub->header == MAP_FAILED)
+    {
+        sub->header = NULL;
+        goto fail;
+    }
+    if (sub->header->magic != SHM_MAGIC || sub->header->version != SHM_VERSION ||
+            sub->header->num_slots == 0 || sub->header->control_size % SHM_PAGE_SIZE ||
+            sub->header->total_size != (uint64_t) st.st_size ||
+            (uint64_t) sub->header->control_size +
+            (uint64_t) sub->header->num_slots * sub->header->slot_size > (uint64_t) st.st_size)
+    {
+        printf("shm: %s: incompatible frame ring\n", socket_path);
+        goto fail;
+    }
+    sub->control_size = sub->header->control_size;
+    sub->data_size = st.st_size - sub->control_size;
+    munmap(sub->header, sizeof(struct ShmHeader));
+
+    // cursors and futex words are written by readers, frames are not
+    sub->header = (ShmHeader *) mmap(NULL, sub->control_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, sub->memfd, 0);
+    if (sub->header == MAP_FAILED)
+    {
+        sub->header = NULL;
+        goto fail;
+    }
+    sub->data = (const BYTE *) mmap(NULL, sub->data_size, PROT_READ,
+            MAP_SHARED, sub->memfd, sub->control_size);
+    if (sub->data == MAP_FAILED)
+    {
+        sub->data = NULL;
+        goto fail;
+    }
+    sub->slots = (ShmSlot *) (sub->header + 1);
+    sub->reader = &sub->header->readers[hello.reader];
+
+    return (sub);
+
+fail:
+    shm_unsubscribe(sub);
+    return (NULL);
+}
+
+/* sleeps until the futex word moves away from value or the timeout passes */
+static void wait_frame(struct ShmSubscriber *sub, uint32_t value, int timeout_ms)
+{
+    struct timespec ts, *tp = NULL;
+
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tp = &ts;
+    }
+
+    // the publisher only calls FUTEX_WAKE when someone waits; it bumps the
+    // word before it checks waiters, so a frame published between our check
+    // and the wait makes FUTEX_WAIT return at once
+    __atomic_add_fetch(&sub->header->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &sub->header->futex, FUTEX_WAIT, value, tp, NULL, 0);
+    __atomic_sub_fetch(&sub->header->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * waits for the next frame
+ */
+int shm_next_frame(struct ShmSubscriber *sub, struct ShmFrame *frame, int timeout_ms)
+{
+    struct ShmHeader *header = sub->header;
+    struct ShmReader *reader = sub->reader;
+    uint64_t cursor = reader->cursor;
+    ULLONG dropped = 0;
+    UINT64 deadline = timeout_ms > 0 ? monotonic_ns() + (UINT64) timeout_ms * 1000000ULL : 0;
+
+    frame->data = NULL;
+    for (;;)
+    {
+        uint32_t futex = __atomic_load_n(&header->futex, __ATOMIC_SEQ_CST);
+        uint64_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+
+        if (cursor < published)
+        {
+            if (published - cursor > header->num_slots)
+            {
+                // a ring behind: older frames are gone, catch up with the newest
+                dropped += published - 1 - cursor;
+                cursor = published - 1;
+            }
+
+            struct ShmSlot *slot = &sub->slots[cursor % header->num_slots];
+            uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+            if (lock == 2 * cursor + 2)
+            {
+                frame->size = MIN(slot->size, header->slot_size);
+                frame->sequence = slot->sequence;
+                frame->timestamp = slot->timestamp;
+                frame->publish_ns = slot->publish_ns;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == lock)
+                {
+                    frame->data = sub->data + (size_t)(cursor % header->num_slots) * header->slot_size;
+                    frame->number = cursor;
+                    frame->dropped = dropped;
+                    frame->lock = lock;
+                    reader->received++;
+                    reader->dropped += dropped;
+                    __atomic_store_n(&reader->cursor, cursor + 1, __ATOMIC_RELEASE);
+                    return (0);
+                }
+            }
+            // overwritten while we looked at it
+            dropped++;
+            cursor++;
+            continue;
+        }
+
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            break;
+
+        int wait_ms = timeout_ms;
+        if (timeout_ms > 0)
+        {
+            UINT64 now = monotonic_ns();
+            if (now >= deadline)
+                break;
+            wait_ms = (int)((deadline - now + 999999) / 1000000);
+        }
+        else if (timeout_ms == 0)
+            break;
+        wait_frame(sub, futex, wait_ms);
+    }
+
+    reader->dropped += dropped;
+    __atomic_store_n(&reader->cursor, cursor, __ATOMIC_RELEASE);
+    return (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) &&
+            cursor >= __atomic_load_n(&header->published, __ATOMIC_ACQUIRE) ? -1 : 1);
+}
+
+/*
+ * returns: 1 if the frame slot was not reused since shm_next_frame returned it
+ */
+int shm_frame_valid(struct ShmSubscriber *sub, const struct ShmFrame *frame)
+{
+    struct ShmSlot *slot = &sub->slots[frame->number % sub->header->num_slots];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == frame->lock);
+}
+
+/*
+ * sends a request to the publisher and waits for the reply
+ */
+int shm_request(struct ShmSubscriber *sub, uint32_t op, uint32_t id, int32_t value,
+        struct ShmReply *reply)
+{
+    struct ShmRequest req;
+    struct ShmReply tmp;
+
+    if (reply == NULL)
+        reply = &tmp;
+    memset(reply, 0, sizeof(struct ShmReply));
+
+    req.magic = SHM_MAGIC;
+    req.op = op;
+    req.id = id;
+    req.value = value;
+    req.tag = ++sub->next_tag;
+    if (send(sub->sock, &req, sizeof(req), MSG_NOSIGNAL) != (ssize_t) sizeof(req))
+        return (reply->status = -EPIPE);
+
+    UINT64 deadline = monotonic_ns() + SHM_REQUEST_TIMEOUT_MS * 1000000ULL;
+    for (;;)
+    {
+        struct pollfd pfd;
+        UINT64 now = monotonic_ns();
+        if (now >= deadline)
+            return (reply->status = -ETIMEDOUT);
+
+        pfd.fd = sub->sock;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+        if (ret < 0 && errno != EINTR)
+            return (reply->status = -EPIPE);
+        if (ret <= 0)
+            continue;
+
+        ssize_t n = recv(sub->sock, reply, sizeof(struct ShmReply), 0);
+        if (n <= 0)
+            return (reply->status = -EPIPE);
+        // a reply to an earlier request that timed out is skipped
+        if (n == (ssize_t) sizeof(struct ShmReply) && reply->magic == SHM_MAGIC &&
+                reply->tag == req.tag)
+            return (reply->status);
+    }
+}
+
+int shm_set_ctrl(struct ShmSubscriber *sub, uint32_t id, int32_t value, int32_t *result)
+{
+    struct ShmReply reply;
+    int ret = shm_request(sub, SHM_OP_SET_CTRL, id, value, &reply);
+
+    if (ret == 0 && result)
+        *result = reply.value;
+    return (ret);
+}
+
+int shm_get_ctrl(struct ShmSubscriber *sub, uint32_t id, int32_t *value)
+{
+    struct ShmReply reply;
+    int ret = shm_request(sub, SHM_OP_GET_CTRL, id, 0, &reply);
+
+    if (ret == 0)
+        *value = reply.value;
+    return (ret);
+}
+
+void shm_unsubscribe(struct ShmSubscriber *sub)
+{
+    if (sub == NULL)
+        return;
+
+    if (sub->data)
+        munmap((void *) sub->data, sub->data_size);
+    if (sub->header)
+        munmap(sub->header, sub->control_size ? sub->control_size : sizeof(struct ShmHeader));
+    if (sub->memfd >= 0)
+        close(sub->memfd);
+    if (sub->sock >= 0)
+        close(sub->sock); // the publisher frees our reader entry on hang up
+    free(sub);
+}
@@ -0,0 +1,111 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHM_SUBSCRIBER_H
+#define SHM_SUBSCRIBER_H
+
+#include "defs.hpp"
+#include "frame_shm.hpp"
+
+/*
+ * Subscriber side of the shared memory frame ring (frame_shm.hpp),
+ * depends only on the ring layout so analytics processes can take these
+ * two files and nothing else.
+ *
+ *   struct ShmSubscriber *sub = shm_subscribe("/tmp/dscam.sock");
+ *   struct ShmFrame frame;
+ *   while (shm_next_frame(sub, &frame, 1000) >= 0)
+ *       if (frame.data && analyse(frame.data, frame.size) && shm_frame_valid(sub, &frame))
+ *           ... result belongs to frame.sequence
+ *   shm_unsubscribe(sub);
+ *
+ * frame.data points into the publisher's ring: the publisher does not wait
+ * for readers, so a slow reader can see its frame overwritten while it is
+ * using it; shm_frame_valid() tells, after the fact, whether that happened.
+ *
+ * publishers that own the camera (the broker, camera_broker.hpp) also take
+ * control requests, e.g. shm_set_ctrl(sub, V4L2_CID_GAIN, 80, NULL).
+ */
+#define SHM_REQUEST_TIMEOUT_MS 5000
+struct ShmFrame
+{
+    const BYTE *data;        // frame in the shared ring (read only)
+    uint32_t size;
+    uint32_t sequence;       // driver frame sequence
+    UINT64 timestamp;        // buffer time stamp (ns)
+    UINT64 publish_ns;       // CLOCK_MONOTONIC when it was published
+    ULLONG number;           // frame number in the ring
+    ULLONG dropped;          // frames skipped right before this one
+    uint64_t lock;           // slot lock the frame was read under
+};
+
+struct ShmSubscriber
+{
+    int sock;                        // connection to the publisher (closing it unsubscribes)
+    int memfd;
+    struct ShmHeader *header;        // control area (read/write)
+    struct ShmSlot *slots;
+    struct ShmReader *reader;        // our cursor
+    const BYTE *data;                // frame slots (read only)
+    size_t control_size;
+    size_t data_size;
+    uint32_t next_tag;               // request tags
+};
+
+/*
+ * connects to a publisher and maps its ring
+ * returns: subscriber or NULL on error
+ */
+struct ShmSubscriber *shm_subscribe(const char *socket_path);
+
+/*
+ * waits for the next frame; a reader more than a ring behind skips to the
+ * newest frame (the skipped frames are counted in frame->dropped)
+ * args:
+ * timeout_ms: -1 - wait until a frame comes or the publisher closes
+ *
+ * returns: 0 - frame, 1 - timeout (frame->data NULL), -1 - publisher closed
+ */
+int shm_next_frame(struct ShmSubscriber *sub, struct ShmFrame *frame, int timeout_ms);
+
+/*
+ * returns: 1 if the frame slot was not reused since shm_next_frame returned it
+ */
+int shm_frame_valid(struct ShmSubscriber *sub, const struct ShmFrame *frame);
+
+/*
+ * sends a request to the publisher and waits for the reply
+ * (up to SHM_REQUEST_TIMEOUT_MS)
+ *
+ * returns: reply->status (0 or -errno), -ETIMEDOUT or -EPIPE if no reply came
+ */
+int shm_request(struct ShmSubscriber *sub, uint32_t op, uint32_t id, int32_t value,
+        struct ShmReply *reply);
+
+/*
+ * sets control id, value: value read back after the change (may be NULL)
+ * returns: 0 on success, -errno on error
+ */
+int shm_set_ctrl(struct ShmSubscriber *sub, uint32_t id, int32_t value, int32_t *result);
+
+/*
+ * returns: 0 and the control value in value, -errno on error
+ */
+int shm_get_ctrl(struct ShmSubscriber *sub, uint32_t id, int32_t *value);
+
+void shm_unsubscribe(struct ShmSubscriber *sub);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "stream_record.hpp"
+
+#define DSR_INDEX_CHUNK 1024
+
+/* write the whole buffer at offset (retry on short writes) */
+static int pwrite_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    const BYTE *p = (const BYTE *) buf;
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return (0);
+}
+
+/*
+ * creates a recording file
+ */
+struct StreamRecord *stream_record_open(const char *filename, int format,
+        int width, int height, int fps, int fps_num)
+{
+    struct StreamRecord *rec = NULL;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Unable to create %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    rec = (StreamRecord *)calloc(1, sizeof(struct StreamRecord));
+    rec->fd = fd;
+    rec->header.magic = DSR_MAGIC;
+    rec->header.version = DSR_VERSION;
+    rec->header.format = format;
+    rec->header.width = width;
+    rec->header.height = height;
+    rec->header.fps = fps;
+    rec->header.fps_num = fps_num;
+
+    if (pwrite_all(fd, &rec->header, sizeof(struct DsrHeader), 0) < 0)
+    {
+        printf("Unable to write %s header: %s\n", filename, strerror(errno));
+        close(fd);
+        free(rec);
+        return NULL;
+    }
+    rec->offset = sizeof(struct DsrHeader);
+
+    return rec;
+}
+
+/*
+ * appends one payload record (single writev, payload is not copied)
+ */
+int stream_record_write(struct StreamRecord *rec, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp, uint32_t flags)
+{
+    struct DsrRecord record;
+    struct iovec iov[2];
+    size_t total = sizeof(struct DsrRecord) + size;
+
+    record.magic = DSR_RECORD_MAGIC;
+    record.size = size;
+    record.sequence = sequence;
+    record.flags = flags;
+    record.timestamp = timestamp;
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(struct DsrRecord);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = size;
+
+    ssize_t n = pwritev(rec->fd, iov, 2, rec->offset);
+    if (n < 0 && errno == EINTR)
+        n = 0;
+    if (n < 0)
+    {
+        printf("stream record: write failed: %s\n", strerror(errno));
+        return (-1);
+    }
+    if ((size_t) n < total)
+    {
+        // finish a short write from where it stopped
+        size_t done = n;
+        if (done < sizeof(struct DsrRecord))
+        {
+            if (pwrite_all(rec->fd, (BYTE *) &record + done,
+                        sizeof(struct DsrRecord) - done, rec->offset + done) < 0)
+                return (-1);
+            done = sizeof(struct DsrRecord);
+        }
+        if (pwrite_all(rec->fd, data + (done - sizeof(struct DsrRecord)),
+                    total - done, rec->offset + done) < 0)
+            return (-1);
+    }
+
+    if (rec->header.frame_count >= rec->index_size)
+    {
+        // the record stays unindexed, the next one overwrites it
+        struct DsrIndex *index = (DsrIndex *)realloc(rec->index,
+                (rec->index_size + DSR_INDEX_CHUNK) * sizeof(struct DsrIndex));
+        if (!index)
+            return (-1);
+        rec->index = index;
+        rec->index_size += DSR_INDEX_CHUNK;
+    }
+    struct DsrIndex *entry = &rec->index[rec->header.frame_count];
+    entry->offset = rec->offset;
+    entry->timestamp = timestamp;
+    entry->sequence = sequence;
+    entry->size = size;
+    rec->header.frame_count++;
+
+    rec->offset += total;
+    rec->bytes_written += total;
+
+    return (0);
+}
+
+/*
+ * writes the index, patches the header and closes the file
+ */
+int stream_record_close(struct StreamRecord *rec)
+{
+    int ret = 0;
+
+    if (rec == NULL)
+        return (-1);
+
+    rec->header.index_offset = rec->offset;
+    if ((pwrite_all(rec->fd, rec->index, rec->header.frame_count * sizeof(struct DsrIndex),
+                    rec->offset) < 0) ||
+            (pwrite_all(rec->fd, &rec->header, sizeof(struct DsrHeader), 0) < 0))
+    {
+        printf("stream record: failed to write index: %s\n", strerror(errno));
+        ret = -1;
+    }
+
+    printf("stream record: %u frames, %llu bytes\n", rec->header.frame_count,
+            (ULLONG) rec->bytes_written);
+
+    close(rec->fd);
+    free(rec->index);
+    free(rec);
+
+    return (ret);
+}
+
+/* read the whole buffer at offset (short reads only at end of file) */
+static int pread_all(int fd, void *buf, size_t size, off_t offset)
+{
+    BYTE *p = (BYTE *) buf;
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        if (n == 0)
+            return (-1);
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return (0);
+}
+
+/* rebuild the index of a recording that was not closed */
+static int scan_records(struct StreamReader *rd)
+{
+    struct stat st;
+    uint64_t offset = sizeof(struct DsrHeader);
+    uint32_t index_size = 0;
+    struct DsrRecord record;
+
+    if (fstat(rd->fd, &st) < 0)
+        return (-1);
+
+    rd->header.frame_count = 0;
+    while (offset + sizeof(struct DsrRecord) <= (uint64_t) st.st_size)
+    {
+        if (pread_all(rd->fd, &record, sizeof(struct DsrRecord), offset) < 0 ||
+                record.magic != DSR_RECORD_MAGIC ||
+                offset + sizeof(struct DsrRecord) + record.size > (uint64_t) st.st_size)
+            break; // torn record at the end
+
+        if (rd->header.frame_count >= index_size)
+        {
+            struct DsrIndex *index = (DsrIndex *)realloc(rd->index,
+                    (index_size + DSR_INDEX_CHUNK) * sizeof(struct DsrIndex));
+            if (!index)
+                return (-1);
+            rd->index = index;
+            index_size += DSR_INDEX_CHUNK;
+        }
+        struct DsrIndex *entry = &rd->index[rd->header.frame_count++];
+        entry->offset = offset;
+        entry->timestamp = record.timestamp;
+        entry->sequence = record.sequence;
+        entry->size = record.size;
+
+        offset += sizeof(struct DsrRecord) + record.size;
+    }
+    printf("stream reader: no index, %u frames recovered\n", rd->header.frame_count);
+
+    return (0);
+}
+
+/*
+ * opens a recording and loads its index
+ */
+struct StreamReader *stream_reader_open(const char *filename)
+{
+    struct StreamReader *rd = (StreamReader *)calloc(1, sizeof(struct StreamReader));
+
+    rd->fd = open(filename, O_RDONLY);
+    if (rd->fd < 0)
+    {
+        printf("Unable to open %s: %s\n", filename, strerror(errno));
+        free(rd);
+        return NULL;
+    }
+    if (pread_all(rd->fd, &rd->header, sizeof(struct DsrHeader), 0) < 0 ||
+            rd->header.magic != DSR_MAGIC || rd->header.version != DSR_VERSION)
+    {
+        printf("%s is not a recording\n", filename);
+        goto fail;
+    }
+
+    if (rd->header.index_offset && rd->header.frame_count)
+    {
+        size_t size = rd->header.frame_count * sizeof(struct DsrIndex);
+        rd->index = (DsrIndex *)malloc(size);
+        if (pread_all(rd->fd, rd->index, size, rd->header.index_offset) < 0)
+        {
+            printf("Unable to read %s index\n", filename);
+            goto fail;
+        }
+    }
+    else if (scan_records(rd) < 0)
+        goto fail;
+
+    if (rd->header.frame_count == 0)
+    {
+        printf("%s has no frames\n", filename);
+        goto fail;
+    }
+
+    for (uint32_t i = 0; i < rd->header.frame_count; i++)
+        rd->max_size = MAX(rd->max_size, rd->index[i].size);
+    // LZ4 frames are at most as big as the uncompressed format allows
+    struct DsrRecord record;
+    if (pread_all(rd->fd, &record, sizeof(struct DsrRecord), rd->index[0].offset) == 0 &&
+            (record.flags & DSR_FLAG_LZ4))
+    {
+#ifdef HAVE_LZ4
+        rd->scratch = (BYTE *)malloc(rd->max_size);
+        rd->max_size = MAX(rd->max_size, rd->header.width * rd->header.height * 3);
+#else
+        printf("%s holds LZ4 frames, rebuild with liblz4 to read it\n", filename);
+        goto fail;
+#endif
+    }
+
+    return rd;
+
+fail:
+    close(rd->fd);
+    free(rd->index);
+    free(rd);
+    return NULL;
+}
+
+/*
+ * reads frame i into dst
+ */
+int stream_reader_read(struct StreamReader *rd, uint32_t i, BYTE *dst, uint32_t capacity,
+        struct DsrRecord *record)
+{
+    struct DsrRecord header;
+    struct iovec iov[2];
+
+    if (i >= rd->header.frame_count)
+        return (-1);
+    if (!record)
+        record = &header;
+
+    struct DsrIndex *entry = &rd->index[i];
+    BYTE *payload = rd->scratch ? rd->scratch : dst;
+    if (!rd->scratch && entry->size > capacity)
+        return (-1);
+
+    iov[0].iov_base = record;
+    iov[0].iov_len = sizeof(struct DsrRecord);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = entry->size;
+    ssize_t n = preadv(rd->fd, iov, 2, entry->offset);
+    if (n != (ssize_t) (sizeof(struct DsrRecord) + entry->size) ||
+            record->magic != DSR_RECORD_MAGIC)
+    {
+        printf("stream reader: frame %u unreadable\n", i);
+        return (-1);
+    }
+
+#ifdef HAVE_LZ4
+    if (record->flags & DSR_FLAG_LZ4)
+        return LZ4_decompress_safe((const char *) payload, (char *) dst, entry->size, capacity);
+#endif
+    if (payload != dst)
+    {
+        // stored uncompressed in an LZ4 recording
+        if (entry->size > capacity)
+            return (-1);
+        memcpy(dst, payload, entry->size);
+    }
+
+    return entry->size;
+}
+
+void stream_reader_close(struct StreamReader *rd)
+{
+    if (rd == NULL)
+        return;
+
+    close(rd->fd);
+    free(rd->index);
+    free(rd->scratch);
+    free(rd);
+}
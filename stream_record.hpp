@@ -0,0 +1,131 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STREAM_RECORD_H
+#define STREAM_RECORD_H
+
+#include "defs.hpp"
+
+/*
+ * Passthrough recording container (.dsr)
+ *
+ * file header | record header + payload | ... | index | (eof)
+ *
+ * payloads are written as delivered by the driver (bytesused bytes, no
+ * decoding), each behind a record header so a file left without index
+ * (crash, power loss) can still be scanned record by record
+ */
+#define DSR_MAGIC         0x31525344  // "DSR1"
+#define DSR_RECORD_MAGIC  0x4d524644  // "DFRM"
+#define DSR_VERSION       1
+
+// record flags
+#define DSR_FLAG_LZ4      0x00000001  // payload is the frame as one LZ4 block
+
+struct DsrHeader
+{
+    uint32_t magic;          // DSR_MAGIC
+    uint32_t version;        // DSR_VERSION
+    uint32_t format;         // v4l2 pixel format of the payloads
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;            // fps denominator
+    uint32_t fps_num;        // fps numerator
+    uint32_t frame_count;    // index entries (0 if not closed)
+    uint64_t index_offset;   // file offset of the index (0 if not closed)
+};
+
+struct DsrRecord
+{
+    uint32_t magic;          // DSR_RECORD_MAGIC
+    uint32_t size;           // payload bytes following the record header
+    uint32_t sequence;       // driver frame sequence
+    uint32_t flags;          // DSR_FLAG_*
+    uint64_t timestamp;      // buffer time stamp (ns)
+};
+
+struct DsrIndex
+{
+    uint64_t offset;         // file offset of the record header
+    uint64_t timestamp;
+    uint32_t sequence;
+    uint32_t size;
+};
+
+struct StreamRecord
+{
+    int fd;                   // output file descriptor
+    struct DsrHeader header;
+    uint64_t offset;          // current end of data
+    struct DsrIndex *index;   // in memory index (written on close)
+    uint32_t index_size;      // allocated index entries
+    uint64_t bytes_written;
+};
+
+/* sequential or random access to a recording (see vcam file replay) */
+struct StreamReader
+{
+    int fd;
+    struct DsrHeader header;
+    struct DsrIndex *index;   // one entry per frame (header.frame_count)
+    uint32_t max_size;        // largest payload (raw size for LZ4 payloads)
+    BYTE *scratch;            // compressed payload buffer
+};
+
+/*
+ * creates a recording file
+ * returns: recording handle or NULL on error
+ */
+struct StreamRecord *stream_record_open(const char *filename, int format,
+        int width, int height, int fps, int fps_num);
+
+/*
+ * appends one payload record (single writev, payload is not copied)
+ * args:
+ * flags: DSR_FLAG_* describing the payload (0 - as delivered by the driver)
+ *
+ * returns: 0 on success, -1 on write error
+ */
+int stream_record_write(struct StreamRecord *rec, const BYTE *data, uint32_t size,
+        uint32_t sequence, UINT64 timestamp, uint32_t flags);
+
+/*
+ * writes the index, patches the header and closes the file
+ * returns: 0 on success, -1 on write error
+ */
+int stream_record_close(struct StreamRecord *rec);
+
+/*
+ * opens a recording and loads its index
+ * (files without index are scanned record by record)
+ * returns: reader or NULL on error
+ */
+struct StreamReader *stream_reader_open(const char *filename);
+
+/*
+ * reads frame i into dst, LZ4 payloads are decompressed
+ * args:
+ * capacity: dst size (at least max_size)
+ * record: filled with the record header (optional)
+ *
+ * returns: frame bytes, -1 on error
+ */
+int stream_reader_read(struct StreamReader *rd, uint32_t i, BYTE *dst, uint32_t capacity,
+        struct DsrRecord *record);
+
+void stream_reader_close(struct StreamReader *rd);
+
+#endif
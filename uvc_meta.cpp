@@ -0,0 +1,355 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/videodev2.h>
+#include <linux/usb/video.h>
+#include <linux/uvcvideo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "uvc_meta.hpp"
+#include "ms_time.hpp"
+#include "v4l2_uvc.hpp"
+#include "v4l2_vcam.hpp"
+
+// driver part of a block (host time and USB frame number)
+#define BLOCK_HEADER (sizeof(UINT64) + sizeof(uint16_t))
+
+/* ioctl on the metadata node, DQBUF is non-blocking: no retries on EAGAIN */
+static int meta_ioctl(int fd, unsigned int request, void *arg)
+{
+    int ret;
+    do
+    {
+        if (vcam_is_open(fd))
+            ret = vcam_ioctl(fd, request, arg);
+        else
+            ret = ioctl(fd, request, arg);
+    }
+    while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/* payload header fields are little endian and unaligned */
+static uint32_t get_le32(const BYTE *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t get_le16(const BYTE *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/* the metadata node of a device: "/dev/videoN" is followed by "/dev/video(N+1)" */
+static int open_companion(struct vdIn *vd, char *path, size_t size)
+{
+    const char *dev = vd->videodevice;
+    size_t len = strlen(dev);
+    while (len > 0 && dev[len - 1] >= '0' && dev[len - 1] <= '9')
+        len--;
+    if (dev[len] == '\0')
+        return (-1);
+
+    snprintf(path, size, "%.*s%i", (int) len, dev, atoi(dev + len) + 1);
+    int fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+        return (-1);
+
+    // a node of some other device or a second capture node
+    struct v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (meta_ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0 ||
+            strcmp((char *) cap.bus_info, (char *) vd->cap.bus_info) != 0)
+    {
+        close(fd);
+        return (-1);
+    }
+    return fd;
+}
+
+/* a device clock sample: STC extended past its 32 bit wrap, rate over the window */
+static void clock_sample(struct UvcMeta *meta, uint32_t stc, UINT64 ns)
+{
+    if (meta->clock_samples++ == 0)
+    {
+        meta->stc = stc;
+        meta->window.anchor = stc;
+        meta->window.anchor_ns = ns;
+    }
+    else
+        meta->stc += (uint32_t) (stc - meta->last_stc);
+    meta->last_stc = stc;
+    meta->stc_ns = ns;
+
+    double ns_per_tick = hrc_window_fit(&meta->window, meta->stc, ns,
+            UVC_META_CLOCK_MS * 1000000ULL, UVC_META_WINDOW_MS * 1000000ULL);
+    if (ns_per_tick > 0)
+        meta->hz = G_NSEC_PER_SEC / ns_per_tick;
+}
+
+/*
+ * one metadata buffer: blocks of host time, SOF and a payload header, one
+ * for every header carrying a PTS or a new SCR. The PTS is the same in all
+ * headers of a frame, the last SCR is the most recent clock sample.
+ */
+static void parse_buffer(struct UvcMeta *meta, const BYTE *data, uint32_t used,
+        uint32_t sequence)
+{
+    struct UvcFrameMeta *frame = &meta->history[meta->next];
+    meta->next = (meta->next + 1) % UVC_META_HISTORY;
+    memset(frame, 0, sizeof(*frame));
+    frame->sequence = sequence;
+
+    uint32_t off = 0;
+    while (off + sizeof(struct uvc_meta_buf) <= used)
+    {
+        const struct uvc_meta_buf *block = (const struct uvc_meta_buf *) (data + off);
+        uint8_t length = block->length;
+        if (length < 2 || off + BLOCK_HEADER + length > used)
+            break; // truncated
+        UINT64 ns;
+        memcpy(&ns, data + off, sizeof(ns));
+
+        if (!frame->valid)
+        {
+            frame->valid = 1;
+            frame->host_ns = ns;
+            frame->host_sof = get_le16(data + off + sizeof(UINT64));
+        }
+        const BYTE *p = block->buf;
+        int need = 2 + (block->flags & UVC_STREAM_PTS ? 4 : 0) + (block->flags & UVC_STREAM_SCR ? 6 : 0);
+        if (length >= need)
+        {
+            if (block->flags & UVC_STREAM_PTS)
+            {
+                frame->has_pts = 1;
+                frame->pts = get_le32(p);
+                p += 4;
+            }
+            if (block->flags & UVC_STREAM_SCR)
+            {
+                frame->has_scr = 1;
+                frame->scr_stc = get_le32(p);
+                frame->scr_sof = get_le16(p + 4) & 0x7ff;
+                clock_sample(meta, frame->scr_stc, ns);
+            }
+        }
+        // vendor data after the standard fields is not decoded
+        off += BLOCK_HEADER + length;
+    }
+
+    if (frame->has_pts && meta->hz > 0)
+    {
+        // the PTS precedes the last clock sample by (stc - pts) ticks
+        int32_t ticks = (int32_t) (meta->last_stc - frame->pts);
+        frame->sensor_ns = meta->stc_ns - (INT64) (ticks * (double) G_NSEC_PER_SEC / meta->hz);
+    }
+    meta->buffers++;
+}
+
+/* parse and requeue every completed metadata buffer */
+static void drain(struct UvcMeta *meta)
+{
+    struct v4l2_buffer buf;
+
+    for (;;)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (meta_ioctl(meta->fd, VIDIOC_DQBUF, &buf) < 0)
+        {
+            if (errno != EAGAIN)
+                printf("uvc meta: VIDIOC_DQBUF failed: %s\n", strerror(errno));
+            return;
+        }
+        if (buf.index < (uint32_t) meta->num_buffers && !(buf.flags & V4L2_BUF_FLAG_ERROR))
+            parse_buffer(meta, (const BYTE *) meta->mem[buf.index],
+                    MIN(buf.bytesused, meta->length[buf.index]), buf.sequence);
+        if (meta_ioctl(meta->fd, VIDIOC_QBUF, &buf) < 0)
+            printf("uvc meta: VIDIOC_QBUF failed: %s\n", strerror(errno));
+    }
+}
+
+struct UvcMeta *uvc_meta_open(struct vdIn *vd, const char *node)
+{
+    char path[64];
+    struct UvcMeta *meta = (UvcMeta *)calloc(1, sizeof(struct UvcMeta));
+    meta->fd = -1;
+
+    if (strcmp(node, "auto") != 0)
+    {
+        snprintf(path, sizeof(path), "%s", node);
+        meta->fd = open(path, O_RDWR | O_NONBLOCK);
+    }
+    else if (vcam_is_open(vd->fd))
+    {
+        snprintf(path, sizeof(path), "%s metadata", vd->videodevice);
+        meta->fd = vcam_open_meta(vd->fd);
+    }
+    else
+        meta->fd = open_companion(vd, path, sizeof(path));
+    if (meta->fd < 0)
+    {
+        printf("uvc meta: no metadata node for %s\n", vd->videodevice);
+        free(meta);
+        return (NULL);
+    }
+    meta->device = strdup(path);
+
+    struct v4l2_capability cap;
+    memset(&cap, 0, sizeof(cap));
+    if (meta_ioctl(meta->fd, VIDIOC_QUERYCAP, &cap) < 0 ||
+            !(cap.device_caps & V4L2_CAP_META_CAPTURE) || !(cap.device_caps & V4L2_CAP_STREAMING))
+    {
+        printf("uvc meta: %s is not a metadata capture node\n", meta->device);
+        uvc_meta_close(meta);
+        return (NULL);
+    }
+
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+    fmt.fmt.meta.dataformat = V4L2_META_FMT_UVC;
+    if (meta_ioctl(meta->fd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.meta.dataformat != V4L2_META_FMT_UVC)
+    {
+        printf("uvc meta: %s does not offer UVC payload headers\n", meta->device);
+        uvc_meta_close(meta);
+        return (NULL);
+    }
+
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.count = UVC_META_BUFFERS;
+    rb.type = V4L2_BUF_TYPE_META_CAPTURE;
+    rb.memory = V4L2_MEMORY_MMAP;
+    if (meta_ioctl(meta->fd, VIDIOC_REQBUFS, &rb) < 0 || rb.count == 0)
+    {
+        printf("uvc meta: VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+        uvc_meta_close(meta);
+        return (NULL);
+    }
+
+    for (uint32_t i = 0; i < MIN(rb.count, (uint32_t) UVC_META_BUFFERS); i++)
+    {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.index = i;
+        buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (meta_ioctl(meta->fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            printf("uvc meta: VIDIOC_QUERYBUF failed: %s\n", strerror(errno));
+            uvc_meta_close(meta);
+            return (NULL);
+        }
+        if (vcam_is_open(meta->fd))
+            meta->mem[i] = vcam_mmap(meta->fd, buf.length, buf.m.offset);
+        else
+            meta->mem[i] = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, meta->fd, buf.m.offset);
+        if (meta->mem[i] == MAP_FAILED)
+        {
+            meta->mem[i] = NULL;
+            printf("uvc meta: unable to map buffer %u\n", i);
+            uvc_meta_close(meta);
+            return (NULL);
+        }
+        meta->length[i] = buf.length;
+        meta->num_buffers++;
+        if (meta_ioctl(meta->fd, VIDIOC_QBUF, &buf) < 0)
+        {
+            printf("uvc meta: VIDIOC_QBUF failed: %s\n", strerror(errno));
+            uvc_meta_close(meta);
+            return (NULL);
+        }
+    }
+
+    int type = V4L2_BUF_TYPE_META_CAPTURE;
+    if (meta_ioctl(meta->fd, VIDIOC_STREAMON, &type) < 0)
+    {
+        printf("uvc meta: VIDIOC_STREAMON failed: %s\n", strerror(errno));
+        uvc_meta_close(meta);
+        return (NULL);
+    }
+    meta->streaming = 1;
+
+    printf("uvc meta: %s, %i buffers of %u bytes\n", meta->device, meta->num_buffers,
+            meta->length[0]);
+    return meta;
+}
+
+int uvc_meta_match(struct UvcMeta *meta, uint32_t sequence, struct UvcFrameMeta *frame)
+{
+    drain(meta);
+
+    for (int i = 0; i < UVC_META_HISTORY; i++)
+    {
+        struct UvcFrameMeta *entry = &meta->history[i];
+        if (entry->valid && entry->sequence == sequence)
+        {
+            *frame = *entry;
+            meta->matched++;
+            return (0);
+        }
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->sequence = sequence;
+    meta->missed++;
+    return (-1);
+}
+
+void uvc_meta_close(struct UvcMeta *meta)
+{
+    if (meta == NULL)
+        return;
+
+    if (meta->streaming)
+    {
+        int type = V4L2_BUF_TYPE_META_CAPTURE;
+        meta_ioctl(meta->fd, VIDIOC_STREAMOFF, &type);
+        printf("uvc meta: %llu buffers, %llu frames matched, %llu without metadata, "
+                "device clock %.6f MHz\n", meta->buffers, meta->matched, meta->missed,
+                meta->hz / 1e6);
+    }
+
+    int vcam = vcam_is_open(meta->fd);
+    for (int i = 0; i < meta->num_buffers; i++)
+        if (meta->mem[i] && !vcam)
+            munmap(meta->mem[i], meta->length[i]);
+    if (meta->num_buffers)
+    {
+        struct v4l2_requestbuffers rb;
+        memset(&rb, 0, sizeof(rb));
+        rb.type = V4L2_BUF_TYPE_META_CAPTURE;
+        rb.memory = V4L2_MEMORY_MMAP;
+        meta_ioctl(meta->fd, VIDIOC_REQBUFS, &rb);
+    }
+
+    if (vcam)
+        vcam_close(meta->fd);
+    else if (meta->fd >= 0)
+        close(meta->fd);
+    free(meta->device);
+    free(meta);
+}
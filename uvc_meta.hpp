@@ -0,0 +1,108 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UVC_META_H
+#define UVC_META_H
+
+#include "defs.hpp"
+#include "hr_clock.hpp"
+
+/*
+ * UVC metadata node
+ *
+ * the uvcvideo driver exposes the payload headers of a stream on a second
+ * node (V4L2_META_FMT_UVC): per frame the host time and USB frame number
+ * of the packets carrying a PTS/SCR, and the headers themselves. The PTS
+ * is the device clock (STC) when the sensor started the frame, the SCR a
+ * (STC, USB SOF) sample taken while sending it. Both arrive with the
+ * frame, no extra control transfers are needed.
+ *
+ * the node streams on its own small mmap ring, buffers carry the sequence
+ * of their video frame (the driver completes them first), so a frame is
+ * matched by sequence right after its VIDIOC_DQBUF. The device clock rate
+ * is measured from the SCR samples against the host time; once known the
+ * PTS of every frame is converted to host monotonic time.
+ */
+#define UVC_META_BUFFERS     4
+#define UVC_META_HISTORY     16     // parsed frames kept for matching
+#define UVC_META_CLOCK_MS    500    // SCR span before the device clock rate is used
+#define UVC_META_WINDOW_MS   10000  // the rate is measured over at most this span
+
+struct vdIn;
+
+/* timing of one frame from its payload headers */
+struct UvcFrameMeta
+{
+    int valid;                 // matched to the frame
+    uint32_t sequence;         // video frame sequence
+    UINT64 host_ns;            // host time of the first header of the frame (monotonic)
+    uint16_t host_sof;         // USB frame number at that time
+    int has_pts;
+    uint32_t pts;              // device clock at the start of the frame
+    int has_scr;
+    uint32_t scr_stc;          // device clock of the last clock sample
+    uint16_t scr_sof;          // USB frame number of the last clock sample
+    UINT64 sensor_ns;          // host time of pts (0 - device clock not measured yet)
+};
+
+struct UvcMeta
+{
+    int fd;                                  // metadata node
+    char *device;
+    int num_buffers;
+    void *mem[UVC_META_BUFFERS];
+    uint32_t length[UVC_META_BUFFERS];
+    int streaming;
+
+    struct UvcFrameMeta history[UVC_META_HISTORY];   // ring of parsed frames
+    int next;                                        // next history slot
+
+    // device clock: STC extended to 64 bits against host time
+    int clock_samples;
+    uint32_t last_stc;
+    UINT64 stc;                 // extended STC of the last sample
+    UINT64 stc_ns;              // host time of the last sample
+    struct RateWindow window;   // extended STC against host time
+    double hz;                  // device clock rate (0 - not measured yet)
+
+    ULLONG buffers;             // metadata buffers parsed
+    ULLONG matched;             // frames given their metadata
+    ULLONG missed;              // frames without metadata
+};
+
+/*
+ * opens and starts streaming the metadata node of a capture device
+ * args:
+ * vd: open capture device
+ * node: metadata device or "auto" (the next node of the same device)
+ *
+ * returns: metadata stream or NULL on error (the capture works without)
+ */
+struct UvcMeta *uvc_meta_open(struct vdIn *vd, const char *node);
+
+/*
+ * drains the metadata buffers completed so far and looks up a frame
+ * args:
+ * sequence: video frame sequence
+ * frame: filled in (frame->valid 0 - no metadata for it)
+ *
+ * returns: 0 if found, -1 if not
+ */
+int uvc_meta_match(struct UvcMeta *meta, uint32_t sequence, struct UvcFrameMeta *frame);
+
+void uvc_meta_close(struct UvcMeta *meta);
+
+#endif
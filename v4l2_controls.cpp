@@ -25,6 +25,11 @@
 
 #include "v4l2_uvc.hpp"
 #include "v4l2_controls.hpp"
+#include "v4l2_vcam.hpp"
+#include "mem_arena.hpp"
+
+// menu index range reserved up front, wider (sparse) menus are counted first
+#define MAX_MENU_ENTRIES 256
 
 #ifndef V4L2_CTRL_ID2CLASS
 #define V4L2_CTRL_ID2CLASS(id)    ((id) & 0x0fff0000UL)
@@ -41,7 +46,10 @@ static int query_ioctl(int hdevice, int current_ctrl, struct v4l2_queryctrl *ctr
     {
         if(ret)
             ctrl->id = current_ctrl | V4L2_CTRL_FLAG_NEXT_CTRL;
-        ret = ioctl(hdevice, VIDIOC_QUERYCTRL, ctrl);
+        if (vcam_is_open(hdevice))
+            ret = vcam_ioctl(hdevice, VIDIOC_QUERYCTRL, ctrl);
+        else
+            ret = ioctl(hdevice, VIDIOC_QUERYCTRL, ctrl);
     }
     while (ret && tries-- &&
             ((errno == EIO || errno == EPIPE || errno == ETIMEDOUT)));
@@ -104,7 +112,7 @@ void print_control(Control *control, int i)
     }
 }
 
-static Control *add_control(int hdevice, struct v4l2_queryctrl *queryctrl, Control **current, Control **first)
+static Control *add_control(int hdevice, struct v4l2_queryctrl *queryctrl, ControlTable *table)
 {
     Control *control = NULL;
     struct v4l2_querymenu *menu = NULL; //menu list
@@ -122,56 +130,122 @@ static Control *add_control(int hdevice, struct v4l2_queryctrl *queryctrl, Contr
         int i = 0;
         int ret = 0;
         struct v4l2_querymenu querymenu={0};
+        // room for every index and the terminator (arena, zeroed)
+        INT64 entries = (INT64) queryctrl->maximum - queryctrl->minimum + 1;
+        if (entries > MAX_MENU_ENTRIES)
+        {
+            // wide range: only the indexes the driver names take room
+            entries = 0;
+            querymenu.id = queryctrl->id;
+            for (INT64 index = queryctrl->minimum; index <= queryctrl->maximum; index++)
+            {
+                querymenu.index = (__u32) index;
+                if (xioctl(hdevice, VIDIOC_QUERYMENU, &querymenu) == 0)
+                    entries++;
+            }
+        }
+        menu = (struct v4l2_querymenu *)arena_alloc(table->arena,
+                sizeof(struct v4l2_querymenu) * (MAX(entries, 0) + 1));
 
-        for (querymenu.index = queryctrl->minimum;
-                querymenu.index <= queryctrl->maximum;
-                querymenu.index++)
+        for (INT64 index = queryctrl->minimum; index <= queryctrl->maximum && i < entries; index++)
         {
+            querymenu.index = (__u32) index;
             querymenu.id = queryctrl->id;
             ret = xioctl (hdevice, VIDIOC_QUERYMENU, &querymenu);
             if (ret < 0)
                 continue;
 
-            if(!menu)
-                menu = (struct v4l2_querymenu *)calloc(1, sizeof (struct v4l2_querymenu) * (i+1));
-            else
-                menu = (struct v4l2_querymenu *)realloc(menu, sizeof (struct v4l2_querymenu) * (i+1));
-
             memcpy(&(menu[i]), &querymenu, sizeof(struct v4l2_querymenu));
             i++;
         }
 
-        if(!menu)
-            menu = (struct v4l2_querymenu *)calloc(1, sizeof(struct v4l2_querymenu) * (i+1));
-        else
-            menu = (struct v4l2_querymenu *)realloc(menu, sizeof(struct v4l2_querymenu) * (i+1));
-
-        menu[i].id = querymenu.id;
+        menu[i].id = queryctrl->id;
         menu[i].index = queryctrl->maximum+1;
         if(queryctrl->type == V4L2_CTRL_TYPE_MENU)
             menu[i].name[0] = 0;
     }
 
-    // Add the control to the linked list
-    control = (Control *)calloc (1, sizeof(Control));
+    // Add the control to the table (linked by finish_table)
+    if (table->num_controls == table->capacity)
+    {
+        int capacity = table->capacity ? 2 * table->capacity : 32;
+        Control *controls = (Control *)realloc(table->controls, capacity * sizeof(Control));
+        if (!controls)
+        {
+            printf("Control 0x%08x: out of memory, not listed\n", queryctrl->id);
+            return NULL; // the controls listed so far stay
+        }
+        table->controls = controls;
+        table->capacity = capacity;
+    }
+    control = &table->controls[table->num_controls++];
+    memset(control, 0, sizeof(Control));
     memcpy(&(control->control), queryctrl, sizeof(struct v4l2_queryctrl));
     control->class_ctrl = V4L2_CTRL_ID2CLASS(control->control.id);
     //add the menu adress (NULL if not a menu)
     control->menu = menu;
     control->string = NULL;
+    if (queryctrl->type == V4L2_CTRL_TYPE_STRING)
+        control->string = (char *)arena_alloc(table->arena, queryctrl->maximum + 1);
+    control->table = table;
+
+    return control;
+}
+
+static uint32_t ctrl_hash(int id, uint32_t mask)
+{
+    return (((uint32_t) id * 0x9E3779B1u) >> 7) & mask;
+}
 
-    if(*first != NULL)
+/*
+ * groups the controls by class (keeping their order), moves them into
+ * the arena, links the list and builds the id index
+ * returns: first control (NULL if the table is empty, the table is freed)
+ */
+static Control *finish_table(ControlTable *table)
+{
+    int n = table->num_controls;
+    Control *building = table->controls;
+
+    if (n == 0)
     {
-        (*current)->next = control;
-        *current = control;
+        free(building);
+        arena_destroy(table->arena);
+        return NULL;
     }
-    else
+
+    table->controls = (Control *)arena_alloc(table->arena, n * sizeof(Control));
+    memcpy(table->controls, building, n * sizeof(Control));
+    free(building);
+    table->capacity = n;
+
+    // stable insertion sort, the enumeration is (nearly) sorted already
+    for (int i = 1; i < n; i++)
     {
-        *first = control;
-        *current = *first;
+        Control tmp = table->controls[i];
+        int j = i;
+        for (; j > 0 && (uint32_t) table->controls[j-1].class_ctrl > (uint32_t) tmp.class_ctrl; j--)
+            table->controls[j] = table->controls[j-1];
+        table->controls[j] = tmp;
+    }
+    for (int i = 0; i < n; i++)
+        table->controls[i].next = i + 1 < n ? &table->controls[i+1] : NULL;
+
+    // at most half full
+    uint32_t slots = 16;
+    while (slots < 2 * (uint32_t) n)
+        slots <<= 1;
+    table->index_mask = slots - 1;
+    table->index = (int *)arena_alloc(table->arena, slots * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t h = ctrl_hash(table->controls[i].control.id, table->index_mask);
+        while (table->index[h])
+            h = (h + 1) & table->index_mask;
+        table->index[h] = i + 1;
     }
 
-    return control;
+    return table->controls;
 }
 
 /*
@@ -183,8 +257,10 @@ static Control *add_control(int hdevice, struct v4l2_queryctrl *queryctrl, Contr
 Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
 {
     int ret=0;
-    Control *first   = NULL;
-    Control *current = NULL;
+    // controls, menus, strings and the index of the device: one arena
+    struct MemArena *arena = arena_create(0);
+    ControlTable *table = (ControlTable *)arena_alloc(arena, sizeof(ControlTable));
+    table->arena = arena;
 
     int n = 0;
     struct v4l2_queryctrl queryctrl={0};
@@ -196,7 +272,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
     {
         while ((ret=query_ioctl(hdevice, currentctrl, &queryctrl)) == 0)
         {
-            if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+            if(add_control(hdevice, &queryctrl, table) != NULL)
                 n++;
 
             currentctrl = queryctrl.id;
@@ -206,7 +282,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
         if (queryctrl.id != V4L2_CTRL_FLAG_NEXT_CTRL)
         {
             *num_ctrls = n;
-            return first; //done
+            return finish_table(table); //done
         }
 
         if(ret)
@@ -215,6 +291,8 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
         }
 
         printf("buggy V4L2_CTRL_FLAG_NEXT_CTRL flag implementation (workaround enabled)\n");
+        table->num_controls = 0; // menus stay in the arena
+        n = 0;
 
         //next_flag method failed loop through the ids:
         // USER CLASS Controls
@@ -223,7 +301,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
             queryctrl.id = currentctrl;
             if (xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0)
             {
-                if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+                if(add_control(hdevice, &queryctrl, table) != NULL)
                     n++;
             }
         }
@@ -233,7 +311,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
             queryctrl.id = currentctrl;
             if (xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0)
             {
-                if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+                if(add_control(hdevice, &queryctrl, table) != NULL)
                     n++;
             }
         }
@@ -241,7 +319,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
         for (queryctrl.id = V4L2_CID_PRIVATE_BASE;
                 xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0; queryctrl.id++)
         {
-            if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+            if(add_control(hdevice, &queryctrl, table) != NULL)
                 n++;
         }
     }
@@ -255,7 +333,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
             queryctrl.id = currentctrl;
             if (xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0)
             {
-                if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+                if(add_control(hdevice, &queryctrl, table) != NULL)
                     n++;
             }
         }
@@ -265,7 +343,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
             queryctrl.id = currentctrl;
             if (xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0)
             {
-                if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+                if(add_control(hdevice, &queryctrl, table) != NULL)
                     n++;
             }
         }
@@ -273,13 +351,13 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method)
         for (queryctrl.id = V4L2_CID_PRIVATE_BASE;
                 xioctl(hdevice, VIDIOC_QUERYCTRL, &queryctrl) == 0; queryctrl.id++)
         {
-            if(add_control(hdevice, &queryctrl, &current, &first) != NULL)
+            if(add_control(hdevice, &queryctrl, table) != NULL)
                 n++;
         }
     }
 
     *num_ctrls = n;
-    return first;
+    return finish_table(table);
 }
 
 /*
@@ -501,9 +579,14 @@ void disable_special_auto (int hdevice, Control *control_list, int id)
  */
 Control *get_ctrl_by_id(Control *control_list, int id)
 {
-    Control *current = control_list;
-    for(; current != NULL; current = current->next)
+    if (control_list == NULL)
+        return(NULL);
+
+    ControlTable *table = control_list->table;
+    uint32_t h = ctrl_hash(id, table->index_mask);
+    for (; table->index[h]; h = (h + 1) & table->index_mask)
     {
+        Control *current = &table->controls[table->index[h] - 1];
         if(current->control.id == id)
             return (current);
     }
@@ -518,6 +601,7 @@ void get_ctrl_values (int hdevice, Control *control_list, int num_controls, void
 {
     int ret = 0;
     struct v4l2_ext_control clist[num_controls];
+    Control *owner[num_controls]; // control of each clist entry
     Control *current = control_list;
     int count = 0;
     int i = 0;
@@ -528,6 +612,14 @@ void get_ctrl_values (int hdevice, Control *control_list, int num_controls, void
             continue;
 
         clist[count].id = current->control.id;
+        clist[count].size = 0;
+        if(current->control.type == V4L2_CTRL_TYPE_STRING)
+        {
+            // read in place into the arena buffer
+            clist[count].size = current->control.maximum + 1;
+            clist[count].string = current->string;
+        }
+        owner[count] = current;
         count++;
 
         if((current->next == NULL) || (current->next->class_ctrl != current->class_ctrl))
@@ -575,14 +667,13 @@ void get_ctrl_values (int hdevice, Control *control_list, int num_controls, void
             //fill in the values on the control list
             for(i=0; i<count; i++)
             {
-                Control *ctrl = get_ctrl_by_id(control_list, clist[i].id);
-                if(!ctrl)
-                {
-                    printf("couldn't get control for id: %i\n", clist[i].id);
-                    continue;
-                }
+                Control *ctrl = owner[i];
                 switch(ctrl->control.type)
                 {
+                    case V4L2_CTRL_TYPE_STRING:
+                        printf("control %i [0x%08x] = \"%s\"\n",
+                                i, clist[i].id, ctrl->string);
+                        break;
                     default:
                         ctrl->value = clist[i].value;
                         printf("control %i [0x%08x] = %i\n",
@@ -637,6 +728,11 @@ int get_ctrl(int hdevice, Control *control_list, int id)
         struct v4l2_ext_controls ctrls = {0};
         struct v4l2_ext_control ctrl = {0};
         ctrl.id = control->control.id;
+        if(control->control.type == V4L2_CTRL_TYPE_STRING)
+        {
+            ctrl.size = control->control.maximum + 1;
+            ctrl.string = control->string;
+        }
         ctrls.ctrl_class = control->class_ctrl;
         ctrls.count = 1;
         ctrls.controls = &ctrl;
@@ -648,6 +744,8 @@ int get_ctrl(int hdevice, Control *control_list, int id)
         {
             switch(control->control.type)
             {
+                case V4L2_CTRL_TYPE_STRING:
+                    break; // read in place
                 default:
                     control->value = ctrl.value;
                     //printf("control %i [0x%08x] = %i\n",
@@ -657,7 +755,8 @@ int get_ctrl(int hdevice, Control *control_list, int id)
         }
     }
 
-    update_ctrl_flags(control_list, id);
+    if(!control->table->events)
+        update_ctrl_flags(control_list, id);
 #if 0
     update_widget_state(control_list, all_data);
 #endif
@@ -682,8 +781,13 @@ void set_ctrl_values (int hdevice, Control *control_list, int num_controls)
             continue;
 
         clist[count].id = current->control.id;
+        clist[count].size = 0;
         switch (current->control.type)
         {
+            case V4L2_CTRL_TYPE_STRING:
+                clist[count].size = strlen(current->string) + 1;
+                clist[count].string = current->string;
+                break;
             default:
                 clist[count].value = current->value;
                 break;
@@ -778,13 +882,31 @@ void set_default_values(int hdevice, Control *control_list, int num_controls, vo
     }
 
     set_ctrl_values (hdevice, control_list, num_controls);
-    get_ctrl_values (hdevice, control_list, num_controls, all_data);
+    //the events bring the values in effect when subscribed
+    if(!control_list->table->events)
+        get_ctrl_values (hdevice, control_list, num_controls, all_data);
+}
+
+int ctrl_clamp(Control *ctrl, int64_t value)
+{
+    int64_t step = MAX(ctrl->control.step, 1);
+
+    value = MIN(MAX(value, (int64_t) ctrl->control.minimum), (int64_t) ctrl->control.maximum);
+    value = ctrl->control.minimum + (value - ctrl->control.minimum + step / 2) / step * step;
+    if(value > ctrl->control.maximum)
+        value -= step;
+    return ((int) value);
+}
+
+int ctrl_gain_base(Control *gain)
+{
+    return gain->control.minimum > 0 ? 0 : 1 - gain->control.minimum;
 }
 
 /*
- * sets the value for control id
+ * sets the value for control id without reading it back
  */
-int set_ctrl(int hdevice, Control *control_list, int id)
+int write_ctrl(int hdevice, Control *control_list, int id)
 {
     Control *control = get_ctrl_by_id(control_list, id );
     int ret = 0;
@@ -810,6 +932,10 @@ int set_ctrl(int hdevice, Control *control_list, int id)
         ctrl.id = control->control.id;
         switch (control->control.type)
         {
+            case V4L2_CTRL_TYPE_STRING:
+                ctrl.size = strlen(control->string) + 1;
+                ctrl.string = control->string;
+                break;
             default:
                 ctrl.value = control->value;
                 break;
@@ -823,31 +949,262 @@ int set_ctrl(int hdevice, Control *control_list, int id)
                     ctrl.id, ret);
     }
 
-    //update real value
-    get_ctrl(hdevice, control_list, id);
-
     return (ret);
 }
 
 /*
- * frees the control list allocations
+ * sets the value for control id and reads back the value in effect
  */
-void free_control_list (Control *control_list)
+int set_ctrl(int hdevice, Control *control_list, int id)
+{
+    int ret = write_ctrl(hdevice, control_list, id);
+    Control *control = get_ctrl_by_id(control_list, id);
+
+    //update real value: a refused write raises no change event, an accepted
+    //one brings the value in effect when subscribed
+    if(control && (ret != 0 || !control->table->events))
+        get_ctrl(hdevice, control_list, id);
+
+    return (ret);
+}
+
+void ctrl_txn_begin(ControlTxn *txn, int hdevice, Control *control_list)
 {
-    Control *first = control_list;
-    Control *next = first->next;
-    while (next != NULL)
+    txn->hdevice = hdevice;
+    txn->control_list = control_list;
+    txn->count = 0;
+}
+
+int ctrl_txn_set(ControlTxn *txn, int id, int32_t value)
+{
+    Control *control = get_ctrl_by_id(txn->control_list, id);
+    int i = 0;
+
+    if(!control || (control->control.flags & V4L2_CTRL_FLAG_READ_ONLY))
+        return (-1);
+    if(control->control.type == V4L2_CTRL_TYPE_STRING ||
+            control->control.type == V4L2_CTRL_TYPE_INTEGER64)
+        return (-1);
+
+    // the table array is in list order: keep the staged controls sorted
+    // by address and every class is one run
+    for(i = 0; i < txn->count && txn->controls[i] < control; i++);
+    if(i < txn->count && txn->controls[i] == control)
     {
-        if(first->string) free(first->string);
-        if(first->menu) free(first->menu);
-        free(first);
-        first = next;
-        next = first->next;
+        txn->values[i] = value;
+        return (0);
     }
-    //clean the last one
-    if(first->string) free(first->string);
-    if(first) free(first);
-    control_list = NULL;
+    if(txn->count == CTRL_TXN_MAX)
+        return (-1);
+
+    memmove(&txn->controls[i + 1], &txn->controls[i], (txn->count - i) * sizeof(Control *));
+    memmove(&txn->values[i + 1], &txn->values[i], (txn->count - i) * sizeof(int32_t));
+    txn->controls[i] = control;
+    txn->values[i] = value;
+    txn->count++;
+    return (0);
+}
+
+/* end of the class run starting at first */
+static int txn_class_end(ControlTxn *txn, int first)
+{
+    int end = first + 1;
+    while(end < txn->count && txn->controls[end]->class_ctrl == txn->controls[first]->class_ctrl)
+        end++;
+    return (end);
 }
 
+/* one extended controls ioctl for the class run [first, end) */
+static int txn_ioctl(ControlTxn *txn, int request, struct v4l2_ext_control *clist,
+        int first, int end)
+{
+    struct v4l2_ext_controls ctrls = {0};
+    ctrls.ctrl_class = txn->controls[first]->class_ctrl;
+    ctrls.count = end - first;
+    ctrls.controls = &clist[first];
+    int ret = xioctl(txn->hdevice, request, &ctrls);
+    if(ret && ctrls.error_idx < ctrls.count)
+    {
+        Control *bad = txn->controls[first + ctrls.error_idx];
+        printf("control(0x%08x) \"%s\" rejected value %i (error %i)\n",
+                bad->control.id, bad->control.name, clist[first + ctrls.error_idx].value, ret);
+    }
+    return (ret);
+}
 
+int ctrl_txn_commit(ControlTxn *txn, int flags)
+{
+    struct v4l2_ext_control clist[CTRL_TXN_MAX];
+    int first = 0;
+    int end = 0;
+    int ret = 0;
+    int i = 0;
+
+    if(txn->count == 0)
+        return (0);
+
+    memset(clist, 0, sizeof(clist));
+    for(i = 0; i < txn->count; i++)
+    {
+        clist[i].id = txn->controls[i]->control.id;
+        clist[i].value = txn->values[i];
+    }
+
+    if(flags & CTRL_TXN_TRY)
+    {
+        for(first = 0; first < txn->count; first = end)
+        {
+            end = txn_class_end(txn, first);
+            if(txn_ioctl(txn, VIDIOC_TRY_EXT_CTRLS, clist, first, end))
+            {
+                txn->count = 0;
+                return (-1);
+            }
+        }
+    }
+
+    for(first = 0; first < txn->count; first = end)
+    {
+        end = txn_class_end(txn, first);
+        if(txn_ioctl(txn, VIDIOC_S_EXT_CTRLS, clist, first, end) == 0)
+        {
+            // the driver returns the values it adjusted
+            for(i = first; i < end; i++)
+                txn->controls[i]->value = clist[i].value;
+            continue;
+        }
+        if(txn->controls[first]->class_ctrl != V4L2_CTRL_CLASS_USER)
+        {
+            printf("VIDIOC_S_EXT_CTRLS failed for class: 0x%08x\n",
+                    txn->controls[first]->class_ctrl);
+            ret = -1;
+            continue;
+        }
+        // older drivers only take user class controls one by one
+        for(i = first; i < end; i++)
+        {
+            struct v4l2_control ctrl;
+            ctrl.id = clist[i].id;
+            ctrl.value = clist[i].value;
+            if(xioctl(txn->hdevice, VIDIOC_S_CTRL, &ctrl))
+            {
+                printf("control(0x%08x) \"%s\" failed to set\n",
+                        ctrl.id, txn->controls[i]->control.name);
+                ret = -1;
+            }
+            else
+                txn->controls[i]->value = ctrl.value;
+        }
+    }
+
+    if(flags & CTRL_TXN_READBACK)
+    {
+        for(first = 0; first < txn->count; first = end)
+        {
+            end = txn_class_end(txn, first);
+            if(txn_ioctl(txn, VIDIOC_G_EXT_CTRLS, clist, first, end) == 0)
+            {
+                for(i = first; i < end; i++)
+                    if(!(txn->controls[i]->control.flags & V4L2_CTRL_FLAG_WRITE_ONLY))
+                        txn->controls[i]->value = clist[i].value;
+            }
+            else
+            {
+                for(i = first; i < end; i++)
+                    get_ctrl(txn->hdevice, txn->control_list, clist[i].id);
+            }
+        }
+    }
+
+    if(!txn->control_list->table->events)
+        for(i = 0; i < txn->count; i++)
+            update_ctrl_flags(txn->control_list, txn->controls[i]->control.id);
+
+    txn->count = 0;
+    return (ret);
+}
+
+int ctrl_events_subscribe(int hdevice, Control *control_list)
+{
+    Control *current = control_list;
+    ControlTable *table = control_list->table;
+
+    // no id wildcard for control events: one subscription per control
+    for(; current != NULL; current = current->next)
+    {
+        struct v4l2_event_subscription sub;
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = current->control.id;
+        sub.flags = V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK;
+        if(xioctl(hdevice, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+        {
+            printf("control events not supported (0x%08x), reading values back\n",
+                    current->control.id);
+            memset(&sub, 0, sizeof(sub));
+            sub.type = V4L2_EVENT_ALL;
+            xioctl(hdevice, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
+            return (-1);
+        }
+    }
+
+    table->events = 1;
+    return (0);
+}
+
+int ctrl_events_process(int hdevice, Control *control_list)
+{
+    struct v4l2_event ev;
+    int count = 0;
+
+    do
+    {
+        memset(&ev, 0, sizeof(ev));
+        if(xioctl(hdevice, VIDIOC_DQEVENT, &ev) < 0)
+            break; // ENOENT: none left
+
+        Control *control = get_ctrl_by_id(control_list, ev.id);
+        if(ev.type != V4L2_EVENT_CTRL || !control)
+            continue;
+
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE)
+        {
+            switch(control->control.type)
+            {
+                case V4L2_CTRL_TYPE_STRING:
+                    get_ctrl(hdevice, control_list, ev.id); // not in the event
+                    break;
+                case V4L2_CTRL_TYPE_INTEGER64:
+                    control->value64 = ev.u.ctrl.value64;
+                    break;
+                default:
+                    control->value = ev.u.ctrl.value;
+                    break;
+            }
+        }
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_FLAGS)
+            control->control.flags = ev.u.ctrl.flags;
+        if(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE)
+        {
+            control->control.minimum = ev.u.ctrl.minimum;
+            control->control.maximum = ev.u.ctrl.maximum;
+            control->control.step = ev.u.ctrl.step;
+            control->control.default_value = ev.u.ctrl.default_value;
+        }
+        count++;
+    }
+    while(ev.pending > 0);
+
+    return (count);
+}
+
+/*
+ * frees the control list allocations
+ */
+void free_control_list (Control *control_list)
+{
+    if (control_list == NULL)
+        return;
+
+    arena_destroy(control_list->table->arena);
+}
@@ -21,6 +21,8 @@
 #include <inttypes.h>
 #include "defs.hpp"
 
+struct _ControlTable;
+
 typedef struct _Control
 {
     struct v4l2_queryctrl control;
@@ -31,8 +33,26 @@ typedef struct _Control
     char *string;
     //next control in the list
     struct _Control *next;
+    //table holding the control (id index)
+    struct _ControlTable *table;
 } Control;
 
+/*
+ * storage of a control list: the controls are one array, grouped by
+ * class (the list order), with an open addressing id hash on top; the
+ * table, controls, menus, string values and hash live in one arena
+ */
+typedef struct _ControlTable
+{
+    Control *controls;      // the list (controls[i].next == &controls[i+1])
+    int num_controls;
+    int capacity;
+    int *index;             // control index + 1 per hash slot (0 - empty)
+    uint32_t index_mask;    // hash slots - 1
+    struct MemArena *arena; // freed by free_control_list
+    int events;             // V4L2_EVENT_CTRL subscribed: values and flags follow the events
+} ControlTable;
+
 struct VidState
 {
     Control *control_list;
@@ -52,7 +72,7 @@ Control *get_control_list(int hdevice, int *num_ctrls, int list_method);
 
 /*
  * Returns the Control structure corresponding to control id,
- * from the control list.
+ * from the control list (hash lookup, no allocation).
  */
 Control *get_ctrl_by_id(Control *control_list, int id);
 
@@ -86,9 +106,82 @@ void set_default_values(int hdevice, Control *control_list, int num_controls, vo
 
 /*
  * sets the value for control id
+ * (reads it back unless control events are subscribed)
  */
 int set_ctrl(int hdevice, Control *control_list, int id);
 
+/*
+ * returns: nearest valid value of an integer control (clamped to
+ *          minimum/maximum, on the step grid from minimum)
+ */
+int ctrl_clamp(Control *ctrl, int64_t value);
+
+/*
+ * gain is taken as linear in its value: value + base is the gain factor
+ * (base offsets the range to start at 1 when it starts at 0 or below)
+ */
+int ctrl_gain_base(Control *gain);
+
+/*
+ * sets the value for control id without reading it back
+ * (one ioctl, the cached value must already be valid for the control)
+ */
+int write_ctrl(int hdevice, Control *control_list, int id);
+
+/*
+ * control transaction: changes are staged and submitted with one
+ * VIDIOC_S_EXT_CTRLS per control class (atomic within the class) instead
+ * of a set and a read back per control
+ */
+#define CTRL_TXN_MAX       32
+
+#define CTRL_TXN_TRY       0x01    // validate all with VIDIOC_TRY_EXT_CTRLS first, set nothing on error
+#define CTRL_TXN_READBACK  0x02    // read the values in effect back (one VIDIOC_G_EXT_CTRLS per class)
+
+typedef struct _ControlTxn
+{
+    int hdevice;
+    Control *control_list;
+    int count;
+    Control *controls[CTRL_TXN_MAX];   // in list order (grouped by class)
+    int32_t values[CTRL_TXN_MAX];
+} ControlTxn;
+
+void ctrl_txn_begin(ControlTxn *txn, int hdevice, Control *control_list);
+
+/*
+ * stages value for control id (replaces a value staged before for it)
+ * returns: 0 - staged, -1 - unknown, read only or not an integer value,
+ *          or the transaction is full
+ */
+int ctrl_txn_set(ControlTxn *txn, int id, int32_t value);
+
+/*
+ * submits the staged changes and empties the transaction; the cached
+ * values take the ones the driver accepted (or read back)
+ * args:
+ * flags: CTRL_TXN_TRY | CTRL_TXN_READBACK
+ *
+ * returns: 0 on success, -1 if a class failed (or the validation failed,
+ *          nothing was set then)
+ */
+int ctrl_txn_commit(ControlTxn *txn, int flags);
+
+/*
+ * subscribes to V4L2_EVENT_CTRL (with feedback, our own changes are
+ * reported too) for all controls: from then on the cached values and
+ * flags are updated by ctrl_events_process instead of read backs
+ * returns: 0 - subscribed, -1 - not supported (values are read back)
+ */
+int ctrl_events_subscribe(int hdevice, Control *control_list);
+
+/*
+ * dequeues the pending control events (the device fd signals them as
+ * an exception, POLLPRI) and applies them to the cached controls
+ * returns: number of control events applied
+ */
+int ctrl_events_process(int hdevice, Control *control_list);
+
 /*
  * frees the control list allocations
  */
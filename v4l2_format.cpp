@@ -223,6 +223,59 @@ int get_pixMode(int pixfmt, char *mode)
     return (-1);
 }
 
+/* convert mode (Fourcc) to v4l2 pix format
+ * args:
+ * mode: fourcc string (case insensitive)
+ * returns v4l2 pix format
+ * or -1 on failure (not supported)          */
+int get_PixFormat(const char *mode)
+{
+    int i=0;
+    for (i=0; i<SUP_PIX_FMT; i++)
+    {
+        if (strncasecmp(mode, listSupFormats[i].mode, 4) == 0)
+            return (listSupFormats[i].format);
+    }
+    return (-1);
+}
+
+/* bytes per pixel in the first (or only) plane of a raw format
+ * args:
+ * pixfmt: V4L2 pixel format
+ * returns bytes per pixel
+ * or 0 for compressed/bit-packed formats       */
+int get_pixBytes(int pixfmt)
+{
+    switch (pixfmt)
+    {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YVYU:
+        case V4L2_PIX_FMT_UYVY:
+        case V4L2_PIX_FMT_Y16:
+            return (2);
+
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24:
+            return (3);
+
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_NV16:
+        case V4L2_PIX_FMT_NV61:
+        case V4L2_PIX_FMT_SGBRG8:
+        case V4L2_PIX_FMT_SGRBG8:
+        case V4L2_PIX_FMT_SBGGR8:
+        case V4L2_PIX_FMT_SRGGB8:
+            return (1);
+
+        default:
+            return (0);
+    }
+}
+
 /* get Format index from available format list
  * args:
  * listFormats: available video format list
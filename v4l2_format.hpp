@@ -168,6 +168,10 @@ LFormats *enum_frame_formats( int *width, int *height, int fd);
 
 int get_pixMode(int pixfmt, char *mode);
 
+int get_PixFormat(const char *mode);
+
+int get_pixBytes(int pixfmt);
+
 int get_formatIndex(LFormats *listFormats, int format);
 
 int check_supPixFormat(int pixfmt);
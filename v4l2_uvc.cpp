@@ -32,6 +32,7 @@
 #include "globals.hpp"
 #include "v4l2_format.hpp"
 #include "ms_time.hpp"
+#include "v4l2_vcam.hpp"
 
 
 /* ioctl with a number of retries in the case of failure
@@ -49,7 +50,10 @@ int xioctl(int fd, int IOCTL_X, void *arg)
     {
         //Start of e-con
         //		ret = v4l2_ioctl(fd, IOCTL_X, arg);
-        ret = ioctl(fd, IOCTL_X, arg);
+        if (vcam_is_open(fd))
+            ret = vcam_ioctl(fd, IOCTL_X, arg);
+        else
+            ret = ioctl(fd, IOCTL_X, arg);
         //End of e-con
     }
     while (ret && tries-- &&
@@ -111,8 +115,8 @@ static int unmap_buff(struct vdIn *vd)
 
     for (i = 0; i < NB_BUFFER; i++)
     {
-        // unmap old buffer
-        if((vd->mem[i] != MAP_FAILED) && vd->buff_length[i])
+        // unmap old buffer (virtual camera buffers are not mapped)
+        if((vd->mem[i] != MAP_FAILED) && vd->buff_length[i] && !vcam_is_open(vd->fd))
             if((ret=v4l2_munmap(vd->mem[i], vd->buff_length[i]))<0)
             {
                 printf("couldn't unmap buff");
@@ -127,12 +131,15 @@ static int map_buff(struct vdIn *vd)
     // map new buffer
     for (i = 0; i < NB_BUFFER; i++)
     {
-        vd->mem[i] = v4l2_mmap( NULL, // start anywhere
-                vd->buff_length[i],
-                PROT_READ | PROT_WRITE,
-                MAP_SHARED,
-                vd->fd,
-                vd->buff_offset[i]);
+        if (vcam_is_open(vd->fd))
+            vd->mem[i] = vcam_mmap(vd->fd, vd->buff_length[i], vd->buff_offset[i]);
+        else
+            vd->mem[i] = v4l2_mmap( NULL, // start anywhere
+                    vd->buff_length[i],
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    vd->fd,
+                    vd->buff_offset[i]);
         if (vd->mem[i] == MAP_FAILED)
         {
             printf("Unable to map buffer");
@@ -317,6 +324,17 @@ static int init_v4l2(struct vdIn *vd, struct GLOBAL *global)
 		return VDIN_FORMAT_ERR;
     }
 
+    /* ----------- ROI --------------*/
+    // before buffers are requested: a hardware crop changes the frame size
+    if ((ret = uvc_set_roi(vd, global, global->roi_left, global->roi_top,
+            global->roi_width, global->roi_height)) != VDIN_OK)
+    {
+        printf("ROI: invalid region %ix%i at (%i,%i) for a %ix%i frame\n",
+                global->roi_width, global->roi_height, global->roi_left, global->roi_top,
+                vd->fmt.fmt.pix.width, vd->fmt.fmt.pix.height);
+        return ret;
+    }
+
     /* ----------- FPS --------------*/
     input_set_framerate(vd, &global->fps, &global->fps_num);
 
@@ -467,9 +485,15 @@ void init_controls (struct vdIn *vd, struct GLOBAL *global)
 
     get_ctrl_values (vd->fd, s->control_list, s->num_controls, NULL);
 
+    // from here on the driver reports changes (no read backs), if it can
+    if (ctrl_events_subscribe(vd->fd, s->control_list) == 0)
+        printf("%s: control events subscribed\n", vd->videodevice);
+
     for(current = s->control_list; current != NULL; current = current->next)
     {
-        get_ctrl(vd->fd, s->control_list, current->control.id);
+        // without events the flags (e.g. inactive) are worked out locally
+        if (!s->control_list->table->events)
+            get_ctrl(vd->fd, s->control_list, current->control.id);
         if (!strcmp((const char *)current->control.name, "Exposure (Absolute)"))
         {
             vd->exposure_id = current->control.id;
@@ -498,6 +522,8 @@ void close_controls(struct vdIn *vd)
 {
     struct VidState *s = vd->s;
 
+    if (s == NULL)
+        return; // init failed before the controls
     if (s->control_list)
     {
         free_control_list (s->control_list);
@@ -509,9 +535,19 @@ void close_controls(struct vdIn *vd)
 }
 
 
+/* closes a device or virtual camera fd */
+static void close_device(int fd)
+{
+    if (vcam_is_open(fd))
+        vcam_close(fd);
+    else
+        v4l2_close(fd);
+}
+
 void clear_v4l2(struct vdIn *vd)
 {
-    v4l2_close(vd->fd);
+    if (vd->fd > 0)
+        close_device(vd->fd);
     vd->fd = 0;
     free(vd->videodevice);
     vd->videodevice = NULL;
@@ -541,7 +577,11 @@ int init_videoIn(struct vdIn *vd, struct GLOBAL *global)
 	//open device
 	if (vd->fd <=0 )
     {
-        if ((vd->fd = v4l2_open(vd->videodevice, O_RDWR | O_NONBLOCK, 0)) < 0)
+        if (vcam_is_device(vd->videodevice))
+            vd->fd = vcam_open(vd->videodevice);
+        else
+            vd->fd = v4l2_open(vd->videodevice, O_RDWR | O_NONBLOCK, 0);
+        if (vd->fd < 0)
         {
             printf("ERROR opening V4L interface:%s\n", vd->videodevice);
             ret = VDIN_DEVICE_ERR;
@@ -570,6 +610,10 @@ int init_videoIn(struct vdIn *vd, struct GLOBAL *global)
     // init controls
     init_controls(vd, global);
 
+    // payload headers on the metadata node, the capture works without
+    if (global->meta_device)
+        vd->meta = uvc_meta_open(vd, global->meta_device);
+
     return (ret);
 }
 
@@ -610,18 +654,30 @@ void close_videoIn(struct vdIn *vd)
     close_controls(vd);
 
     vd->videodevice = NULL;
+    uvc_meta_close(vd->meta);
+    vd->meta = NULL;
     // close device descriptorF
-    if(vd->fd) v4l2_close(vd->fd);
+    if(vd->fd) close_device(vd->fd);
     // free struct allocation
     if(vd) free(vd);
     vd = NULL;
 }
 
+/* control events flagged by select (a virtual camera is asked instead) */
+static int events_pending(struct vdIn *vd, fd_set *exset)
+{
+    if (vcam_is_open(vd->fd))
+        return vcam_events_pending(vd->fd) > 0;
+    return FD_ISSET(vd->fd, exset);
+}
+
 static int check_frame_available(struct vdIn *vd)
 {
     int ret = VDIN_OK;
     fd_set rdset;
+    fd_set exset;
     struct timeval timeout;
+    int events = vd->s && vd->s->control_list && vd->s->control_list->table->events;
     //make sure streaming is on
     if (!vd->isstreaming)
         if (video_enable(vd))
@@ -630,12 +686,22 @@ static int check_frame_available(struct vdIn *vd)
             return VDIN_STREAMON_ERR;
         }
 
-    FD_ZERO(&rdset);
-    FD_SET(vd->fd, &rdset);
     timeout.tv_sec = 6; // 1 sec timeout
     timeout.tv_usec = 0;
-    // select - wait for data or timeout
-    ret = select(vd->fd + 1, &rdset, NULL, NULL, &timeout);
+    do
+    {
+        FD_ZERO(&rdset);
+        FD_SET(vd->fd, &rdset);
+        FD_ZERO(&exset);
+        if (events)
+            FD_SET(vd->fd, &exset);
+        // select - wait for data, control events or timeout
+        ret = select(vd->fd + 1, &rdset, NULL, events ? &exset : NULL, &timeout);
+        if (ret > 0 && events && events_pending(vd, &exset))
+            ctrl_events_process(vd->fd, vd->s->control_list);
+    }
+    while (ret > 0 && !FD_ISSET(vd->fd, &rdset)); // only events, keep waiting (linux select updates timeout)
+
     if (ret < 0)
     {
         printf(" Could not grab image (select error)");
@@ -655,117 +721,421 @@ static int check_frame_available(struct vdIn *vd)
 
 }
 
-/* Grabs video frame and store it in new_frame(free it by yourself) 
+/* Dequeues a video frame and hands out the mmap'd driver buffer (no copy)
+ * the buffer stays owned by the caller until uvc_release_frame
  *
  * returns: error code ( 0 - VDIN_OK)
  */
-int uvc_grab(struct vdIn *vd, struct GLOBAL *global, BYTE*& new_frame)
+int uvc_lease_frame(struct vdIn *vd, struct FrameLease *lease)
 {
     int ret = check_frame_available(vd);
-	int frame_size = global->width * global->height * 2;
 
     if (ret < 0)
         return ret;
 
     // dequeue the buffer
-    memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-    vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
 
-    ret = xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
+    ret = xioctl(vd->fd, VIDIOC_DQBUF, &buf);
     if (ret < 0)
     {
         printf("VIDIOC_DQBUF - Unable to dequeue buffer ");
         ret = VDIN_DEQBUFS_ERR;
         return ret;
     }
+    vd->buf = buf;
+    if (vd->frame_index && (buf.sequence > vd->last_sequence + 1))
+        vd->dropped_frames += buf.sequence - vd->last_sequence - 1;
+    vd->last_sequence = buf.sequence;
+    vd->timestamp = (UINT64) buf.timestamp.tv_sec * G_NSEC_PER_SEC +
+        (UINT64) buf.timestamp.tv_usec * 1000;
+
+    lease->index = buf.index;
+    lease->data = (BYTE *) vd->mem[buf.index];
+    lease->bytesused = buf.bytesused;
+    lease->sequence = buf.sequence;
+    lease->timestamp = vd->timestamp;
+    // completed before the frame by the driver
+    if (vd->meta)
+        uvc_meta_match(vd->meta, buf.sequence, &lease->meta);
+    else
+        memset(&lease->meta, 0, sizeof(lease->meta));
 
-	// store
-	new_frame = (BYTE*)malloc(frame_size);
-	memcpy(new_frame, vd->mem[vd->buf.index], frame_size);
+    return VDIN_OK;
+}
 
-	// queue the buffer
-    ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-    if (ret < 0)
+/* Queues a leased buffer back to the driver
+ *
+ * returns: error code ( 0 - VDIN_OK)
+ */
+int uvc_release_frame(struct vdIn *vd, struct FrameLease *lease)
+{
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = lease->index;
+
+    if (xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0)
     {
         printf("VIDIOC_QBUF - Unable to queue buffer");
-        ret = VDIN_QBUF_ERR;
-        return ret;
+        return VDIN_QBUF_ERR;
     }
+    lease->data = NULL;
 
-    vd->frame_index++;
+    // leases may be given back from other threads (see frame_fanout)
+    __atomic_add_fetch(&vd->frame_index, 1, __ATOMIC_RELAXED);
 
     return VDIN_OK;
 }
 
-int exposure_control(struct vdIn *vd, int direct)
+/* Programs a hardware crop rectangle
+ * tries VIDIOC_S_SELECTION first and the older VIDIOC_S_CROP as fallback
+ * args:
+ * rect: requested rectangle (updated with the one set by the driver)
+ *
+ * returns: 0 if the driver cropped to the requested size
+ */
+static int set_hw_crop(struct vdIn *vd, struct v4l2_rect *rect)
 {
-    Control *ctrl = NULL;
-    ctrl = get_ctrl_by_id(vd->s->control_list, vd->exposure_id);
-    if (!ctrl)
+    struct v4l2_selection sel;
+    struct v4l2_crop crop;
+
+    memset(&sel, 0, sizeof(struct v4l2_selection));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = *rect;
+    if (xioctl(vd->fd, VIDIOC_S_SELECTION, &sel) == 0)
     {
-        printf("%s failed for NULL!!\n", __func__);
+        if ((sel.r.width == rect->width) && (sel.r.height == rect->height))
+        {
+            *rect = sel.r;
+            return 0;
+        }
+        // driver adjusted the rectangle: restore the default crop
+        sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+        if (xioctl(vd->fd, VIDIOC_G_SELECTION, &sel) == 0)
+        {
+            sel.target = V4L2_SEL_TGT_CROP;
+            xioctl(vd->fd, VIDIOC_S_SELECTION, &sel);
+        }
         return -1;
     }
 
-    if (direct == IOCTL_DIRECT_INC)
+    memset(&crop, 0, sizeof(struct v4l2_crop));
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = *rect;
+    if (xioctl(vd->fd, VIDIOC_S_CROP, &crop) == 0)
     {
-        ctrl->value++;
-        if (ctrl->value > ctrl->control.maximum)
-            ctrl->value = ctrl->control.maximum;
-        set_ctrl(vd->fd, vd->s->control_list, vd->exposure_id);
+        // S_CROP may round the rectangle, read it back
+        if ((xioctl(vd->fd, VIDIOC_G_CROP, &crop) == 0) &&
+                (crop.c.width == rect->width) && (crop.c.height == rect->height))
+        {
+            *rect = crop.c;
+            return 0;
+        }
+        struct v4l2_cropcap cropcap;
+        memset(&cropcap, 0, sizeof(struct v4l2_cropcap));
+        cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(vd->fd, VIDIOC_CROPCAP, &cropcap) == 0)
+        {
+            crop.c = cropcap.defrect;
+            xioctl(vd->fd, VIDIOC_S_CROP, &crop);
+        }
     }
-    else if (direct == IOCTL_DIRECT_DEC)
+
+    return -1;
+}
+
+/* Sets the region of interest handed to consumers
+ * the sensor/bridge crop is used when the driver supports it and buffers
+ * are not allocated yet, otherwise consumers get a strided sub-view of
+ * the mapped buffer (see uvc_roi_view)
+ * args:
+ * vd: pointer to a VdIn struct ( must be allready initiated)
+ * global: frame width and height are updated on a hardware crop
+ * left, top, width, height: roi in frame pixels (width 0 - full frame)
+ *
+ * returns: error code ( 0 - VDIN_OK)
+ */
+int uvc_set_roi(struct vdIn *vd, struct GLOBAL *global, int left, int top, int width, int height)
+{
+    int frame_width = vd->fmt.fmt.pix.width;
+    int frame_height = vd->fmt.fmt.pix.height;
+    struct v4l2_rect rect;
+
+    // full frame unless a crop succeeds
+    vd->roi.left = 0;
+    vd->roi.top = 0;
+    vd->roi.width = frame_width;
+    vd->roi.height = frame_height;
+    vd->roi_mode = VDIN_ROI_NONE;
+
+    if (width <= 0 || height <= 0)
+        return VDIN_OK;
+
+    rect.left = left;
+    rect.top = top;
+    rect.width = width;
+    rect.height = height;
+
+    if (!vd->isstreaming && (vd->rb.count == 0) && (set_hw_crop(vd, &rect) == 0))
     {
-        ctrl->value--;
-        if (ctrl->value < ctrl->control.minimum)
-            ctrl->value = ctrl->control.minimum;
-        set_ctrl(vd->fd, vd->s->control_list, vd->exposure_id);
+        // the frame size follows the crop rectangle
+        vd->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(vd->fd, VIDIOC_G_FMT, &vd->fmt) < 0)
+            printf("VIDIOC_G_FMT - Unable to get format");
+        global->width = vd->fmt.fmt.pix.width;
+        global->height = vd->fmt.fmt.pix.height;
+
+        vd->roi.width = vd->fmt.fmt.pix.width;
+        vd->roi.height = vd->fmt.fmt.pix.height;
+        vd->roi_mode = VDIN_ROI_HW;
+        printf("ROI: hardware crop %ux%u at (%i,%i)\n",
+                rect.width, rect.height, rect.left, rect.top);
+        return VDIN_OK;
     }
-    else
+
+    if (get_pixBytes(vd->fmt.fmt.pix.pixelformat) == 0)
     {
-        printf("%s, error for direct!!\n", __func__);
-        return -1;
+        printf("ROI: no software crop for compressed format\n");
+        return VDIN_FORMAT_ERR;
     }
 
-    vd->currExposureTime = ctrl->value;
+    // software crop - clamp to the frame and keep chroma pairs whole
+    if (left < 0)
+        left = 0;
+    if (top < 0)
+        top = 0;
+    if (left >= frame_width || top >= frame_height)
+        return VDIN_RESOL_ERR;
+    if (left + width > frame_width)
+        width = frame_width - left;
+    if (top + height > frame_height)
+        height = frame_height - top;
+    left &= ~1;
+    top &= ~1;
+    width &= ~1;
+    height &= ~1;
+    if (width <= 0 || height <= 0)
+        return VDIN_RESOL_ERR;
 
-    print_control(ctrl, 0);
-    return 0;
+    vd->roi.left = left;
+    vd->roi.top = top;
+    vd->roi.width = width;
+    vd->roi.height = height;
+    vd->roi_mode = VDIN_ROI_SW;
+    printf("ROI: software crop %ix%i at (%i,%i)\n", width, height, left, top);
+
+    return VDIN_OK;
 }
 
+/* Describes the roi of a leased buffer in place (no copy)
+ * args:
+ * lease: frame from uvc_lease_frame
+ * view: roi rectangle inside the driver buffer
+ *
+ * returns: error code ( 0 - VDIN_OK)
+ */
+int uvc_roi_view(struct vdIn *vd, struct FrameLease *lease, struct FrameView *view)
+{
+    int pixbytes = get_pixBytes(vd->fmt.fmt.pix.pixelformat);
+    if (pixbytes == 0)
+        return VDIN_FORMAT_ERR;
 
-int gain_control(struct vdIn *vd, int direct)
+    int stride = vd->fmt.fmt.pix.bytesperline;
+    if (stride <= 0)
+        stride = vd->fmt.fmt.pix.width * pixbytes;
+
+    view->data = lease->data + vd->roi.top * stride + vd->roi.left * pixbytes;
+    view->width = vd->roi.width;
+    view->height = vd->roi.height;
+    view->stride = stride;
+    view->pixbytes = pixbytes;
+
+    return VDIN_OK;
+}
+
+/* Size of the frame uvc_grab hands out for a leased buffer
+ * (roi rows for a software roi, bytesused for compressed formats)
+ *
+ * returns: frame size in bytes
+ */
+int uvc_frame_size(struct vdIn *vd, struct FrameLease *lease)
 {
-    Control *ctrl = NULL;
-    ctrl = get_ctrl_by_id(vd->s->control_list, vd->gain_id);
-    if (!ctrl)
+    int pixbytes = get_pixBytes(vd->fmt.fmt.pix.pixelformat);
+
+    // compressed payloads only carry bytesused bytes
+    if (pixbytes == 0)
+        return MIN(lease->bytesused, vd->buff_length[lease->index]);
+
+    if (vd->roi_mode == VDIN_ROI_SW)
+        return vd->roi.width * vd->roi.height * pixbytes;
+
+    // planar and grey formats are not 2 bytes per pixel: the driver's image
+    // size (or row pitch by height), never past the buffer
+    int size = vd->fmt.fmt.pix.sizeimage ? (int) vd->fmt.fmt.pix.sizeimage :
+        (int) (vd->fmt.fmt.pix.bytesperline * vd->fmt.fmt.pix.height);
+    if (size <= 0)
+        size = vd->fmt.fmt.pix.width * vd->fmt.fmt.pix.height * pixbytes;
+    return MIN(size, (int) vd->buff_length[lease->index]);
+}
+
+/* Largest frame uvc_copy_frame hands out (the roi for a software roi),
+ * to size buffers before the first frame
+ *
+ * returns: frame size in bytes
+ */
+int uvc_max_frame_size(struct vdIn *vd)
+{
+    int pixbytes = get_pixBytes(vd->fmt.fmt.pix.pixelformat);
+
+    if (vd->roi_mode == VDIN_ROI_SW && pixbytes)
+        return vd->roi.width * vd->roi.height * pixbytes;
+
+    uint32_t size = 0;
+    for (int i = 0; i < NB_BUFFER; i++)
+        size = MAX(size, vd->buff_length[i]);
+    return (int) size;
+}
+
+/* Copies a leased frame into dst (must hold uvc_frame_size bytes)
+ *
+ * returns: bytes copied
+ */
+int uvc_copy_frame(struct vdIn *vd, struct FrameLease *lease, BYTE *dst)
+{
+    int frame_size = uvc_frame_size(vd, lease);
+    struct FrameView view;
+
+    if ((vd->roi_mode == VDIN_ROI_SW) && (uvc_roi_view(vd, lease, &view) == VDIN_OK))
     {
-        printf("%s failed for NULL\n", __func__);
-        return -1;
+        // copy only the roi rows
+        int row_size = view.width * view.pixbytes;
+        for (int y = 0; y < view.height; y++)
+            memcpy(dst + y * row_size, view.data + y * view.stride, row_size);
     }
-    if (direct == IOCTL_DIRECT_INC)
+    else
+        memcpy(dst, lease->data, frame_size);
+
+    return frame_size;
+}
+
+/* Grabs video frame and store it in new_frame(free it by yourself) 
+ *
+ * returns: error code ( 0 - VDIN_OK)
+ */
+int uvc_grab(struct vdIn *vd, struct GLOBAL *global, BYTE*& new_frame)
+{
+    struct FrameLease lease;
+
+    int ret = uvc_lease_frame(vd, &lease);
+    if (ret < 0)
+        return ret;
+
+    // store
+    new_frame = (BYTE*)malloc(uvc_frame_size(vd, &lease));
+    uvc_copy_frame(vd, &lease, new_frame);
+
+    // queue the buffer
+    return uvc_release_frame(vd, &lease);
+}
+
+double exposure_unit_us(struct vdIn *vd)
+{
+    // only the absolute exposure has a unit, V4L2_CID_EXPOSURE is up to the driver
+    return vd->exposure_id == V4L2_CID_EXPOSURE_ABSOLUTE ? 100.0 : 0.0;
+}
+
+int exposure_frame_max(struct vdIn *vd)
+{
+    Control *ctrl = vd->s ? get_ctrl_by_id(vd->s->control_list, vd->exposure_id) : NULL;
+    struct v4l2_fract *tpf = &vd->streamparm.parm.capture.timeperframe;
+    double unit = exposure_unit_us(vd);
+
+    if (!ctrl)
+        return 0;
+    if (unit <= 0 || tpf->denominator == 0)
+        return ctrl->control.maximum;
+
+    int64_t period = (int64_t) (1e6 * tpf->numerator / tpf->denominator / unit);
+    int value = ctrl_clamp(ctrl, period);
+    if (value > period && value - MAX(ctrl->control.step, 1) >= ctrl->control.minimum)
+        value -= MAX(ctrl->control.step, 1); // the grid point below the period
+    return value;
+}
+
+/* stages control id to manual, if it is not already */
+static int stage_manual(ControlTxn *txn, int id, int manual)
+{
+    Control *ctrl = get_ctrl_by_id(txn->control_list, id);
+    if (!ctrl || ctrl->value == manual)
+        return 0;
+    if (ctrl_txn_set(txn, id, manual) < 0)
+        return 0;
+    printf("%s set to manual\n", ctrl->control.name);
+    return 1;
+}
+
+int exposure_manual(struct vdIn *vd)
+{
+    ControlTxn txn;
+
+    if (!vd->s || !vd->s->control_list)
+        return -1;
+    ctrl_txn_begin(&txn, vd->fd, vd->s->control_list);
+    int n = stage_manual(&txn, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+    n += stage_manual(&txn, V4L2_CID_AUTOGAIN, 0);
+    if (n && ctrl_txn_commit(&txn, CTRL_TXN_READBACK) < 0)
+        return -1;
+    return n;
+}
+
+/* moves control id by one control step (clamped), reads the value in effect back */
+static Control *step_control(struct vdIn *vd, int id, int direct, const char *caller)
+{
+    Control *ctrl = get_ctrl_by_id(vd->s->control_list, id);
+    if (!ctrl)
     {
-        ctrl->value++;
-        if (ctrl->value > ctrl->control.maximum)
-            ctrl->value = ctrl->control.maximum;
-        set_ctrl(vd->fd, vd->s->control_list, vd->gain_id);
+        printf("%s failed for NULL!!\n", caller);
+        return NULL;
     }
-    else if(direct == IOCTL_DIRECT_DEC)
+    if (direct != IOCTL_DIRECT_INC && direct != IOCTL_DIRECT_DEC)
     {
-        ctrl->value--;
-        if (ctrl->value < ctrl->control.minimum)
-            ctrl->value = ctrl->control.minimum;
-        set_ctrl(vd->fd, vd->s->control_list, vd->gain_id);
+        printf("%s, error for direct!!\n", caller);
+        return NULL;
     }
+
+    ctrl->value = ctrl_clamp(ctrl, (int64_t) ctrl->value + direct * MAX(ctrl->control.step, 1));
+    set_ctrl(vd->fd, vd->s->control_list, id);
+    return ctrl;
+}
+
+int exposure_control(struct vdIn *vd, int direct)
+{
+    Control *ctrl = step_control(vd, vd->exposure_id, direct, __func__);
+    if (!ctrl)
+        return -1;
+
+    vd->currExposureTime = ctrl->value;
+    if (exposure_unit_us(vd) > 0)
+        printf("%s: %i (%.1f ms)\n", ctrl->control.name, ctrl->value,
+                ctrl->value * exposure_unit_us(vd) / 1000);
     else
-    {
-        printf("%s, error for direct!!\n", __func__);
+        printf("%s: %i\n", ctrl->control.name, ctrl->value);
+    return 0;
+}
+
+int gain_control(struct vdIn *vd, int direct)
+{
+    Control *ctrl = step_control(vd, vd->gain_id, direct, __func__);
+    if (!ctrl)
         return -1;
-    }
 
     vd->currGainValue = ctrl->value;
-
-    print_control(ctrl, 0);
+    printf("%s: %i\n", ctrl->control.name, ctrl->value);
     return 0;
 }
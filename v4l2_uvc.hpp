@@ -22,11 +22,12 @@
 #include "defs.hpp"
 #include "v4l2_format.hpp"
 #include "v4l2_controls.hpp"
+#include "uvc_meta.hpp"
 
 #define LIST_CTL_METHOD_LOOP 0
 #define LIST_CTL_METHOD_NEXT_FLAG  1
 
-#define NB_BUFFER 4
+#define NB_BUFFER 8
 
 #define VDIN_DYNCTRL_OK            3
 #define VDIN_SELETIMEOUT_ERR       2
@@ -53,6 +54,11 @@
 //set ioctl retries to 4 - linux uvc as increased timeout from 1000 to 3000 ms
 #define IOCTL_RETRY 4
 
+//ROI crop method
+#define VDIN_ROI_NONE             0  // full frame
+#define VDIN_ROI_HW               1  // sensor/bridge crop (VIDIOC_S_SELECTION or VIDIOC_S_CROP)
+#define VDIN_ROI_SW               2  // strided sub-view of the mapped buffer
+
 //Control direct
 #define IOCTL_DIRECT_INC          1
 #define IOCTL_DIRECT_DEC          -1
@@ -76,6 +82,8 @@ struct vdIn
     UINT64 timestamp;                   // video frame time stamp
     int signalquit;                     // video loop exit flag
     uint64_t frame_index;               // captured frame index
+    uint32_t last_sequence;             // driver sequence of the last dequeued frame
+    uint64_t dropped_frames;            // frames lost by the driver (sequence gaps)
     LFormats *listFormats;              // structure with frame formats list
 
 	struct VidState *s;
@@ -88,12 +96,51 @@ struct vdIn
     int minGainValue;
     int currGainValue;
 
+    struct v4l2_rect roi;               // region handed to consumers (whole frame if no roi)
+    int roi_mode;                       // VDIN_ROI_NONE, VDIN_ROI_HW or VDIN_ROI_SW
+
+    struct UvcMeta *meta;               // metadata node stream (NULL - off)
+};
+
+/* driver buffer handed out without copy (must be given back with uvc_release_frame) */
+struct FrameLease
+{
+    int index;                          // driver buffer index
+    BYTE *data;                         // start of the mmap'd driver buffer
+    uint32_t bytesused;                 // payload size as set by VIDIOC_DQBUF
+    uint32_t sequence;                  // driver frame sequence
+    UINT64 timestamp;                   // buffer time stamp (ns)
+    struct UvcFrameMeta meta;           // payload header timing (meta.valid 0 - none)
+};
+
+/* rectangle of a frame buffer, addressed in place (first plane only for planar formats) */
+struct FrameView
+{
+    BYTE *data;                         // first byte of the top left pixel
+    int width;                          // pixels per row
+    int height;                         // rows
+    int stride;                         // bytes between rows
+    int pixbytes;                       // bytes per pixel
 };
 
 int init_videoIn(struct vdIn *videoIn, struct GLOBAL *global);
 
 int uvc_grab(struct vdIn *vd, struct GLOBAL *global, BYTE*& new_frame);
 
+int uvc_lease_frame(struct vdIn *vd, struct FrameLease *lease);
+
+int uvc_release_frame(struct vdIn *vd, struct FrameLease *lease);
+
+int uvc_frame_size(struct vdIn *vd, struct FrameLease *lease);
+
+int uvc_max_frame_size(struct vdIn *vd);
+
+int uvc_copy_frame(struct vdIn *vd, struct FrameLease *lease, BYTE *dst);
+
+int uvc_set_roi(struct vdIn *vd, struct GLOBAL *global, int left, int top, int width, int height);
+
+int uvc_roi_view(struct vdIn *vd, struct FrameLease *lease, struct FrameView *view);
+
 void close_videoIn(struct vdIn *videoIn);
 
 int xioctl(int fd, int IOCTL_X, void *arg);
@@ -102,8 +149,34 @@ int input_set_framerate (struct vdIn * device, int *fps, int *fps_num);
 
 int input_get_framerate (struct vdIn * device, int *fps, int *fps_num);
 
+/*
+ * step exposure or gain by one control step
+ * args:
+ * direct: IOCTL_DIRECT_INC or IOCTL_DIRECT_DEC
+ */
 int exposure_control(struct vdIn *vd, int direct);
 
 int gain_control(struct vdIn *vd, int direct);
 
+/*
+ * returns: microseconds per exposure control unit (0 - the driver gives
+ *          the exposure control no unit)
+ */
+double exposure_unit_us(struct vdIn *vd);
+
+/*
+ * longest exposure that fits one frame period (longer costs frame rate),
+ * on the control's step grid
+ * returns: control units (the control maximum when the exposure has no
+ *          unit or the frame rate is not known, 0 - no exposure control)
+ */
+int exposure_frame_max(struct vdIn *vd);
+
+/*
+ * switches the camera side auto exposure and auto gain off, in one
+ * transaction, before exposure and gain are set by hand
+ * returns: number of controls switched, -1 on error
+ */
+int exposure_manual(struct vdIn *vd);
+
 #endif
@@ -0,0 +1,1358 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/usb/video.h>
+#include <linux/uvcvideo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "v4l2_vcam.hpp"
+#include "v4l2_format.hpp"
+#include "ms_time.hpp"
+
+#define VCAM_MIN_SIZE 32
+#define VCAM_MAX_SIZE 4096
+#define VCAM_BAR_WIDTH 16
+
+static struct VCam *vcams[VCAM_MAX_FD];
+static __MUTEX_TYPE vcams_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int vcams_opened = 0;   // bus_info numbering
+
+static const uint32_t pattern_formats[] =
+{
+    V4L2_PIX_FMT_YUYV,
+    V4L2_PIX_FMT_UYVY,
+    V4L2_PIX_FMT_GREY,
+    V4L2_PIX_FMT_NV12,
+};
+#define NUM_PATTERN_FORMATS (int)(sizeof(pattern_formats) / sizeof(pattern_formats[0]))
+
+static const struct v4l2_frmsize_discrete pattern_sizes[] =
+{
+    { 640, 480 },
+    { DEFAULT_WIDTH, DEFAULT_HEIGHT },
+    { 1280, 720 },
+    { 1920, 1080 },
+};
+#define NUM_PATTERN_SIZES (int)(sizeof(pattern_sizes) / sizeof(pattern_sizes[0]))
+
+static const int pattern_rates[] = { 60, 30, 15 };
+#define NUM_PATTERN_RATES (int)(sizeof(pattern_rates) / sizeof(pattern_rates[0]))
+
+// the constant part of a VCamCtrl
+struct VCamCtrlInfo
+{
+    uint32_t id;
+    uint32_t type;
+    const char *name;
+    int32_t minimum;
+    int32_t maximum;
+    int32_t step;
+    int32_t default_value;
+    uint32_t menu_mask;
+};
+
+// uvcvideo-like controls, sorted by id (V4L2_CTRL_FLAG_NEXT_CTRL order)
+static const struct VCamCtrlInfo default_ctrls[VCAM_NUM_CTRLS] =
+{
+    { V4L2_CID_BRIGHTNESS, V4L2_CTRL_TYPE_INTEGER, "Brightness", -64, 64, 1, 0, 0 },
+    { V4L2_CID_CONTRAST, V4L2_CTRL_TYPE_INTEGER, "Contrast", 0, 100, 1, 50, 0 },
+    { V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CTRL_TYPE_BOOLEAN, "White Balance Temperature, Auto", 0, 1, 1, 1, 0 },
+    { V4L2_CID_GAIN, V4L2_CTRL_TYPE_INTEGER, "Gain", 16, 255, 1, 64, 0 },
+    { V4L2_CID_EXPOSURE_AUTO, V4L2_CTRL_TYPE_MENU, "Exposure, Auto", 0, 3, 1, V4L2_EXPOSURE_MANUAL,
+        (1 << V4L2_EXPOSURE_MANUAL) | (1 << V4L2_EXPOSURE_APERTURE_PRIORITY) },
+    { V4L2_CID_EXPOSURE_ABSOLUTE, V4L2_CTRL_TYPE_INTEGER, "Exposure (Absolute)", 3, 2047, 1, 166, 0 },
+};
+
+static const char *exposure_menu[] = { "Auto Mode", "Manual Mode", "Shutter Priority Mode",
+    "Aperture Priority Mode" };
+
+/* 75% color bars (Y, U, V) */
+static const BYTE bars[8][3] =
+{
+    { 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 }, { 112, 72, 58 },
+    { 84, 184, 198 }, { 65, 100, 212 }, { 35, 212, 114 }, { 16, 128, 128 },
+};
+
+static struct VCam *get_vcam(int fd)
+{
+    if (fd < 0 || fd >= VCAM_MAX_FD)
+        return NULL;
+    return vcams[fd];
+}
+
+static int fail(int err)
+{
+    errno = err;
+    return (-1);
+}
+
+static int pixel_bytes(uint32_t format)
+{
+    return format == V4L2_PIX_FMT_GREY || format == V4L2_PIX_FMT_NV12 ? 1 : 2;
+}
+
+static uint32_t image_size(uint32_t format, uint32_t width, uint32_t height)
+{
+    if (format == V4L2_PIX_FMT_NV12)
+        return width * height * 3 / 2;
+    return width * height * pixel_bytes(format);
+}
+
+static struct VCamCtrl *find_ctrl(struct VCam *cam, uint32_t id)
+{
+    for (int i = 0; i < VCAM_NUM_CTRLS; i++)
+        if (cam->ctrls[i].id == id)
+            return &cam->ctrls[i];
+    return NULL;
+}
+
+/*-------------------------------- frames -----------------------------------*/
+
+/* luma gain from exposure, gain, contrast and brightness in effect */
+static void build_pattern(struct VCam *cam)
+{
+    struct v4l2_pix_format *pix = &cam->pix;
+    double scale = (double) find_ctrl(cam, V4L2_CID_EXPOSURE_ABSOLUTE)->active / 166.0 *
+        find_ctrl(cam, V4L2_CID_GAIN)->active / 64.0 *
+        find_ctrl(cam, V4L2_CID_CONTRAST)->active / 50.0;
+    int offset = find_ctrl(cam, V4L2_CID_BRIGHTNESS)->active;
+    BYTE luma[8];
+
+    for (int b = 0; b < 8; b++)
+    {
+        int y = 16 + (int) ((bars[b][0] - 16) * scale) + offset;
+        luma[b] = CLIP(y);
+    }
+
+    free(cam->pattern);
+    cam->pattern = (BYTE *)malloc(pix->sizeimage);
+
+    for (uint32_t row = 0; row < pix->height; row++)
+    {
+        BYTE *line = cam->pattern + row * pix->bytesperline;
+        for (uint32_t x = 0; x < pix->width; x += 2)
+        {
+            int b = x * 8 / pix->width;
+            switch (pix->pixelformat)
+            {
+                case V4L2_PIX_FMT_YUYV:
+                    line[x * 2] = luma[b];
+                    line[x * 2 + 1] = bars[b][1];
+                    line[x * 2 + 2] = luma[b];
+                    line[x * 2 + 3] = bars[b][2];
+                    break;
+                case V4L2_PIX_FMT_UYVY:
+                    line[x * 2] = bars[b][1];
+                    line[x * 2 + 1] = luma[b];
+                    line[x * 2 + 2] = bars[b][2];
+                    line[x * 2 + 3] = luma[b];
+                    break;
+                default: // GREY and NV12 luma plane
+                    line[x] = luma[b];
+                    line[x + 1] = luma[b];
+                    break;
+            }
+        }
+    }
+    if (pix->pixelformat == V4L2_PIX_FMT_NV12)
+    {
+        BYTE *chroma = cam->pattern + pix->bytesperline * pix->height;
+        for (uint32_t row = 0; row < pix->height / 2; row++)
+            for (uint32_t x = 0; x < pix->width; x += 2)
+            {
+                int b = x * 8 / pix->width;
+                chroma[row * pix->bytesperline + x] = bars[b][1];
+                chroma[row * pix->bytesperline + x + 1] = bars[b][2];
+            }
+    }
+
+    cam->pattern_dirty = 0;
+}
+
+/* pattern frame: base image plus a bar moving with the sequence */
+static uint32_t render_pattern(struct VCam *cam, BYTE *dst)
+{
+    struct v4l2_pix_format *pix = &cam->pix;
+
+    if (cam->pattern_dirty)
+        build_pattern(cam);
+    memcpy(dst, cam->pattern, pix->sizeimage);
+
+    int pixbytes = pixel_bytes(pix->pixelformat);
+    int first = pix->pixelformat == V4L2_PIX_FMT_UYVY ? 1 : 0;
+    // moving frames so far: the first move of every 100 frames
+    uint32_t moved = cam->sequence / 100 * cam->move + MIN(cam->sequence % 100, cam->move);
+    uint32_t bar = (moved * 4) % (pix->width - VCAM_BAR_WIDTH);
+    for (uint32_t row = 0; row < pix->height; row++)
+    {
+        BYTE *line = dst + row * pix->bytesperline + bar * pixbytes + first;
+        for (int x = 0; x < VCAM_BAR_WIDTH; x++)
+            line[x * pixbytes] = 235;
+    }
+
+    return pix->sizeimage;
+}
+
+/* controls set with a delay take effect on this frame */
+static void apply_ctrls(struct VCam *cam)
+{
+    for (int i = 0; i < VCAM_NUM_CTRLS; i++)
+    {
+        struct VCamCtrl *ctrl = &cam->ctrls[i];
+        int n = 0;
+        while (n < ctrl->num_pending && (int32_t) (cam->sequence - ctrl->pending_sequence[n]) >= 0)
+            n++;
+        if (n == 0)
+            continue;
+        // the latest value due by this frame
+        if (ctrl->active != ctrl->pending[n - 1])
+        {
+            ctrl->active = ctrl->pending[n - 1];
+            cam->pattern_dirty = 1;
+        }
+        ctrl->num_pending -= n;
+        memmove(ctrl->pending, ctrl->pending + n, ctrl->num_pending * sizeof(int32_t));
+        memmove(ctrl->pending_sequence, ctrl->pending_sequence + n,
+                ctrl->num_pending * sizeof(uint32_t));
+    }
+}
+
+/* device clock ticks at host time ns */
+static uint32_t device_clock(struct VCam *cam, UINT64 ns)
+{
+    double hz = VCAM_META_CLOCK_HZ * (1 + VCAM_META_CLOCK_PPM / 1e6);
+    return (uint32_t) (UINT64) ((double) (ns - cam->clock_base_ns) * hz / G_NSEC_PER_SEC);
+}
+
+/* metadata of the frame started at ns: one payload header with PTS and SCR */
+static void produce_meta(struct VCam *cam, UINT64 ns, uint32_t sequence)
+{
+    if (!cam->meta_streaming)
+        return;
+    if (cam->meta_num_queued == 0)
+    {
+        cam->meta_lost++;
+        return;
+    }
+
+    int index = cam->meta_queued[0];
+    memmove(cam->meta_queued, cam->meta_queued + 1, --cam->meta_num_queued * sizeof(int));
+
+    UINT64 sent = ns + VCAM_META_SEND_NS;
+    UINT64 host = sent + VCAM_META_USB_NS;
+    uint32_t pts = device_clock(cam, ns);
+    uint32_t stc = device_clock(cam, sent);
+    uint16_t sof = (host / 1000000) & 0x7ff; // USB frame number, one per ms
+
+    struct uvc_meta_buf *block = (struct uvc_meta_buf *) cam->meta_mem[index];
+    block->ns = host;
+    block->sof = sof;
+    block->length = 12;
+    block->flags = UVC_STREAM_EOH | UVC_STREAM_SCR | UVC_STREAM_PTS | (sequence & 1 ? UVC_STREAM_FID : 0);
+    memcpy(block->buf, &pts, 4);
+    memcpy(block->buf + 4, &stc, 4);
+    memcpy(block->buf + 8, &sof, 2);
+
+    struct v4l2_buffer *buf = &cam->meta_buf[index];
+    buf->bytesused = sizeof(struct uvc_meta_buf) + block->length - 2;
+    buf->sequence = sequence;
+    buf->timestamp.tv_sec = ns / G_NSEC_PER_SEC;
+    buf->timestamp.tv_usec = (ns % G_NSEC_PER_SEC) / 1000;
+    buf->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    cam->meta_done[cam->meta_num_done++] = index;
+}
+
+/* fill the oldest empty buffer with the frame due at ns */
+static void produce_frame(struct VCam *cam, UINT64 ns)
+{
+    apply_ctrls(cam);
+
+    if (cam->num_queued == 0)
+    {
+        // nowhere to put it: the sequence shows the gap
+        cam->sequence++;
+        cam->lost++;
+        return;
+    }
+
+    int index = cam->queued[0];
+    memmove(cam->queued, cam->queued + 1, --cam->num_queued * sizeof(int));
+
+    struct v4l2_buffer *buf = &cam->buf[index];
+    int size = 0;
+    if (cam->source == VCAM_SOURCE_FILE)
+    {
+        size = stream_reader_read(cam->reader, cam->replay_frame, cam->mem[index],
+                buf->length, NULL);
+        cam->replay_frame = (cam->replay_frame + 1) % cam->reader->header.frame_count;
+        if (size < 0)
+            size = 0;
+    }
+    else
+        size = render_pattern(cam, cam->mem[index]);
+
+    buf->bytesused = size;
+    buf->sequence = cam->sequence++;
+    buf->timestamp.tv_sec = ns / G_NSEC_PER_SEC;
+    buf->timestamp.tv_usec = (ns % G_NSEC_PER_SEC) / 1000;
+    buf->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    buf->field = V4L2_FIELD_NONE;
+    cam->done[cam->num_done++] = index;
+    cam->produced++;
+    // before the frame can be dequeued, like the uvc driver completes it
+    produce_meta(cam, ns, buf->sequence);
+}
+
+/* arm the timer: now if frames are waiting, otherwise at the next frame */
+static void arm_timer(struct VCam *cam)
+{
+    struct itimerspec its;
+    UINT64 when = cam->num_done ? 1 : cam->next_ns;
+
+    memset(&its, 0, sizeof(its));
+    if (cam->streaming)
+    {
+        its.it_value.tv_sec = when / G_NSEC_PER_SEC;
+        its.it_value.tv_nsec = when % G_NSEC_PER_SEC;
+    }
+    timerfd_settime(cam->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* next frame time, simulated losses are skipped here so no wake up is wasted on them */
+static void schedule_next(struct VCam *cam)
+{
+    UINT64 period = (UINT64) G_NSEC_PER_SEC * cam->fps_num / cam->fps;
+
+    cam->nominal_ns += period;
+    while (cam->drop > 0 && rand_r(&cam->seed) < cam->drop * RAND_MAX)
+    {
+        cam->nominal_ns += period;
+        cam->sequence++;
+        cam->lost++;
+    }
+    cam->next_ns = cam->nominal_ns;
+    if (cam->jitter > 0)
+    {
+        double j = ((double) rand_r(&cam->seed) / RAND_MAX * 2 - 1) * cam->jitter;
+        cam->next_ns += (INT64) (j * period);
+    }
+}
+
+/* produce every frame due by now (the driver keeps filling while we are late) */
+static void advance(struct VCam *cam)
+{
+    UINT64 now = ns_time_monotonic();
+    UINT64 expirations;
+
+    // clear the readable state, re-armed below
+    if (read(cam->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        printf("vcam: timer read failed: %s\n", strerror(errno));
+
+    while (cam->next_ns <= now)
+    {
+        produce_frame(cam, cam->next_ns);
+        schedule_next(cam);
+    }
+    arm_timer(cam);
+}
+
+/*-------------------------------- ioctls -----------------------------------*/
+
+static int querycap(struct VCam *cam, struct v4l2_capability *cap)
+{
+    memset(cap, 0, sizeof(*cap));
+    snprintf((char *) cap->driver, sizeof(cap->driver), "vcam");
+    snprintf((char *) cap->card, sizeof(cap->card), "Virtual Camera (%s)",
+            cam->name + strlen(VCAM_PREFIX));
+    snprintf((char *) cap->bus_info, sizeof(cap->bus_info), "virtual:%i", cam->fd);
+    cap->version = 0x00010000;
+    cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return (0);
+}
+
+static int enum_fmt(struct VCam *cam, struct v4l2_fmtdesc *fmt)
+{
+    uint32_t format;
+
+    if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return fail(EINVAL);
+    if (cam->source == VCAM_SOURCE_FILE)
+    {
+        if (fmt->index > 0)
+            return fail(EINVAL);
+        format = cam->reader->header.format;
+    }
+    else
+    {
+        if (fmt->index >= NUM_PATTERN_FORMATS)
+            return fail(EINVAL);
+        format = pattern_formats[fmt->index];
+    }
+
+    fmt->pixelformat = format;
+    fmt->flags = get_pixBytes(format) == 0 ? V4L2_FMT_FLAG_COMPRESSED : 0;
+    snprintf((char *) fmt->description, sizeof(fmt->description), "%c%c%c%c",
+            format & 0xFF, (format >> 8) & 0xFF, (format >> 16) & 0xFF, (format >> 24) & 0xFF);
+    return (0);
+}
+
+static int has_format(struct VCam *cam, uint32_t format)
+{
+    if (cam->source == VCAM_SOURCE_FILE)
+        return format == cam->reader->header.format;
+    for (int i = 0; i < NUM_PATTERN_FORMATS; i++)
+        if (pattern_formats[i] == format)
+            return 1;
+    return 0;
+}
+
+static int enum_framesizes(struct VCam *cam, struct v4l2_frmsizeenum *fsize)
+{
+    if (!has_format(cam, fsize->pixel_format))
+        return fail(EINVAL);
+
+    fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    if (cam->source == VCAM_SOURCE_FILE)
+    {
+        if (fsize->index > 0)
+            return fail(EINVAL);
+        fsize->discrete.width = cam->reader->header.width;
+        fsize->discrete.height = cam->reader->header.height;
+        return (0);
+    }
+    if (fsize->index >= NUM_PATTERN_SIZES)
+        return fail(EINVAL);
+    fsize->discrete = pattern_sizes[fsize->index];
+    return (0);
+}
+
+static int enum_frameintervals(struct VCam *cam, struct v4l2_frmivalenum *fival)
+{
+    if (!has_format(cam, fival->pixel_format))
+        return fail(EINVAL);
+
+    fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+    fival->discrete.numerator = 1;
+    if (cam->fixed_fps)
+    {
+        if (fival->index > 0)
+            return fail(EINVAL);
+        fival->discrete.denominator = cam->fixed_fps;
+        return (0);
+    }
+    if (fival->index >= NUM_PATTERN_RATES)
+        return fail(EINVAL);
+    fival->discrete.denominator = pattern_rates[fival->index];
+    return (0);
+}
+
+/* adjust the format to what the camera can do (like VIDIOC_TRY_FMT) */
+static int try_fmt(struct VCam *cam, struct v4l2_format *fmt)
+{
+    struct v4l2_pix_format *pix = &fmt->fmt.pix;
+
+    if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return fail(EINVAL);
+
+    if (cam->source == VCAM_SOURCE_FILE)
+    {
+        pix->pixelformat = cam->reader->header.format;
+        pix->width = cam->reader->header.width;
+        pix->height = cam->reader->header.height;
+    }
+    else
+    {
+        if (!has_format(cam, pix->pixelformat))
+            pix->pixelformat = pattern_formats[0];
+        pix->width = MIN(MAX(pix->width, VCAM_MIN_SIZE), VCAM_MAX_SIZE) & ~1;
+        pix->height = MIN(MAX(pix->height, VCAM_MIN_SIZE), VCAM_MAX_SIZE) & ~1;
+    }
+
+    pix->field = V4L2_FIELD_NONE;
+    pix->colorspace = V4L2_COLORSPACE_SRGB;
+    if (get_pixBytes(pix->pixelformat) == 0)
+    {
+        // compressed: room for the largest recorded payload
+        pix->bytesperline = 0;
+        pix->sizeimage = cam->reader->max_size;
+    }
+    else
+    {
+        pix->bytesperline = pix->width * pixel_bytes(pix->pixelformat);
+        pix->sizeimage = image_size(pix->pixelformat, pix->width, pix->height);
+        if (cam->reader)
+            pix->sizeimage = MAX(pix->sizeimage, cam->reader->max_size);
+    }
+    return (0);
+}
+
+static int s_fmt(struct VCam *cam, struct v4l2_format *fmt)
+{
+    if (cam->num_buffers)
+        return fail(EBUSY);
+    if (try_fmt(cam, fmt) < 0)
+        return (-1);
+    cam->pix = fmt->fmt.pix;
+    cam->pattern_dirty = 1;
+    return (0);
+}
+
+static int g_fmt(struct VCam *cam, struct v4l2_format *fmt)
+{
+    if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return fail(EINVAL);
+    fmt->fmt.pix = cam->pix;
+    return (0);
+}
+
+static int g_parm(struct VCam *cam, struct v4l2_streamparm *parm)
+{
+    if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return fail(EINVAL);
+    memset(&parm->parm.capture, 0, sizeof(parm->parm.capture));
+    parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+    parm->parm.capture.timeperframe.numerator = cam->fps_num;
+    parm->parm.capture.timeperframe.denominator = cam->fps;
+    parm->parm.capture.readbuffers = cam->num_buffers;
+    return (0);
+}
+
+static int s_parm(struct VCam *cam, struct v4l2_streamparm *parm)
+{
+    struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+
+    if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return fail(EINVAL);
+    if (!cam->fixed_fps && tpf->numerator && tpf->denominator)
+    {
+        cam->fps_num = tpf->numerator;
+        cam->fps = tpf->denominator;
+    }
+    return g_parm(cam, parm);
+}
+
+static void free_buffers(struct VCam *cam)
+{
+    for (int i = 0; i < cam->num_buffers; i++)
+        munmap(cam->mem[i], cam->buffer_stride);
+    cam->num_buffers = 0;
+    cam->num_queued = 0;
+    cam->num_done = 0;
+}
+
+static int reqbufs(struct VCam *cam, struct v4l2_requestbuffers *rb)
+{
+    if (rb->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || rb->memory != V4L2_MEMORY_MMAP)
+        return fail(EINVAL);
+    if (cam->streaming)
+        return fail(EBUSY);
+
+    free_buffers(cam);
+    if (rb->count == 0)
+        return (0);
+
+    rb->count = MIN(rb->count, VCAM_MAX_BUFFERS);
+    size_t page = sysconf(_SC_PAGESIZE);
+    cam->buffer_stride = (cam->pix.sizeimage + page - 1) / page * page;
+    for (uint32_t i = 0; i < rb->count; i++)
+    {
+        // anonymous pages: aligned and sized like driver buffers
+        cam->mem[i] = (BYTE *) mmap(NULL, cam->buffer_stride, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cam->mem[i] == MAP_FAILED)
+        {
+            free_buffers(cam);
+            return fail(ENOMEM);
+        }
+        cam->num_buffers++;
+
+        struct v4l2_buffer *buf = &cam->buf[i];
+        memset(buf, 0, sizeof(*buf));
+        buf->index = i;
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
+        buf->length = cam->pix.sizeimage;
+        buf->m.offset = i * cam->buffer_stride;
+    }
+    return (0);
+}
+
+static int querybuf(struct VCam *cam, struct v4l2_buffer *buf)
+{
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->index >= (uint32_t) cam->num_buffers)
+        return fail(EINVAL);
+    *buf = cam->buf[buf->index];
+    return (0);
+}
+
+static int qbuf(struct VCam *cam, struct v4l2_buffer *buf)
+{
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->memory != V4L2_MEMORY_MMAP ||
+            buf->index >= (uint32_t) cam->num_buffers)
+        return fail(EINVAL);
+    for (int i = 0; i < cam->num_queued; i++)
+        if (cam->queued[i] == (int) buf->index)
+            return fail(EINVAL);
+    for (int i = 0; i < cam->num_done; i++)
+        if (cam->done[i] == (int) buf->index)
+            return fail(EINVAL);
+
+    cam->buf[buf->index].flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_QUEUED;
+    cam->queued[cam->num_queued++] = buf->index;
+    return (0);
+}
+
+static int dqbuf(struct VCam *cam, struct v4l2_buffer *buf)
+{
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->memory != V4L2_MEMORY_MMAP)
+        return fail(EINVAL);
+    if (!cam->streaming)
+        return fail(EINVAL);
+
+    advance(cam);
+    if (cam->num_done == 0 && cam->num_queued > 0)
+    {
+        // woken early: wait for the frame like a driver completing it
+        // (unlocked, consumers queue buffers meanwhile)
+        UINT64 due = cam->next_ns;
+        __UNLOCK_MUTEX(&cam->mutex);
+        sleep_until_ns(due);
+        __LOCK_MUTEX(&cam->mutex);
+        if (!cam->streaming)
+            return fail(EINVAL);
+        advance(cam);
+    }
+    if (cam->num_done == 0)
+        return fail(EAGAIN); // O_NONBLOCK semantics
+
+    int index = cam->done[0];
+    memmove(cam->done, cam->done + 1, --cam->num_done * sizeof(int));
+    *buf = cam->buf[index];
+    cam->buf[index].flags = V4L2_BUF_FLAG_MAPPED;
+    arm_timer(cam);
+    return (0);
+}
+
+static int streamon(struct VCam *cam)
+{
+    if (cam->num_buffers == 0)
+        return fail(EINVAL);
+    if (cam->streaming)
+        return (0);
+
+    cam->streaming = 1;
+    cam->sequence = 0;
+    cam->nominal_ns = ns_time_monotonic();
+    schedule_next(cam);
+    arm_timer(cam);
+    return (0);
+}
+
+static int streamoff(struct VCam *cam)
+{
+    cam->streaming = 0;
+    cam->num_queued = 0;
+    cam->num_done = 0;
+    for (int i = 0; i < cam->num_buffers; i++)
+        cam->buf[i].flags = V4L2_BUF_FLAG_MAPPED;
+    arm_timer(cam); // disarm
+    return (0);
+}
+
+static int queryctrl(struct VCam *cam, struct v4l2_queryctrl *qc)
+{
+    struct VCamCtrl *ctrl = NULL;
+
+    if (qc->id & V4L2_CTRL_FLAG_NEXT_CTRL)
+    {
+        uint32_t id = qc->id & ~(V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+        for (int i = 0; i < VCAM_NUM_CTRLS && !ctrl; i++)
+            if (cam->ctrls[i].id > id)
+                ctrl = &cam->ctrls[i];
+    }
+    else
+        ctrl = find_ctrl(cam, qc->id);
+    if (!ctrl)
+        return fail(EINVAL);
+
+    memset(qc, 0, sizeof(*qc));
+    qc->id = ctrl->id;
+    qc->type = ctrl->type;
+    snprintf((char *) qc->name, sizeof(qc->name), "%s", ctrl->name);
+    qc->minimum = ctrl->minimum;
+    qc->maximum = ctrl->maximum;
+    qc->step = ctrl->step;
+    qc->default_value = ctrl->default_value;
+    qc->flags = ctrl->flags;
+    return (0);
+}
+
+static int querymenu(struct VCam *cam, struct v4l2_querymenu *qm)
+{
+    struct VCamCtrl *ctrl = find_ctrl(cam, qm->id);
+
+    if (!ctrl || ctrl->type != V4L2_CTRL_TYPE_MENU || qm->index > (uint32_t) ctrl->maximum ||
+            !(ctrl->menu_mask & (1 << qm->index)))
+        return fail(EINVAL);
+    snprintf((char *) qm->name, sizeof(qm->name), "%s", exposure_menu[qm->index]);
+    return (0);
+}
+
+/* clamp to the control range and step like the v4l2 core */
+static int check_value(struct VCamCtrl *ctrl, int32_t *value)
+{
+    switch (ctrl->type)
+    {
+        case V4L2_CTRL_TYPE_MENU:
+            if (*value < ctrl->minimum || *value > ctrl->maximum ||
+                    !(ctrl->menu_mask & (1 << *value)))
+                return (-1);
+            return (0);
+
+        case V4L2_CTRL_TYPE_BOOLEAN:
+            *value = !!*value;
+            return (0);
+
+        default:
+            *value = MIN(MAX(*value, ctrl->minimum), ctrl->maximum);
+            *value = ctrl->minimum + (*value - ctrl->minimum + ctrl->step / 2) / ctrl->step * ctrl->step;
+            if (*value > ctrl->maximum)
+                *value -= ctrl->step;
+            return (0);
+    }
+}
+
+/* queues a control event for a subscription with feedback */
+static void queue_event(struct VCam *cam, struct VCamCtrl *ctrl, uint32_t changes)
+{
+    if (!ctrl->subscribed || !(ctrl->sub_flags & V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK))
+        return;
+    if (cam->num_events == VCAM_MAX_EVENTS)
+    {
+        // like the v4l2 core: the oldest event is lost
+        memmove(&cam->events[0], &cam->events[1], (VCAM_MAX_EVENTS - 1) * sizeof(struct v4l2_event));
+        cam->num_events--;
+    }
+
+    struct v4l2_event *ev = &cam->events[cam->num_events++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = V4L2_EVENT_CTRL;
+    ev->id = ctrl->id;
+    ev->sequence = cam->event_sequence++;
+    clock_gettime(CLOCK_MONOTONIC, &ev->timestamp);
+    ev->u.ctrl.changes = changes;
+    ev->u.ctrl.type = ctrl->type;
+    ev->u.ctrl.value = ctrl->value;
+    ev->u.ctrl.flags = ctrl->flags;
+    ev->u.ctrl.minimum = ctrl->minimum;
+    ev->u.ctrl.maximum = ctrl->maximum;
+    ev->u.ctrl.step = ctrl->step;
+    ev->u.ctrl.default_value = ctrl->default_value;
+}
+
+static void set_value(struct VCam *cam, struct VCamCtrl *ctrl, int32_t value)
+{
+    int changed = ctrl->value != value;
+    ctrl->value = value;
+    if (changed)
+        queue_event(cam, ctrl, V4L2_EVENT_CTRL_CH_VALUE);
+    if (ctrl->id == V4L2_CID_EXPOSURE_AUTO)
+    {
+        // the absolute exposure only applies in manual and shutter priority modes
+        struct VCamCtrl *exposure = find_ctrl(cam, V4L2_CID_EXPOSURE_ABSOLUTE);
+        uint32_t flags = (value == V4L2_EXPOSURE_MANUAL || value == V4L2_EXPOSURE_SHUTTER_PRIORITY) ?
+            0 : V4L2_CTRL_FLAG_INACTIVE;
+        if (exposure->flags != flags)
+        {
+            exposure->flags = flags;
+            queue_event(cam, exposure, V4L2_EVENT_CTRL_CH_FLAGS);
+        }
+    }
+    if (!cam->streaming || cam->delay == 0)
+    {
+        ctrl->active = value;
+        ctrl->num_pending = 0;
+        cam->pattern_dirty = 1;
+        return;
+    }
+    // latched for frame sequence + delay (a full pipeline loses its oldest value)
+    if (ctrl->num_pending == VCAM_CTRL_PIPE)
+    {
+        ctrl->num_pending--;
+        memmove(ctrl->pending, ctrl->pending + 1, ctrl->num_pending * sizeof(int32_t));
+        memmove(ctrl->pending_sequence, ctrl->pending_sequence + 1,
+                ctrl->num_pending * sizeof(uint32_t));
+    }
+    ctrl->pending[ctrl->num_pending] = value;
+    ctrl->pending_sequence[ctrl->num_pending++] = cam->sequence + cam->delay;
+}
+
+static int g_ctrl(struct VCam *cam, struct v4l2_control *c)
+{
+    struct VCamCtrl *ctrl = find_ctrl(cam, c->id);
+    if (!ctrl)
+        return fail(EINVAL);
+    c->value = ctrl->value;
+    return (0);
+}
+
+static int s_ctrl(struct VCam *cam, struct v4l2_control *c)
+{
+    struct VCamCtrl *ctrl = find_ctrl(cam, c->id);
+    if (!ctrl)
+        return fail(EINVAL);
+    if (check_value(ctrl, &c->value) < 0)
+        return fail(EINVAL);
+    set_value(cam, ctrl, c->value);
+    return (0);
+}
+
+/* G/S/TRY_EXT_CTRLS: all or nothing, error_idx points at the bad control */
+static int ext_ctrls(struct VCam *cam, unsigned int request, struct v4l2_ext_controls *ctrls)
+{
+    struct VCamCtrl *found[V4L2_CID_MAX_CTRLS];
+
+    if (ctrls->count > V4L2_CID_MAX_CTRLS)
+    {
+        // as the kernel: no controls are looked at
+        ctrls->error_idx = ctrls->count;
+        return fail(E2BIG);
+    }
+    for (uint32_t i = 0; i < ctrls->count; i++)
+    {
+        struct v4l2_ext_control *c = &ctrls->controls[i];
+        found[i] = find_ctrl(cam, c->id);
+        if (!found[i] || (ctrls->ctrl_class && V4L2_CTRL_ID2CLASS(c->id) != ctrls->ctrl_class))
+        {
+            ctrls->error_idx = (request == VIDIOC_S_EXT_CTRLS) ? ctrls->count : i;
+            return fail(EINVAL);
+        }
+        int32_t value = c->value; // v4l2_ext_control is packed
+        if (request != VIDIOC_G_EXT_CTRLS && check_value(found[i], &value) < 0)
+        {
+            ctrls->error_idx = (request == VIDIOC_S_EXT_CTRLS) ? ctrls->count : i;
+            return fail(EINVAL);
+        }
+        c->value = value;
+    }
+
+    for (uint32_t i = 0; i < ctrls->count; i++)
+    {
+        if (request == VIDIOC_G_EXT_CTRLS)
+            ctrls->controls[i].value = found[i]->value;
+        else if (request == VIDIOC_S_EXT_CTRLS)
+            set_value(cam, found[i], ctrls->controls[i].value);
+    }
+    return (0);
+}
+
+/* control events only (V4L2_EVENT_ALL unsubscribes everything) */
+static int subscribe_event(struct VCam *cam, unsigned int request, struct v4l2_event_subscription *sub)
+{
+    if (request == VIDIOC_UNSUBSCRIBE_EVENT && sub->type == V4L2_EVENT_ALL)
+    {
+        for (int i = 0; i < VCAM_NUM_CTRLS; i++)
+            cam->ctrls[i].subscribed = 0;
+        cam->num_events = 0;
+        return (0);
+    }
+
+    struct VCamCtrl *ctrl = find_ctrl(cam, sub->id);
+    if (sub->type != V4L2_EVENT_CTRL || !ctrl)
+        return fail(EINVAL);
+    ctrl->subscribed = request == VIDIOC_SUBSCRIBE_EVENT;
+    ctrl->sub_flags = sub->flags;
+    if (ctrl->subscribed && (sub->flags & V4L2_EVENT_SUB_FL_SEND_INITIAL))
+    {
+        ctrl->sub_flags |= V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK; // the initial event is always sent
+        queue_event(cam, ctrl, V4L2_EVENT_CTRL_CH_VALUE | V4L2_EVENT_CTRL_CH_FLAGS);
+        ctrl->sub_flags = sub->flags;
+    }
+    return (0);
+}
+
+static int dqevent(struct VCam *cam, struct v4l2_event *ev)
+{
+    if (cam->num_events == 0)
+        return fail(ENOENT);
+    *ev = cam->events[0];
+    cam->num_events--;
+    memmove(&cam->events[0], &cam->events[1], cam->num_events * sizeof(struct v4l2_event));
+    ev->pending = cam->num_events;
+    return (0);
+}
+
+/*------------------------------ metadata node ------------------------------*/
+
+static void free_meta_buffers(struct VCam *cam)
+{
+    for (int i = 0; i < cam->meta_num_buffers; i++)
+        munmap(cam->meta_mem[i], VCAM_META_SIZE);
+    cam->meta_num_buffers = 0;
+    cam->meta_num_queued = 0;
+    cam->meta_num_done = 0;
+}
+
+static int meta_fmt(struct v4l2_format *fmt)
+{
+    if (fmt->type != V4L2_BUF_TYPE_META_CAPTURE)
+        return fail(EINVAL);
+    fmt->fmt.meta.dataformat = V4L2_META_FMT_UVC;
+    fmt->fmt.meta.buffersize = VCAM_META_SIZE;
+    return (0);
+}
+
+static int meta_reqbufs(struct VCam *cam, struct v4l2_requestbuffers *rb)
+{
+    if (rb->type != V4L2_BUF_TYPE_META_CAPTURE || rb->memory != V4L2_MEMORY_MMAP)
+        return fail(EINVAL);
+    if (cam->meta_streaming)
+        return fail(EBUSY);
+
+    free_meta_buffers(cam);
+    rb->count = MIN(rb->count, VCAM_META_BUFFERS);
+    for (uint32_t i = 0; i < rb->count; i++)
+    {
+        cam->meta_mem[i] = (BYTE *) mmap(NULL, VCAM_META_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cam->meta_mem[i] == MAP_FAILED)
+        {
+            free_meta_buffers(cam);
+            return fail(ENOMEM);
+        }
+        cam->meta_num_buffers++;
+
+        struct v4l2_buffer *buf = &cam->meta_buf[i];
+        memset(buf, 0, sizeof(*buf));
+        buf->index = i;
+        buf->type = V4L2_BUF_TYPE_META_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
+        buf->length = VCAM_META_SIZE;
+        buf->m.offset = i * sysconf(_SC_PAGESIZE);
+    }
+    return (0);
+}
+
+static int meta_buffer(struct VCam *cam, unsigned int request, struct v4l2_buffer *buf)
+{
+    if (buf->type != V4L2_BUF_TYPE_META_CAPTURE || buf->memory != V4L2_MEMORY_MMAP)
+        return fail(EINVAL);
+
+    if (request == VIDIOC_DQBUF)
+    {
+        // filled with their frames, nothing to wait for
+        if (!cam->meta_streaming)
+            return fail(EINVAL);
+        if (cam->meta_num_done == 0)
+            return fail(EAGAIN);
+        int index = cam->meta_done[0];
+        memmove(cam->meta_done, cam->meta_done + 1, --cam->meta_num_done * sizeof(int));
+        *buf = cam->meta_buf[index];
+        cam->meta_buf[index].flags = V4L2_BUF_FLAG_MAPPED;
+        return (0);
+    }
+
+    if (buf->index >= (uint32_t) cam->meta_num_buffers)
+        return fail(EINVAL);
+    if (request == VIDIOC_QUERYBUF)
+    {
+        *buf = cam->meta_buf[buf->index];
+        return (0);
+    }
+    if (cam->meta_buf[buf->index].flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE))
+        return fail(EINVAL);
+    cam->meta_buf[buf->index].flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_QUEUED;
+    cam->meta_queued[cam->meta_num_queued++] = buf->index;
+    return (0);
+}
+
+static int meta_stream(struct VCam *cam, int on)
+{
+    if (on && cam->meta_num_buffers == 0)
+        return fail(EINVAL);
+    cam->meta_streaming = on;
+    if (!on)
+    {
+        cam->meta_num_queued = 0;
+        cam->meta_num_done = 0;
+        for (int i = 0; i < cam->meta_num_buffers; i++)
+            cam->meta_buf[i].flags = V4L2_BUF_FLAG_MAPPED;
+    }
+    return (0);
+}
+
+static int meta_ioctl(struct VCam *cam, unsigned int request, void *arg)
+{
+    switch (request)
+    {
+        case VIDIOC_QUERYCAP:
+        {
+            struct v4l2_capability *cap = (struct v4l2_capability *) arg;
+            querycap(cam, cap);
+            cap->device_caps = V4L2_CAP_META_CAPTURE | V4L2_CAP_STREAMING;
+            cap->capabilities |= V4L2_CAP_META_CAPTURE;
+            return (0);
+        }
+        case VIDIOC_TRY_FMT:
+        case VIDIOC_S_FMT:
+        case VIDIOC_G_FMT:
+            return meta_fmt((struct v4l2_format *) arg);
+        case VIDIOC_REQBUFS:
+            return meta_reqbufs(cam, (struct v4l2_requestbuffers *) arg);
+        case VIDIOC_QUERYBUF:
+        case VIDIOC_QBUF:
+        case VIDIOC_DQBUF:
+            return meta_buffer(cam, request, (struct v4l2_buffer *) arg);
+        case VIDIOC_STREAMON:
+        case VIDIOC_STREAMOFF:
+            if (*(int *) arg != V4L2_BUF_TYPE_META_CAPTURE)
+                return fail(EINVAL);
+            return meta_stream(cam, request == VIDIOC_STREAMON);
+        default:
+            return fail(ENOTTY);
+    }
+}
+
+/* unregisters and closes the metadata node */
+static void close_meta(struct VCam *cam)
+{
+    __LOCK_MUTEX(&vcams_mutex);
+    vcams[cam->meta_fd] = NULL;
+    __UNLOCK_MUTEX(&vcams_mutex);
+
+    if (cam->meta_lost)
+        printf("vcam: %s metadata lost for %llu frames\n", cam->name, cam->meta_lost);
+    free_meta_buffers(cam);
+    close(cam->meta_fd);
+    cam->meta_fd = -1;
+    cam->meta_streaming = 0;
+}
+
+static int device_ioctl(struct VCam *cam, unsigned int request, void *arg)
+{
+    switch (request)
+    {
+        case VIDIOC_QUERYCAP:
+            return querycap(cam, (struct v4l2_capability *) arg);
+        case VIDIOC_ENUM_FMT:
+            return enum_fmt(cam, (struct v4l2_fmtdesc *) arg);
+        case VIDIOC_ENUM_FRAMESIZES:
+            return enum_framesizes(cam, (struct v4l2_frmsizeenum *) arg);
+        case VIDIOC_ENUM_FRAMEINTERVALS:
+            return enum_frameintervals(cam, (struct v4l2_frmivalenum *) arg);
+        case VIDIOC_TRY_FMT:
+            return try_fmt(cam, (struct v4l2_format *) arg);
+        case VIDIOC_S_FMT:
+            return s_fmt(cam, (struct v4l2_format *) arg);
+        case VIDIOC_G_FMT:
+            return g_fmt(cam, (struct v4l2_format *) arg);
+        case VIDIOC_G_PARM:
+            return g_parm(cam, (struct v4l2_streamparm *) arg);
+        case VIDIOC_S_PARM:
+            return s_parm(cam, (struct v4l2_streamparm *) arg);
+        case VIDIOC_REQBUFS:
+            return reqbufs(cam, (struct v4l2_requestbuffers *) arg);
+        case VIDIOC_QUERYBUF:
+            return querybuf(cam, (struct v4l2_buffer *) arg);
+        case VIDIOC_QBUF:
+            return qbuf(cam, (struct v4l2_buffer *) arg);
+        case VIDIOC_DQBUF:
+            return dqbuf(cam, (struct v4l2_buffer *) arg);
+        case VIDIOC_STREAMON:
+            return streamon(cam);
+        case VIDIOC_STREAMOFF:
+            return streamoff(cam);
+        case VIDIOC_QUERYCTRL:
+            return queryctrl(cam, (struct v4l2_queryctrl *) arg);
+        case VIDIOC_QUERYMENU:
+            return querymenu(cam, (struct v4l2_querymenu *) arg);
+        case VIDIOC_G_CTRL:
+            return g_ctrl(cam, (struct v4l2_control *) arg);
+        case VIDIOC_S_CTRL:
+            return s_ctrl(cam, (struct v4l2_control *) arg);
+        case VIDIOC_G_EXT_CTRLS:
+        case VIDIOC_S_EXT_CTRLS:
+        case VIDIOC_TRY_EXT_CTRLS:
+            return ext_ctrls(cam, request, (struct v4l2_ext_controls *) arg);
+        case VIDIOC_SUBSCRIBE_EVENT:
+        case VIDIOC_UNSUBSCRIBE_EVENT:
+            return subscribe_event(cam, request, (struct v4l2_event_subscription *) arg);
+        case VIDIOC_DQEVENT:
+            return dqevent(cam, (struct v4l2_event *) arg);
+        default:
+            // no cropping, selection, ...
+            return fail(ENOTTY);
+    }
+}
+
+/*
+ * ioctl emulation: one call at a time per camera (buffers are returned
+ * by consumer threads while the capture thread dequeues)
+ */
+int vcam_ioctl(int fd, unsigned int request, void *arg)
+{
+    struct VCam *cam = get_vcam(fd);
+    if (!cam)
+        return fail(EBADF);
+
+    __LOCK_MUTEX(&cam->mutex);
+    int ret = fd == cam->meta_fd ? meta_ioctl(cam, request, arg) : device_ioctl(cam, request, arg);
+    int err = errno;
+    __UNLOCK_MUTEX(&cam->mutex);
+    errno = err;
+    return ret;
+}
+
+/*--------------------------------- device ----------------------------------*/
+
+int vcam_is_device(const char *device)
+{
+    return device && strncmp(device, VCAM_PREFIX, strlen(VCAM_PREFIX)) == 0;
+}
+
+int vcam_is_open(int fd)
+{
+    return get_vcam(fd) != NULL;
+}
+
+/* source[,fps=n][,jitter=p][,drop=p][,delay=n][,move=p] */
+static int parse_device(struct VCam *cam, const char *device)
+{
+    char *spec = strdup(device + strlen(VCAM_PREFIX));
+    char *save = NULL;
+    char *source = strtok_r(spec, ",", &save);
+    int ret = 0;
+
+    if (!source || !*source)
+        ret = -1;
+    else if (strcmp(source, "pattern") == 0)
+        cam->source = VCAM_SOURCE_PATTERN;
+    else
+    {
+        cam->source = VCAM_SOURCE_FILE;
+        cam->reader = stream_reader_open(source);
+        if (!cam->reader)
+            ret = -1;
+    }
+
+    for (char *opt = strtok_r(NULL, ",", &save); opt && ret == 0; opt = strtok_r(NULL, ",", &save))
+    {
+        if (sscanf(opt, "fps=%i", &cam->fixed_fps) == 1 && cam->fixed_fps > 0)
+            continue;
+        if (sscanf(opt, "jitter=%lf", &cam->jitter) == 1)
+        {
+            cam->jitter = MIN(MAX(cam->jitter, 0.0), 50.0) / 100;
+            continue;
+        }
+        if (sscanf(opt, "drop=%lf", &cam->drop) == 1)
+        {
+            cam->drop = MIN(MAX(cam->drop, 0.0), 100.0) / 100;
+            continue;
+        }
+        if (sscanf(opt, "delay=%u", &cam->delay) == 1)
+            continue;
+        if (sscanf(opt, "move=%u", &cam->move) == 1)
+        {
+            cam->move = MIN(cam->move, 100u);
+            continue;
+        }
+        printf("vcam: unknown option '%s'\n", opt);
+        ret = -1;
+    }
+
+    free(spec);
+    return ret;
+}
+
+/*
+ * creates a virtual camera
+ */
+int vcam_open(const char *device)
+{
+    struct VCam *cam = (VCam *)calloc(1, sizeof(struct VCam));
+    cam->move = 100;
+
+    if (!vcam_is_device(device) || parse_device(cam, device) < 0)
+    {
+        stream_reader_close(cam->reader);
+        free(cam);
+        return fail(ENODEV);
+    }
+
+    cam->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (cam->fd < 0 || cam->fd >= VCAM_MAX_FD)
+    {
+        int err = cam->fd < 0 ? errno : EMFILE;
+        if (cam->fd >= 0)
+            close(cam->fd);
+        stream_reader_close(cam->reader);
+        free(cam);
+        return fail(err);
+    }
+
+    cam->name = strdup(device);
+    cam->meta_fd = -1;
+    __INIT_MUTEX(&cam->mutex);
+    cam->clock_base_ns = ns_time_monotonic();
+    for (int i = 0; i < VCAM_NUM_CTRLS; i++)
+    {
+        const struct VCamCtrlInfo *info = &default_ctrls[i];
+        struct VCamCtrl *ctrl = &cam->ctrls[i];
+        ctrl->id = info->id;
+        ctrl->type = info->type;
+        ctrl->name = info->name;
+        ctrl->minimum = info->minimum;
+        ctrl->maximum = info->maximum;
+        ctrl->step = info->step;
+        ctrl->default_value = info->default_value;
+        ctrl->menu_mask = info->menu_mask;
+        ctrl->value = info->default_value;
+        ctrl->active = info->default_value;
+    }
+
+    __LOCK_MUTEX(&vcams_mutex);
+    cam->seed = ++vcams_opened;
+    vcams[cam->fd] = cam;
+    __UNLOCK_MUTEX(&vcams_mutex);
+
+    // default format, like a driver after power up
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.pixelformat = pattern_formats[0];
+    fmt.fmt.pix.width = pattern_sizes[0].width;
+    fmt.fmt.pix.height = pattern_sizes[0].height;
+    s_fmt(cam, &fmt);
+    cam->fps = DEFAULT_FPS;
+    cam->fps_num = 1;
+    if (cam->fixed_fps)
+        cam->fps = cam->fixed_fps;
+    else if (cam->reader && cam->reader->header.fps && cam->reader->header.fps_num)
+    {
+        // replay at the recorded rate unless the application asks otherwise
+        cam->fps = cam->reader->header.fps;
+        cam->fps_num = cam->reader->header.fps_num;
+    }
+
+    return cam->fd;
+}
+
+/*
+ * metadata node: a second fd of the camera
+ */
+int vcam_open_meta(int fd)
+{
+    struct VCam *cam = get_vcam(fd);
+    if (!cam || fd != cam->fd)
+        return fail(EINVAL);
+    if (cam->meta_fd >= 0)
+        return fail(EBUSY);
+
+    int meta_fd = fcntl(cam->fd, F_DUPFD_CLOEXEC, 0);
+    if (meta_fd < 0 || meta_fd >= VCAM_MAX_FD)
+    {
+        int err = meta_fd < 0 ? errno : EMFILE;
+        if (meta_fd >= 0)
+            close(meta_fd);
+        return fail(err);
+    }
+
+    __LOCK_MUTEX(&cam->mutex);
+    cam->meta_fd = meta_fd;
+    __UNLOCK_MUTEX(&cam->mutex);
+    __LOCK_MUTEX(&vcams_mutex);
+    vcams[meta_fd] = cam;
+    __UNLOCK_MUTEX(&vcams_mutex);
+    return meta_fd;
+}
+
+int vcam_events_pending(int fd)
+{
+    struct VCam *cam = get_vcam(fd);
+    if (!cam)
+        return 0;
+    __LOCK_MUTEX(&cam->mutex);
+    int pending = cam->num_events;
+    __UNLOCK_MUTEX(&cam->mutex);
+    return pending;
+}
+
+/*
+ * mmap emulation
+ */
+void *vcam_mmap(int fd, size_t length, off_t offset)
+{
+    struct VCam *cam = get_vcam(fd);
+
+    void *mem = MAP_FAILED;
+
+    if (!cam)
+        return MAP_FAILED;
+    __LOCK_MUTEX(&cam->mutex);
+    if (fd == cam->meta_fd)
+    {
+        off_t page = sysconf(_SC_PAGESIZE);
+        if (offset % page == 0 && offset / page < cam->meta_num_buffers && length <= VCAM_META_SIZE)
+            mem = cam->meta_mem[offset / page];
+    }
+    else if (cam->buffer_stride && offset % (off_t) cam->buffer_stride == 0)
+    {
+        off_t index = offset / (off_t) cam->buffer_stride;
+        if (index < cam->num_buffers && length <= cam->buffer_stride)
+            mem = cam->mem[index];
+    }
+    __UNLOCK_MUTEX(&cam->mutex);
+    return mem;
+}
+
+int vcam_close(int fd)
+{
+    struct VCam *cam = get_vcam(fd);
+    if (!cam)
+        return fail(EBADF);
+    if (cam->meta_fd >= 0)
+    {
+        // the node goes with its camera
+        int meta = fd == cam->meta_fd;
+        close_meta(cam);
+        if (meta)
+            return (0);
+    }
+
+    __LOCK_MUTEX(&vcams_mutex);
+    vcams[fd] = NULL;
+    __UNLOCK_MUTEX(&vcams_mutex);
+
+    printf("vcam: %s produced %llu frames, lost %llu\n", cam->name, cam->produced, cam->lost);
+
+    free_buffers(cam);
+    stream_reader_close(cam->reader);
+    close(cam->fd);
+    free(cam->pattern);
+    free(cam->name);
+    __CLOSE_MUTEX(&cam->mutex);
+    free(cam);
+    return (0);
+}
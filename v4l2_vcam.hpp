@@ -0,0 +1,199 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef V4L2_VCAM_H
+#define V4L2_VCAM_H
+
+#include <linux/videodev2.h>
+#include <sys/types.h>
+#include "defs.hpp"
+#include "stream_record.hpp"
+
+/*
+ * Virtual camera
+ *
+ * emulates a V4L2 capture device at the ioctl level, so init_videoIn,
+ * uvc_lease_frame/uvc_grab and the control functions run unchanged on top
+ * of it. The device fd is a timerfd that becomes readable when a frame is
+ * due, select() in the capture path works as with a real driver. A
+ * timerfd cannot signal exceptions, so pending control events (which a
+ * driver flags with POLLPRI) are asked for with vcam_events_pending.
+ *
+ * vcam_open_meta adds a UVC metadata node (V4L2_META_FMT_UVC): every
+ * frame gets a payload header with a PTS and SCR of a device clock
+ * running VCAM_META_CLOCK_PPM off VCAM_META_CLOCK_HZ, like a camera
+ * with its own crystal.
+ *
+ * device names:
+ *   vcam:pattern[,options]      synthetic color bars with a moving bar
+ *                               (yuyv, uyvy, grey, nv12 - any frame size)
+ *   vcam:<file.dsr>[,options]   replays a recording (-r) in a loop
+ * options:
+ *   fps=<n>      the device only offers n fps (default: honors VIDIOC_S_PARM)
+ *   jitter=<p>   frame time jitter, percent of the frame period
+ *   drop=<p>     percent of frames lost (sequence gaps, like a busy bus)
+ *   delay=<n>    frames before a new control value shows in the image (values
+ *                written on consecutive frames are pipelined like sensor
+ *                registers, each shows in its own frame)
+ *   move=<p>     the bar moves in p percent of the frames (a burst at the
+ *                start of every 100 frames, still otherwise; default 100)
+ */
+#define VCAM_PREFIX       "vcam:"
+#define VCAM_MAX_FD       1024   // fds above this are not handed out
+#define VCAM_MAX_BUFFERS  32
+#define VCAM_NUM_CTRLS    6
+#define VCAM_MAX_EVENTS   32     // queued control events (older ones are dropped)
+#define VCAM_CTRL_PIPE    8      // control values waiting for their frame
+#define VCAM_META_BUFFERS 8
+#define VCAM_META_SIZE    1024   // metadata buffer size
+
+// metadata device clock
+#define VCAM_META_CLOCK_HZ   48000000.0
+#define VCAM_META_CLOCK_PPM  40.0
+#define VCAM_META_SEND_NS    2000000   // the clock sample is sent this long after the frame start
+#define VCAM_META_USB_NS     125000    // until the host sees it (one USB microframe)
+
+// frame source
+#define VCAM_SOURCE_PATTERN  0
+#define VCAM_SOURCE_FILE     1
+
+struct VCamCtrl
+{
+    uint32_t id;
+    uint32_t type;             // v4l2 control type
+    const char *name;
+    int32_t minimum;
+    int32_t maximum;
+    int32_t step;
+    int32_t default_value;
+    uint32_t menu_mask;        // valid menu indexes (menu controls)
+    int32_t value;             // value reported to the application
+    int32_t active;            // value in effect on the image
+    int32_t pending[VCAM_CTRL_PIPE];        // values set with a delay, oldest first
+    uint32_t pending_sequence[VCAM_CTRL_PIPE];  // frame from which each is in effect
+    int num_pending;
+    uint32_t flags;            // V4L2_CTRL_FLAG_* (exposure is inactive in auto modes)
+    int subscribed;            // V4L2_EVENT_CTRL subscribed
+    uint32_t sub_flags;        // V4L2_EVENT_SUB_FL_*
+};
+
+struct VCam
+{
+    int fd;                                 // timerfd (device fd)
+    __MUTEX_TYPE mutex;                     // device state (ioctl and mmap from any thread)
+    int source;                             // VCAM_SOURCE_*
+    char *name;                             // device name
+    struct StreamReader *reader;            // file replay
+    uint32_t replay_frame;                  // next frame of the recording
+
+    // options
+    int fixed_fps;                          // 0 - any
+    double jitter;                          // fraction of the period
+    double drop;                            // probability
+    uint32_t delay;                         // control latency (frames)
+    uint32_t move;                          // percent of frames the bar moves in
+    unsigned int seed;                      // rand_r state
+
+    // format
+    struct v4l2_pix_format pix;
+    int fps;                                // fps denominator
+    int fps_num;                            // fps numerator
+
+    // buffers
+    int num_buffers;
+    size_t buffer_stride;                   // mmap offset between buffers
+    BYTE *mem[VCAM_MAX_BUFFERS];
+    struct v4l2_buffer buf[VCAM_MAX_BUFFERS];
+    int queued[VCAM_MAX_BUFFERS];           // empty buffers, fill order
+    int num_queued;
+    int done[VCAM_MAX_BUFFERS];             // filled buffers, dequeue order
+    int num_done;
+
+    // streaming
+    int streaming;
+    uint32_t sequence;                      // next frame sequence
+    UINT64 nominal_ns;                      // frame time without jitter
+    UINT64 next_ns;                         // when the next frame is due
+    ULLONG produced;
+    ULLONG lost;                            // no empty buffer or simulated drop
+
+    // pattern
+    BYTE *pattern;                          // base image (rebuilt on control changes)
+    int pattern_dirty;
+
+    struct VCamCtrl ctrls[VCAM_NUM_CTRLS];
+
+    // control events (the fd is the only file handle: every change is
+    // caused by it, so only subscriptions with feedback get events)
+    struct v4l2_event events[VCAM_MAX_EVENTS];
+    int num_events;
+    uint32_t event_sequence;
+
+    // metadata node (fd -1 - not open)
+    int meta_fd;
+    int meta_num_buffers;
+    BYTE *meta_mem[VCAM_META_BUFFERS];
+    struct v4l2_buffer meta_buf[VCAM_META_BUFFERS];
+    int meta_queued[VCAM_META_BUFFERS];
+    int meta_num_queued;
+    int meta_done[VCAM_META_BUFFERS];
+    int meta_num_done;
+    int meta_streaming;
+    UINT64 clock_base_ns;                   // host time of device clock 0
+    ULLONG meta_lost;                       // frames without an empty metadata buffer
+};
+
+/*
+ * returns: 1 if device names a virtual camera
+ */
+int vcam_is_device(const char *device);
+
+/*
+ * creates a virtual camera
+ * returns: device fd or -1 on error (errno set)
+ */
+int vcam_open(const char *device);
+
+/*
+ * returns: 1 if fd is a virtual camera
+ */
+int vcam_is_open(int fd);
+
+/*
+ * ioctl emulation (same contract as ioctl: -1 and errno on error)
+ */
+int vcam_ioctl(int fd, unsigned int request, void *arg);
+
+/*
+ * returns: number of control events waiting for VIDIOC_DQEVENT
+ */
+int vcam_events_pending(int fd);
+
+/*
+ * mmap emulation: returns the buffer at offset (as from VIDIOC_QUERYBUF)
+ * or MAP_FAILED, buffers stay owned by the camera (no munmap)
+ */
+void *vcam_mmap(int fd, size_t length, off_t offset);
+
+/*
+ * opens the metadata node of a virtual camera
+ * returns: node fd (closed with vcam_close) or -1 on error (errno set)
+ */
+int vcam_open_meta(int fd);
+
+int vcam_close(int fd);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/videodev2.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "yuv_luma.hpp"
+#include "v4l2_format.hpp"
+
+/*
+ * fills view with the luma plane of frame (no copy)
+ */
+int get_luma_view(const BYTE *frame, int format, int width, int height,
+        int bytesperline, struct LumaView *view)
+{
+    int offset = 0;
+    int step = 0;
+
+    switch (format)
+    {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YVYU:
+            step = 2;
+            break;
+
+        case V4L2_PIX_FMT_UYVY:
+            offset = 1;
+            step = 2;
+            break;
+
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+        case V4L2_PIX_FMT_NV16:
+        case V4L2_PIX_FMT_NV61:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+        case V4L2_PIX_FMT_GREY:
+            step = 1;
+            break;
+
+        default:
+            return (-1);
+    }
+
+    view->data = frame + offset;
+    view->width = width;
+    view->height = height;
+    view->stride = bytesperline > 0 ? bytesperline : width * step;
+    view->step = step;
+
+    return (0);
+}
+
+/* deinterleave even bytes of one packed row into dst */
+static void deinterleave_row(const BYTE *src, BYTE *dst, int width)
+{
+    int x = 0;
+
+    // a 16 sample block reads 32 bytes from src; stop one sample short of
+    // the row end so a view starting at byte 1 (UYVY) never reads past it
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    for (; x + 16 < width; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+        a = _mm_and_si128(a, mask);
+        b = _mm_and_si128(b, mask);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 < width; x += 16)
+    {
+        uint8x16x2_t v = vld2q_u8(src + 2 * x);
+        vst1q_u8(dst + x, v.val[0]);
+    }
+#endif
+    for (; x < width; x++)
+        dst[x] = src[2 * x];
+}
+
+/*
+ * copies the view into a tightly strided 8 bit gray buffer
+ */
+void extract_luma(const struct LumaView *view, BYTE *luma, int luma_stride)
+{
+    int y = 0;
+
+    if (luma_stride <= 0)
+        luma_stride = view->width;
+
+    if (view->step == 1)
+    {
+        if (view->stride == view->width && luma_stride == view->width)
+        {
+            memcpy(luma, view->data, view->width * view->height);
+            return;
+        }
+        for (y = 0; y < view->height; y++)
+            memcpy(luma + y * luma_stride, view->data + y * view->stride, view->width);
+        return;
+    }
+
+    for (y = 0; y < view->height; y++)
+        deinterleave_row(view->data + y * view->stride, luma + y * luma_stride, view->width);
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (c) 2018 DoSee Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef YUV_LUMA_H
+#define YUV_LUMA_H
+
+#include "defs.hpp"
+
+/* Y channel of a frame buffer, addressed in place */
+struct LumaView
+{
+    const BYTE *data;   // first luma sample
+    int width;          // luma samples per row
+    int height;         // luma rows
+    int stride;         // bytes between rows
+    int step;           // bytes between luma samples (1 - planar, 2 - packed 4:2:2)
+};
+
+/*
+ * fills view with the luma plane of frame (no copy)
+ * args:
+ * frame: frame buffer (e.g. mmap'd driver buffer)
+ * format: v4l2 pixel format (YUYV, YVYU, UYVY, NV12, NV21, NV16, NV61, YU12, YV12, GREY)
+ * width, height: frame size
+ * bytesperline: bytes per (luma) row, 0 for tightly packed
+ *
+ * returns 0 on success, -1 if format carries no 8 bit luma plane
+ */
+int get_luma_view(const BYTE *frame, int format, int width, int height,
+        int bytesperline, struct LumaView *view);
+
+/*
+ * copies the view into a tightly strided 8 bit gray buffer
+ * packed formats are deinterleaved with SSE2/NEON when available
+ * args:
+ * luma_stride: bytes per row of luma (0 for width)
+ */
+void extract_luma(const struct LumaView *view, BYTE *luma, int luma_stride);
+
+#endif